@@ -14,9 +14,27 @@ char packet_bytes[] = {0x00, 0x00, 0x01, 0x20, 0x00, 0x01, 0x00, 0x00,
                        0x61, 0x6c, 0x69, 0x75, 0x6d, 0x03, 0x63, 0x6f,
                        0x6d, 0x00, 0x00, 0x01, 0x00, 0x01};
 
+// Z bit of the header. The stub resolver of liumOS (127.0.0.53) sets it in
+// the answer to a query with it set if the answer is from its cache.
+#define DNS_FLAG_Z 0x4000  // in the byte order of DNSMessage.flags
+
+static uint64_t GetNowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 int main(int argc, char** argv) {
+  int show_stats = 0;
+  if (argc == 4 && strcmp(argv[1], "-s") == 0) {
+    show_stats = 1;
+    argc--;
+    argv++;
+  }
   if (argc != 3) {
-    Print("Usage: dig.bin <DNS server ip> <hostname>\n");
+    Print("Usage: dig.bin [-s] <DNS server ip> <hostname>\n");
+    Print("  -s: show the query time and whether the answer is from the cache"
+          " of the stub resolver (127.0.0.53)\n");
     return EXIT_FAILURE;
   }
 
@@ -40,6 +58,9 @@ int main(int argc, char** argv) {
   struct DNSMessage* query = (struct DNSMessage*)query_buf;
   memset(query, 0, sizeof(struct DNSMessage));
   query->flags = 0x2001;
+  if (show_stats) {
+    query->flags |= DNS_FLAG_Z;
+  }
   query->num_questions = 0x0100;
   query_size += sizeof(struct DNSMessage);
 
@@ -63,6 +84,7 @@ int main(int argc, char** argv) {
   query_buf[query_size++] = 0x00;
   query_buf[query_size++] = 0x01;
 
+  const uint64_t sent_at_ns = GetNowNs();
   sent_size = sendto(socket_fd, query_buf, query_size, 0,
                      (struct sockaddr*)&dst_address, sizeof(dst_address));
   for (int i = 0; i < query_size; i++) {
@@ -83,6 +105,7 @@ int main(int argc, char** argv) {
   if (recv_size == -1) {
     panic("error: recvfrom returned -1\n");
   }
+  const uint64_t query_time_us = (GetNowNs() - sent_at_ns) / 1000;
   Print("Received size: ");
   PrintNum(recv_size);
   Print("\n");
@@ -94,6 +117,13 @@ int main(int argc, char** argv) {
   Print("\n");
 
   struct DNSMessage* dns = (struct DNSMessage*)buf;
+  if (show_stats) {
+    Print("Query time: ");
+    PrintNum((int)query_time_us);
+    Print(" us (");
+    Print(dns->flags & DNS_FLAG_Z ? "cache hit" : "cache miss");
+    Print(")\n");
+  }
   Print("Num of answer RRs: ");
   PrintNum(htons(dns->num_answers));
   Print("\n");
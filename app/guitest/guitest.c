@@ -114,6 +114,31 @@ void FlushWindowBuffer(struct WindowBuffer* w) {
   msync(w->file_buf, w->file_size, MS_SYNC);
 }
 
+void FlushWindowRect(struct WindowBuffer* w,
+                     int x,
+                     int y,
+                     int xsize,
+                     int ysize) {
+  if (!w || !w->file_buf)
+    return;
+  struct WindowRect r = {x, y, xsize, ysize};
+  damage_window(w->file_buf, &r, 1);
+}
+
+void FillRect(struct WindowBuffer* w,
+              int px,
+              int py,
+              int xsize,
+              int ysize,
+              uint32_t col) {
+  uint32_t* bmp = w->bmp_buf;
+  for (int y = py; y < py + ysize; y++) {
+    for (int x = px; x < px + xsize; x++) {
+      bmp[y * w->width + x] = col;
+    }
+  }
+}
+
 int main(int argc, char* argv[]) {
   InitFreeType();
 
@@ -134,5 +159,20 @@ int main(int argc, char* argv[]) {
 
   FlushWindowBuffer(&w);
 
+  // Another window of this process, with a blinking cursor. Each blink
+  // flushes only the cursor rect.
+  struct WindowBuffer w2 = CreateWindowBuffer(256, 64);
+  if (!w2.file_buf) {
+    return 1;
+  }
+  FillRect(&w2, 0, 0, w2.width, w2.height, 0xFFFFFF);
+  FlushWindowBuffer(&w2);
+  const struct timespec interval = {0, 500 * 1000 * 1000};
+  for (int i = 0; i < 10; i++) {
+    FillRect(&w2, 16, 16, 2, 32, (i & 1) ? 0xFFFFFF : 0x000000);
+    FlushWindowRect(&w2, 16, 16, 2, 32);
+    nanosleep(&interval, NULL);
+  }
+
   return 0;
 }
@@ -24,6 +24,13 @@
 #define MAP_SHARED 0x01
 #define MAP_FAILED ((void*)-1)
 #define MS_SYNC 4
+#define CLOCK_MONOTONIC 1
+#define MSG_WAITFORONE 0x10000
+#define EPOLLIN 0x001
+#define EPOLLET (1u << 31)
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
 
 #define INADDR_ANY ((unsigned long int)0x00000000)
 
@@ -86,6 +93,40 @@ struct sockaddr {
   char sa_data[14];         /* 14 bytes of protocol address */
 };
 
+// c.f.
+// https://elixir.bootlin.com/linux/v5.4.66/source/include/linux/socket.h#L50
+struct iovec {
+  void* iov_base;
+  size_t iov_len;
+};
+
+struct msghdr {
+  void* msg_name;
+  socklen_t msg_namelen;
+  struct iovec* msg_iov;
+  size_t msg_iovlen;
+  void* msg_control;
+  size_t msg_controllen;
+  unsigned int msg_flags;
+};
+
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+
+// c.f.
+// https://elixir.bootlin.com/linux/v5.4.66/source/include/uapi/linux/eventpoll.h#L77
+struct epoll_event {
+  uint32_t events;
+  uint64_t data;
+} __attribute__((packed));
+
+// A damaged area of a window, in pixels from its top-left corner.
+struct WindowRect {
+  int x, y, xsize, ysize;
+};
+
 // System call functions.
 int ftruncate(int fd, off_t length);
 int open(const char* pathname, int flags, int mode);
@@ -107,6 +148,15 @@ ssize_t recvfrom(int sockfd,
                  int flags,
                  struct sockaddr* src_addr,
                  socklen_t* addrlen);
+int sendmmsg(int sockfd,
+             struct mmsghdr* msgvec,
+             unsigned int vlen,
+             int flags);
+int recvmmsg(int sockfd,
+             struct mmsghdr* msgvec,
+             unsigned int vlen,
+             int flags,
+             struct timespec* timeout);
 int bind(int sockfd, struct sockaddr* addr, socklen_t addrlen);
 int listen(int sockfd, int backlog);
 int setsockopt(int sockfd,
@@ -122,7 +172,19 @@ void* mmap(void* addr,
            int fd,
            off_t offset);
 int msync(void* addr, size_t length, int flags);
+// liumOS specific. Flushes only rects of the window mapped at addr by mmap
+// to the screen, while msync flushes the whole window.
+int damage_window(void* addr,
+                  const struct WindowRect* rects,
+                  int num_of_rects);
 int nanosleep(const struct timespec *, struct timespec *);
+int clock_gettime(int clk_id, struct timespec* tp);
+int epoll_create1(int flags);
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event* event);
+int epoll_wait(int epfd,
+               struct epoll_event* events,
+               int maxevents,
+               int timeout);
 
 // Standard library functions.
 void bzero(void* s, size_t n);
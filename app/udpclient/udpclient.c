@@ -1,8 +1,67 @@
 #include "../liumlib/liumlib.h"
 
+#define BENCH_PAYLOAD_SIZE 64
+#define BENCH_MAX_BATCH_SIZE 64
+
+static uint64_t GetNowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Sends num_of_packets datagrams with sendmmsg() for each batch size and
+// prints packets/sec.
+static void RunBenchmark(int socket_fd,
+                         struct sockaddr_in* dst_address,
+                         int num_of_packets) {
+  static const unsigned int batch_sizes[] = {1, 8, 32, BENCH_MAX_BATCH_SIZE};
+  static char payload[BENCH_PAYLOAD_SIZE];
+  struct iovec iovs[BENCH_MAX_BATCH_SIZE];
+  struct mmsghdr msgs[BENCH_MAX_BATCH_SIZE];
+  for (int i = 0; i < BENCH_MAX_BATCH_SIZE; i++) {
+    iovs[i].iov_base = payload;
+    iovs[i].iov_len = sizeof(payload);
+    bzero(&msgs[i], sizeof(msgs[i]));
+    msgs[i].msg_hdr.msg_name = dst_address;
+    msgs[i].msg_hdr.msg_namelen = sizeof(*dst_address);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  // Let the first datagram resolve the destination address, so that the
+  // measurement does not depend on ARP.
+  sendto(socket_fd, payload, sizeof(payload), 0,
+         (struct sockaddr*)dst_address, sizeof(*dst_address));
+  uint64_t warmup_end_ns = GetNowNs() + 100000000ULL;
+  while (GetNowNs() < warmup_end_ns) {
+  }
+  for (unsigned int i = 0; i < sizeof(batch_sizes) / sizeof(batch_sizes[0]);
+       i++) {
+    unsigned int batch_size = batch_sizes[i];
+    int sent = 0;
+    uint64_t start_ns = GetNowNs();
+    while (sent < num_of_packets) {
+      int n = sendmmsg(socket_fd, msgs, batch_size, 0);
+      if (n == -1) {
+        panic("error: sendmmsg returned -1\n");
+      }
+      sent += n;
+    }
+    uint64_t elapsed_ns = GetNowNs() - start_ns;
+    if (elapsed_ns == 0) {
+      elapsed_ns = 1;
+    }
+    Print("batch ");
+    PrintNum(batch_size);
+    Print(": ");
+    PrintNum((int)((uint64_t)sent * 1000000000ULL / elapsed_ns));
+    Print(" packets/sec\n");
+  }
+}
+
 int main(int argc, char** argv) {
-  if(argc < 4) {
+  if (argc < 4) {
     Print("Usage: udpclient.bin <ip addr> <port> <message>\n");
+    Print("       udpclient.bin <ip addr> <port> --bench [num of packets]\n");
     return EXIT_FAILURE;
   }
 
@@ -17,6 +76,12 @@ int main(int argc, char** argv) {
   dst_address.sin_addr.s_addr = MakeIPv4AddrFromString(argv[1]);
   dst_address.sin_port = htons(StrToNum16(argv[2], NULL));
 
+  if (strcmp(argv[3], "--bench") == 0) {
+    int num_of_packets = argc < 5 ? 10000 : StrToNum16(argv[4], NULL);
+    RunBenchmark(socket_fd, &dst_address, num_of_packets);
+    return 0;
+  }
+
   char* buf = argv[3];
   ssize_t sent_size;
 
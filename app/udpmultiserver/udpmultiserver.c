@@ -0,0 +1,79 @@
+#include "../liumlib/liumlib.h"
+
+#define MAX_PORTS 512
+#define MAX_EVENTS 64
+
+int socket_fds[MAX_PORTS];
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    Print("Usage: udpmultiserver.bin <first port> <num of ports>\n");
+    return EXIT_FAILURE;
+  }
+  uint16_t first_port = StrToNum16(argv[1], NULL);
+  int num_of_ports = StrToNum16(argv[2], NULL);
+  if (num_of_ports <= 0 || MAX_PORTS < num_of_ports ||
+      first_port + num_of_ports > 0x10000) {
+    panic("error: invalid number of ports\n");
+  }
+
+  int epoll_fd;
+  if ((epoll_fd = epoll_create1(0)) == -1) {
+    panic("error: failed to create epoll\n");
+  }
+
+  for (int i = 0; i < num_of_ports; i++) {
+    int socket_fd;
+    if ((socket_fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+      panic("error: failed to create socket\n");
+    }
+    struct sockaddr_in server_address;
+    server_address.sin_family = AF_INET; /* IP */
+    server_address.sin_addr.s_addr = INADDR_ANY;
+    server_address.sin_port = htons(first_port + i);
+    if (bind(socket_fd, (struct sockaddr*)&server_address,
+             sizeof(server_address)) == -1) {
+      panic("error: failed to bind socket\n");
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data = i;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &ev) == -1) {
+      panic("error: epoll_ctl failed\n");
+    }
+    socket_fds[i] = socket_fd;
+  }
+  Print("Listening ports: ");
+  PrintNum(first_port);
+  Print(" - ");
+  PrintNum(first_port + num_of_ports - 1);
+  Print("\n");
+
+  // Event loop
+  struct epoll_event events[MAX_EVENTS];
+  struct sockaddr_in client_address;
+  socklen_t client_addr_len = sizeof(client_address);
+  char buf[2048];
+  for (;;) {
+    int num_of_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (num_of_events == -1) {
+      panic("error: epoll_wait returned -1\n");
+    }
+    for (int i = 0; i < num_of_events; i++) {
+      int idx = events[i].data;
+      ssize_t received_size =
+          recvfrom(socket_fds[idx], buf, sizeof(buf), 0,
+                   (struct sockaddr*)&client_address, &client_addr_len);
+      if (received_size == -1) {
+        panic("error: recvfrom returned -1\n");
+      }
+      Print("Port ");
+      PrintNum(first_port + idx);
+      Print(": received ");
+      PrintNum(received_size);
+      Print(" bytes\n");
+      sendto(socket_fds[idx], buf, received_size, 0,
+             (struct sockaddr*)&client_address, sizeof(client_address));
+    }
+  }
+}
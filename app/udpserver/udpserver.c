@@ -1,8 +1,51 @@
 #include "../liumlib/liumlib.h"
 
+#define BENCH_MAX_BATCH_SIZE 64
+
+static uint64_t GetNowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Receives datagrams with recvmmsg() and prints packets/sec every second.
+static void RunBenchmark(int socket_fd, unsigned int batch_size) {
+  static char bufs[BENCH_MAX_BATCH_SIZE][2048];
+  struct iovec iovs[BENCH_MAX_BATCH_SIZE];
+  struct mmsghdr msgs[BENCH_MAX_BATCH_SIZE];
+  for (int i = 0; i < BENCH_MAX_BATCH_SIZE; i++) {
+    iovs[i].iov_base = bufs[i];
+    iovs[i].iov_len = sizeof(bufs[i]);
+    bzero(&msgs[i], sizeof(msgs[i]));
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  int received = 0;
+  uint64_t start_ns = GetNowNs();
+  for (;;) {
+    int n = recvmmsg(socket_fd, msgs, batch_size, MSG_WAITFORONE, NULL);
+    if (n == -1) {
+      panic("error: recvmmsg returned -1\n");
+    }
+    received += n;
+    uint64_t elapsed_ns = GetNowNs() - start_ns;
+    if (elapsed_ns < 1000000000ULL) {
+      continue;
+    }
+    Print("batch ");
+    PrintNum(batch_size);
+    Print(": ");
+    PrintNum((int)((uint64_t)received * 1000000000ULL / elapsed_ns));
+    Print(" packets/sec\n");
+    received = 0;
+    start_ns = GetNowNs();
+  }
+}
+
 int main(int argc, char** argv) {
   if (argc < 2) {
     Print("Usage: udpserver.bin <port>\n");
+    Print("       udpserver.bin <port> --bench <batch size>\n");
     return EXIT_FAILURE;
   }
   uint16_t port = StrToNum16(argv[1], NULL);
@@ -27,6 +70,14 @@ int main(int argc, char** argv) {
   PrintNum(port);
   Print("\n");
 
+  if (argc >= 4 && strcmp(argv[2], "--bench") == 0) {
+    unsigned int batch_size = StrToNum16(argv[3], NULL);
+    if (batch_size < 1 || BENCH_MAX_BATCH_SIZE < batch_size) {
+      panic("error: batch size should be in 1-64\n");
+    }
+    RunBenchmark(socket_fd, batch_size);
+  }
+
   // Receive loop
   struct sockaddr_in client_address;
   socklen_t client_addr_len = sizeof(client_address);
@@ -0,0 +1,33 @@
+#!/usr/bin/env python3
+# Runs gfxbench on liumOS and saves the results to gfxbench_results.csv
+# to track graphics performance across changes.
+import os
+import sys
+import test_util
+
+WORKLOADS = ["fill", "scroll", "drag", "alpha", "cube"]
+RESULT_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                           "gfxbench_results.csv")
+
+def gfxbench_on_qemu(qemu_mon_conn, liumos_serial_conn, liumos_builder_conn):
+    liumos_serial_conn.sendline("gfxbench csv");
+    rows = []
+    while True:
+        i = liumos_serial_conn.expect(
+            [r"gfxbench,end", r"gfxbench,([^\r\n]*)\r?\n"], timeout=60)
+        if i == 0:
+            break
+        rows.append(liumos_serial_conn.match.group(1).decode("utf-8"))
+    found = [row.split(",")[0] for row in rows[1:]]
+    if found != WORKLOADS:
+        print("FAIL: gfxbench workloads {} != {}".format(found, WORKLOADS))
+        sys.exit(1)
+    with open(RESULT_PATH, "w") as f:
+        for row in rows:
+            print(row)
+            f.write(row + "\n")
+    print("PASS: gfxbench results are saved to {}".format(RESULT_PATH))
+
+if __name__ == "__main__":
+    test_util.launch_test(gfxbench_on_qemu);
+    sys.exit(0)
@@ -93,6 +93,12 @@ QEMU_ARGS_NET_TAP:=\
 		-nic tap,ifname=tap0,id=u1,model=virtio,script=no \
 		-object filter-dump,id=f1,netdev=u1,file=dump.dat
 
+# multiqueue virtio-net needs a backend with multiple queues (tap)
+QEMU_ARGS_NET_TAP_MQ:=\
+		-netdev tap,ifname=tap0,id=u1,script=no,queues=4 \
+		-device virtio-net-pci,netdev=u1,mq=on \
+		-object filter-dump,id=f1,netdev=u1,file=dump.dat
+
 QEMU_ARGS_NET_USB:=\
 		-netdev user,id=usbnet0 -device usb-net,netdev=usbnet0 \
 		-object filter-dump,id=f2,netdev=usbnet0,file=dump_usb_nic.dat
@@ -104,12 +110,34 @@ else ifeq (${NET}, rtl8139)
 QEMU_ARGS+=${QEMU_ARGS_NET_RTL8139}
 else ifeq (${NET}, tap)
 QEMU_ARGS+=${QEMU_ARGS_NET_TAP}
+else ifeq (${NET}, tap_mq)
+QEMU_ARGS+=${QEMU_ARGS_NET_TAP_MQ}
 else ifeq (${NET}, usb)
 QEMU_ARGS+=${QEMU_ARGS_NET_USB}
 else
 $(error Invalid value ${NET} for NET)
 endif
 
+#
+# Block device configs
+#
+
+QEMU_ARGS_BLK_VIRTIO:=\
+		-drive if=none,id=blk0,format=raw,file=disk.img \
+		-device virtio-blk-pci,drive=blk0
+
+# virtio needs mkfs.fat and mcopy to build disk.img (see below). Without a
+# block device, files loaded by the loader are read instead.
+BLK?=n
+ifeq (${BLK}, virtio)
+QEMU_ARGS+=${QEMU_ARGS_BLK_VIRTIO}
+BLK_IMAGES:=disk.img
+else ifeq (${BLK}, n)
+# Do nothing
+else
+$(error Invalid value ${BLK} for BLK)
+endif
+
 #
 # GDB configs
 #
@@ -143,6 +171,15 @@ endif
 pmem.img :
 	qemu-img create $@ 2G
 
+# A FAT32 volume mounted by the kernel. Needs mkfs.fat (dosfstools) and
+# mcopy (mtools). It is made again from mnt/ whenever files in mnt/ change,
+# which discards the files written by liumOS.
+disk.img : $(shell find mnt -type f 2>/dev/null)
+	-rm -f $@
+	qemu-img create -f raw $@ 64M
+	mkfs.fat -F 32 $@
+	mcopy -s -i $@ mnt/* ::
+
 watch_com1:
 	while ! telnet localhost ${PORT_COM2} ; do sleep 1 ; done ;
 
@@ -157,10 +194,10 @@ common_run_rust :
 	make -C ${PROJECT_ROOT}/loader install
 	cd ${PROJECT_ROOT} && $(QEMU) $(QEMU_ARGS_PMEM)
 
-run_root : files pmem.img
+run_root : files pmem.img $(BLK_IMAGES)
 	make run_nobuild_root
 
-run_nobuild_root : pmem.img
+run_nobuild_root : pmem.img $(BLK_IMAGES)
 ifeq (${GUI}, n)
 	# Set VNC password
 	( echo 'change vnc password $(VNC_PASSWORD)' | while ! nc localhost $(PORT_MONITOR) ; do sleep 1 ; done ) &
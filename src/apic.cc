@@ -80,4 +80,6 @@ void InitIOAPIC(uint64_t local_apic_id) {
   SetInterruptRedirection(local_apic_id, 2, 0x20);   // HPET
   SetInterruptRedirection(local_apic_id, 1, 0x21);   // KBC
   SetInterruptRedirection(local_apic_id, 12, 0x22);  // MOUSE
+  SetInterruptRedirection(local_apic_id, kIRQCOM2, 0x23);
+  SetInterruptRedirection(local_apic_id, kIRQCOM1, 0x24);
 }
@@ -21,12 +21,12 @@ constexpr uint64_t kLocalAPICBaseBitx2APICEnabled = (1 << 10);
 constexpr uint64_t kRFlagsInterruptEnable = (1ULL << 9);
 
 struct CPUFeatureIndex {
-  enum { kX2APIC, kXSAVE, kOSXSAVE, kAPIC, kFXSR, kSize };
+  enum { kX2APIC, kXSAVE, kOSXSAVE, kAPIC, kFXSR, kSSE2, kAVX2, kPAT, kSize };
   int dummy;
 };
 
 static const char* CPUFeatureString[] = {
-    "x2APIC", "XSAVE", "OSXSAVE", "APIC", "FXSR",
+    "x2APIC", "XSAVE", "OSXSAVE", "APIC", "FXSR", "SSE2", "AVX2", "PAT",
 };
 
 packed_struct CPUFeatureSet {
@@ -179,6 +179,7 @@ static_assert(sizeof(IA_TSS64) == 104);
 enum class MSRIndex : uint32_t {
   kLocalAPICBase = 0x1b,
   kx2APICEndOfInterrupt = 0x80b,
+  kPAT = 0x277,
   kEFER = 0xC0000080,
   kSTAR = 0xC0000081,
   kLSTAR = 0xC0000082,
@@ -211,6 +212,7 @@ __attribute__((ms_abi)) void WriteIOPort32(uint16_t addr, uint32_t data);
 __attribute__((ms_abi)) void StoreIntFlag(void);
 __attribute__((ms_abi)) void StoreIntFlagAndHalt(void);
 __attribute__((ms_abi)) void ClearIntFlag(void);
+__attribute__((ms_abi)) uint64_t ReadRFLAGS(void);
 [[noreturn]] __attribute__((ms_abi)) void Die(void);
 __attribute__((ms_abi)) uint16_t ReadCSSelector(void);
 __attribute__((ms_abi)) uint16_t ReadSSSelector(void);
@@ -219,6 +221,7 @@ __attribute__((ms_abi)) void WriteSSSelector(uint16_t);
 __attribute__((ms_abi)) void WriteDataAndExtraSegmentSelectors(uint16_t);
 __attribute__((ms_abi)) uint64_t ReadCR2(void);
 __attribute__((ms_abi)) uint64_t ReadCR3(void);
+__attribute__((ms_abi)) uint64_t ReadTSC(void);
 __attribute__((ms_abi)) void WriteCR3(uint64_t);
 __attribute__((ms_abi)) uint64_t CompareAndSwap(uint64_t*, uint64_t);
 __attribute__((ms_abi)) void SwapGS(void);
@@ -239,7 +242,28 @@ __attribute__((ms_abi)) void RepeatMove8Bytes(size_t count,
 __attribute__((ms_abi)) void RepeatStore8Bytes(size_t count,
                                                const void* dst,
                                                uint64_t data);
+// Kernels for rows of 32-bit pixels. See pixel_kernels.h.
+__attribute__((ms_abi)) void CopyPixelsSSE2(size_t count,
+                                            const void* dst,
+                                            const void* src);
+__attribute__((ms_abi)) void FillPixelsSSE2(size_t count,
+                                            const void* dst,
+                                            uint32_t value);
+__attribute__((ms_abi)) void BlendPixelsSSE2(size_t count,
+                                             const void* dst,
+                                             const void* src);
+__attribute__((ms_abi)) void CopyPixelsAVX2(size_t count,
+                                            const void* dst,
+                                            const void* src);
+__attribute__((ms_abi)) void FillPixelsAVX2(size_t count,
+                                            const void* dst,
+                                            uint32_t value);
+__attribute__((ms_abi)) void BlendPixelsAVX2(size_t count,
+                                             const void* dst,
+                                             const void* src);
 __attribute__((ms_abi)) void CLFlushOptimized(const void*);
+// Drains write-combining buffers as well.
+__attribute__((ms_abi)) void StoreFence(void);
 __attribute__((ms_abi)) bool CompareAndExchange64(uint64_t* dst,
                                                   uint64_t expected,
                                                   uint64_t value);
@@ -260,6 +284,9 @@ __attribute__((ms_abi)) void AsmIntHandler13_SIMDFPException(void);
 __attribute__((ms_abi)) void AsmIntHandler20(void);
 __attribute__((ms_abi)) void AsmIntHandler21(void);
 __attribute__((ms_abi)) void AsmIntHandler22(void);
+__attribute__((ms_abi)) void AsmIntHandler23(void);
+__attribute__((ms_abi)) void AsmIntHandler24(void);
+__attribute__((ms_abi)) void AsmIntHandler30(void);
 __attribute__((ms_abi)) void AsmIntHandlerNotImplemented(void);
 __attribute__((ms_abi)) void Disable8259PIC(void);
 }
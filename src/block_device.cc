@@ -0,0 +1,46 @@
+#include "block_device.h"
+
+void BlockDevice::SubmitWhenRoom(Request& req) {
+  while (Submit(req)) {
+    Kick();
+    HandleCompletions();
+    asm volatile("pause");
+  }
+}
+
+void BlockDevice::Wait(Request& req) {
+  while (!req.is_done) {
+    HandleCompletions();
+    asm volatile("pause");
+  }
+}
+
+bool BlockDevice::DoSync(Request::Type type,
+                         uint64_t sector,
+                         void* buf,
+                         uint32_t num_of_sectors) {
+  Request req = {};
+  req.type = type;
+  req.sector = sector;
+  req.num_of_sectors = num_of_sectors;
+  req.buf = buf;
+  SubmitWhenRoom(req);
+  Kick();
+  Wait(req);
+  return req.has_failed;
+}
+
+bool BlockDevice::Read(uint64_t sector, void* buf, uint32_t num_of_sectors) {
+  return DoSync(Request::Type::kRead, sector, buf, num_of_sectors);
+}
+
+bool BlockDevice::Write(uint64_t sector,
+                        const void* buf,
+                        uint32_t num_of_sectors) {
+  return DoSync(Request::Type::kWrite, sector, const_cast<void*>(buf),
+                num_of_sectors);
+}
+
+bool BlockDevice::Flush() {
+  return DoSync(Request::Type::kFlush, 0, nullptr, 0);
+}
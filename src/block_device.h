@@ -0,0 +1,61 @@
+#pragma once
+
+#include "generic.h"
+
+// Interface between block device drivers (virtio-blk) and the page cache.
+// Requests are asynchronous: Submit() queues them, Kick() sends the queued
+// ones to the device at once, and they complete in HandleCompletions() or
+// on the interrupt of the device.
+class BlockDevice {
+ public:
+  static constexpr uint32_t kSectorSize = 512;
+
+  struct Request {
+    // 5.2.6 Device Operation (virtio-blk)
+    enum class Type : uint32_t {
+      kRead = 0,
+      kWrite = 1,
+      kFlush = 4,
+    };
+    Type type;
+    uint64_t sector;
+    uint32_t num_of_sectors;
+    // Should be mapped in the kernel. It does not have to be physically
+    // contiguous.
+    void* buf;
+    // Set on completion.
+    volatile bool is_done;
+    volatile bool has_failed;
+    // Called on completion with interrupts disabled, if not nullptr.
+    void (*on_complete)(Request& req);
+    void* context;
+    // Used by the driver while the request is queued.
+    Request* next_merged;
+  };
+
+  virtual uint64_t GetNumOfSectors() = 0;
+  virtual bool IsReadOnly() = 0;
+  // Queues req. Returns true if there is no room for req until some requests
+  // complete.
+  virtual bool Submit(Request& req) = 0;
+  // Makes the queued requests available to the device.
+  virtual void Kick() = 0;
+  // Completes the requests which the device has processed.
+  virtual void HandleCompletions() = 0;
+
+  // Submits req, kicking the device and completing requests until there is
+  // room for it.
+  void SubmitWhenRoom(Request& req);
+  // Waits until req, which was submitted and kicked, completes.
+  void Wait(Request& req);
+  // Synchronous I/O. Return true on failure.
+  bool Read(uint64_t sector, void* buf, uint32_t num_of_sectors);
+  bool Write(uint64_t sector, const void* buf, uint32_t num_of_sectors);
+  bool Flush();
+
+ private:
+  bool DoSync(Request::Type type,
+              uint64_t sector,
+              void* buf,
+              uint32_t num_of_sectors);
+};
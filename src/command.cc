@@ -6,11 +6,18 @@
 
 #include "adlib.h"
 #include "command_line_args.h"
+#include "compositor.h"
+#include "dns.h"
+#include "gfxbench.h"
 #include "kernel.h"
 #include "liumos.h"
+#include "net_device.h"
 #include "network.h"
+#include "packet_capture.h"
 #include "pci.h"
+#include "pixel_kernels.h"
 #include "pmem.h"
+#include "virtio_blk.h"
 #include "virtio_net.h"
 #include "xhci.h"
 
@@ -617,6 +624,313 @@ const char* tree_aa[10] = {
     "       | |",    "      |---|",
 };
 
+static void Capture(CommandLineArgs& args) {
+  // capture start [arp|icmp|tcp|udp] [port <port>]
+  // capture stop
+  // capture dump
+  // capture (shows the status)
+  using Filter = PacketCapture::Filter;
+  PacketCapture& capture = PacketCapture::GetInstance();
+  if (args.GetNumOfArgs() >= 2 && IsEqualString(args.GetArg(1), "start")) {
+    Filter filter = {Filter::Protocol::kAny, 0};
+    for (int i = 2; i < args.GetNumOfArgs(); i++) {
+      const char* arg = args.GetArg(i);
+      if (IsEqualString(arg, "arp")) {
+        filter.protocol = Filter::Protocol::kARP;
+      } else if (IsEqualString(arg, "icmp")) {
+        filter.protocol = Filter::Protocol::kICMP;
+      } else if (IsEqualString(arg, "tcp")) {
+        filter.protocol = Filter::Protocol::kTCP;
+      } else if (IsEqualString(arg, "udp")) {
+        filter.protocol = Filter::Protocol::kUDP;
+      } else if (IsEqualString(arg, "port") && i + 1 < args.GetNumOfArgs()) {
+        filter.port = static_cast<uint16_t>(atoi(args.GetArg(++i)));
+      } else {
+        kprintf("capture: unknown filter %s\n", arg);
+        return;
+      }
+    }
+    capture.Start(filter);
+    PutString("capture: started\n");
+    return;
+  }
+  if (args.GetNumOfArgs() == 2 && IsEqualString(args.GetArg(1), "stop")) {
+    capture.Stop();
+    PutString("capture: stopped\n");
+    return;
+  }
+  if (args.GetNumOfArgs() == 2 && IsEqualString(args.GetArg(1), "dump")) {
+    uint64_t num_of_records = capture.GetNumOfPendingRecords();
+    if (!capture.WritePCAP()) {
+      PutString("capture: no output port\n");
+      return;
+    }
+    kprintf("capture: %lu frames written to COM1 in pcap format\n",
+            num_of_records);
+    return;
+  }
+  const PacketCapture::Stats& st = capture.GetStats();
+  kprintf("capture: %s, %lu captured %lu drops %lu pending\n",
+          PacketCapture::IsEnabled() ? "running" : "stopped", st.captured,
+          st.drops, capture.GetNumOfPendingRecords());
+}
+
+static void DHCP(CommandLineArgs& args) {
+  // dhcp restart
+  // dhcp (shows the status)
+  using State = Network::DHCPClient::State;
+  Network& network = Network::GetInstance();
+  if (args.GetNumOfArgs() == 2 && IsEqualString(args.GetArg(1), "restart")) {
+    NetDevice* dev = network.GetPrimaryNetDevice();
+    if (!dev) {
+      PutString("No network device found\n");
+      return;
+    }
+    network.StartDHCPClient(*dev);
+    PutString("DHCP discover sent.\n");
+    return;
+  }
+  for (auto dev : network.GetNetDevices()) {
+    const Network::DHCPClient* client = network.GetDHCPClient(*dev);
+    if (!client) {
+      continue;
+    }
+    static const char* kStateNames[] = {"stopped",    "selecting",
+                                        "requesting", "bound",
+                                        "renewing",   "rebinding"};
+    kprintf("%s: %s", dev->GetName(),
+            kStateNames[static_cast<int>(client->state)]);
+    if (client->has_lease) {
+      PutString(" ");
+      client->lease.addr.Print();
+      PutString(" from ");
+      client->lease.server.Print();
+      kprintf(" lease %u s (T1 %u s, T2 %u s)", client->lease.lease_time_s,
+              client->lease.t1_s, client->lease.t2_s);
+    } else if (client->state == State::kRequesting) {
+      PutString(" ");
+      client->offered_addr.Print();
+    }
+    PutString("\n");
+  }
+}
+
+static void DNS(CommandLineArgs& args) {
+  // dns server <ip>
+  // dns flush
+  // dns (shows the status)
+  DNSResolver& resolver = Network::GetInstance().GetDNSResolver();
+  if (args.GetNumOfArgs() == 3 && IsEqualString(args.GetArg(1), "server")) {
+    auto addr = Network::IPv4Addr::CreateFromString(args.GetArg(2));
+    if (!addr.has_value()) {
+      PutString("Invalid IP Addr format\n");
+      return;
+    }
+    resolver.SetUpstreamServer(*addr);
+    return;
+  }
+  if (args.GetNumOfArgs() == 2 && IsEqualString(args.GetArg(1), "flush")) {
+    resolver.Flush();
+    return;
+  }
+  const DNSResolver::Stats& stats = resolver.GetStats();
+  PutString("stub ");
+  DNSResolver::kStubAddr.Print();
+  PutString(" upstream ");
+  resolver.GetUpstreamServer().Print();
+  kprintf("\ncache: %d / %d entries\n",
+          resolver.GetNumOfCacheEntries(
+              HPET::GetInstance().ReadMainCounterValueInMs()),
+          DNSResolver::kNumOfCacheEntries);
+  kprintf("queries %lu: hits %lu (negative %lu), coalesced %lu, "
+          "upstream %lu, timeouts %lu\n",
+          stats.queries, stats.hits, stats.negative_hits, stats.coalesced,
+          stats.upstream_queries, stats.timeouts);
+}
+
+static void BenchmarkKernelLog() {
+  // Compares the cost of a line on the console with that of a log message,
+  // recorded or filtered out.
+  using Level = KernelLog::Level;
+  constexpr int kNumOfMessages = KernelLog::kNumOfEntries / 2;
+  KernelLog& log = KernelLog::GetInstance();
+  HPET& hpet = HPET::GetInstance();
+  const Level saved_level = log.GetMinLevel();
+  auto to_ns_per_message = [&hpet](uint64_t count) {
+    return count * hpet.GetFemtosecondPerCount() / 1'000'000 / kNumOfMessages;
+  };
+  uint64_t t0 = hpet.ReadMainCounterValue();
+  for (int i = 0; i < kNumOfMessages; i++) {
+    kprintf("log bench: message %d\n", i);
+  }
+  liumos->main_console->Flush();
+  uint64_t kprintf_ns = to_ns_per_message(hpet.ReadMainCounterValue() - t0);
+  uint64_t klog_ns[2];
+  for (int i = 0; i < 2; i++) {
+    log.SetMinLevel(i == 0 ? Level::kDebug : Level::kInfo);
+    t0 = hpet.ReadMainCounterValue();
+    for (int k = 0; k < kNumOfMessages; k++) {
+      klog(Level::kDebug, "log bench: message %d", k);
+    }
+    klog_ns[i] = to_ns_per_message(hpet.ReadMainCounterValue() - t0);
+  }
+  log.SetMinLevel(saved_level);
+  kprintf("kprintf: %lu ns/message\n", kprintf_ns);
+  kprintf("klog (recorded): %lu ns/message\n", klog_ns[0]);
+  kprintf("klog (filtered): %lu ns/message\n", klog_ns[1]);
+}
+
+static void BenchmarkFramebuffer() {
+  // Compares the bandwidth of presenting the whole screen through an
+  // uncached mapping of the framebuffer with that of the write-combining
+  // mapping which the compositor uses.
+  constexpr uint64_t kUncachedFramebufferBase = 0xFFFF'FFFF'8400'0000ULL;
+  constexpr int kNumOfFrames = 16;
+  Compositor& compositor = Compositor::GetInstance();
+  const Sheet& back_buffer = compositor.GetBackBuffer();
+  Sheet& framebuffer = compositor.GetFramebuffer();
+  static bool is_uncached_mapping_created = false;
+  if (!is_uncached_mapping_created) {
+    CreatePageMapping(GetSystemDRAMAllocator(), GetKernelPML4(),
+                      kUncachedFramebufferBase, v2p(framebuffer.GetBuf()),
+                      framebuffer.GetBufSize(),
+                      kPageAttrPresent | kPageAttrWritable |
+                          kPageAttrCacheDisable | kPageAttrWriteThrough);
+    is_uncached_mapping_created = true;
+  }
+  struct {
+    const char* name;
+    uint32_t* buf;
+  } targets[] = {
+      {"UC", reinterpret_cast<uint32_t*>(kUncachedFramebufferBase)},
+      {"WC", framebuffer.GetBuf()},
+  };
+  HPET& hpet = HPET::GetInstance();
+  const int xsize = back_buffer.GetXSize();
+  const int ysize = back_buffer.GetYSize();
+  const int line_size = back_buffer.GetPixelsPerScanLine();
+  const uint64_t bytes_per_frame = static_cast<uint64_t>(xsize) * ysize * 4;
+  for (auto& t : targets) {
+    const uint64_t t0 = hpet.ReadMainCounterValue();
+    for (int i = 0; i < kNumOfFrames; i++) {
+      for (int y = 0; y < ysize; y++) {
+        PixelKernels::CopyRow(&t.buf[y * line_size],
+                              &back_buffer.GetBuf()[y * line_size], xsize);
+      }
+      StoreFence();
+    }
+    const uint64_t ns = (hpet.ReadMainCounterValue() - t0) *
+                        hpet.GetFemtosecondPerCount() / 1'000'000;
+    kprintf("%s: %lu MB/s, %lu us/frame\n", t.name,
+            ns ? bytes_per_frame * kNumOfFrames * 1000 / ns : 0,
+            ns / 1000 / kNumOfFrames);
+  }
+}
+
+static void BenchmarkBlockDevice() {
+  // Reads 4 KiB blocks in batches of queue depth requests. Sequential
+  // batches are merged into fewer virtio requests by the driver.
+  constexpr uint32_t kBlockSize = 4096;
+  constexpr int kNumOfRequests = 1024;
+  Virtio::Blk& blk = Virtio::Blk::GetInstance();
+  if (!blk.IsInitialized()) {
+    PutString("virtio-blk is not initialized\n");
+    return;
+  }
+  constexpr uint32_t kSectorsPerBlock = kBlockSize / Virtio::Blk::kSectorSize;
+  const uint64_t num_of_blocks = blk.GetNumOfSectors() / kSectorsPerBlock;
+  if (num_of_blocks < kNumOfRequests) {
+    PutString("virtio-blk: device is too small\n");
+    return;
+  }
+  const int max_depth = blk.GetNumOfSlots();
+  static uint8_t* buf;
+  static Virtio::Blk::Request* reqs;
+  if (!buf) {
+    buf = AllocKernelMemory<uint8_t*>(kBlockSize * max_depth);
+    reqs = AllocKernelMemory<Virtio::Blk::Request*>(
+        sizeof(Virtio::Blk::Request) * max_depth);
+  }
+  const struct {
+    const char* name;
+    bool is_random;
+    int depth;
+  } workloads[] = {
+      {"seq read", false, max_depth},
+      {"rand read QD1", true, 1},
+      {"rand read", true, max_depth},
+  };
+  HPET& hpet = HPET::GetInstance();
+  uint64_t seed = 0x2545'F491'4F6C'DD1DULL;
+  for (auto& w : workloads) {
+    const Virtio::Blk::Stats st0 = blk.GetStats();
+    bool has_failed = false;
+    const uint64_t t0 = hpet.ReadMainCounterValue();
+    for (int i = 0; i < kNumOfRequests; i += w.depth) {
+      // The last batch is clamped so that exactly kNumOfRequests are issued.
+      const int batch_size = std::min(w.depth, kNumOfRequests - i);
+      for (int k = 0; k < batch_size; k++) {
+        uint64_t block = i + k;
+        if (w.is_random) {
+          seed ^= seed << 13;
+          seed ^= seed >> 7;
+          seed ^= seed << 17;
+          block = seed % num_of_blocks;
+        }
+        Virtio::Blk::Request& req = reqs[k];
+        req = {};
+        req.type = Virtio::Blk::Request::Type::kRead;
+        req.sector = block * kSectorsPerBlock;
+        req.num_of_sectors = kSectorsPerBlock;
+        req.buf = &buf[kBlockSize * k];
+        blk.SubmitWhenRoom(req);
+      }
+      blk.Kick();
+      for (int k = 0; k < batch_size; k++) {
+        blk.Wait(reqs[k]);
+        has_failed |= reqs[k].has_failed;
+      }
+    }
+    const uint64_t ns = (hpet.ReadMainCounterValue() - t0) *
+                        hpet.GetFemtosecondPerCount() / 1'000'000;
+    const Virtio::Blk::Stats& st = blk.GetStats();
+    kprintf("%s (QD%d): %lu IOPS, %lu MB/s, %lu device requests "
+            "(%lu merged)%s\n",
+            w.name, w.depth, ns ? kNumOfRequests * 1'000'000'000ULL / ns : 0,
+            ns ? kBlockSize * kNumOfRequests * 1000ULL / ns : 0,
+            st.device_requests - st0.device_requests,
+            st.merged_requests - st0.merged_requests,
+            has_failed ? " FAILED" : "");
+  }
+}
+
+static void Log(CommandLineArgs& args) {
+  // log level <debug|info|warning|error>
+  // log bench
+  // log (prints the messages in the ring)
+  KernelLog& log = KernelLog::GetInstance();
+  if (args.GetNumOfArgs() == 3 && IsEqualString(args.GetArg(1), "level")) {
+    KernelLog::Level level;
+    if (KernelLog::ParseLevel(args.GetArg(2), level)) {
+      PutString("Invalid log level\n");
+      return;
+    }
+    log.SetMinLevel(level);
+    return;
+  }
+  if (args.GetNumOfArgs() == 2 && IsEqualString(args.GetArg(1), "bench")) {
+    BenchmarkKernelLog();
+    return;
+  }
+  KernelLog::Entry e;
+  for (uint64_t seq = log.GetOldestSeq(); log.ReadNext(seq, e);) {
+    kprintf("[%lu] %s: %s\n", e.timestamp, KernelLog::GetLevelName(e.level),
+            e.message);
+  }
+  kprintf("level: %s, %lu messages recorded\n",
+          KernelLog::GetLevelName(log.GetMinLevel()), log.GetNextSeq());
+}
+
 void Date() {
   uint8_t bcd_year = ReadCMOS(0x09);
   uint8_t bcd_month = ReadCMOS(0x08);
@@ -633,6 +947,38 @@ void Date() {
   }
 }
 
+static void TestScroll() {
+  // Prints lines for a second in each rendering mode of the console.
+  // kImmediate is the baseline which draws and flushes every glyph.
+  using Mode = Console::RenderingMode;
+  constexpr Mode kModes[] = {Mode::kImmediate, Mode::kPerCall,
+                             Mode::kDeferred};
+  constexpr const char* kModeNames[] = {"immediate", "per-call", "deferred"};
+  constexpr int kNumOfModes = sizeof(kModes) / sizeof(kModes[0]);
+  constexpr uint64_t kDurationMs = 1000;
+  Console& console = *liumos->main_console;
+  HPET& hpet = HPET::GetInstance();
+  const Mode saved_mode = console.GetRenderingMode();
+  uint64_t lines_per_sec[kNumOfModes];
+  uint64_t line = 0;
+  for (int i = 0; i < kNumOfModes; i++) {
+    console.SetRenderingMode(kModes[i]);
+    uint64_t t0 = hpet.ReadMainCounterValueInMs();
+    uint64_t num_of_lines = 0;
+    while (hpet.ReadMainCounterValueInMs() - t0 < kDurationMs) {
+      PutStringAndHex("Line", ++line);
+      num_of_lines++;
+    }
+    console.Flush();
+    uint64_t elapsed_ms = hpet.ReadMainCounterValueInMs() - t0;
+    lines_per_sec[i] = num_of_lines * 1000 / elapsed_ms;
+  }
+  console.SetRenderingMode(saved_mode);
+  for (int i = 0; i < kNumOfModes; i++) {
+    kprintf("%-9s: %lu lines/s\n", kModeNames[i], lines_per_sec[i]);
+  }
+}
+
 void Run(TextBox& tbox) {
   const char* raw = tbox.GetRecordedString();
   char line[TextBox::kSizeOfBuffer + 1];
@@ -661,24 +1007,23 @@ void Run(TextBox& tbox) {
     return;
   }
   if (IsEqualString(args.GetArg(0), "ip")) {
-    Virtio::Net& net = Virtio::Net::GetInstance();
-    auto ip_addr = net.GetSelfIPv4Addr();
-    auto mac_addr = net.GetSelfEtherAddr();
-
     auto& network = Network::GetInstance();
-    auto mask = network.GetIPv4NetMask();
-    auto gateway_ip = network.GetIPv4DefaultGateway();
-
-    StringBuffer<128> line;
-    ip_addr.WriteString(line);
-    line.WriteString(" eth ");
-    mac_addr.WriteString(line);
-    line.WriteString(" mask ");
-    mask.WriteString(line);
-    line.WriteString(" gateway ");
-    gateway_ip.WriteString(line);
-    line.WriteChar('\n');
-    PutString(line.GetString());
+    for (auto dev : network.GetNetDevices()) {
+      StringBuffer<128> line;
+      line.WriteString(dev->GetName());
+      line.WriteString(": ");
+      dev->GetSelfIPv4Addr().WriteString(line);
+      line.WriteString(" eth ");
+      dev->GetSelfEtherAddr().WriteString(line);
+      if (dev == network.GetPrimaryNetDevice()) {
+        line.WriteString(" mask ");
+        network.GetIPv4NetMask().WriteString(line);
+        line.WriteString(" gateway ");
+        network.GetIPv4DefaultGateway().WriteString(line);
+      }
+      line.WriteChar('\n');
+      PutString(line.GetString());
+    }
     return;
   }
   if (IsEqualString(args.GetArg(0), "arp")) {
@@ -688,17 +1033,95 @@ void Run(TextBox& tbox) {
     }
     auto& net = Network::GetInstance();
     kprintf("%d entries found:\n", net.GetARPTable().size());
+    using State = Network::Neighbor::State;
     for (const auto& e : net.GetARPTable()) {
       e.first.Print();
       PutString(" -> ");
-      e.second.Print();
+      e.second.eth_addr.Print();
+      switch (e.second.state) {
+        case State::kIncomplete:
+          kprintf(" (incomplete, %lu pending)",
+                  e.second.pending_frames.size());
+          break;
+        case State::kReachable:
+          PutString(" (reachable)");
+          break;
+        case State::kStale:
+          PutString(" (stale)");
+          break;
+        case State::kPermanent:
+          PutString(" (permanent)");
+          break;
+      }
       PutString("\n");
     }
     return;
   }
+  if (IsEqualString(line, "netstat")) {
+    for (auto dev : Network::GetInstance().GetNetDevices()) {
+      const NetDevice::Stats& st = dev->GetStats();
+      kprintf("%s: rx %lu pkts %lu bytes %lu drops, ", dev->GetName(),
+              st.rx_packets, st.rx_bytes, st.rx_drops);
+      kprintf("tx %lu pkts %lu bytes %lu drops\n", st.tx_packets, st.tx_bytes,
+              st.tx_drops);
+    }
+    const Network::IPv4ReassemblyStats& reasm =
+        Network::GetInstance().GetIPv4ReassemblyStats();
+    kprintf("ipv4 reassembly: %lu done %lu timeouts %lu overlaps %lu drops\n",
+            reasm.reassembled, reasm.timeouts, reasm.overlaps, reasm.drops);
+    auto& virtio_net = Virtio::Net::GetInstance();
+    using QueueStats = Virtio::Net::QueueStats;
+    for (int i = 0; i < virtio_net.GetNumOfQueuePairs(); i++) {
+      const QueueStats& rx = virtio_net.GetRXQueueStats(i);
+      const QueueStats& tx = virtio_net.GetTXQueueStats(i);
+      kprintf("  virtio-net queue pair %d: ", i);
+      kprintf("rx %lu pkts %lu bytes %lu drops, ", rx.packets, rx.bytes,
+              rx.drops);
+      kprintf("tx %lu pkts %lu bytes\n", tx.packets, tx.bytes);
+    }
+    return;
+  }
+  if (IsEqualString(args.GetArg(0), "capture")) {
+    Capture(args);
+    return;
+  }
   if (IsEqualString(args.GetArg(0), "dhcp")) {
-    SendDHCPRequest();
-    kprintf("DHCP request sent.\n");
+    DHCP(args);
+    return;
+  }
+  if (IsEqualString(args.GetArg(0), "dns")) {
+    DNS(args);
+    return;
+  }
+  if (IsEqualString(args.GetArg(0), "log")) {
+    Log(args);
+    return;
+  }
+  if (IsEqualString(args.GetArg(0), "gfxbench")) {
+    // gfxbench [csv]
+    RunGraphicsBenchmark(args.GetNumOfArgs() == 2 &&
+                         IsEqualString(args.GetArg(1), "csv"));
+    return;
+  }
+  if (IsEqualString(line, "blkbench")) {
+    BenchmarkBlockDevice();
+    return;
+  }
+  if (IsEqualString(line, "fbbench")) {
+    BenchmarkFramebuffer();
+    return;
+  }
+  if (IsEqualString(line, "compositor")) {
+    const Compositor::Stats& st = Compositor::GetInstance().GetStats();
+    kprintf("frames %lu (late %lu), rects %lu\n", st.frames, st.late_frames,
+            st.rects_presented);
+    // Bytes flushed per byte presented. Above 1.00 means that overlapping
+    // flushes were presented at once.
+    const uint64_t overdraw_x100 =
+        st.bytes_presented ? st.bytes_flushed * 100 / st.bytes_presented : 0;
+    kprintf("flushed %lu KiB, presented %lu KiB, overdraw %lu.%02lu\n",
+            st.bytes_flushed >> 10, st.bytes_presented >> 10,
+            overdraw_x100 / 100, overdraw_x100 % 100);
     return;
   }
   if (IsEqualString(line, "hello")) {
@@ -869,6 +1292,9 @@ void Run(TextBox& tbox) {
     for (int i = 0; i < CPUFeatureIndex::kSize; i++) {
       PutStringAndBool(CPUFeatureString[i], (f.features >> i) & 1);
     }
+    PutString("Pixel kernels: ");
+    PutString(PixelKernels::GetTypeName(PixelKernels::GetSelectedType()));
+    PutChar('\n');
   } else if (IsEqualString(line, "lspci")) {
     ListPCIDevices();
   } else if (IsEqualString(line, "version")) {
@@ -884,13 +1310,14 @@ void Run(TextBox& tbox) {
     PutString("test mem: Test memory access \n");
     PutString("free: show memory free entries\n");
     PutString("time: show HPET main counter value\n");
+    PutString("testscroll: measure lines/s of the console\n");
+    PutString("log: show kernel log messages\n");
+    PutString("compositor: show frames and bytes presented to the screen\n");
+    PutString("fbbench: measure full-screen present bandwidth (UC vs WC)\n");
+    PutString("gfxbench [csv]: measure drawing throughput and frame times\n");
+    PutString("blkbench: measure IOPS of virtio-blk and request merging\n");
   } else if (IsEqualString(line, "testscroll")) {
-    uint64_t t0 = HPET::GetInstance().ReadMainCounterValue();
-    uint64_t t1 = t0 + 3 * 1000'000'000'000'000 /
-                           HPET::GetInstance().GetFemtosecondPerCount();
-    for (int i = 0; HPET::GetInstance().ReadMainCounterValue() < t1; i++) {
-      PutStringAndHex("Line", i + 1);
-    }
+    TestScroll();
   } else if (IsEqualString(line, "xhci init")) {
     XHCI::Controller::GetInstance().Init();
   } else if (IsEqualString(line, "xhci show portsc")) {
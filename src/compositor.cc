@@ -0,0 +1,93 @@
+#include "compositor.h"
+
+#include "hpet.h"
+#include "kernel.h"
+#include "pixel_kernels.h"
+
+static Compositor compositor_;
+
+Compositor& Compositor::GetInstance() {
+  return compositor_;
+}
+
+void Compositor::Init(Sheet& back_buffer, Sheet& framebuffer) {
+  assert(back_buffer.GetXSize() == framebuffer.GetXSize() &&
+         back_buffer.GetYSize() == framebuffer.GetYSize());
+  back_buffer_ = &back_buffer;
+  framebuffer_ = &framebuffer;
+  damage_.Clear();
+  bzero(&stats_, sizeof(stats_));
+  next_frame_ms_ = 0;
+  back_buffer.SetDamageHandler(HandleDamage);
+  AddDamage(back_buffer.GetClientRect());
+}
+
+void Compositor::AddDamage(const Rect& r) {
+  // Flushes may happen in any task, and a task can be switched while
+  // updating the list.
+  const bool int_enabled = ReadRFLAGS() & kRFlagsInterruptEnable;
+  ClearIntFlag();
+  stats_.bytes_flushed +=
+      static_cast<uint64_t>(r.xsize) * static_cast<uint64_t>(r.ysize) * 4;
+  damage_.Add(r);
+  if (int_enabled)
+    StoreIntFlag();
+}
+
+void Compositor::Present() {
+  // Take the damage out so that flushes during the copies below are kept
+  // for the next frame. Pixels updated during the copies are presented
+  // again on the next frame since damage is added after the update.
+  DamageList<kMaxDamagedRects> damage;
+  const bool int_enabled = ReadRFLAGS() & kRFlagsInterruptEnable;
+  ClearIntFlag();
+  damage = damage_;
+  damage_.Clear();
+  if (int_enabled)
+    StoreIntFlag();
+  if (damage.IsEmpty())
+    return;
+  const int src_line_size = back_buffer_->GetPixelsPerScanLine();
+  const int dst_line_size = framebuffer_->GetPixelsPerScanLine();
+  const uint32_t* src_buf = back_buffer_->GetBuf();
+  uint32_t* dst_buf = framebuffer_->GetBuf();
+  for (int i = 0; i < damage.GetNumOfRects(); i++) {
+    const Rect r =
+        damage.GetRect(i).GetIntersectionWith(back_buffer_->GetClientRect());
+    for (int y = r.y; y < r.GetBottom(); y++) {
+      PixelKernels::CopyRow(&dst_buf[y * dst_line_size + r.x],
+                            &src_buf[y * src_line_size + r.x], r.xsize);
+    }
+    stats_.bytes_presented +=
+        static_cast<uint64_t>(r.xsize) * static_cast<uint64_t>(r.ysize) * 4;
+  }
+  // Drain the write-combining buffers so that the frame reaches the screen.
+  StoreFence();
+  stats_.rects_presented += damage.GetNumOfRects();
+  stats_.frames++;
+}
+
+void Compositor::Tick(uint64_t now_ms) {
+  if (now_ms < next_frame_ms_)
+    return;
+  Present();
+  // next_frame_ms_ is 0 until the first frame.
+  const bool is_late =
+      next_frame_ms_ && next_frame_ms_ + kFrameIntervalMs <= now_ms;
+  next_frame_ms_ += kFrameIntervalMs;
+  if (next_frame_ms_ <= now_ms) {
+    // Skip the frames missed instead of presenting them in a burst.
+    next_frame_ms_ = now_ms + kFrameIntervalMs;
+  }
+  if (is_late)
+    stats_.late_frames++;
+}
+
+void FramePresenter() {
+  Compositor& compositor = Compositor::GetInstance();
+  HPET& hpet = HPET::GetInstance();
+  while (true) {
+    compositor.Tick(hpet.ReadMainCounterValueInMs());
+    Sleep();
+  }
+}
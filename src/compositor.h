@@ -0,0 +1,53 @@
+#pragma once
+
+#include "damage_list.h"
+#include "generic.h"
+#include "sheet.h"
+
+// Presents a back buffer sheet to the framebuffer at a fixed frame rate.
+// Sheets are flushed into the back buffer in memory, and the rects they
+// update are accumulated as damage. Every frame, FramePresenter() copies each
+// damaged rect to the framebuffer once, so repeated small flushes of
+// animations and mouse moves within a frame reach the (uncached) framebuffer
+// only once.
+class Compositor {
+ public:
+  static constexpr uint64_t kFrameIntervalMs = 16;  // ~60 Hz
+  static constexpr int kMaxDamagedRects = 16;
+  struct Stats {
+    uint64_t frames;
+    // Frames which started after the next one was due.
+    uint64_t late_frames;
+    uint64_t rects_presented;
+    // Bytes written to the back buffer by flushes, including overdraw.
+    uint64_t bytes_flushed;
+    uint64_t bytes_presented;
+  };
+
+  static Compositor& GetInstance();
+  // Both sheets should have the same size. The contents of back_buffer are
+  // presented entirely on the first frame.
+  void Init(Sheet& back_buffer, Sheet& framebuffer);
+  // Adds a rect of the back buffer to be presented on the next frame. Can be
+  // called with interrupts disabled.
+  void AddDamage(const Rect& r);
+  // Copies the damaged rects to the framebuffer.
+  void Present();
+  // Presents if the next frame is due at now_ms.
+  void Tick(uint64_t now_ms);
+  const Stats& GetStats() const { return stats_; }
+  Sheet& GetBackBuffer() { return *back_buffer_; }
+  Sheet& GetFramebuffer() { return *framebuffer_; }
+
+ private:
+  static void HandleDamage(const Rect& r) { GetInstance().AddDamage(r); }
+
+  Sheet* back_buffer_;
+  Sheet* framebuffer_;
+  DamageList<kMaxDamagedRects> damage_;
+  Stats stats_;
+  uint64_t next_frame_ms_;
+};
+
+// Kernel task which presents frames of the compositor.
+void FramePresenter();
@@ -1,10 +1,44 @@
 #include "corefunc.h"
+#include "kernel_log.h"
 #include "liumos.h"
 
 #ifndef LIUMOS_LOADER
 #include "xhci.h"
 #endif
 
+void Console::SetSheet(Sheet* sheet) {
+  lock_.Lock();
+  FlushWithoutLocking();
+  sheet_ = sheet;
+  if (sheet_) {
+    grid_.Init(sheet_->GetXSize() / kCharWidth,
+               sheet_->GetYSize() / kCharHeight);
+    // The pixels on the sheet are kept as they are. They are scrolled out as
+    // new lines are written.
+    if (cursor_y_ >= grid_.GetRows())
+      cursor_y_ = grid_.GetRows() - 1;
+    if (cursor_x_ >= grid_.GetColumns())
+      cursor_x_ = 0;
+  }
+  lock_.Unlock();
+}
+
+void Console::SetRenderingMode(RenderingMode mode) {
+  lock_.Lock();
+  FlushWithoutLocking();
+  rendering_mode_ = mode;
+  lock_.Unlock();
+}
+
+void Console::NewLine() {
+  cursor_x_ = 0;
+  cursor_y_++;
+  if (cursor_y_ >= grid_.GetRows()) {
+    grid_.ScrollUp();
+    cursor_y_ = grid_.GetRows() - 1;
+  }
+}
+
 void Console::PutCharWithoutLocking(char c) {
   if (serial_port_) {
     if (c == '\n')
@@ -21,37 +55,95 @@ void Console::PutCharWithoutLocking(char c) {
     return;
   }
   if (c == '\n') {
-    cursor_y_ += 16;
-    cursor_x_ = 0;
+    NewLine();
   } else if (c == '\b') {
-    cursor_x_ -= 8;
+    cursor_x_--;
+    if (cursor_x_ < 0) {
+      if (cursor_y_ > 0) {
+        cursor_y_--;
+        cursor_x_ = grid_.GetColumns() - 1;
+      } else {
+        cursor_x_ = 0;
+      }
+    }
+    grid_.PutChar(cursor_x_, cursor_y_, ' ');
   } else {
-    SheetPainter::DrawCharacter(*sheet_, c, cursor_x_, cursor_y_, true);
-    cursor_x_ += 8;
+    grid_.PutChar(cursor_x_, cursor_y_, c);
+    cursor_x_++;
+    if (cursor_x_ >= grid_.GetColumns())
+      NewLine();
   }
-  if (cursor_x_ >= sheet_->GetXSize()) {
-    cursor_y_ += 16;
-    cursor_x_ = 0;
-  } else if (cursor_x_ < 0) {
-    cursor_y_ -= 16;
-    cursor_x_ = (sheet_->GetXSize() - 8) & ~7;
-  }
-  if (c == '\b') {
-    SheetPainter::DrawRect(*sheet_, cursor_x_, cursor_y_, 8, 16, 0x000000,
-                           true);
+  if (rendering_mode_ == RenderingMode::kImmediate)
+    FlushWithoutLocking();
+}
+
+void Console::FlushWithoutLocking() {
+  if (!sheet_ || !grid_.HasDamage())
+    return;
+  const int xsize = sheet_->GetXSize();
+  const int rows = grid_.GetRows();
+  // Rows [flush_begin, flush_end) and columns [flush_left, flush_right)
+  int flush_begin = rows, flush_end = 0;
+  int flush_left = grid_.GetColumns(), flush_right = 0;
+  int num_of_scrolled_lines = grid_.GetNumOfScrolledLines();
+  if (num_of_scrolled_lines) {
+    // Lines scrolled since the last flush are moved at once. The rest of the
+    // screen is not changed by scrolling, so BlockTransfer moves it in the
+    // parent as well, or flushes it. The sheet is kept flushed after each
+    // call so the parent has the same pixels.
+    int exposed_begin = rows - num_of_scrolled_lines;
+    if (exposed_begin > 0) {
+      sheet_->BlockTransfer(0, 0, 0, num_of_scrolled_lines * kCharHeight, xsize,
+                            exposed_begin * kCharHeight, true);
+    }
+    SheetPainter::DrawRect(*sheet_, 0, exposed_begin * kCharHeight, xsize,
+                           num_of_scrolled_lines * kCharHeight, 0x000000,
+                           false);
+    flush_begin = exposed_begin;
+    flush_end = rows;
+    flush_left = 0;
+    flush_right = grid_.GetColumns();
   }
-  if (cursor_y_ + 16 > sheet_->GetYSize()) {
-    sheet_->BlockTransfer(0, 0, 0, 16, sheet_->GetXSize(),
-                          sheet_->GetYSize() - 16);
-    SheetPainter::DrawRect(*sheet_, 0, cursor_y_ - 16, sheet_->GetXSize(), 16,
-                           0x000000, true);
-    cursor_y_ -= 16;
+  for (int y = 0; y < rows; y++) {
+    int begin, end;
+    grid_.GetDirtyRange(y, begin, end);
+    if (begin >= end)
+      continue;
+    SheetPainter::DrawCharacters(
+        *sheet_, grid_.GetRow(y) + begin, end - begin, begin * kCharWidth,
+        y * kCharHeight, SheetPainter::kDefaultForeground,
+        SheetPainter::kDefaultBackground, false);
+    if (y < flush_begin)
+      flush_begin = y;
+    if (y + 1 > flush_end)
+      flush_end = y + 1;
+    if (begin < flush_left)
+      flush_left = begin;
+    if (end > flush_right)
+      flush_right = end;
   }
+  grid_.ClearDamage();
+  if (flush_begin >= flush_end)
+    return;
+  int flush_x = flush_left * kCharWidth;
+  int flush_w = flush_right * kCharWidth - flush_x;
+  if (num_of_scrolled_lines)
+    flush_w = xsize;
+  sheet_->Flush(flush_x, flush_begin * kCharHeight, flush_w,
+                (flush_end - flush_begin) * kCharHeight);
+}
+
+void Console::Flush() {
+  lock_.Lock();
+  FlushWithoutLocking();
+  lock_.Unlock();
 }
 
 void Console::PutChar(char c) {
   lock_.Lock();
   PutCharWithoutLocking(c);
+  if (rendering_mode_ == RenderingMode::kPerCall)
+    FlushWithoutLocking();
   lock_.Unlock();
 }
 
@@ -60,12 +152,16 @@ void Console::PutString(const char* s) {
   while (*s) {
     PutCharWithoutLocking(*(s++));
   }
+  if (rendering_mode_ == RenderingMode::kPerCall)
+    FlushWithoutLocking();
   lock_.Unlock();
 }
 
 #ifndef LIUMOS_LOADER
 
 uint16_t Console::GetCharWithoutBlocking() {
+  // Show what was written before waiting for input, e.g. a prompt.
+  Flush();
   while (1) {
     uint16_t keyid;
     if ((keyid = liumos->keyboard_ctrl->ReadKeyID()) ||
@@ -94,6 +190,20 @@ uint16_t Console::GetCharWithoutBlocking() {
   return KeyID::kNoInput;
 }
 
+void ConsoleFlusher() {
+  HPET& hpet = HPET::GetInstance();
+  uint64_t last_flush_ms = 0;
+  while (true) {
+    uint64_t now_ms = hpet.ReadMainCounterValueInMs();
+    if (now_ms - last_flush_ms >= Console::kFlushIntervalMs) {
+      liumos->main_console->Flush();
+      KernelLog::GetInstance().WriteNewEntries();
+      last_flush_ms = now_ms;
+    }
+    Sleep();
+  }
+}
+
 #endif
 
 void PutChar(char c) {
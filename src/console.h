@@ -1,6 +1,7 @@
 #pragma once
 #include "generic.h"
 #include "process_lock.h"
+#include "text_grid.h"
 
 class Sheet;
 class SerialPort;
@@ -10,34 +11,70 @@ class Console {
   struct CursorPosition {
     int x, y;
   };
+  // When the output written to the grid is rendered into the sheet.
+  enum class RenderingMode {
+    // Every character is drawn and flushed as soon as it is written.
+    kImmediate,
+    // Rendered at the end of each PutChar() / PutString() call.
+    kPerCall,
+    // Rendered only by Flush(), e.g. periodically by ConsoleFlusher().
+    kDeferred,
+  };
+  // Text beyond these is not shown on larger screens.
+  static constexpr int kMaxColumns = 256;
+  static constexpr int kMaxRows = 128;
+  static constexpr int kCharWidth = 8;
+  static constexpr int kCharHeight = 16;
+  static constexpr uint64_t kFlushIntervalMs = 16;
+
   Console()
-      : cursor_x_(0), cursor_y_(0), sheet_(nullptr), serial_port_(nullptr) {}
+      : cursor_x_(0),
+        cursor_y_(0),
+        sheet_(nullptr),
+        serial_port_(nullptr),
+        rendering_mode_(RenderingMode::kPerCall) {}
+  // x and y are in pixels.
   void SetCursorPosition(int x, int y) {
-    cursor_x_ = x;
-    cursor_y_ = y;
+    cursor_x_ = x / kCharWidth;
+    cursor_y_ = y / kCharHeight;
   }
   void ResetCursorPosition() { SetCursorPosition(0, 0); }
   struct CursorPosition GetCursorPosition() {
-    return {cursor_x_, cursor_y_};
+    return {cursor_x_ * kCharWidth, cursor_y_ * kCharHeight};
   }
-  void SetSheet(Sheet* sheet) { sheet_ = sheet; }
+  void SetSheet(Sheet* sheet);
   void SetSerial(SerialPort* serial_port) { serial_port_ = serial_port; }
+  void SetRenderingMode(RenderingMode mode);
+  RenderingMode GetRenderingMode() { return rendering_mode_; }
   void PutChar(char c);
   void PutString(const char* s);
+  // Renders the cells written since the last flush into the sheet.
+  void Flush();
 
 #ifndef LIUMOS_LOADER
   uint16_t GetCharWithoutBlocking();
 #endif
 
  private:
+  // In cells
   int cursor_x_, cursor_y_;
   Sheet* sheet_;
   SerialPort* serial_port_;
+  RenderingMode rendering_mode_;
   ProcessLock lock_;
+  TextGrid<kMaxColumns, kMaxRows> grid_;
 
   void PutCharWithoutLocking(char c);
+  void NewLine();
+  void FlushWithoutLocking();
 };
 
+#ifndef LIUMOS_LOADER
+// Kernel task which flushes liumos->main_console every kFlushIntervalMs.
+// New KernelLog messages are written to its output port at the same time.
+void ConsoleFlusher();
+#endif
+
 void PutChar(char c);
 void PutString(const char* s);
 void PutStringAndDecimal(const char* s, uint64_t value);
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "generic.h"
+#include "rect.h"
+
+// A bounded set of damaged rects to be presented at once.
+// A new rect is merged with a rect in the set if their bounding rect is not
+// larger than the two rects in total, so overlapping flushes of the same
+// region are presented only once. When the set is full, the new rect is
+// merged with the rect whose bounding rect grows the least instead.
+template <int kMaxRects>
+class DamageList {
+ public:
+  void Clear() { num_of_rects_ = 0; }
+  int GetNumOfRects() const { return num_of_rects_; }
+  const Rect& GetRect(int i) const { return rects_[i]; }
+  bool IsEmpty() const { return num_of_rects_ == 0; }
+  void Add(Rect r) {
+    if (r.xsize <= 0 || r.ysize <= 0)
+      return;
+    for (;;) {
+      int merge_index = -1;
+      for (int i = 0; i < num_of_rects_; i++) {
+        const Rect u = rects_[i].GetUnionWith(r);
+        if (GetArea(u) <= GetArea(rects_[i]) + GetArea(r)) {
+          merge_index = i;
+          break;
+        }
+      }
+      if (merge_index < 0 && num_of_rects_ < kMaxRects) {
+        rects_[num_of_rects_++] = r;
+        return;
+      }
+      if (merge_index < 0)
+        merge_index = FindCheapestMerge(r);
+      // The merged rect may now overlap others, so add it again.
+      r = rects_[merge_index].GetUnionWith(r);
+      rects_[merge_index] = rects_[--num_of_rects_];
+    }
+  }
+  // Sum of the areas of the rects in pixels.
+  uint64_t GetTotalArea() const {
+    uint64_t area = 0;
+    for (int i = 0; i < num_of_rects_; i++) {
+      area += GetArea(rects_[i]);
+    }
+    return area;
+  }
+
+ private:
+  static uint64_t GetArea(const Rect& r) {
+    return static_cast<uint64_t>(r.xsize) * static_cast<uint64_t>(r.ysize);
+  }
+  int FindCheapestMerge(const Rect& r) const {
+    int best = 0;
+    uint64_t best_growth = ~0ULL;
+    for (int i = 0; i < num_of_rects_; i++) {
+      const uint64_t growth =
+          GetArea(rects_[i].GetUnionWith(r)) - GetArea(rects_[i]);
+      if (growth < best_growth) {
+        best = i;
+        best_growth = growth;
+      }
+    }
+    return best;
+  }
+
+  Rect rects_[kMaxRects];
+  int num_of_rects_;
+};
@@ -0,0 +1,83 @@
+#include "damage_list.h"
+
+#ifdef LIUMOS_TEST
+
+#include <stdio.h>
+
+#include <cassert>
+
+static void TestIgnoresEmptyRects() {
+  DamageList<4> list;
+  list.Clear();
+  list.Add({10, 10, 0, 5});
+  list.Add({10, 10, 5, -1});
+  assert(list.IsEmpty());
+}
+
+static void TestMergesOverlappingRects() {
+  DamageList<4> list;
+  list.Clear();
+  // The same character cell flushed twice is presented once.
+  list.Add({8, 16, 8, 16});
+  list.Add({8, 16, 8, 16});
+  assert(list.GetNumOfRects() == 1);
+  assert(list.GetRect(0) == Rect({8, 16, 8, 16}));
+  // Adjacent cells on a line become a run.
+  list.Add({16, 16, 8, 16});
+  assert(list.GetNumOfRects() == 1);
+  assert(list.GetRect(0) == Rect({8, 16, 16, 16}));
+  // A rect far away is kept apart.
+  list.Add({200, 100, 8, 8});
+  assert(list.GetNumOfRects() == 2);
+  assert(list.GetTotalArea() == 16 * 16 + 8 * 8);
+}
+
+static void TestDoesNotMergeCrossingBars() {
+  DamageList<4> list;
+  list.Clear();
+  // Merging these would present 100x100 pixels for 1900 damaged ones.
+  list.Add({0, 45, 100, 10});
+  list.Add({45, 0, 10, 100});
+  assert(list.GetNumOfRects() == 2);
+}
+
+static void TestMergedRectIsMergedAgain() {
+  DamageList<4> list;
+  list.Clear();
+  list.Add({0, 0, 10, 10});
+  list.Add({20, 0, 10, 10});
+  assert(list.GetNumOfRects() == 2);
+  // Bridges the two rects above.
+  list.Add({5, 0, 20, 10});
+  assert(list.GetNumOfRects() == 1);
+  assert(list.GetRect(0) == Rect({0, 0, 30, 10}));
+}
+
+static void TestIsBounded() {
+  DamageList<4> list;
+  list.Clear();
+  for (int i = 0; i < 4; i++) {
+    list.Add({i * 100, 0, 10, 10});
+  }
+  assert(list.GetNumOfRects() == 4);
+  // Merged with the nearest one when full.
+  list.Add({315, 0, 10, 10});
+  assert(list.GetNumOfRects() == 4);
+  bool found = false;
+  for (int i = 0; i < list.GetNumOfRects(); i++) {
+    found |= list.GetRect(i) == Rect({300, 0, 25, 10});
+  }
+  assert(found);
+}
+
+int main() {
+  TestIgnoresEmptyRects();
+  TestMergesOverlappingRects();
+  TestDoesNotMergeCrossingBars();
+  TestMergedRectIsMergedAgain();
+  TestIsBounded();
+  puts("PASS");
+  return 0;
+}
+
+#endif
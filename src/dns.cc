@@ -0,0 +1,400 @@
+#include "dns.h"
+
+#include <algorithm>
+
+// https://tools.ietf.org/html/rfc1035#section-4.1.1
+static constexpr size_t kHeaderSize = 12;
+static constexpr uint8_t kFlagQR = 0x80;      // in the 3rd byte
+static constexpr uint8_t kMaskOpcode = 0x78;  // in the 3rd byte
+static constexpr uint8_t kFlagTC = 0x02;      // in the 3rd byte
+static constexpr uint8_t kFlagRA = 0x80;      // in the 4th byte
+static constexpr uint8_t kMaskRCode = 0x0F;   // in the 4th byte
+static constexpr uint8_t kRCodeServerFailure = 2;
+static constexpr uint8_t kRCodeNameError = 3;
+static constexpr uint16_t kTypeSOA = 6;
+static constexpr uint16_t kTypeOPT = 41;  // EDNS (RFC6891)
+
+static uint16_t Read16(const uint8_t* p) {
+  return static_cast<uint16_t>(p[0] << 8 | p[1]);
+}
+
+static uint32_t Read32(const uint8_t* p) {
+  return static_cast<uint32_t>(p[0]) << 24 |
+         static_cast<uint32_t>(p[1]) << 16 |
+         static_cast<uint32_t>(p[2]) << 8 | p[3];
+}
+
+static void Write16(uint8_t* p, uint16_t v) {
+  p[0] = static_cast<uint8_t>(v >> 8);
+  p[1] = static_cast<uint8_t>(v);
+}
+
+static void Write32(uint8_t* p, uint32_t v) {
+  Write16(p, static_cast<uint16_t>(v >> 16));
+  Write16(p + 2, static_cast<uint16_t>(v));
+}
+
+// Returns the offset next to the name at pos, or 0 if it is malformed.
+static size_t SkipName(const uint8_t* msg, size_t size, size_t pos) {
+  while (pos < size) {
+    const uint8_t len = msg[pos];
+    if ((len & 0xC0) == 0xC0) {
+      // Compressed (RFC1035 4.1.4)
+      return pos + 2 <= size ? pos + 2 : 0;
+    }
+    if (len & 0xC0) {
+      return 0;
+    }
+    pos += 1 + len;
+    if (len == 0) {
+      return pos;
+    }
+  }
+  return 0;
+}
+
+// Calls f(type, rr, index) for each resource record after the question,
+// where rr is the offset of the TYPE field and index counts from the first
+// answer. Returns false if msg is malformed.
+template <typename F>
+static bool ForEachRR(const uint8_t* msg,
+                      size_t size,
+                      size_t question_end,
+                      F f) {
+  const int num_of_rrs =
+      Read16(&msg[6]) + Read16(&msg[8]) + Read16(&msg[10]);
+  size_t pos = question_end;
+  for (int i = 0; i < num_of_rrs; i++) {
+    pos = SkipName(msg, size, pos);
+    if (!pos || pos + 10 > size) {
+      return false;
+    }
+    const size_t rdata_end = pos + 10 + Read16(&msg[pos + 8]);
+    if (rdata_end > size) {
+      return false;
+    }
+    f(Read16(&msg[pos]), pos, i);
+    pos = rdata_end;
+  }
+  return true;
+}
+
+bool DNSResolver::Key::IsEqualTo(const Key& to) const {
+  return size == to.size && std::equal(data, data + size, to.data);
+}
+
+bool DNSResolver::ParseQuestion(const uint8_t* msg,
+                                size_t size,
+                                Key& key,
+                                size_t& question_end) {
+  if (size < kHeaderSize || Read16(&msg[4]) != 1) {
+    return false;
+  }
+  size_t pos = kHeaderSize;
+  key.size = 0;
+  while (true) {
+    if (pos >= size) {
+      return false;
+    }
+    const uint8_t len = msg[pos];
+    if (len & 0xC0 || pos + 1 + len > size ||
+        key.size + 1 + len > kMaxKeySize - 4) {
+      return false;
+    }
+    key.data[key.size++] = len;
+    pos++;
+    for (int i = 0; i < len; i++) {
+      const uint8_t c = msg[pos++];
+      key.data[key.size++] =
+          ('A' <= c && c <= 'Z') ? static_cast<uint8_t>(c - 'A' + 'a') : c;
+    }
+    if (len == 0) {
+      break;
+    }
+  }
+  // QTYPE and QCLASS
+  if (pos + 4 > size) {
+    return false;
+  }
+  std::copy(&msg[pos], &msg[pos + 4], &key.data[key.size]);
+  key.size += 4;
+  question_end = pos + 4;
+  return true;
+}
+
+uint32_t DNSResolver::CalcCacheTTL(const uint8_t* msg,
+                                   size_t size,
+                                   size_t question_end,
+                                   bool& is_negative) {
+  const uint8_t rcode = msg[3] & kMaskRCode;
+  if (msg[2] & kFlagTC) {
+    return 0;
+  }
+  is_negative =
+      rcode == kRCodeNameError || (rcode == 0 && Read16(&msg[6]) == 0);
+  if (!is_negative && rcode != 0) {
+    return 0;
+  }
+  const int num_of_answers = Read16(&msg[6]);
+  uint32_t ttl = is_negative ? kMaxNegativeTTL : kMaxTTL;
+  bool has_soa = false;
+  bool ok = ForEachRR(msg, size, question_end,
+                      [&](uint16_t type, size_t rr, int index) {
+                        if (type == kTypeOPT) {
+                          return;
+                        }
+                        const uint32_t rr_ttl = Read32(&msg[rr + 4]);
+                        if (!is_negative) {
+                          ttl = std::min(ttl, rr_ttl);
+                          return;
+                        }
+                        if (type != kTypeSOA || index < num_of_answers) {
+                          return;
+                        }
+                        // RFC2308 5: the smaller of the TTL of the SOA
+                        // and its MINIMUM field.
+                        const size_t rdata_end =
+                            rr + 10 + Read16(&msg[rr + 8]);
+                        ttl = std::min(ttl, rr_ttl);
+                        ttl = std::min(ttl, Read32(&msg[rdata_end - 4]));
+                        has_soa = true;
+                      });
+  if (!ok) {
+    return 0;
+  }
+  if (is_negative && !has_soa) {
+    ttl = kDefaultNegativeTTL;
+  }
+  return ttl;
+}
+
+void DNSResolver::DecrementTTLs(uint8_t* msg,
+                                size_t size,
+                                size_t question_end,
+                                uint32_t elapsed_s) {
+  ForEachRR(msg, size, question_end, [&](uint16_t type, size_t rr, int) {
+    if (type == kTypeOPT) {
+      return;
+    }
+    const uint32_t ttl = Read32(&msg[rr + 4]);
+    Write32(&msg[rr + 4], ttl > elapsed_s ? ttl - elapsed_s : 0);
+  });
+}
+
+void DNSResolver::SendToClient(Transport& transport,
+                               const Client& client,
+                               const uint8_t* msg,
+                               size_t size) {
+  transport.Send(kStubAddr, kPort, client.addr, client.port, msg, size);
+}
+
+void DNSResolver::SendServerFailure(Transport& transport,
+                                    const uint8_t* query,
+                                    size_t query_size,
+                                    const Client& client) {
+  std::copy(query, query + query_size, tx_buf_);
+  Write16(&tx_buf_[0], client.id);
+  tx_buf_[2] = static_cast<uint8_t>(kFlagQR | (query[2] & ~kFlagTC));
+  tx_buf_[3] = kFlagRA | kRCodeServerFailure;
+  SendToClient(transport, client, tx_buf_, query_size);
+}
+
+void DNSResolver::HandleQuery(Transport& transport,
+                              Network::IPv4Addr client_addr,
+                              uint16_t client_port,
+                              const uint8_t* msg,
+                              size_t size,
+                              uint64_t now_ms) {
+  Key key;
+  size_t question_end;
+  if (size > kMaxMessageSize || !ParseQuestion(msg, size, key, question_end) ||
+      msg[2] & (kFlagQR | kMaskOpcode)) {
+    return;
+  }
+  const Client client = {client_addr, client_port, Read16(&msg[0])};
+  stats_.queries++;
+  for (auto& e : cache_) {
+    if (!e.in_use || !e.key.IsEqualTo(key)) {
+      continue;
+    }
+    if (now_ms >= e.expires_at_ms) {
+      e.in_use = false;
+      break;
+    }
+    std::copy(e.msg, e.msg + e.size, tx_buf_);
+    Write16(&tx_buf_[0], client.id);
+    tx_buf_[3] = static_cast<uint8_t>((tx_buf_[3] & ~kFlagZ) |
+                                      (msg[3] & kFlagZ));
+    DecrementTTLs(tx_buf_, e.size, question_end,
+                  static_cast<uint32_t>((now_ms - e.stored_at_ms) / 1000));
+    e.last_used_ms = now_ms;
+    stats_.hits++;
+    if (e.is_negative) {
+      stats_.negative_hits++;
+    }
+    SendToClient(transport, client, tx_buf_, e.size);
+    return;
+  }
+  // The header and the question of this query, with other counts cleared
+  // (e.g. EDNS is not forwarded so that the answer fits in 512 bytes).
+  uint8_t query[kMaxMessageSize];
+  std::copy(msg, msg + question_end, query);
+  std::fill(&query[6], &query[kHeaderSize], 0);
+  query[3] = static_cast<uint8_t>(query[3] & ~kFlagZ);
+  PendingQuery* free_slot = nullptr;
+  for (auto& q : pending_) {
+    if (!q.in_use) {
+      free_slot = free_slot ? free_slot : &q;
+      continue;
+    }
+    if (!q.key.IsEqualTo(key)) {
+      continue;
+    }
+    if (q.num_of_waiters >= kMaxWaitersPerQuery) {
+      SendServerFailure(transport, query, question_end, client);
+      return;
+    }
+    q.waiters[q.num_of_waiters++] = client;
+    stats_.coalesced++;
+    return;
+  }
+  if (!free_slot || upstream_server_.IsEqualTo(Network::kWildcardIPv4Addr)) {
+    SendServerFailure(transport, query, question_end, client);
+    return;
+  }
+  PendingQuery& q = *free_slot;
+  q.in_use = true;
+  q.key = key;
+  const uint32_t random = GenerateRandom();
+  q.upstream_id = static_cast<uint16_t>(random);
+  q.upstream_port = static_cast<uint16_t>(
+      kMinUpstreamPort + (random >> 16) % kNumOfUpstreamPorts);
+  q.sent_at_ms = now_ms;
+  q.num_of_retries = 0;
+  q.num_of_waiters = 1;
+  q.waiters[0] = client;
+  q.size = question_end;
+  std::copy(query, query + question_end, q.msg);
+  Write16(&q.msg[0], q.upstream_id);
+  stats_.upstream_queries++;
+  transport.Send(Network::kWildcardIPv4Addr, q.upstream_port,
+                 upstream_server_, kPort, q.msg, q.size);
+}
+
+void DNSResolver::HandleResponse(Transport& transport,
+                                 uint16_t dst_port,
+                                 const uint8_t* msg,
+                                 size_t size,
+                                 uint64_t now_ms) {
+  Key key;
+  size_t question_end;
+  if (size > kMaxMessageSize || !(msg[2] & kFlagQR) ||
+      !ParseQuestion(msg, size, key, question_end)) {
+    return;
+  }
+  const uint16_t id = Read16(&msg[0]);
+  for (auto& q : pending_) {
+    if (!q.in_use || q.upstream_id != id || q.upstream_port != dst_port ||
+        !q.key.IsEqualTo(key)) {
+      continue;
+    }
+    Store(key, msg, size, now_ms);
+    for (int i = 0; i < q.num_of_waiters; i++) {
+      std::copy(msg, msg + size, tx_buf_);
+      Write16(&tx_buf_[0], q.waiters[i].id);
+      tx_buf_[3] = static_cast<uint8_t>(tx_buf_[3] & ~kFlagZ);
+      SendToClient(transport, q.waiters[i], tx_buf_, size);
+    }
+    q.in_use = false;
+    return;
+  }
+}
+
+void DNSResolver::ProcessTimers(Transport& transport, uint64_t now_ms) {
+  for (auto& q : pending_) {
+    if (!q.in_use || now_ms - q.sent_at_ms < kRetryIntervalMs) {
+      continue;
+    }
+    if (q.num_of_retries >= kMaxRetries) {
+      for (int i = 0; i < q.num_of_waiters; i++) {
+        SendServerFailure(transport, q.msg, q.size, q.waiters[i]);
+      }
+      q.in_use = false;
+      stats_.timeouts++;
+      continue;
+    }
+    q.num_of_retries++;
+    q.sent_at_ms = now_ms;
+    stats_.upstream_queries++;
+    transport.Send(Network::kWildcardIPv4Addr, q.upstream_port,
+                   upstream_server_, kPort, q.msg, q.size);
+  }
+}
+
+void DNSResolver::Store(const Key& key,
+                        const uint8_t* msg,
+                        size_t size,
+                        uint64_t now_ms) {
+  size_t question_end;
+  Key parsed_key;
+  bool is_negative = false;
+  if (!ParseQuestion(msg, size, parsed_key, question_end)) {
+    return;
+  }
+  const uint32_t ttl = CalcCacheTTL(msg, size, question_end, is_negative);
+  if (!ttl) {
+    return;
+  }
+  // Replace the entry of the same question, an unused or expired one, or
+  // the least recently used one in this order.
+  CacheEntry* victim = &cache_[0];
+  for (auto& e : cache_) {
+    if (e.in_use && e.key.IsEqualTo(key)) {
+      victim = &e;
+      break;
+    }
+    if (!victim->in_use || now_ms >= victim->expires_at_ms) {
+      continue;
+    }
+    if (!e.in_use || now_ms >= e.expires_at_ms ||
+        e.last_used_ms < victim->last_used_ms) {
+      victim = &e;
+    }
+  }
+  CacheEntry& e = *victim;
+  e.in_use = true;
+  e.is_negative = is_negative;
+  e.key = key;
+  e.stored_at_ms = now_ms;
+  e.expires_at_ms = now_ms + ttl * 1000ULL;
+  e.last_used_ms = now_ms;
+  e.size = size;
+  std::copy(msg, msg + size, e.msg);
+}
+
+uint32_t DNSResolver::GenerateRandom() {
+  if (!random_state_) {
+    // Not seeded. xorshift never leaves the zero state.
+    random_state_ = 0x9E3779B97F4A7C15ULL;
+  }
+  random_state_ ^= random_state_ >> 12;
+  random_state_ ^= random_state_ << 25;
+  random_state_ ^= random_state_ >> 27;
+  return static_cast<uint32_t>((random_state_ * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+void DNSResolver::Flush() {
+  for (auto& e : cache_) {
+    e.in_use = false;
+  }
+}
+
+int DNSResolver::GetNumOfCacheEntries(uint64_t now_ms) {
+  int count = 0;
+  for (auto& e : cache_) {
+    if (e.in_use && now_ms < e.expires_at_ms) {
+      count++;
+    }
+  }
+  return count;
+}
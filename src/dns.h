@@ -0,0 +1,155 @@
+#pragma once
+
+#include "generic.h"
+#include "network.h"
+
+// Caching stub DNS resolver (RFC1035, negative caching: RFC2308).
+// Apps send ordinary DNS queries to kStubAddr:53 instead of the upstream
+// server. Answers are served from the cache with their TTLs decremented,
+// and identical queries in flight share one upstream query.
+// This class only handles messages and the time given by the caller.
+// Network passes received messages to it and sends messages via Transport.
+class DNSResolver {
+ public:
+  class Transport {
+   public:
+    // src_addr is kWildcardIPv4Addr for the address of the device to send.
+    virtual void Send(Network::IPv4Addr src_addr,
+                      uint16_t src_port,
+                      Network::IPv4Addr dst_addr,
+                      uint16_t dst_port,
+                      const uint8_t* msg,
+                      size_t size) = 0;
+  };
+  struct Client {
+    Network::IPv4Addr addr;
+    uint16_t port;
+    uint16_t id;  // ID of the query from the client
+  };
+  struct Stats {
+    uint64_t queries;
+    uint64_t hits;
+    uint64_t negative_hits;
+    uint64_t coalesced;
+    uint64_t upstream_queries;
+    uint64_t timeouts;
+  };
+  static constexpr Network::IPv4Addr kStubAddr = {127, 0, 0, 53};
+  static constexpr uint16_t kPort = 53;
+  // Queries to the upstream server are sent from a random port in this
+  // range with a random ID so that off-path attackers can hardly guess them
+  // to forge answers (RFC5452). The range is reserved by the kernel.
+  static constexpr uint16_t kMinUpstreamPort = 61440;
+  static constexpr int kNumOfUpstreamPorts = 4096;
+  static bool IsUpstreamPort(uint16_t port) {
+    return port >= kMinUpstreamPort &&
+           port - kMinUpstreamPort < kNumOfUpstreamPorts;
+  }
+  static constexpr size_t kMaxMessageSize = 512;  // RFC1035 4.2.1
+  // If a query has the Z bit of the header set, its answer has the bit set
+  // when it is served from the cache. This is a private extension of this
+  // stub (see app/dig).
+  static constexpr uint8_t kFlagZ = 0x40;  // in the 4th byte of the header
+  static constexpr int kNumOfCacheEntries = 64;
+  static constexpr int kNumOfPendingQueries = 16;
+  static constexpr int kMaxWaitersPerQuery = 8;
+  static constexpr uint64_t kRetryIntervalMs = 1000;
+  static constexpr int kMaxRetries = 3;
+  static constexpr uint32_t kMaxTTL = 24 * 3600;
+  // RFC2308 5: used when the negative answer has no SOA record
+  static constexpr uint32_t kDefaultNegativeTTL = 60;
+  static constexpr uint32_t kMaxNegativeTTL = 3 * 3600;
+
+  void SetUpstreamServer(Network::IPv4Addr addr) { upstream_server_ = addr; }
+  // Seeds the generator of upstream IDs and ports. Should be unpredictable.
+  void SetRandomSeed(uint64_t seed) { random_state_ = seed | 1; }
+  Network::IPv4Addr GetUpstreamServer() { return upstream_server_; }
+  // Handles a message to kStubAddr:kPort from client_addr:client_port.
+  void HandleQuery(Transport& transport,
+                   Network::IPv4Addr client_addr,
+                   uint16_t client_port,
+                   const uint8_t* msg,
+                   size_t size,
+                   uint64_t now_ms);
+  // Handles a message from the upstream server to dst_port.
+  void HandleResponse(Transport& transport,
+                      uint16_t dst_port,
+                      const uint8_t* msg,
+                      size_t size,
+                      uint64_t now_ms);
+  // Retransmits queries to the upstream server. Clients of queries which
+  // were not answered are replied with SERVFAIL. Called periodically.
+  void ProcessTimers(Transport& transport, uint64_t now_ms);
+  void Flush();
+  int GetNumOfCacheEntries(uint64_t now_ms);
+  const Stats& GetStats() { return stats_; }
+
+ private:
+  // Lowercased QNAME followed by QTYPE and QCLASS
+  static constexpr size_t kMaxKeySize = 255 + 4;
+  struct Key {
+    uint8_t data[kMaxKeySize];
+    size_t size;
+    bool IsEqualTo(const Key& to) const;
+  };
+  struct CacheEntry {
+    bool in_use;
+    bool is_negative;
+    Key key;
+    uint64_t stored_at_ms;
+    uint64_t expires_at_ms;
+    uint64_t last_used_ms;
+    size_t size;
+    uint8_t msg[kMaxMessageSize];
+  };
+  struct PendingQuery {
+    bool in_use;
+    Key key;
+    uint16_t upstream_id;
+    uint16_t upstream_port;
+    uint64_t sent_at_ms;
+    int num_of_retries;
+    int num_of_waiters;
+    Client waiters[kMaxWaitersPerQuery];
+    // The query sent to the upstream server: the header and the question of
+    // the first query, without other sections. Also used to build SERVFAIL.
+    size_t size;
+    uint8_t msg[kMaxMessageSize];
+  };
+
+  // Returns false if msg has no valid question. question_end is the offset
+  // where the question ends.
+  static bool ParseQuestion(const uint8_t* msg,
+                            size_t size,
+                            Key& key,
+                            size_t& question_end);
+  // Returns the TTL for the cache, or 0 if msg should not be cached.
+  static uint32_t CalcCacheTTL(const uint8_t* msg,
+                               size_t size,
+                               size_t question_end,
+                               bool& is_negative);
+  static void DecrementTTLs(uint8_t* msg,
+                            size_t size,
+                            size_t question_end,
+                            uint32_t elapsed_s);
+  void SendToClient(Transport& transport,
+                    const Client& client,
+                    const uint8_t* msg,
+                    size_t size);
+  // Replies SERVFAIL to the query which consists of only the header and
+  // the question.
+  void SendServerFailure(Transport& transport,
+                         const uint8_t* query,
+                         size_t query_size,
+                         const Client& client);
+  void Store(const Key& key, const uint8_t* msg, size_t size, uint64_t now_ms);
+  // xorshift64*
+  uint32_t GenerateRandom();
+
+  Network::IPv4Addr upstream_server_;
+  uint64_t random_state_;
+  Stats stats_;
+  CacheEntry cache_[kNumOfCacheEntries];
+  PendingQuery pending_[kNumOfPendingQueries];
+  uint8_t tx_buf_[kMaxMessageSize];
+};
@@ -0,0 +1,267 @@
+#include "dns.h"
+
+#ifdef LIUMOS_TEST
+
+#include <stdio.h>
+#include <string.h>
+
+#include <cassert>
+#include <vector>
+
+using IPv4Addr = Network::IPv4Addr;
+
+static constexpr IPv4Addr kUpstreamAddr = {10, 0, 2, 3};
+static constexpr IPv4Addr kClientAddr = {127, 0, 0, 1};
+
+struct SentMessage {
+  IPv4Addr src_addr;
+  uint16_t src_port;
+  IPv4Addr dst_addr;
+  uint16_t dst_port;
+  std::vector<uint8_t> msg;
+};
+
+class FakeTransport : public DNSResolver::Transport {
+ public:
+  void Send(IPv4Addr src_addr,
+            uint16_t src_port,
+            IPv4Addr dst_addr,
+            uint16_t dst_port,
+            const uint8_t* msg,
+            size_t size) override {
+    sent.push_back(
+        {src_addr, src_port, dst_addr, dst_port, {msg, msg + size}});
+  }
+  std::vector<SentMessage> sent;
+};
+
+static uint16_t GetID(const std::vector<uint8_t>& msg) {
+  return static_cast<uint16_t>(msg[0] << 8 | msg[1]);
+}
+
+static uint8_t GetRCode(const std::vector<uint8_t>& msg) {
+  return msg[3] & 0x0F;
+}
+
+static std::vector<uint8_t> MakeQuery(uint16_t id, const char* name) {
+  std::vector<uint8_t> q = {static_cast<uint8_t>(id >> 8),
+                            static_cast<uint8_t>(id), 0x01, 0x00, 0, 1, 0, 0,
+                            0, 0, 0, 0};
+  while (*name) {
+    const char* end = strchr(name, '.');
+    size_t len = end ? static_cast<size_t>(end - name) : strlen(name);
+    q.push_back(static_cast<uint8_t>(len));
+    q.insert(q.end(), name, name + len);
+    name += len + (end ? 1 : 0);
+  }
+  q.insert(q.end(), {0, 0, 1, 0, 1});  // root, type A, class IN
+  return q;
+}
+
+// An answer of an A record with ttl, or NXDOMAIN with an SOA of
+// soa_minimum if ttl is 0.
+static std::vector<uint8_t> MakeResponse(const std::vector<uint8_t>& query,
+                                         uint32_t ttl,
+                                         uint32_t soa_minimum) {
+  std::vector<uint8_t> r = query;
+  r[2] = 0x81;
+  r[3] = ttl ? 0x80 : 0x83;
+  auto put32 = [&r](uint32_t v) {
+    r.insert(r.end(), {static_cast<uint8_t>(v >> 24),
+                       static_cast<uint8_t>(v >> 16),
+                       static_cast<uint8_t>(v >> 8), static_cast<uint8_t>(v)});
+  };
+  if (ttl) {
+    r[7] = 1;  // ANCOUNT
+    r.insert(r.end(), {0xC0, 12, 0, 1, 0, 1});
+    put32(ttl);
+    r.insert(r.end(), {0, 4, 93, 184, 216, 34});
+    return r;
+  }
+  r[9] = 1;  // NSCOUNT
+  r.insert(r.end(), {0, 0, 6, 0, 1});
+  put32(900);
+  r.insert(r.end(), {0, 22, 0, 0});  // RDLENGTH, MNAME and RNAME (root)
+  for (int i = 0; i < 4; i++) {
+    put32(0);  // SERIAL, REFRESH, RETRY, EXPIRE
+  }
+  put32(soa_minimum);
+  return r;
+}
+
+static uint32_t GetAnswerTTL(const std::vector<uint8_t>& msg) {
+  // The answer follows the query of MakeQuery("example.com").
+  const size_t ttl_offset = 12 + 13 + 4 + 6;
+  return static_cast<uint32_t>(msg[ttl_offset]) << 24 |
+         msg[ttl_offset + 1] << 16 | msg[ttl_offset + 2] << 8 |
+         msg[ttl_offset + 3];
+}
+
+static void Query(DNSResolver& r,
+                  FakeTransport& t,
+                  const std::vector<uint8_t>& q,
+                  uint16_t port,
+                  uint64_t now_ms) {
+  r.HandleQuery(t, kClientAddr, port, q.data(), q.size(), now_ms);
+}
+
+static void TestCacheAndCoalescing() {
+  static DNSResolver r;
+  FakeTransport t;
+  r.SetUpstreamServer(kUpstreamAddr);
+  uint64_t now = 5000;
+
+  // Two identical queries in flight share one upstream query.
+  Query(r, t, MakeQuery(0x1111, "example.com"), 10001, now);
+  Query(r, t, MakeQuery(0x2222, "EXAMPLE.com"), 10002, now);
+  assert(t.sent.size() == 1);
+  const SentMessage upstream = t.sent[0];
+  assert(upstream.dst_addr.IsEqualTo(kUpstreamAddr));
+  assert(upstream.dst_port == 53);
+  assert(DNSResolver::IsUpstreamPort(upstream.src_port));
+  t.sent.clear();
+
+  // A response with a wrong ID or to a wrong port is ignored.
+  std::vector<uint8_t> resp = MakeResponse(upstream.msg, 300, 0);
+  resp[0] ^= 0xFF;
+  r.HandleResponse(t, upstream.src_port, resp.data(), resp.size(), now);
+  assert(t.sent.empty());
+  resp[0] ^= 0xFF;
+  const uint16_t wrong_port =
+      upstream.src_port == DNSResolver::kMinUpstreamPort
+          ? DNSResolver::kMinUpstreamPort + 1
+          : DNSResolver::kMinUpstreamPort;
+  r.HandleResponse(t, wrong_port, resp.data(), resp.size(), now);
+  assert(t.sent.empty());
+  now += 20;
+  r.HandleResponse(t, upstream.src_port, resp.data(), resp.size(), now);
+  assert(t.sent.size() == 2);
+  assert(GetID(t.sent[0].msg) == 0x1111 && t.sent[0].dst_port == 10001);
+  assert(GetID(t.sent[1].msg) == 0x2222 && t.sent[1].dst_port == 10002);
+  assert(t.sent[0].src_addr.IsEqualTo(DNSResolver::kStubAddr));
+  assert(GetAnswerTTL(t.sent[0].msg) == 300);
+  t.sent.clear();
+
+  // Served from the cache with the TTL decremented, and with the Z bit if
+  // asked.
+  now += 100 * 1000;
+  std::vector<uint8_t> q = MakeQuery(0x3333, "example.com");
+  q[3] |= DNSResolver::kFlagZ;
+  Query(r, t, q, 10003, now);
+  assert(t.sent.size() == 1);
+  assert(GetID(t.sent[0].msg) == 0x3333);
+  assert(GetAnswerTTL(t.sent[0].msg) == 200);
+  assert(t.sent[0].msg[3] & DNSResolver::kFlagZ);
+  assert(r.GetStats().hits == 1 && r.GetStats().coalesced == 1);
+  t.sent.clear();
+
+  // Expires after the TTL.
+  now += 200 * 1000;
+  Query(r, t, MakeQuery(0x4444, "example.com"), 10004, now);
+  assert(t.sent.size() == 1 && t.sent[0].dst_addr.IsEqualTo(kUpstreamAddr));
+  assert(!(t.sent[0].msg[3] & DNSResolver::kFlagZ));
+  assert(r.GetNumOfCacheEntries(now) == 0);
+}
+
+static void TestNegativeCache() {
+  static DNSResolver r;
+  FakeTransport t;
+  r.SetUpstreamServer(kUpstreamAddr);
+  uint64_t now = 0;
+  Query(r, t, MakeQuery(0x1111, "example.com"), 10001, now);
+  // NXDOMAIN is cached for min(SOA TTL, SOA MINIMUM) = 30 s.
+  std::vector<uint8_t> resp = MakeResponse(t.sent[0].msg, 0, 30);
+  const uint16_t upstream_port = t.sent[0].src_port;
+  t.sent.clear();
+  r.HandleResponse(t, upstream_port, resp.data(), resp.size(), now);
+  assert(t.sent.size() == 1 && GetRCode(t.sent[0].msg) == 3);
+  t.sent.clear();
+  now += 29 * 1000;
+  Query(r, t, MakeQuery(0x2222, "example.com"), 10001, now);
+  assert(t.sent.size() == 1 && GetRCode(t.sent[0].msg) == 3);
+  assert(t.sent[0].dst_port == 10001);
+  assert(r.GetStats().negative_hits == 1);
+  t.sent.clear();
+  now += 1000;
+  Query(r, t, MakeQuery(0x3333, "example.com"), 10001, now);
+  assert(t.sent.size() == 1 && t.sent[0].dst_addr.IsEqualTo(kUpstreamAddr));
+}
+
+static void TestRetryAndServerFailure() {
+  static DNSResolver r;
+  FakeTransport t;
+  // Without an upstream server, queries fail immediately.
+  Query(r, t, MakeQuery(0x1111, "example.com"), 10001, 0);
+  assert(t.sent.size() == 1 && GetRCode(t.sent[0].msg) == 2);
+  assert(GetID(t.sent[0].msg) == 0x1111);
+  t.sent.clear();
+
+  r.SetUpstreamServer(kUpstreamAddr);
+  uint64_t now = 0;
+  Query(r, t, MakeQuery(0x2222, "example.com"), 10002, now);
+  for (int i = 0; i < DNSResolver::kMaxRetries; i++) {
+    now += DNSResolver::kRetryIntervalMs;
+    r.ProcessTimers(t, now);
+  }
+  assert(t.sent.size() == 1 + DNSResolver::kMaxRetries);
+  for (auto& m : t.sent) {
+    assert(m.dst_addr.IsEqualTo(kUpstreamAddr));
+  }
+  t.sent.clear();
+  now += DNSResolver::kRetryIntervalMs;
+  r.ProcessTimers(t, now);
+  assert(t.sent.size() == 1 && GetRCode(t.sent[0].msg) == 2);
+  assert(GetID(t.sent[0].msg) == 0x2222 && t.sent[0].dst_port == 10002);
+  assert(r.GetStats().timeouts == 1);
+}
+
+static void TestRandomUpstreamIDAndPort() {
+  static DNSResolver r;
+  FakeTransport t;
+  r.SetUpstreamServer(kUpstreamAddr);
+  r.SetRandomSeed(0x0123456789ABCDEFULL);
+  constexpr int kNumOfQueries = DNSResolver::kNumOfPendingQueries;
+  char name[] = "a.example.com";
+  for (int i = 0; i < kNumOfQueries; i++) {
+    name[0] = static_cast<char>('a' + i);
+    Query(r, t, MakeQuery(0x1111, name), 10001, 0);
+  }
+  assert(t.sent.size() == kNumOfQueries);
+  // Neither IDs nor ports are sequential, so most of them differ.
+  int num_of_distinct_ids = 0;
+  int num_of_distinct_ports = 0;
+  for (int i = 0; i < kNumOfQueries; i++) {
+    assert(DNSResolver::IsUpstreamPort(t.sent[i].src_port));
+    bool id_seen = false;
+    bool port_seen = false;
+    for (int k = 0; k < i; k++) {
+      id_seen |= GetID(t.sent[k].msg) == GetID(t.sent[i].msg);
+      port_seen |= t.sent[k].src_port == t.sent[i].src_port;
+    }
+    num_of_distinct_ids += !id_seen;
+    num_of_distinct_ports += !port_seen;
+  }
+  assert(num_of_distinct_ids >= kNumOfQueries - 1);
+  assert(num_of_distinct_ports >= kNumOfQueries - 1);
+
+  // Retransmissions keep the ID and the port of each query.
+  const std::vector<SentMessage> first = t.sent;
+  t.sent.clear();
+  r.ProcessTimers(t, DNSResolver::kRetryIntervalMs);
+  assert(t.sent.size() == kNumOfQueries);
+  for (int i = 0; i < kNumOfQueries; i++) {
+    assert(GetID(t.sent[i].msg) == GetID(first[i].msg));
+    assert(t.sent[i].src_port == first[i].src_port);
+  }
+}
+
+int main() {
+  TestCacheAndCoalescing();
+  TestNegativeCache();
+  TestRetryAndServerFailure();
+  TestRandomUpstreamIDAndPort();
+  puts("PASS");
+  return 0;
+}
+
+#endif
@@ -0,0 +1,810 @@
+#include "fat32.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Microsoft Extensible Firmware Initiative FAT32 File System Specification
+constexpr uint8_t kAttrReadOnly = 0x01;
+constexpr uint8_t kAttrHidden = 0x02;
+constexpr uint8_t kAttrSystem = 0x04;
+constexpr uint8_t kAttrVolumeID = 0x08;
+constexpr uint8_t kAttrDirectory = 0x10;
+constexpr uint8_t kAttrArchive = 0x20;
+constexpr uint8_t kAttrLongName =
+    kAttrReadOnly | kAttrHidden | kAttrSystem | kAttrVolumeID;
+constexpr uint8_t kAttrLongNameMask = kAttrLongName | kAttrDirectory |
+                                      kAttrArchive;
+
+constexpr uint8_t kEntryEnd = 0x00;
+constexpr uint8_t kEntryFree = 0xE5;
+constexpr uint8_t kLastLongNameEntry = 0x40;
+constexpr int kMaxLongNameEntries = 20;
+// Set in ShortEntry::nt_reserved if the part of the name is in lower case.
+constexpr uint8_t kLowerCaseBase = 0x08;
+constexpr uint8_t kLowerCaseExt = 0x10;
+
+constexpr uint32_t kClusterMask = 0x0FFF'FFFF;
+constexpr uint32_t kEndOfChain = 0x0FFF'FFFF;
+constexpr uint32_t kMinEndOfChain = 0x0FFF'FFF8;
+constexpr uint64_t kMaxFileSize = 0xFFFF'FFFF;
+constexpr uint64_t kMaxDirSize = 65536 * 32;
+
+constexpr uint32_t kFSInfoLeadSignature = 0x4161'5252;
+constexpr uint32_t kFSInfoStructSignature = 0x6141'7272;
+constexpr uint32_t kFSInfoUnknown = 0xFFFF'FFFF;
+
+static const uint8_t zeros[kPageSize] = {};
+
+template <typename T>
+static T ReadLE(const uint8_t* p) {
+  T v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint8_t CalcShortNameChecksum(const char (&short_name)[11]) {
+  uint8_t sum = 0;
+  for (int i = 0; i < 11; i++) {
+    sum = static_cast<uint8_t>(((sum & 1) << 7) + (sum >> 1) +
+                               static_cast<uint8_t>(short_name[i]));
+  }
+  return sum;
+}
+
+static char ToLower(char c) {
+  return ('A' <= c && c <= 'Z') ? static_cast<char>(c + 'a' - 'A') : c;
+}
+
+static bool IsShortNameChar(char c) {
+  return ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9') ||
+         (c && strchr("$%'-_@~`!(){}^#&", c));
+}
+
+// Fills short_name with the 8.3 name for name. Returns true if name is not
+// representable as is, and needs long name entries. In that case,
+// short_name is the basis to add a numeric tail to.
+static bool MakeShortName(const char* name,
+                          size_t len,
+                          char (&short_name)[11],
+                          uint8_t& nt_flags) {
+  memset(short_name, ' ', sizeof(short_name));
+  nt_flags = 0;
+  size_t dot = len;
+  for (size_t i = len; i > 0; i--) {
+    if (name[i - 1] == '.') {
+      dot = i - 1;
+      break;
+    }
+  }
+  bool needs_long_name = (dot == 0);
+  const struct {
+    size_t begin;
+    size_t end;
+    int max_len;
+    char* dst;
+    uint8_t lower_case_flag;
+  } parts[2] = {
+      {0, dot, 8, &short_name[0], kLowerCaseBase},
+      {std::min(dot + 1, len), len, 3, &short_name[8], kLowerCaseExt},
+  };
+  for (auto& part : parts) {
+    int n = 0;
+    bool has_lower = false;
+    bool has_upper = false;
+    for (size_t i = part.begin; i < part.end; i++) {
+      char c = name[i];
+      if (c == ' ' || c == '.') {
+        needs_long_name = true;
+        continue;
+      }
+      if ('a' <= c && c <= 'z') {
+        has_lower = true;
+        c = static_cast<char>(c - 'a' + 'A');
+      } else if ('A' <= c && c <= 'Z') {
+        has_upper = true;
+      }
+      if (!IsShortNameChar(c)) {
+        needs_long_name = true;
+        c = '_';
+      }
+      if (n == part.max_len) {
+        needs_long_name = true;
+        break;
+      }
+      part.dst[n++] = c;
+    }
+    if (has_lower && has_upper)
+      needs_long_name = true;
+    if (has_lower)
+      nt_flags |= part.lower_case_flag;
+  }
+  if (short_name[0] == ' ')
+    short_name[0] = '_';
+  if (needs_long_name)
+    nt_flags = 0;
+  return needs_long_name;
+}
+
+// Replaces the end of the base name with "~n" as Windows does.
+static void AddNumericTail(char (&short_name)[11],
+                           const char (&basis)[11],
+                           int n) {
+  char tail[8];
+  int tail_len = 0;
+  for (int v = n; v; v /= 10) {
+    tail[tail_len++] = static_cast<char>('0' + v % 10);
+  }
+  tail[tail_len++] = '~';
+  int base_len = 0;
+  while (base_len < 8 && basis[base_len] != ' ') {
+    base_len++;
+  }
+  const int keep = std::min(base_len, 8 - tail_len);
+  memcpy(short_name, basis, sizeof(short_name));
+  memset(&short_name[keep], ' ', 8 - keep);
+  for (int i = 0; i < tail_len; i++) {
+    short_name[keep + i] = tail[tail_len - 1 - i];
+  }
+}
+
+// Converts a UTF-8 name to UTF-16. Returns the length, or -1 if the name is
+// not valid as a long file name.
+static int ToLongName(const char* name,
+                      size_t len,
+                      uint16_t (&dst)[FAT32::kMaxFileNameLen]) {
+  int n = 0;
+  for (size_t i = 0; i < len;) {
+    const uint8_t c = static_cast<uint8_t>(name[i]);
+    uint16_t u;
+    if (c < 0x80) {
+      if (c < 0x20 || strchr("\"*/:<>?\\|", c))
+        return -1;
+      u = c;
+      i++;
+    } else if ((c & 0xE0) == 0xC0 && i + 1 < len) {
+      u = static_cast<uint16_t>(((c & 0x1F) << 6) | (name[i + 1] & 0x3F));
+      i += 2;
+    } else if ((c & 0xF0) == 0xE0 && i + 2 < len) {
+      u = static_cast<uint16_t>(((c & 0x0F) << 12) |
+                                ((name[i + 1] & 0x3F) << 6) |
+                                (name[i + 2] & 0x3F));
+      i += 3;
+    } else {
+      // Characters out of the BMP are not supported.
+      return -1;
+    }
+    if (n == FAT32::kMaxFileNameLen)
+      return -1;
+    dst[n++] = u;
+  }
+  return n;
+}
+
+// Appends u to dst as UTF-8.
+static size_t AppendUTF8(char* dst, size_t len, uint16_t u) {
+  if (u < 0x80) {
+    dst[len++] = static_cast<char>(u);
+  } else if (u < 0x800) {
+    dst[len++] = static_cast<char>(0xC0 | (u >> 6));
+    dst[len++] = static_cast<char>(0x80 | (u & 0x3F));
+  } else {
+    dst[len++] = static_cast<char>(0xE0 | (u >> 12));
+    dst[len++] = static_cast<char>(0x80 | ((u >> 6) & 0x3F));
+    dst[len++] = static_cast<char>(0x80 | (u & 0x3F));
+  }
+  return len;
+}
+
+bool FAT32::Mount(PageCache& cache) {
+  cache_ = &cache;
+  if (!MountVolume(0))
+    return false;
+  // Master Boot Record
+  uint8_t mbr[BlockDevice::kSectorSize];
+  if (cache_->Read(0, mbr, sizeof(mbr)) || mbr[510] != 0x55 ||
+      mbr[511] != 0xAA)
+    return true;
+  for (int i = 0; i < 4; i++) {
+    const uint8_t* partition = &mbr[446 + 16 * i];
+    const uint8_t type = partition[4];
+    const uint32_t first_sector = ReadLE<uint32_t>(&partition[8]);
+    // FAT32 (CHS), FAT32 (LBA), EFI system partition
+    if ((type == 0x0B || type == 0x0C || type == 0xEF) && first_sector &&
+        !MountVolume(first_sector))
+      return false;
+  }
+  return true;
+}
+
+bool FAT32::MountVolume(uint64_t first_sector) {
+  const uint64_t base = first_sector * BlockDevice::kSectorSize;
+  const uint64_t device_size =
+      cache_->GetDevice().GetNumOfSectors() * BlockDevice::kSectorSize;
+  uint8_t sector[BlockDevice::kSectorSize];
+  if (base + sizeof(sector) > device_size ||
+      cache_->Read(base, sector, sizeof(sector)))
+    return true;
+  BPB bpb;
+  memcpy(&bpb, sector, sizeof(bpb));
+  const uint32_t bytes_per_sector = bpb.bytes_per_sector;
+  const uint32_t sectors_per_cluster = bpb.sectors_per_cluster;
+  if ((bpb.jmp_boot[0] != 0xEB && bpb.jmp_boot[0] != 0xE9) ||
+      sector[510] != 0x55 || sector[511] != 0xAA ||
+      bytes_per_sector < 512 || bytes_per_sector > 4096 ||
+      (bytes_per_sector & (bytes_per_sector - 1)) || !sectors_per_cluster ||
+      (sectors_per_cluster & (sectors_per_cluster - 1)) ||
+      !bpb.num_of_reserved_sectors || !bpb.num_of_fats ||
+      bpb.num_of_root_entries || bpb.fat_size16 || !bpb.fat_size32)
+    return true;
+  const uint64_t total_sectors =
+      bpb.total_sectors16 ? bpb.total_sectors16 : bpb.total_sectors32;
+  const uint64_t meta_sectors =
+      bpb.num_of_reserved_sectors +
+      static_cast<uint64_t>(bpb.num_of_fats) * bpb.fat_size32;
+  if (total_sectors <= meta_sectors ||
+      base + total_sectors * bytes_per_sector > device_size)
+    return true;
+  fat_ofs_ = base + bpb.num_of_reserved_sectors * bytes_per_sector;
+  fat_size_ = static_cast<uint64_t>(bpb.fat_size32) * bytes_per_sector;
+  num_of_fats_ = bpb.num_of_fats;
+  data_ofs_ = base + meta_sectors * bytes_per_sector;
+  cluster_size_ = bytes_per_sector * sectors_per_cluster;
+  num_of_clusters_ = static_cast<uint32_t>(
+      std::min((total_sectors - meta_sectors) / sectors_per_cluster,
+               fat_size_ / sizeof(uint32_t) - 2));
+  root_cluster_ = bpb.root_cluster;
+  if (!IsValidCluster(root_cluster_))
+    return true;
+
+  fs_info_ofs_ = 0;
+  num_of_free_clusters_ = kFSInfoUnknown;
+  next_free_cluster_ = 2;
+  if (bpb.fs_info_sector && bpb.fs_info_sector != 0xFFFF) {
+    const uint64_t ofs = base + bpb.fs_info_sector * bytes_per_sector;
+    if (!cache_->Read(ofs, sector, sizeof(sector)) &&
+        ReadLE<uint32_t>(&sector[0]) == kFSInfoLeadSignature &&
+        ReadLE<uint32_t>(&sector[484]) == kFSInfoStructSignature) {
+      fs_info_ofs_ = ofs;
+      num_of_free_clusters_ = ReadLE<uint32_t>(&sector[488]);
+      if (IsValidCluster(ReadLE<uint32_t>(&sector[492])))
+        next_free_cluster_ = ReadLE<uint32_t>(&sector[492]);
+    }
+  }
+  if (num_of_free_clusters_ > num_of_clusters_) {
+    // Not recorded. Count them.
+    num_of_free_clusters_ = 0;
+    for (uint32_t c = 2; c < num_of_clusters_ + 2; c++) {
+      uint32_t v;
+      if (ReadFATEntry(c, v))
+        return true;
+      num_of_free_clusters_ += (v == 0);
+    }
+  }
+  return false;
+}
+
+bool FAT32::ReadFATEntry(uint32_t cluster, uint32_t& value) {
+  if (!IsValidCluster(cluster) ||
+      cache_->Read(fat_ofs_ + cluster * sizeof(uint32_t), &value,
+                   sizeof(value)))
+    return true;
+  value &= kClusterMask;
+  return false;
+}
+
+bool FAT32::WriteFATEntry(uint32_t cluster, uint32_t value) {
+  uint32_t entry;
+  const uint64_t ofs = cluster * sizeof(uint32_t);
+  if (!IsValidCluster(cluster) ||
+      cache_->Read(fat_ofs_ + ofs, &entry, sizeof(entry)))
+    return true;
+  // The upper 4 bits are reserved.
+  entry = (entry & ~kClusterMask) | (value & kClusterMask);
+  for (int i = 0; i < num_of_fats_; i++) {
+    if (cache_->Write(fat_ofs_ + fat_size_ * i + ofs, &entry, sizeof(entry)))
+      return true;
+  }
+  return false;
+}
+
+uint32_t FAT32::AllocCluster(uint32_t prev) {
+  for (uint32_t i = 0; num_of_free_clusters_ && i < num_of_clusters_; i++) {
+    const uint32_t c = 2 + (next_free_cluster_ - 2 + i) % num_of_clusters_;
+    uint32_t v;
+    if (ReadFATEntry(c, v))
+      return 0;
+    if (v)
+      continue;
+    if (WriteFATEntry(c, kEndOfChain) || (prev && WriteFATEntry(prev, c)))
+      return 0;
+    num_of_free_clusters_--;
+    next_free_cluster_ = IsValidCluster(c + 1) ? c + 1 : 2;
+    return c;
+  }
+  num_of_free_clusters_ = 0;
+  return 0;
+}
+
+bool FAT32::FreeChain(uint32_t cluster) {
+  // Bounded in case the chain has a loop.
+  for (uint32_t i = 0; IsValidCluster(cluster) && i < num_of_clusters_; i++) {
+    uint32_t next;
+    if (ReadFATEntry(cluster, next) || WriteFATEntry(cluster, 0))
+      return true;
+    num_of_free_clusters_++;
+    cluster = next;
+  }
+  return false;
+}
+
+bool FAT32::ZeroCluster(uint32_t cluster) {
+  const uint64_t ofs = GetClusterOffset(cluster);
+  for (uint64_t done = 0; done < cluster_size_; done += sizeof(zeros)) {
+    if (cache_->Write(ofs + done, zeros,
+                      std::min<uint64_t>(sizeof(zeros), cluster_size_ - done)))
+      return true;
+  }
+  return false;
+}
+
+uint32_t FAT32::GetCluster(File& file, uint32_t idx, bool allocate) {
+  if (!file.first_cluster) {
+    if (!allocate)
+      return 0;
+    const uint32_t c = AllocCluster(0);
+    if (!c || (file.is_dir && ZeroCluster(c)))
+      return 0;
+    file.first_cluster = c;
+    if (UpdateEntry(file))
+      return 0;
+  }
+  uint32_t i = 0;
+  uint32_t c = file.first_cluster;
+  if (file.cached_cluster && file.cached_cluster_idx <= idx) {
+    i = file.cached_cluster_idx;
+    c = file.cached_cluster;
+  }
+  for (; i < idx; i++) {
+    uint32_t next;
+    if (ReadFATEntry(c, next))
+      return 0;
+    if (!IsValidCluster(next)) {
+      if (!allocate || next < kMinEndOfChain)
+        return 0;
+      next = AllocCluster(c);
+      if (!next || (file.is_dir && ZeroCluster(next)))
+        return 0;
+    }
+    c = next;
+  }
+  file.cached_cluster_idx = i;
+  file.cached_cluster = c;
+  return c;
+}
+
+bool FAT32::AccessChain(File& file,
+                        uint64_t ofs,
+                        void* buf,
+                        uint64_t size,
+                        bool is_write) {
+  uint8_t* p = reinterpret_cast<uint8_t*>(buf);
+  while (size) {
+    const uint64_t ofs_in_cluster = ofs % cluster_size_;
+    const uint64_t len = std::min(size, cluster_size_ - ofs_in_cluster);
+    const uint32_t c =
+        GetCluster(file, static_cast<uint32_t>(ofs / cluster_size_), is_write);
+    if (!c)
+      return true;
+    const uint64_t dev_ofs = GetClusterOffset(c) + ofs_in_cluster;
+    if (is_write ? cache_->Write(dev_ofs, p, len)
+                 : cache_->Read(dev_ofs, p, len))
+      return true;
+    p += len;
+    ofs += len;
+    size -= len;
+  }
+  return false;
+}
+
+bool FAT32::UpdateEntry(const File& file) {
+  if (!file.entry_ofs)
+    return false;
+  ShortEntry e;
+  if (cache_->Read(file.entry_ofs, &e, sizeof(e)))
+    return true;
+  e.first_cluster_high = static_cast<uint16_t>(file.first_cluster >> 16);
+  e.first_cluster_low = static_cast<uint16_t>(file.first_cluster);
+  e.file_size = file.is_dir ? 0 : file.size;
+  return cache_->Write(file.entry_ofs, &e, sizeof(e));
+}
+
+FAT32::File FAT32::GetRootDir() const {
+  File dir = {};
+  dir.first_cluster = root_cluster_;
+  dir.is_dir = true;
+  return dir;
+}
+
+FAT32::File FAT32::GetFileOfEntry(const ShortEntry& e,
+                                  uint64_t entry_ofs) const {
+  File file = {};
+  file.first_cluster = (static_cast<uint32_t>(e.first_cluster_high) << 16) |
+                       e.first_cluster_low;
+  file.is_dir = e.attr & kAttrDirectory;
+  if (file.is_dir && !file.first_cluster) {
+    // ".." in a child of the root directory
+    return GetRootDir();
+  }
+  file.size = file.is_dir ? 0 : e.file_size;
+  file.entry_ofs = entry_ofs;
+  return file;
+}
+
+bool FAT32::ReadDirInternal(File& dir,
+                            uint64_t& ofs,
+                            DirEntry& entry,
+                            File& file) {
+  uint16_t long_name[kMaxLongNameEntries * kCharsPerLongNameEntry];
+  // The order of the long name entry expected next. 0 after the last one.
+  int long_name_next = -1;
+  uint8_t long_name_checksum = 0;
+  for (; ofs < kMaxDirSize; ofs += sizeof(ShortEntry)) {
+    uint8_t raw[sizeof(ShortEntry)];
+    if (AccessChain(dir, ofs, raw, sizeof(raw), false) || raw[0] == kEntryEnd)
+      return true;
+    if (raw[0] == kEntryFree) {
+      long_name_next = -1;
+      continue;
+    }
+    if ((raw[11] & kAttrLongNameMask) == kAttrLongName) {
+      LongNameEntry l;
+      memcpy(&l, raw, sizeof(l));
+      const int order = l.order & ~kLastLongNameEntry;
+      if (l.order & kLastLongNameEntry) {
+        long_name_next = order;
+        long_name_checksum = l.checksum;
+        if (order < 1 || order > kMaxLongNameEntries) {
+          long_name_next = -1;
+          continue;
+        }
+        for (auto& c : long_name) {
+          c = 0;
+        }
+      }
+      if (long_name_next < 1 || order != long_name_next ||
+          l.checksum != long_name_checksum) {
+        long_name_next = -1;
+        continue;
+      }
+      uint16_t* dst = &long_name[(order - 1) * kCharsPerLongNameEntry];
+      memcpy(dst, l.name1, sizeof(l.name1));
+      memcpy(dst + 5, l.name2, sizeof(l.name2));
+      memcpy(dst + 11, l.name3, sizeof(l.name3));
+      long_name_next--;
+      continue;
+    }
+    if (raw[11] & kAttrVolumeID) {
+      long_name_next = -1;
+      continue;
+    }
+    ShortEntry e;
+    memcpy(&e, raw, sizeof(e));
+    size_t len = 0;
+    if (long_name_next == 0 &&
+        long_name_checksum == CalcShortNameChecksum(e.name)) {
+      for (int i = 0; i < kMaxFileNameLen && long_name[i] &&
+                      long_name[i] != 0xFFFF;
+           i++) {
+        len = AppendUTF8(entry.name, len, long_name[i]);
+      }
+    } else {
+      for (int i = 0; i < 11; i++) {
+        if (i == 8 && e.name[8] != ' ')
+          entry.name[len++] = '.';
+        char c = e.name[i];
+        if (c == ' ')
+          continue;
+        if (i == 0 && c == 0x05)
+          c = static_cast<char>(kEntryFree);
+        if (e.nt_reserved & (i < 8 ? kLowerCaseBase : kLowerCaseExt))
+          c = ToLower(c);
+        entry.name[len++] = c;
+      }
+    }
+    entry.name[len] = 0;
+    // AccessChain() has left the cluster of the entry in dir.
+    const uint64_t entry_ofs =
+        GetClusterOffset(dir.cached_cluster) + ofs % cluster_size_;
+    file = GetFileOfEntry(e, entry_ofs);
+    entry.is_dir = file.is_dir;
+    entry.size = file.size;
+    entry.id = entry_ofs / sizeof(ShortEntry);
+    ofs += sizeof(ShortEntry);
+    return false;
+  }
+  return true;
+}
+
+bool FAT32::ReadDir(File& dir, uint64_t& ofs, DirEntry& entry) {
+  File file;
+  return !dir.is_dir || ReadDirInternal(dir, ofs, entry, file);
+}
+
+bool FAT32::FindInDir(File& dir,
+                      const char* name,
+                      size_t name_len,
+                      File& file) {
+  static DirEntry entry;
+  for (uint64_t ofs = 0; !ReadDirInternal(dir, ofs, entry, file);) {
+    size_t i = 0;
+    while (i < name_len && entry.name[i] &&
+           ToLower(entry.name[i]) == ToLower(name[i])) {
+      i++;
+    }
+    if (i == name_len && !entry.name[i])
+      return false;
+  }
+  return true;
+}
+
+bool FAT32::Resolve(const char* path, size_t path_len, File& file) {
+  File dir = GetRootDir();
+  const char* p = path;
+  const char* const path_end = path + path_len;
+  for (;;) {
+    while (p < path_end && *p == '/') {
+      p++;
+    }
+    if (p == path_end)
+      break;
+    const char* end = p;
+    while (end < path_end && *end != '/') {
+      end++;
+    }
+    const size_t len = static_cast<size_t>(end - p);
+    if (!dir.is_dir)
+      return true;
+    const bool is_dot = (len == 1 && p[0] == '.');
+    const bool is_dotdot_of_root =
+        (!dir.entry_ofs && len == 2 && p[0] == '.' && p[1] == '.');
+    if (!is_dot && !is_dotdot_of_root) {
+      File child;
+      if (FindInDir(dir, p, len, child))
+        return true;
+      dir = child;
+    }
+    p = end;
+  }
+  file = dir;
+  return false;
+}
+
+bool FAT32::Open(const char* path, File& file) {
+  return Resolve(path, strlen(path), file);
+}
+
+bool FAT32::OpenParent(const char* path,
+                       File& parent,
+                       const char*& name,
+                       size_t& name_len) {
+  size_t end = strlen(path);
+  while (end && path[end - 1] == '/') {
+    end--;
+  }
+  size_t begin = end;
+  while (begin && path[begin - 1] != '/') {
+    begin--;
+  }
+  name = &path[begin];
+  name_len = end - begin;
+  return !name_len || Resolve(path, begin, parent) || !parent.is_dir;
+}
+
+bool FAT32::ShortNameExists(File& dir, const char (&short_name)[11]) {
+  for (uint64_t ofs = 0; ofs < kMaxDirSize; ofs += sizeof(ShortEntry)) {
+    ShortEntry e;
+    if (AccessChain(dir, ofs, &e, sizeof(e), false) ||
+        static_cast<uint8_t>(e.name[0]) == kEntryEnd)
+      return false;
+    if (static_cast<uint8_t>(e.name[0]) != kEntryFree &&
+        (e.attr & kAttrLongNameMask) != kAttrLongName &&
+        !memcmp(e.name, short_name, sizeof(short_name)))
+      return true;
+  }
+  return false;
+}
+
+bool FAT32::AddEntry(File& dir,
+                     const char* name,
+                     size_t name_len,
+                     uint8_t attr,
+                     uint32_t first_cluster,
+                     File& file) {
+  uint16_t long_name[kMaxFileNameLen];
+  const int long_name_len = ToLongName(name, name_len, long_name);
+  if (long_name_len <= 0 || (name[0] == '.' && (name_len == 1 ||
+                                                (name_len == 2 &&
+                                                 name[1] == '.'))))
+    return true;
+  ShortEntry e = {};
+  int num_of_long_name_entries = 0;
+  if (MakeShortName(name, name_len, e.name, e.nt_reserved)) {
+    char basis[11];
+    memcpy(basis, e.name, sizeof(basis));
+    for (int n = 1;; n++) {
+      if (n > 999999)
+        return true;
+      AddNumericTail(e.name, basis, n);
+      if (!ShortNameExists(dir, e.name))
+        break;
+    }
+    num_of_long_name_entries =
+        (long_name_len + kCharsPerLongNameEntry - 1) / kCharsPerLongNameEntry;
+  }
+  e.attr = attr;
+  e.first_cluster_high = static_cast<uint16_t>(first_cluster >> 16);
+  e.first_cluster_low = static_cast<uint16_t>(first_cluster);
+
+  // Find free entries in a row. All entries after the end mark are free.
+  const int num_of_entries = num_of_long_name_entries + 1;
+  uint64_t ofs = 0;
+  uint64_t first_free_ofs = 0;
+  int num_of_free_entries = 0;
+  for (; num_of_free_entries < num_of_entries; ofs += sizeof(ShortEntry)) {
+    if (ofs >= kMaxDirSize)
+      return true;
+    uint8_t first_byte;
+    if (AccessChain(dir, ofs, &first_byte, 1, false))
+      first_byte = kEntryEnd;  // Beyond the chain
+    if (first_byte != kEntryEnd && first_byte != kEntryFree) {
+      num_of_free_entries = 0;
+      continue;
+    }
+    if (!num_of_free_entries++)
+      first_free_ofs = ofs;
+    if (first_byte == kEntryEnd)
+      break;
+  }
+  if (first_free_ofs + num_of_entries * sizeof(ShortEntry) > kMaxDirSize)
+    return true;
+
+  const uint8_t checksum = CalcShortNameChecksum(e.name);
+  for (int i = 0; i < num_of_long_name_entries; i++) {
+    const int order = num_of_long_name_entries - i;
+    uint16_t chars[kCharsPerLongNameEntry];
+    for (int k = 0; k < kCharsPerLongNameEntry; k++) {
+      const int idx = (order - 1) * kCharsPerLongNameEntry + k;
+      chars[k] = idx < long_name_len ? long_name[idx]
+                                     : (idx == long_name_len ? 0 : 0xFFFF);
+    }
+    LongNameEntry l = {};
+    l.order = static_cast<uint8_t>(order | (i ? 0 : kLastLongNameEntry));
+    l.attr = kAttrLongName;
+    l.checksum = checksum;
+    memcpy(l.name1, &chars[0], sizeof(l.name1));
+    memcpy(l.name2, &chars[5], sizeof(l.name2));
+    memcpy(l.name3, &chars[11], sizeof(l.name3));
+    if (AccessChain(dir, first_free_ofs + i * sizeof(l), &l, sizeof(l), true))
+      return true;
+  }
+  const uint64_t short_entry_ofs =
+      first_free_ofs + num_of_long_name_entries * sizeof(e);
+  if (AccessChain(dir, short_entry_ofs, &e, sizeof(e), true))
+    return true;
+  file = GetFileOfEntry(
+      e, GetClusterOffset(dir.cached_cluster) +
+             short_entry_ofs % cluster_size_);
+  return false;
+}
+
+bool FAT32::CreateInternal(const char* path, bool is_dir, File& file) {
+  File parent;
+  const char* name;
+  size_t name_len;
+  if (OpenParent(path, parent, name, name_len))
+    return true;
+  File existing;
+  if (!FindInDir(parent, name, name_len, existing)) {
+    if (existing.is_dir != is_dir)
+      return true;
+    file = existing;
+    return false;
+  }
+  uint32_t cluster = 0;
+  if (is_dir) {
+    cluster = AllocCluster(0);
+    if (!cluster || ZeroCluster(cluster))
+      return true;
+    ShortEntry dots[2] = {};
+    for (int i = 0; i < 2; i++) {
+      memset(dots[i].name, ' ', sizeof(dots[i].name));
+      memset(dots[i].name, '.', i + 1);
+      dots[i].attr = kAttrDirectory;
+    }
+    // ".." of a child of the root directory points cluster 0.
+    const uint32_t parent_cluster = parent.entry_ofs ? parent.first_cluster : 0;
+    dots[0].first_cluster_high = static_cast<uint16_t>(cluster >> 16);
+    dots[0].first_cluster_low = static_cast<uint16_t>(cluster);
+    dots[1].first_cluster_high = static_cast<uint16_t>(parent_cluster >> 16);
+    dots[1].first_cluster_low = static_cast<uint16_t>(parent_cluster);
+    if (cache_->Write(GetClusterOffset(cluster), dots, sizeof(dots)))
+      return true;
+  }
+  return AddEntry(parent, name, name_len,
+                  is_dir ? kAttrDirectory : kAttrArchive, cluster, file);
+}
+
+bool FAT32::Create(const char* path, File& file) {
+  return CreateInternal(path, false, file);
+}
+
+bool FAT32::CreateDirectory(const char* path, File& dir) {
+  return CreateInternal(path, true, dir);
+}
+
+int64_t FAT32::Read(File& file, uint64_t ofs, void* buf, uint64_t size) {
+  if (file.is_dir)
+    return -1;
+  if (ofs >= file.size)
+    return 0;
+  size = std::min(size, file.size - ofs);
+  if (AccessChain(file, ofs, buf, size, false))
+    return -1;
+  return static_cast<int64_t>(size);
+}
+
+int64_t FAT32::Write(File& file,
+                     uint64_t ofs,
+                     const void* buf,
+                     uint64_t size) {
+  if (file.is_dir || ofs + size > kMaxFileSize)
+    return -1;
+  for (uint64_t gap = file.size; gap < ofs;) {
+    const uint64_t len = std::min<uint64_t>(sizeof(zeros), ofs - gap);
+    if (AccessChain(file, gap, const_cast<uint8_t*>(zeros), len, true))
+      return -1;
+    gap += len;
+  }
+  if (AccessChain(file, ofs, const_cast<void*>(buf), size, true))
+    return -1;
+  if (ofs + size > file.size) {
+    file.size = static_cast<uint32_t>(ofs + size);
+    if (UpdateEntry(file))
+      return -1;
+  }
+  return static_cast<int64_t>(size);
+}
+
+bool FAT32::Truncate(File& file, uint64_t size) {
+  if (file.is_dir || size > kMaxFileSize)
+    return true;
+  if (size >= file.size)
+    return Write(file, size, nullptr, 0) < 0;
+  const uint32_t num_of_clusters =
+      static_cast<uint32_t>((size + cluster_size_ - 1) / cluster_size_);
+  file.cached_cluster = 0;
+  if (!num_of_clusters) {
+    if (FreeChain(file.first_cluster))
+      return true;
+    file.first_cluster = 0;
+  } else {
+    const uint32_t last = GetCluster(file, num_of_clusters - 1, false);
+    uint32_t next;
+    if (!last || ReadFATEntry(last, next))
+      return true;
+    if (IsValidCluster(next) &&
+        (WriteFATEntry(last, kEndOfChain) || FreeChain(next)))
+      return true;
+  }
+  file.size = static_cast<uint32_t>(size);
+  return UpdateEntry(file);
+}
+
+bool FAT32::Sync() {
+  if (fs_info_ofs_) {
+    const uint32_t info[2] = {num_of_free_clusters_, next_free_cluster_};
+    if (cache_->Write(fs_info_ofs_ + 488, info, sizeof(info)))
+      return true;
+  }
+  return cache_->Sync();
+}
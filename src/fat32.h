@@ -0,0 +1,179 @@
+#pragma once
+
+#include "generic.h"
+#include "page_cache.h"
+
+// FAT32 file system, the format of the EFI system partition, on a block
+// device. Every access to the volume goes through the PageCache.
+// The volume is either the whole device or the first FAT32 partition in the
+// MBR of the device. Long file names are read and written. Timestamps are
+// not updated.
+class FAT32 {
+ public:
+  static constexpr int kMaxFileNameLen = 255;
+
+  // A file or a directory. Returned by Open() and Create() and passed to
+  // the other functions.
+  struct File {
+    uint32_t first_cluster;  // 0 if no cluster is allocated
+    uint32_t size;
+    bool is_dir;
+    // Offset of the directory entry on the device. 0 for the root directory.
+    uint64_t entry_ofs;
+    // The position in the cluster chain which was accessed last, to avoid
+    // walking the chain from the first cluster on sequential access.
+    uint32_t cached_cluster_idx;
+    uint32_t cached_cluster;
+  };
+  struct DirEntry {
+    char name[kMaxFileNameLen * 3 + 1];  // UTF-8
+    bool is_dir;
+    uint32_t size;
+    // Unique in the volume while the file exists.
+    uint64_t id;
+  };
+
+  // Returns true if no FAT32 volume is found.
+  bool Mount(PageCache& cache);
+  PageCache& GetPageCache() { return *cache_; }
+  uint64_t GetNumOfFreeClusters() const { return num_of_free_clusters_; }
+  uint32_t GetClusterSize() const { return cluster_size_; }
+
+  // Paths are separated by '/' and start from the root directory. Names are
+  // compared case-insensitively. Return true on failure.
+  bool Open(const char* path, File& file);
+  // Opens the file if it exists. Otherwise creates an empty one in an
+  // existing directory.
+  bool Create(const char* path, File& file);
+  bool CreateDirectory(const char* path, File& dir);
+
+  // Return the number of bytes copied, or -1 on failure.
+  int64_t Read(File& file, uint64_t ofs, void* buf, uint64_t size);
+  // Extends the file if needed. The gap before ofs is filled with zeros.
+  int64_t Write(File& file, uint64_t ofs, const void* buf, uint64_t size);
+  // Returns true on failure.
+  bool Truncate(File& file, uint64_t size);
+  // Reads the entry of the directory at ofs, and advances ofs to the next
+  // one. Returns true if there are no more entries.
+  bool ReadDir(File& dir, uint64_t& ofs, DirEntry& entry);
+  // Writes back everything to the device. Returns true on failure.
+  bool Sync();
+
+ private:
+  packed_struct BPB {
+    uint8_t jmp_boot[3];
+    char oem_name[8];
+    uint16_t bytes_per_sector;
+    uint8_t sectors_per_cluster;
+    uint16_t num_of_reserved_sectors;
+    uint8_t num_of_fats;
+    uint16_t num_of_root_entries;
+    uint16_t total_sectors16;
+    uint8_t media;
+    uint16_t fat_size16;
+    uint16_t sectors_per_track;
+    uint16_t num_of_heads;
+    uint32_t num_of_hidden_sectors;
+    uint32_t total_sectors32;
+    uint32_t fat_size32;
+    uint16_t ext_flags;
+    uint16_t fs_version;
+    uint32_t root_cluster;
+    uint16_t fs_info_sector;
+    uint16_t backup_boot_sector;
+    uint8_t reserved[12];
+    uint8_t drive_number;
+    uint8_t reserved1;
+    uint8_t boot_signature;
+    uint32_t volume_id;
+    char volume_label[11];
+    char fs_type[8];
+  };
+  static_assert(sizeof(BPB) == 90);
+  packed_struct ShortEntry {
+    char name[11];
+    uint8_t attr;
+    uint8_t nt_reserved;
+    uint8_t create_time_tenth;
+    uint16_t create_time;
+    uint16_t create_date;
+    uint16_t last_access_date;
+    uint16_t first_cluster_high;
+    uint16_t write_time;
+    uint16_t write_date;
+    uint16_t first_cluster_low;
+    uint32_t file_size;
+  };
+  static_assert(sizeof(ShortEntry) == 32);
+  packed_struct LongNameEntry {
+    uint8_t order;
+    uint16_t name1[5];
+    uint8_t attr;
+    uint8_t type;
+    uint8_t checksum;
+    uint16_t name2[6];
+    uint16_t first_cluster_low;
+    uint16_t name3[2];
+  };
+  static_assert(sizeof(LongNameEntry) == 32);
+  static constexpr int kCharsPerLongNameEntry = 13;
+
+  bool MountVolume(uint64_t first_sector);
+  uint64_t GetClusterOffset(uint32_t cluster) const {
+    return data_ofs_ + static_cast<uint64_t>(cluster - 2) * cluster_size_;
+  }
+  bool IsValidCluster(uint32_t cluster) const {
+    return 2 <= cluster && cluster < num_of_clusters_ + 2;
+  }
+  bool ReadFATEntry(uint32_t cluster, uint32_t& value);
+  bool WriteFATEntry(uint32_t cluster, uint32_t value);
+  // Allocates a cluster and appends it to prev if prev is not 0. Returns 0
+  // on failure.
+  uint32_t AllocCluster(uint32_t prev);
+  bool FreeChain(uint32_t cluster);
+  bool ZeroCluster(uint32_t cluster);
+  // Returns the cluster at idx in the chain of file. If allocate is true,
+  // the chain is extended as needed. Returns 0 on failure.
+  uint32_t GetCluster(File& file, uint32_t idx, bool allocate);
+  // Reads or writes the chain of file, ignoring the size of file.
+  bool AccessChain(File& file,
+                   uint64_t ofs,
+                   void* buf,
+                   uint64_t size,
+                   bool is_write);
+  bool UpdateEntry(const File& file);
+  File GetRootDir() const;
+  File GetFileOfEntry(const ShortEntry& e, uint64_t entry_ofs) const;
+  // Reads the entry at ofs of dir as ReadDir() does, also returning the
+  // entry as a File.
+  bool ReadDirInternal(File& dir, uint64_t& ofs, DirEntry& entry, File& file);
+  bool FindInDir(File& dir, const char* name, size_t name_len, File& file);
+  // Resolves the first path_len bytes of path.
+  bool Resolve(const char* path, size_t path_len, File& file);
+  // Resolves path except its last component, which is returned as name.
+  bool OpenParent(const char* path,
+                  File& parent,
+                  const char*& name,
+                  size_t& name_len);
+  bool ShortNameExists(File& dir, const char (&short_name)[11]);
+  bool AddEntry(File& dir,
+                const char* name,
+                size_t name_len,
+                uint8_t attr,
+                uint32_t first_cluster,
+                File& file);
+  bool CreateInternal(const char* path, bool is_dir, File& file);
+
+  PageCache* cache_;
+  uint64_t fat_ofs_;
+  uint64_t fat_size_;
+  int num_of_fats_;
+  uint64_t data_ofs_;
+  uint32_t cluster_size_;
+  uint32_t num_of_clusters_;
+  uint32_t root_cluster_;
+  // 0 if the volume has no FSInfo sector
+  uint64_t fs_info_ofs_;
+  uint32_t num_of_free_clusters_;
+  uint32_t next_free_cluster_;
+};
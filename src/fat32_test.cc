@@ -0,0 +1,354 @@
+#include "fat32.h"
+
+#ifdef LIUMOS_TEST
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+// Completes requests on HandleCompletions() as a device does, counting
+// contiguous requests kicked together as one as virtio-blk merges them.
+class RamDisk : public BlockDevice {
+ public:
+  RamDisk(uint64_t num_of_sectors)
+      : data_(num_of_sectors * kSectorSize), device_requests_(0) {}
+  uint64_t GetNumOfSectors() override { return data_.size() / kSectorSize; }
+  bool IsReadOnly() override { return false; }
+  bool Submit(Request& req) override {
+    if (queued_.size() + in_flight_.size() >= kMaxRequests)
+      return true;
+    req.is_done = false;
+    req.has_failed = false;
+    queued_.push_back(&req);
+    return false;
+  }
+  void Kick() override {
+    for (size_t i = 0; i < queued_.size(); i++) {
+      const Request* prev = i ? queued_[i - 1] : nullptr;
+      const Request& req = *queued_[i];
+      if (!prev || prev->type != req.type ||
+          prev->sector + prev->num_of_sectors != req.sector)
+        device_requests_++;
+      in_flight_.push_back(queued_[i]);
+    }
+    queued_.clear();
+  }
+  void HandleCompletions() override {
+    for (Request* req : in_flight_) {
+      const uint64_t ofs = req->sector * kSectorSize;
+      const uint64_t size = req->num_of_sectors * kSectorSize;
+      assert(ofs + size <= data_.size());
+      if (req->type == Request::Type::kRead)
+        memcpy(req->buf, &data_[ofs], size);
+      else if (req->type == Request::Type::kWrite)
+        memcpy(&data_[ofs], req->buf, size);
+      req->is_done = true;
+    }
+    in_flight_.clear();
+  }
+  uint8_t* GetData() { return data_.data(); }
+  bool Contains(const char* s) {
+    return std::search(data_.begin(), data_.end(), s, s + strlen(s)) !=
+           data_.end();
+  }
+  uint64_t GetNumOfDeviceRequests() { return device_requests_; }
+
+ private:
+  static constexpr size_t kMaxRequests = 16;
+  std::vector<uint8_t> data_;
+  std::vector<Request*> queued_;
+  std::vector<Request*> in_flight_;
+  uint64_t device_requests_;
+};
+
+constexpr uint64_t kDiskSectors = 64 * 1024 * 1024 / BlockDevice::kSectorSize;
+
+template <typename T>
+static void Put(uint8_t* p, T v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+// Formats the disk as mkfs.fat -F 32 does. The number of free clusters is
+// not recorded in FSInfo so that Mount() counts them.
+static void Format(RamDisk& disk,
+                   uint32_t first_sector,
+                   uint8_t sectors_per_cluster) {
+  constexpr uint16_t kReservedSectors = 32;
+  const uint32_t total_sectors =
+      static_cast<uint32_t>(disk.GetNumOfSectors()) - first_sector;
+  const uint32_t fat_size =
+      (total_sectors / sectors_per_cluster + 2) * 4 / 512 + 1;
+  uint8_t* base = disk.GetData() + first_sector * 512;
+  base[0] = 0xEB;
+  base[1] = 0x58;
+  base[2] = 0x90;
+  Put<uint16_t>(&base[11], 512);
+  base[13] = sectors_per_cluster;
+  Put<uint16_t>(&base[14], kReservedSectors);
+  base[16] = 2;
+  base[21] = 0xF8;
+  Put<uint32_t>(&base[28], first_sector);
+  Put<uint32_t>(&base[32], total_sectors);
+  Put<uint32_t>(&base[36], fat_size);
+  Put<uint32_t>(&base[44], 2);
+  Put<uint16_t>(&base[48], 1);
+  Put<uint16_t>(&base[50], 6);
+  base[66] = 0x29;
+  memcpy(&base[82], "FAT32   ", 8);
+  base[510] = 0x55;
+  base[511] = 0xAA;
+  uint8_t* fs_info = base + 512;
+  Put<uint32_t>(&fs_info[0], 0x41615252);
+  Put<uint32_t>(&fs_info[484], 0x61417272);
+  Put<uint32_t>(&fs_info[488], 0xFFFFFFFF);
+  Put<uint32_t>(&fs_info[492], 0xFFFFFFFF);
+  Put<uint32_t>(&fs_info[508], 0xAA550000);
+  for (int i = 0; i < 2; i++) {
+    uint8_t* fat = base + (kReservedSectors + fat_size * i) * 512;
+    Put<uint32_t>(&fat[0], 0x0FFFFFF8);
+    Put<uint32_t>(&fat[4], 0x0FFFFFFF);
+    // The root directory
+    Put<uint32_t>(&fat[8], 0x0FFFFFFF);
+  }
+}
+
+static void AddPartition(RamDisk& disk, uint32_t first_sector) {
+  uint8_t* mbr = disk.GetData();
+  mbr[446 + 4] = 0x0C;
+  Put<uint32_t>(&mbr[446 + 8], first_sector);
+  Put<uint32_t>(&mbr[446 + 12],
+                static_cast<uint32_t>(disk.GetNumOfSectors()) - first_sector);
+  mbr[510] = 0x55;
+  mbr[511] = 0xAA;
+}
+
+// A mounted volume with a cold page cache.
+struct Volume {
+  Volume(RamDisk& disk) : cache(new PageCache(disk)) {
+    assert(!fs.Mount(*cache));
+  }
+  ~Volume() { delete cache; }
+  PageCache* cache;
+  FAT32 fs;
+};
+
+static void TestMountFailsOnBlankDevice() {
+  RamDisk disk(kDiskSectors);
+  PageCache* cache = new PageCache(disk);
+  FAT32 fs;
+  assert(fs.Mount(*cache));
+  delete cache;
+}
+
+static void TestCreateWriteAndRead() {
+  RamDisk disk(kDiskSectors);
+  Format(disk, 0, 1);
+  Volume v(disk);
+  FAT32& fs = v.fs;
+  const uint64_t num_of_free_clusters = fs.GetNumOfFreeClusters();
+  FAT32::File file;
+  assert(fs.Open("hello.txt", file));
+  assert(!fs.Create("/hello.txt", file));
+  const char msg[] = "Hello, FAT32!";
+  assert(fs.Write(file, 0, msg, strlen(msg)) ==
+         static_cast<int64_t>(strlen(msg)));
+  assert(fs.GetNumOfFreeClusters() == num_of_free_clusters - 1);
+
+  FAT32::File opened;
+  assert(!fs.Open("/HELLO.TXT", opened));
+  assert(!opened.is_dir);
+  assert(opened.size == strlen(msg));
+  char buf[32] = {};
+  assert(fs.Read(opened, 7, buf, sizeof(buf)) == 6);
+  assert(strcmp(buf, "FAT32!") == 0);
+  assert(fs.Read(opened, opened.size, buf, sizeof(buf)) == 0);
+
+  // Writing beyond the end fills the gap with zeros.
+  assert(fs.Write(opened, 1000, "!", 1) == 1);
+  assert(opened.size == 1001);
+  assert(fs.Read(opened, 0, buf, sizeof(buf)) == sizeof(buf));
+  assert(memcmp(buf, msg, strlen(msg)) == 0);
+  for (size_t i = strlen(msg); i < sizeof(buf); i++) {
+    assert(buf[i] == 0);
+  }
+
+  // A name in lower case fits in the 8.3 entry.
+  FAT32::File root;
+  assert(!fs.Open("/", root));
+  FAT32::DirEntry entry;
+  uint64_t ofs = 0;
+  assert(!fs.ReadDir(root, ofs, entry));
+  assert(strcmp(entry.name, "hello.txt") == 0);
+  assert(!entry.is_dir);
+  assert(entry.size == 1001);
+  assert(ofs == 32);
+  assert(fs.ReadDir(root, ofs, entry));
+}
+
+static void TestLongNamesAndDirectories() {
+  RamDisk disk(kDiskSectors);
+  constexpr uint32_t kPartitionStart = 2048;
+  AddPartition(disk, kPartitionStart);
+  Format(disk, kPartitionStart, 8);
+  Volume v(disk);
+  FAT32& fs = v.fs;
+  FAT32::File dir;
+  assert(!fs.CreateDirectory("/Apps", dir));
+  assert(dir.is_dir);
+  FAT32::File file;
+  assert(fs.Create("/NoSuchDir/a.txt", file));
+  assert(fs.Create("/Apps/a:b", file));
+  assert(!fs.Create("/Apps/A long file name.txt", file));
+  assert(fs.Write(file, 0, "1", 1) == 1);
+  assert(!fs.Create("/Apps/A long file name 2.txt", file));
+  assert(fs.Write(file, 0, "22", 2) == 2);
+  // Creating an existing file opens it.
+  assert(!fs.Create("/apps/a long file name.TXT", file));
+  assert(file.size == 1);
+
+  assert(!fs.Open("/apps/../APPS/./A LONG file name 2.txt", file));
+  assert(file.size == 2);
+  assert(fs.Open("/Apps/A long file name", file));
+  assert(fs.Open("/Apps/A long file name.txt/x", file));
+
+  const char* expected[] = {".", "..", "A long file name.txt",
+                            "A long file name 2.txt"};
+  FAT32::DirEntry entry;
+  uint64_t ofs = 0;
+  uint64_t ids[4];
+  for (int i = 0; i < 4; i++) {
+    assert(!fs.ReadDir(dir, ofs, entry));
+    assert(strcmp(entry.name, expected[i]) == 0);
+    assert(entry.is_dir == (i < 2));
+    ids[i] = entry.id;
+  }
+  assert(fs.ReadDir(dir, ofs, entry));
+  assert(ids[2] != ids[3]);
+
+  // The short names of the long names differ.
+  FAT32::File root;
+  assert(!fs.Open("..", root));
+  ofs = 0;
+  assert(!fs.ReadDir(root, ofs, entry));
+  assert(strcmp(entry.name, "Apps") == 0);
+  assert(entry.is_dir);
+  assert(!fs.Sync());
+  assert(disk.Contains("ALONGF~1TXT"));
+  assert(disk.Contains("ALONGF~2TXT"));
+}
+
+static void TestWriteBackAndRemount() {
+  RamDisk disk(kDiskSectors);
+  Format(disk, 0, 8);
+  const char msg[] = "written back on sync";
+  uint64_t num_of_free_clusters;
+  {
+    Volume v(disk);
+    FAT32::File file;
+    assert(!v.fs.Create("/sync.txt", file));
+    assert(v.fs.Write(file, 0, msg, strlen(msg)) ==
+           static_cast<int64_t>(strlen(msg)));
+    // Only in the cache until Sync().
+    assert(!disk.Contains(msg));
+    assert(!v.fs.Sync());
+    assert(disk.Contains(msg));
+    num_of_free_clusters = v.fs.GetNumOfFreeClusters();
+  }
+  Volume v(disk);
+  assert(v.fs.GetNumOfFreeClusters() == num_of_free_clusters);
+  FAT32::File file;
+  assert(!v.fs.Open("sync.txt", file));
+  char buf[sizeof(msg)] = {};
+  assert(v.fs.Read(file, 0, buf, sizeof(buf)) ==
+         static_cast<int64_t>(strlen(msg)));
+  assert(strcmp(buf, msg) == 0);
+}
+
+static void TestStreamingLargeFile() {
+  // Larger than the cache, so pages are evicted and written back while
+  // writing.
+  constexpr uint32_t kFileSize = 3 * PageCache::kNumOfPages * 4096 / 2;
+  constexpr uint32_t kChunkSize = 4096;
+  RamDisk disk(kDiskSectors);
+  Format(disk, 0, 8);
+  static uint32_t chunk[kChunkSize / sizeof(uint32_t)];
+  {
+    Volume v(disk);
+    FAT32::File file;
+    assert(!v.fs.Create("/large.bin", file));
+    for (uint32_t ofs = 0; ofs < kFileSize; ofs += kChunkSize) {
+      for (uint32_t i = 0; i < kChunkSize / sizeof(uint32_t); i++) {
+        chunk[i] = ofs / sizeof(uint32_t) + i;
+      }
+      assert(v.fs.Write(file, ofs, chunk, kChunkSize) == kChunkSize);
+    }
+    assert(v.cache->GetStats().written_back_pages > 0);
+    assert(!v.fs.Sync());
+  }
+  Volume v(disk);
+  FAT32::File file;
+  assert(!v.fs.Open("/large.bin", file));
+  assert(file.size == kFileSize);
+  const uint64_t device_requests = disk.GetNumOfDeviceRequests();
+  for (uint32_t ofs = 0; ofs < kFileSize; ofs += kChunkSize) {
+    assert(v.fs.Read(file, ofs, chunk, kChunkSize) == kChunkSize);
+    for (uint32_t i = 0; i < kChunkSize / sizeof(uint32_t); i++) {
+      assert(chunk[i] == ofs / sizeof(uint32_t) + i);
+    }
+  }
+  // Most pages have been read ahead, in a few device requests.
+  const PageCache::Stats& stats = v.cache->GetStats();
+  const uint64_t num_of_pages = kFileSize / 4096;
+  const uint64_t num_of_device_requests =
+      disk.GetNumOfDeviceRequests() - device_requests;
+  printf("streamed %lu pages: %lu misses, %lu read ahead, %lu requests\n",
+         num_of_pages, stats.misses, stats.read_ahead_pages,
+         num_of_device_requests);
+  assert(stats.read_ahead_pages > num_of_pages * 9 / 10);
+  assert(num_of_device_requests < num_of_pages / 8);
+}
+
+static void TestTruncate() {
+  RamDisk disk(kDiskSectors);
+  Format(disk, 0, 1);
+  Volume v(disk);
+  FAT32& fs = v.fs;
+  const uint64_t num_of_free_clusters = fs.GetNumOfFreeClusters();
+  FAT32::File file;
+  assert(!fs.Create("/truncate.bin", file));
+  static uint8_t buf[100 * 1024];
+  memset(buf, 0xAB, sizeof(buf));
+  assert(fs.Write(file, 0, buf, sizeof(buf)) == sizeof(buf));
+  assert(fs.GetNumOfFreeClusters() == num_of_free_clusters - 200);
+
+  assert(!fs.Truncate(file, 1000));
+  assert(fs.GetNumOfFreeClusters() == num_of_free_clusters - 2);
+  // Growing fills zeros.
+  assert(!fs.Truncate(file, 2000));
+  FAT32::File opened;
+  assert(!fs.Open("/truncate.bin", opened));
+  assert(opened.size == 2000);
+  assert(fs.Read(opened, 0, buf, sizeof(buf)) == 2000);
+  for (int i = 0; i < 2000; i++) {
+    assert(buf[i] == (i < 1000 ? 0xAB : 0));
+  }
+  assert(!fs.Truncate(opened, 0));
+  assert(fs.GetNumOfFreeClusters() == num_of_free_clusters);
+  assert(opened.first_cluster == 0);
+}
+
+int main() {
+  TestMountFailsOnBlankDevice();
+  TestCreateWriteAndRead();
+  TestLongNamesAndDirectories();
+  TestWriteBackAndRemount();
+  TestStreamingLargeFile();
+  TestTruncate();
+  puts("PASS");
+  return 0;
+}
+
+#endif
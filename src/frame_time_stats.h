@@ -0,0 +1,59 @@
+#pragma once
+
+#include "generic.h"
+
+// Times of frames in a benchmark run. Percentiles are taken over the sorted
+// times so that a few slow frames show up in the tail instead of being
+// averaged out. Frames added beyond kMaxFrames are ignored.
+template <int kMaxFrames>
+class FrameTimeStats {
+ public:
+  void Clear() {
+    num_of_frames_ = 0;
+    total_ns_ = 0;
+    is_sorted_ = true;
+  }
+  void Add(uint64_t ns) {
+    if (num_of_frames_ >= kMaxFrames)
+      return;
+    frame_ns_[num_of_frames_++] = ns;
+    total_ns_ += ns;
+    is_sorted_ = false;
+  }
+  int GetNumOfFrames() const { return num_of_frames_; }
+  uint64_t GetTotalNs() const { return total_ns_; }
+  // Returns the time within which p percent of the frames finished
+  // (nearest-rank), or 0 if there are no frames.
+  uint64_t GetPercentile(int p) {
+    if (!num_of_frames_)
+      return 0;
+    Sort();
+    int rank = (p * num_of_frames_ + 99) / 100;
+    if (rank < 1)
+      rank = 1;
+    if (rank > num_of_frames_)
+      rank = num_of_frames_;
+    return frame_ns_[rank - 1];
+  }
+
+ private:
+  void Sort() {
+    if (is_sorted_)
+      return;
+    // Insertion sort is enough for the number of frames of a run.
+    for (int i = 1; i < num_of_frames_; i++) {
+      const uint64_t v = frame_ns_[i];
+      int k = i;
+      for (; k > 0 && frame_ns_[k - 1] > v; k--) {
+        frame_ns_[k] = frame_ns_[k - 1];
+      }
+      frame_ns_[k] = v;
+    }
+    is_sorted_ = true;
+  }
+
+  uint64_t frame_ns_[kMaxFrames];
+  int num_of_frames_;
+  uint64_t total_ns_;
+  bool is_sorted_;
+};
@@ -0,0 +1,74 @@
+#include "frame_time_stats.h"
+
+#ifdef LIUMOS_TEST
+
+#include <stdio.h>
+
+#include <cassert>
+
+static void TestEmpty() {
+  FrameTimeStats<4> stats;
+  stats.Clear();
+  assert(stats.GetNumOfFrames() == 0);
+  assert(stats.GetTotalNs() == 0);
+  assert(stats.GetPercentile(50) == 0);
+}
+
+static void TestPercentiles() {
+  FrameTimeStats<100> stats;
+  stats.Clear();
+  // 1..100 us in a shuffled order.
+  for (int i = 0; i < 100; i++) {
+    stats.Add(((i * 37) % 100 + 1) * 1000);
+  }
+  assert(stats.GetNumOfFrames() == 100);
+  assert(stats.GetTotalNs() == 5050 * 1000);
+  assert(stats.GetPercentile(0) == 1000);
+  assert(stats.GetPercentile(50) == 50 * 1000);
+  assert(stats.GetPercentile(90) == 90 * 1000);
+  assert(stats.GetPercentile(99) == 99 * 1000);
+  assert(stats.GetPercentile(100) == 100 * 1000);
+}
+
+static void TestTailIsKept() {
+  FrameTimeStats<10> stats;
+  stats.Clear();
+  // One slow frame out of ten shows up above the 90th percentile only.
+  for (int i = 0; i < 9; i++) {
+    stats.Add(100);
+  }
+  stats.Add(5000);
+  assert(stats.GetPercentile(50) == 100);
+  assert(stats.GetPercentile(90) == 100);
+  assert(stats.GetPercentile(99) == 5000);
+  // Adding after taking percentiles sorts again.
+  stats.Clear();
+  stats.Add(300);
+  stats.Add(200);
+  assert(stats.GetPercentile(50) == 200);
+  stats.Add(100);
+  assert(stats.GetPercentile(0) == 100);
+  assert(stats.GetPercentile(100) == 300);
+}
+
+static void TestIsBounded() {
+  FrameTimeStats<2> stats;
+  stats.Clear();
+  stats.Add(1);
+  stats.Add(2);
+  stats.Add(3);
+  assert(stats.GetNumOfFrames() == 2);
+  assert(stats.GetTotalNs() == 3);
+  assert(stats.GetPercentile(100) == 2);
+}
+
+int main() {
+  TestEmpty();
+  TestPercentiles();
+  TestTailIsKept();
+  TestIsBounded();
+  puts("PASS");
+  return 0;
+}
+
+#endif
@@ -0,0 +1,239 @@
+#include "gfxbench.h"
+
+#include "compositor.h"
+#include "frame_time_stats.h"
+#include "hpet.h"
+#include "kernel.h"
+#include "liumos.h"
+#include "polygon_cube.h"
+#include "sheet_painter.h"
+
+constexpr int kNumOfFrames = 120;
+constexpr int kNumOfDragWindows = 16;
+constexpr int kDragWindowXSize = 256;
+constexpr int kDragWindowYSize = 192;
+constexpr int kMaxLineLength = 256;
+
+struct Workload {
+  const char* name;
+  void (*set_up)();
+  // Draws and flushes a frame, and returns the number of pixels updated on
+  // the screen.
+  uint64_t (*draw_frame)(int frame);
+  void (*tear_down)();
+};
+
+// Sheets and buffers are allocated on the first run and reused since the
+// memory is never freed.
+static Sheet screen_sized_sheet_;
+static Sheet overlay_sheet_;
+static Sheet drag_windows_[kNumOfDragWindows];
+static PolygonCube* cube_;
+static uint32_t* screen_sized_buf_;
+static uint32_t* overlay_buf_;
+static uint32_t* drag_window_bufs_[kNumOfDragWindows];
+static FrameTimeStats<kNumOfFrames> frame_time_stats_;
+
+static Sheet& GetScreen() {
+  return *liumos->vram_sheet;
+}
+
+static uint64_t GetArea(const Rect& r) {
+  return static_cast<uint64_t>(r.xsize) * static_cast<uint64_t>(r.ysize);
+}
+
+static uint32_t GetFrameColor(int frame) {
+  return 0x102030 * static_cast<uint32_t>(frame % 8 + 1);
+}
+
+static void AllocBuffers() {
+  if (screen_sized_buf_)
+    return;
+  const int xsize = GetScreen().GetXSize();
+  const int ysize = GetScreen().GetYSize();
+  screen_sized_buf_ = AllocKernelMemory<uint32_t*>(xsize * ysize * 4);
+  overlay_buf_ = AllocKernelMemory<uint32_t*>((xsize / 2) * (ysize / 2) * 4);
+  for (auto& buf : drag_window_bufs_) {
+    buf = AllocKernelMemory<uint32_t*>(kDragWindowXSize * kDragWindowYSize * 4);
+  }
+}
+
+static void SetUpScreenSizedSheet() {
+  Sheet& screen = GetScreen();
+  Sheet& s = screen_sized_sheet_;
+  s.Init(screen_sized_buf_, screen.GetXSize(), screen.GetYSize(),
+         screen.GetXSize());
+  SheetPainter::DrawRect(s, 0, 0, s.GetXSize(), s.GetYSize(), 0x000000);
+  s.SetParent(&screen);
+}
+
+static void TearDownScreenSizedSheet() {
+  screen_sized_sheet_.RemoveFromParent();
+}
+
+static uint64_t DrawFillFrame(int frame) {
+  // Fills the whole screen.
+  Sheet& s = screen_sized_sheet_;
+  SheetPainter::DrawRect(s, 0, 0, s.GetXSize(), s.GetYSize(),
+                         GetFrameColor(frame), true);
+  return GetArea(s.GetRect());
+}
+
+static uint64_t DrawScrollFrame(int frame) {
+  // Scrolls the whole screen by a line and prints a new line, as the console
+  // does.
+  Sheet& s = screen_sized_sheet_;
+  constexpr int kLineHeight = GlyphCache::kHeight;
+  const int xsize = s.GetXSize();
+  const int ysize = s.GetYSize();
+  static char line[kMaxLineLength];
+  int n = xsize / GlyphCache::kWidth;
+  if (n > kMaxLineLength)
+    n = kMaxLineLength;
+  for (int i = 0; i < n; i++) {
+    line[i] = static_cast<char>(' ' + (i + frame) % 95);
+  }
+  s.BlockTransfer(0, 0, 0, kLineHeight, xsize, ysize - kLineHeight, true);
+  SheetPainter::DrawRect(s, 0, ysize - kLineHeight, xsize, kLineHeight,
+                         0x000000);
+  SheetPainter::DrawCharacters(s, line, n, 0, ysize - kLineHeight, 0xffffff,
+                               0x000000);
+  s.Flush(0, ysize - kLineHeight, xsize, kLineHeight);
+  return GetArea(s.GetRect());
+}
+
+static void SetUpDragWindows() {
+  Sheet& screen = GetScreen();
+  const int x_range = screen.GetXSize() - kDragWindowXSize;
+  const int y_range = screen.GetYSize() - kDragWindowYSize;
+  for (int i = 0; i < kNumOfDragWindows; i++) {
+    Sheet& w = drag_windows_[i];
+    w.Init(drag_window_bufs_[i], kDragWindowXSize, kDragWindowYSize,
+           kDragWindowXSize, i * 48 % x_range, i * 32 % y_range);
+    SheetPainter::DrawRect(w, 0, 0, kDragWindowXSize, kDragWindowYSize,
+                           0x404040 + 0x0c0804 * static_cast<uint32_t>(i));
+    w.SetParent(&screen);
+  }
+  drag_windows_[0].Raise();
+}
+
+static uint64_t DrawDragFrame(int frame) {
+  // Drags the frontmost window diagonally over the others, bouncing at the
+  // edges of the screen.
+  Sheet& screen = GetScreen();
+  Sheet& w = drag_windows_[0];
+  const int x_range = screen.GetXSize() - kDragWindowXSize;
+  const int y_range = screen.GetYSize() - kDragWindowYSize;
+  const int x = frame * 8 % (2 * x_range);
+  const int y = frame * 4 % (2 * y_range);
+  const Rect prev_rect = w.GetRect();
+  w.SetPosition(x < x_range ? x : 2 * x_range - x,
+                y < y_range ? y : 2 * y_range - y);
+  return GetArea(prev_rect.GetUnionWith(w.GetRect()));
+}
+
+static void TearDownDragWindows() {
+  for (auto& w : drag_windows_) {
+    w.RemoveFromParent();
+  }
+}
+
+static void SetUpAlphaOverlay() {
+  Sheet& screen = GetScreen();
+  const int xsize = screen.GetXSize() / 2;
+  const int ysize = screen.GetYSize() / 2;
+  Sheet& s = overlay_sheet_;
+  s.Init(overlay_buf_, xsize, ysize, xsize, xsize / 2, ysize / 2);
+  SheetPainter::DrawRect(s, 0, 0, xsize, ysize, 0x80000000);
+  s.SetAlphaEnabled(true);
+  s.SetParent(&screen);
+}
+
+static uint64_t DrawAlphaFrame(int frame) {
+  // Blends a half-transparent overlay of a quarter of the screen.
+  Sheet& s = overlay_sheet_;
+  SheetPainter::DrawRect(s, 0, 0, s.GetXSize(), s.GetYSize(),
+                         0x80000000 | GetFrameColor(frame), true);
+  return GetArea(s.GetRect());
+}
+
+static void TearDownAlphaOverlay() {
+  overlay_sheet_.RemoveFromParent();
+}
+
+static void SetUpCube() {
+  Sheet& screen = GetScreen();
+  const int x = (screen.GetXSize() - PolygonCube::width) / 2;
+  const int y = (screen.GetYSize() - PolygonCube::height) / 2;
+  if (!cube_) {
+    cube_ = new PolygonCube(screen, x, y);
+    return;
+  }
+  cube_->GetSheet().SetParent(&screen);
+}
+
+static uint64_t DrawCubeFrame(int) {
+  // Draws frames as fast as possible, unlike SubTask() which waits.
+  cube_->Draw();
+  return GetArea(cube_->GetSheet().GetRect());
+}
+
+static void TearDownCube() {
+  cube_->GetSheet().RemoveFromParent();
+}
+
+static const Workload workloads_[] = {
+    {"fill", SetUpScreenSizedSheet, DrawFillFrame, TearDownScreenSizedSheet},
+    {"scroll", SetUpScreenSizedSheet, DrawScrollFrame,
+     TearDownScreenSizedSheet},
+    {"drag", SetUpDragWindows, DrawDragFrame, TearDownDragWindows},
+    {"alpha", SetUpAlphaOverlay, DrawAlphaFrame, TearDownAlphaOverlay},
+    {"cube", SetUpCube, DrawCubeFrame, TearDownCube},
+};
+
+void RunGraphicsBenchmark(bool is_csv) {
+  AllocBuffers();
+  HPET& hpet = HPET::GetInstance();
+  Compositor& compositor = Compositor::GetInstance();
+  const uint64_t fs_per_count = hpet.GetFemtosecondPerCount();
+  if (is_csv) {
+    kprintf("gfxbench,workload,frames,mpixels_per_s,p50_us,p90_us,p99_us,"
+            "max_us\n");
+  } else {
+    kprintf("%d frames each on %dx%d\n", kNumOfFrames, GetScreen().GetXSize(),
+            GetScreen().GetYSize());
+    kprintf("workload MPixels/s p50 us p90 us p99 us max us\n");
+  }
+  FrameTimeStats<kNumOfFrames>& stats = frame_time_stats_;
+  for (const Workload& w : workloads_) {
+    w.set_up();
+    // Present what the set up drew so that the first frame is not charged.
+    compositor.Present();
+    stats.Clear();
+    uint64_t pixels = 0;
+    for (int i = 0; i < kNumOfFrames; i++) {
+      const uint64_t t0 = hpet.ReadMainCounterValue();
+      pixels += w.draw_frame(i);
+      compositor.Present();
+      stats.Add((hpet.ReadMainCounterValue() - t0) * fs_per_count /
+                1'000'000);
+    }
+    w.tear_down();
+    const uint64_t total_ns = stats.GetTotalNs();
+    const uint64_t mpixels_per_s = total_ns ? pixels * 1000 / total_ns : 0;
+    const uint64_t us[] = {
+        stats.GetPercentile(50) / 1000, stats.GetPercentile(90) / 1000,
+        stats.GetPercentile(99) / 1000, stats.GetPercentile(100) / 1000};
+    if (is_csv) {
+      kprintf("gfxbench,%s,%d,%lu,%lu,%lu,%lu,%lu\n", w.name,
+              stats.GetNumOfFrames(), mpixels_per_s, us[0], us[1], us[2],
+              us[3]);
+    } else {
+      kprintf("%-8s %9lu %6lu %6lu %6lu %6lu\n", w.name, mpixels_per_s,
+              us[0], us[1], us[2], us[3]);
+    }
+  }
+  if (is_csv) {
+    kprintf("gfxbench,end\n");
+  }
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// Runs fixed graphics workloads on the screen and prints their throughput
+// and frame time percentiles. Each frame of a workload is drawn, flushed and
+// presented to the framebuffer through the compositor before the next one,
+// timed with HPET. With is_csv, results are printed as lines starting with
+// "gfxbench," instead, to be collected from the serial console.
+void RunGraphicsBenchmark(bool is_csv);
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "generic.h"
+
+// @font.gen.cc
+extern uint8_t font[0x100][16];
+
+// Glyphs of the font expanded into 32bpp pixels for pairs of foreground and
+// background colors, so that text can be drawn by copying rows of pixels
+// instead of testing a bit per pixel.
+// The cache is set-associative with LRU replacement in each set. The set of
+// a glyph is chosen by its character plus a hash of the colors, so the 256
+// glyphs of one color pair never evict each other. Hence pointers returned
+// for one color pair stay valid until a glyph of another pair is looked up.
+class GlyphCache {
+ public:
+  static constexpr int kWidth = 8;
+  static constexpr int kHeight = 16;
+  static constexpr int kNumOfSets = 64;
+  // Glyphs of two color pairs fit at once.
+  static constexpr int kNumOfWays = 8;
+  static_assert(kNumOfSets * kNumOfWays >= 2 * 0x100);
+  struct Glyph {
+    uint32_t rows[kHeight][kWidth];
+  };
+  struct Stats {
+    uint64_t hits;
+    uint64_t misses;
+  };
+
+  const Glyph& Lookup(char c, uint32_t fg, uint32_t bg) {
+    const uint8_t code = static_cast<uint8_t>(c);
+    const int set = (code + HashColors(fg, bg)) % kNumOfSets;
+    Tag* tags = tags_[set];
+    clock_++;
+    int victim = 0;
+    for (int i = 0; i < kNumOfWays; i++) {
+      Tag& t = tags[i];
+      if (t.is_valid && t.code == code && t.fg == fg && t.bg == bg) {
+        t.last_used = clock_;
+        stats_.hits++;
+        return glyphs_[set][i];
+      }
+      // Invalid entries have last_used == 0.
+      if (t.last_used < tags[victim].last_used)
+        victim = i;
+    }
+    stats_.misses++;
+    Expand(glyphs_[set][victim], code, fg, bg);
+    tags[victim] = {fg, bg, clock_, code, true};
+    return glyphs_[set][victim];
+  }
+  const Stats& GetStats() const { return stats_; }
+
+ private:
+  // Kept apart from the pixels so that a lookup touches only a cache line or
+  // two of tags.
+  struct Tag {
+    uint32_t fg, bg;
+    uint64_t last_used;
+    uint8_t code;
+    bool is_valid;
+  };
+
+  static uint32_t HashColors(uint32_t fg, uint32_t bg) {
+    return (fg * 0x9E3779B1U ^ bg * 0x85EBCA77U) >> 26;
+  }
+  static void Expand(Glyph& g, uint8_t code, uint32_t fg, uint32_t bg) {
+    for (int y = 0; y < kHeight; y++) {
+      const uint8_t bits = font[code][y];
+      for (int x = 0; x < kWidth; x++) {
+        g.rows[y][x] = ((bits >> (kWidth - 1 - x)) & 1) ? fg : bg;
+      }
+    }
+  }
+
+  Tag tags_[kNumOfSets][kNumOfWays];
+  Glyph glyphs_[kNumOfSets][kNumOfWays];
+  uint64_t clock_;
+  Stats stats_;
+};
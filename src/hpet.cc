@@ -69,6 +69,10 @@ uint64_t HPET::ReadMainCounterValue() {
   return GetKernelVirtAddrForPhysAddr(registers_)->main_counter_value;
 }
 
+uint64_t HPET::ReadMainCounterValueInMs() {
+  return ReadMainCounterValue() / (GetCountPerSecond() / 1000);
+}
+
 void HPET::BusyWait(uint64_t ms) {
   uint64_t count = 1'000'000'000'000ULL * ms / femtosecond_per_count_ +
                    ReadMainCounterValue();
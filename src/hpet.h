@@ -19,6 +19,7 @@ class HPET {
                   uint64_t nanoseconds,
                   HPET::TimerConfig flags);
   uint64_t ReadMainCounterValue();
+  uint64_t ReadMainCounterValueInMs();
   uint64_t GetFemtosecondPerCount();
   uint64_t GetCountPerSecond();
   void BusyWait(uint64_t ms);
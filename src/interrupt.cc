@@ -236,5 +236,9 @@ void IDT::InitInternal() {
   SetEntry(0x20, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler20);
   SetEntry(0x21, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler21);
   SetEntry(0x22, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler22);
+  SetEntry(0x23, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler23);
+  SetEntry(0x24, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler24);
+  // MSI-X of virtio-blk
+  SetEntry(0x30, cs, 0, IDTType::kInterruptGate, 0, AsmIntHandler30);
   WriteIDTR(&idtr);
 }
@@ -5,13 +5,19 @@
 #include <functional>
 #include <vector>
 
+#include "compositor.h"
 #include "corefunc.h"
+#include "fat32.h"
 #include "kernel.h"
 #include "liumos.h"
+#include "loopback_net.h"
+#include "packet_capture.h"
 #include "panic_printer.h"
 #include "pci.h"
+#include "pixel_kernels.h"
 #include "ps2_mouse.h"
 #include "rtl81xx.h"
+#include "virtio_blk.h"
 #include "virtio_net.h"
 #include "xhci.h"
 
@@ -21,13 +27,17 @@ LiumOS* liumos;
 GDT gdt_;
 KeyboardController keyboard_ctrl_;
 LiumOS liumos_;
+Sheet framebuffer_;
 Sheet virtual_vram_;
+SheetSpanMap virtual_vram_map_;
+SheetGrid virtual_vram_grid_;
 Sheet virtual_screen_;
 LocalAPIC bsp_local_apic_;
 CPUFeatureSet cpu_features_;
 SerialPort com1_;
 SerialPort com2_;
 LoaderInfo* loader_info_;
+FAT32* root_fs_;
 
 uint64_t GetKernelStraightMappingBase() {
   return liumos->cpu_features->kernel_phys_page_map_begin;
@@ -47,6 +57,18 @@ void kprintf(const char* fmt, ...) {
   va_end(args);
 }
 
+void klog(KernelLog::Level level, const char* fmt, ...) {
+  KernelLog& log = KernelLog::GetInstance();
+  KernelLog::Entry* e = log.Begin(level, ReadTSC());
+  if (!e)
+    return;
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(e->message, sizeof(e->message), fmt, args);
+  va_end(args);
+  log.Commit(*e);
+}
+
 void kprintbuf(const char* desc,
                const volatile void* data,
                size_t start,
@@ -101,12 +123,40 @@ void InitializeVRAMForKernel() {
   CreatePageMapping(
       GetSystemDRAMAllocator(), GetKernelPML4(), kernel_virtual_vram_base,
       reinterpret_cast<uint64_t>(liumos->vram_sheet->GetBuf()),
-      liumos->vram_sheet->GetBufSize(), kPageAttrPresent | kPageAttrWritable);
-  virtual_vram_.Init(reinterpret_cast<uint32_t*>(kernel_virtual_vram_base),
+      liumos->vram_sheet->GetBufSize(),
+      kPageAttrPresent | kPageAttrWritable | kPageAttrWriteCombining);
+  framebuffer_.Init(reinterpret_cast<uint32_t*>(kernel_virtual_vram_base),
+                    xsize, ysize, ppsl);
+  // Sheets are composed into a back buffer in memory, and FramePresenter()
+  // copies the damaged parts of it to the framebuffer every frame.
+  virtual_vram_.Init(AllocKernelMemory<uint32_t*>(framebuffer_.GetBufSize()),
                      xsize, ysize, ppsl);
+  memcpy(virtual_vram_.GetBuf(), framebuffer_.GetBuf(),
+         virtual_vram_.GetBufSize());
+  Compositor::GetInstance().Init(virtual_vram_, framebuffer_);
   liumos->vram_sheet = &virtual_vram_;
-  virtual_vram_.SetMap(AllocKernelMemory<Sheet**>(
-      virtual_vram_.GetXSize() * virtual_vram_.GetYSize() * sizeof(Sheet*)));
+  constexpr int kSpansPerRow = 64;
+  virtual_vram_map_.Init(AllocKernelMemory<SheetSpanMap::Span*>(
+                             sizeof(SheetSpanMap::Span) * kSpansPerRow * ysize),
+                         AllocKernelMemory<int*>(sizeof(int) * ysize), ysize,
+                         kSpansPerRow);
+  virtual_vram_.SetMap(&virtual_vram_map_);
+  // Chunks for this number of sheets per cell on average. Crowded cells take
+  // more of them.
+  constexpr int kSheetsPerCell = 32;
+  const int xcells = SheetGrid::GetNumOfCells(xsize);
+  const int ycells = SheetGrid::GetNumOfCells(ysize);
+  const int num_of_cells = xcells * ycells;
+  const int num_of_chunks =
+      num_of_cells * kSheetsPerCell / SheetGrid::kEntriesPerChunk;
+  virtual_vram_grid_.Init(
+      AllocKernelMemory<SheetGrid::Cell*>(sizeof(SheetGrid::Cell) *
+                                          num_of_cells),
+      xcells, ycells,
+      AllocKernelMemory<SheetGrid::Chunk*>(sizeof(SheetGrid::Chunk) *
+                                           num_of_chunks),
+      num_of_chunks);
+  virtual_vram_.SetGrid(&virtual_vram_grid_);
 
   constexpr uint64_t kernel_virtual_screen_base = 0xFFFF'FFFF'8800'0000ULL;
   CreatePageMapping(
@@ -213,6 +263,16 @@ void TimerHandler(uint64_t, InterruptInfo* info) {
   SleepHandler(0, info);
 }
 
+void COM1Handler(uint64_t, InterruptInfo*) {
+  com1_.HandleInterrupt();
+  liumos->bsp_local_apic->SendEndOfInterrupt();
+}
+
+void COM2Handler(uint64_t, InterruptInfo*) {
+  com2_.HandleInterrupt();
+  liumos->bsp_local_apic->SendEndOfInterrupt();
+}
+
 void CoreFunc::PutChar(char c) {
   liumos->main_console->PutChar(c);
 }
@@ -231,6 +291,27 @@ LoaderInfo& GetLoaderInfo() {
   return *loader_info_;
 }
 
+FAT32* GetRootFileSystem() {
+  return root_fs_;
+}
+
+static void MountRootFileSystem() {
+  Virtio::Blk& blk = Virtio::Blk::GetInstance();
+  if (!blk.IsInitialized())
+    return;
+  PageCache* cache = AllocKernelMemory<PageCache*>(sizeof(PageCache));
+  new (cache) PageCache(blk);
+  FAT32* fs = AllocKernelMemory<FAT32*>(sizeof(FAT32));
+  new (fs) FAT32();
+  if (fs->Mount(*cache)) {
+    PutString("FAT32 volume not found on virtio-blk\n");
+    return;
+  }
+  kprintf("FAT32 volume mounted: %lu KiB free\n",
+          fs->GetNumOfFreeClusters() * fs->GetClusterSize() / 1024);
+  root_fs_ = fs;
+}
+
 KernelPhysPageAllocator& GetKernelPhysPageAllocator() {
   return *reinterpret_cast<KernelPhysPageAllocator*>(
       reinterpret_cast<uint64_t>(&GetSystemDRAMAllocator()) +
@@ -247,6 +328,7 @@ extern "C" void KernelEntry(LiumOS* liumos_passed, LoaderInfo& loader_info) {
   loader_info_ = &loader_info;
   liumos_ = *liumos_passed;
   liumos = &liumos_;
+  KernelLog::GetInstance().SetMinLevel(KernelLog::Level::kInfo);
 
   auto& kernel_phys_page_allocator = GetKernelPhysPageAllocator();
   InitPMEMManagement();
@@ -270,6 +352,7 @@ extern "C" void KernelEntry(LiumOS* liumos_passed, LoaderInfo& loader_info) {
 
   cpu_features_ = *liumos->cpu_features;
   liumos->cpu_features = &cpu_features_;
+  PixelKernels::Init(cpu_features_, false);
 
   InitializeVRAMForKernel();
 
@@ -284,9 +367,12 @@ extern "C" void KernelEntry(LiumOS* liumos_passed, LoaderInfo& loader_info) {
   com2_.Init(kPortCOM2);
 
   liumos->main_console->SetSerial(&com2_);
+  PacketCapture::GetInstance().SetOutputPort(com1_);
+  KernelLog::GetInstance().SetOutputPort(com2_);
 
   PanicPrinter::Init(liumos->kernel_heap_allocator->Alloc<PanicPrinter>(),
-                     virtual_vram_, com2_);
+                     framebuffer_, com2_);
+  PanicPrinter::SetKernelLog(KernelLog::GetInstance());
 
   bsp_local_apic_.Init();
 
@@ -371,6 +457,10 @@ extern "C" void KernelEntry(LiumOS* liumos_passed, LoaderInfo& loader_info) {
   mouse_ctrl.Init();
 
   IDT::GetInstance().SetIntHandler(0x20, TimerHandler);
+  IDT::GetInstance().SetIntHandler(0x23, COM2Handler);
+  IDT::GetInstance().SetIntHandler(0x24, COM1Handler);
+  com1_.EnableTXInterrupt();
+  com2_.EnableTXInterrupt();
 
   PCI& pci = PCI::GetInstance();
   pci.DetectDevices();
@@ -378,11 +468,17 @@ extern "C" void KernelEntry(LiumOS* liumos_passed, LoaderInfo& loader_info) {
   // CreateAndLaunchKernelTask(SubTask);
   CreateAndLaunchKernelTask(NetworkManager, "network manager");
   CreateAndLaunchKernelTask(MouseManager, "mouse manager");
+  CreateAndLaunchKernelTask(ConsoleFlusher, "console flusher");
+  CreateAndLaunchKernelTask(FramePresenter, "frame presenter");
+  liumos->main_console->SetRenderingMode(Console::RenderingMode::kDeferred);
   // CreateAndLaunchKernelTask(USBManager);
 
   EnableSyscall();
+  LoopbackNet::GetInstance().Init();
   Virtio::Net::GetInstance().Init();
-  // RTL81::GetInstance().Init();
+  Virtio::Blk::GetInstance().Init();
+  MountRootFileSystem();
+  RTL81::GetInstance().Init();
 
   StoreIntFlag();
 
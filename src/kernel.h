@@ -1,13 +1,21 @@
 #pragma once
 
 #include "kernel.h"
+#include "kernel_log.h"
 #include "liumos.h"
 #include "paging.h"
 #include "phys_page_allocator.h"
 
+class FAT32;
+
 KernelPhysPageAllocator& GetKernelPhysPageAllocator();
+// The FAT32 volume on the block device, or nullptr if it is not mounted.
+FAT32* GetRootFileSystem();
 uint64_t GetKernelStraightMappingBase();
 void kprintf(const char* fmt, ...);
+// Records a message into KernelLog without printing it on the console.
+// Messages longer than KernelLog::kMaxMessageSize - 1 are truncated.
+void klog(KernelLog::Level level, const char* fmt, ...);
 void kprintbuf(const char* desc,
                const volatile void* data,
                size_t start,
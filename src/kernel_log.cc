@@ -0,0 +1,64 @@
+#include "kernel_log.h"
+
+#include "serial.h"
+#include "string_buffer.h"
+
+static KernelLog kernel_log_;
+
+KernelLog& KernelLog::GetInstance() {
+  return kernel_log_;
+}
+
+static const char* kLevelNames[] = {"debug", "info", "warning", "error"};
+static_assert(sizeof(kLevelNames) / sizeof(kLevelNames[0]) ==
+              static_cast<int>(KernelLog::Level::kNumOfLevels));
+
+const char* KernelLog::GetLevelName(Level level) {
+  if (level >= Level::kNumOfLevels)
+    return "?";
+  return kLevelNames[static_cast<int>(level)];
+}
+
+bool KernelLog::ParseLevel(const char* name, Level& level) {
+  for (int i = 0; i < static_cast<int>(Level::kNumOfLevels); i++) {
+    if (IsEqualString(name, kLevelNames[i])) {
+      level = static_cast<Level>(i);
+      return false;
+    }
+  }
+  return true;
+}
+
+void KernelLog::WriteEntry(SerialPort& port, const Entry& e) {
+  StringBuffer<kMaxMessageSize + 48> line;
+  line.WriteString("[");
+  line.WriteDecimal64(e.timestamp);
+  line.WriteString("] ");
+  line.WriteString(GetLevelName(e.level));
+  line.WriteString(": ");
+  line.WriteString(e.message);
+  line.WriteString("\n");
+  for (const char* s = line.GetString(); *s; s++) {
+    if (*s == '\n')
+      port.SendChar('\r');
+    port.SendChar(*s);
+  }
+}
+
+void KernelLog::WriteNewEntries() {
+  if (!output_port_)
+    return;
+  Entry e;
+  while (ReadNext(output_seq_, e)) {
+    WriteEntry(*output_port_, e);
+  }
+}
+
+void KernelLog::WriteAllEntries(SerialPort& port) {
+  Entry e;
+  for (uint64_t seq = GetOldestSeq(); seq < GetNextSeq(); seq++) {
+    // Entries being written when the kernel panicked are skipped.
+    if (Read(seq, e))
+      WriteEntry(port, e);
+  }
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "generic.h"
+
+class SerialPort;
+
+// Ring buffer of kernel log messages (see klog() in kernel.h).
+// Writers reserve an entry with an atomic increment of the sequence number,
+// write it in place and then publish it, so they never wait for each other
+// or for readers. Readers copy an entry and check that it was not
+// overwritten while copying (like a seqlock). When the ring is full, the
+// oldest entries are overwritten.
+class KernelLog {
+ public:
+  enum class Level : uint8_t {
+    kDebug,
+    kInfo,
+    kWarning,
+    kError,
+    kNumOfLevels,
+  };
+  static constexpr int kNumOfEntries = 512;
+  static constexpr size_t kMaxMessageSize = 103;  // including the last NUL
+  struct Entry {
+    // seq + 1 when the entry is published. 0 while being written.
+    uint64_t committed_seq;
+    uint64_t seq;
+    uint64_t timestamp;  // TSC
+    Level level;
+    char message[kMaxMessageSize];
+  };
+  static_assert(sizeof(Entry) == 128);
+
+  static KernelLog& GetInstance();
+  static const char* GetLevelName(Level level);
+  // Returns true if the name is not a valid level.
+  static bool ParseLevel(const char* name, Level& level);
+
+  // Messages less severe than this are not recorded.
+  void SetMinLevel(Level level) { min_level_ = level; }
+  Level GetMinLevel() const { return min_level_; }
+  bool IsEnabled(Level level) const { return level >= min_level_; }
+  // Returns an entry to write a message into, or nullptr if the level is
+  // filtered out. The entry is not visible to readers until Commit().
+  Entry* Begin(Level level, uint64_t timestamp) {
+    if (!IsEnabled(level))
+      return nullptr;
+    uint64_t seq = __atomic_fetch_add(&next_seq_, 1, __ATOMIC_RELAXED);
+    Entry& e = entries_[seq % kNumOfEntries];
+    __atomic_store_n(&e.committed_seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e.seq = seq;
+    e.timestamp = timestamp;
+    e.level = level;
+    e.message[0] = 0;
+    return &e;
+  }
+  void Commit(Entry& e) {
+    e.message[kMaxMessageSize - 1] = 0;
+    __atomic_store_n(&e.committed_seq, e.seq + 1, __ATOMIC_RELEASE);
+  }
+  uint64_t GetNextSeq() const {
+    return __atomic_load_n(&next_seq_, __ATOMIC_ACQUIRE);
+  }
+  // Returns the sequence number of the oldest entry in the ring.
+  uint64_t GetOldestSeq() const {
+    uint64_t next_seq = GetNextSeq();
+    return next_seq > kNumOfEntries ? next_seq - kNumOfEntries : 0;
+  }
+  // Copies the entry of seq into e. Returns false if it is not published
+  // yet or was overwritten.
+  bool Read(uint64_t seq, Entry& e) const {
+    const Entry& slot = entries_[seq % kNumOfEntries];
+    uint64_t committed_seq =
+        __atomic_load_n(&slot.committed_seq, __ATOMIC_ACQUIRE);
+    if (committed_seq != seq + 1)
+      return false;
+    e = slot;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot.committed_seq, __ATOMIC_RELAXED) ==
+           committed_seq;
+  }
+  // Copies the oldest published entry whose sequence number is seq or later
+  // into e, and advances seq past it. Entries overwritten before being read
+  // are skipped. Returns false if there are no such entries yet, or the
+  // entry of seq is still being written.
+  bool ReadNext(uint64_t& seq, Entry& e) const {
+    for (;;) {
+      uint64_t oldest_seq = GetOldestSeq();
+      if (seq < oldest_seq)
+        seq = oldest_seq;
+      if (seq >= GetNextSeq())
+        return false;
+      if (Read(seq, e)) {
+        seq++;
+        return true;
+      }
+      if (seq >= GetOldestSeq())
+        return false;
+    }
+  }
+
+  // Entries are written to this port by WriteNewEntries().
+  void SetOutputPort(SerialPort& port) { output_port_ = &port; }
+  // Writes entries published since the last call to the output port.
+  void WriteNewEntries();
+  // Writes all the entries in the ring to port. Used on panic.
+  void WriteAllEntries(SerialPort& port);
+
+ private:
+  static void WriteEntry(SerialPort& port, const Entry& e);
+
+  Entry entries_[kNumOfEntries];
+  uint64_t next_seq_;
+  uint64_t output_seq_;
+  Level min_level_;
+  SerialPort* output_port_;
+};
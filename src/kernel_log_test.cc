@@ -0,0 +1,95 @@
+#include "kernel_log.h"
+
+#ifdef LIUMOS_TEST
+
+#include <stdio.h>
+#include <string.h>
+
+#include <cassert>
+
+using Level = KernelLog::Level;
+
+static void Write(KernelLog& log, Level level, const char* s) {
+  KernelLog::Entry* e = log.Begin(level, 0);
+  if (!e)
+    return;
+  snprintf(e->message, sizeof(e->message), "%s", s);
+  log.Commit(*e);
+}
+
+static void ExpectNext(KernelLog& log, uint64_t& seq, const char* expected) {
+  KernelLog::Entry e;
+  assert(log.ReadNext(seq, e));
+  assert(strcmp(e.message, expected) == 0);
+}
+
+static void TestReadAndFilter() {
+  static KernelLog log;
+  log.SetMinLevel(Level::kInfo);
+  Write(log, Level::kInfo, "a");
+  Write(log, Level::kDebug, "filtered");
+  Write(log, Level::kError, "b");
+  assert(log.GetNextSeq() == 2);
+
+  uint64_t seq = 0;
+  ExpectNext(log, seq, "a");
+  ExpectNext(log, seq, "b");
+  KernelLog::Entry e;
+  assert(!log.ReadNext(seq, e));
+  assert(seq == 2);
+
+  // Long messages are truncated.
+  char long_message[KernelLog::kMaxMessageSize * 2];
+  memset(long_message, 'x', sizeof(long_message) - 1);
+  long_message[sizeof(long_message) - 1] = 0;
+  Write(log, Level::kInfo, long_message);
+  assert(log.ReadNext(seq, e));
+  assert(strlen(e.message) == KernelLog::kMaxMessageSize - 1);
+}
+
+static void TestUncommittedEntry() {
+  static KernelLog log;
+  KernelLog::Entry* first = log.Begin(Level::kInfo, 0);
+  Write(log, Level::kInfo, "second");
+
+  // Readers keep the order and wait for the entry being written.
+  uint64_t seq = 0;
+  KernelLog::Entry e;
+  assert(!log.ReadNext(seq, e));
+  assert(seq == 0);
+  // Read() does not wait, so that the log can be written out on panic.
+  assert(!log.Read(0, e));
+  assert(log.Read(1, e) && strcmp(e.message, "second") == 0);
+
+  strcpy(first->message, "first");
+  log.Commit(*first);
+  ExpectNext(log, seq, "first");
+  ExpectNext(log, seq, "second");
+}
+
+static void TestOverwrite() {
+  static KernelLog log;
+  char s[16];
+  for (int i = 0; i < KernelLog::kNumOfEntries + 10; i++) {
+    snprintf(s, sizeof(s), "%d", i);
+    Write(log, Level::kInfo, s);
+  }
+  assert(log.GetOldestSeq() == 10);
+  // Lost entries are skipped.
+  uint64_t seq = 3;
+  ExpectNext(log, seq, "10");
+  assert(seq == 11);
+  KernelLog::Entry e;
+  assert(!log.Read(9, e));
+  assert(log.Read(KernelLog::kNumOfEntries + 9, e));
+}
+
+int main() {
+  TestReadAndFilter();
+  TestUncommittedEntry();
+  TestOverwrite();
+  puts("PASS");
+  return 0;
+}
+
+#endif
@@ -79,6 +79,8 @@ void IdentifyCPU() {
   f.features |= ((cpuid.ecx >> 27) & 1) << CPUFeatureIndex::kOSXSAVE;
   f.features |= ((cpuid.edx >> 9) & 1) << CPUFeatureIndex::kAPIC;
   f.features |= ((cpuid.edx >> 24) & 1) << CPUFeatureIndex::kFXSR;
+  f.features |= ((cpuid.edx >> 26) & 1) << CPUFeatureIndex::kSSE2;
+  f.features |= ((cpuid.edx >> 16) & 1) << CPUFeatureIndex::kPAT;
   if (!(cpuid.edx & kCPUID01H_EDXBitAPIC))
     Panic("APIC not supported");
   if (!(cpuid.edx & kCPUID01H_EDXBitMSR))
@@ -89,6 +91,7 @@ void IdentifyCPU() {
   if (7 <= f.max_cpuid) {
     ReadCPUID(&cpuid, 7, 0);
     f.clflushopt = cpuid.ebx & (1 << 23);
+    f.features |= ((cpuid.ebx >> 5) & 1) << CPUFeatureIndex::kAVX2;
   }
 
   if (0x8000'0004 <= f.max_extended_cpuid) {
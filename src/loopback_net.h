@@ -0,0 +1,33 @@
+#pragma once
+
+#include "generic.h"
+#include "net_device.h"
+#include "network.h"
+
+// In-kernel loopback device. Frames sent to it are received by the stack on
+// the next PollRX(). Checksums are never calculated.
+class LoopbackNet : public NetDevice {
+ public:
+  void Init();
+  const char* GetName() override { return "lo"; }
+  void PollRX() override;
+
+  static LoopbackNet& GetInstance();
+
+ protected:
+  uint8_t* GetNextTXBuf(size_t size, uint32_t flow_hash) override;
+  void QueueTXPacket() override;
+  void KickTX() override {}
+  void SetTXBufUDPChecksum(Network::IPv4UDPPacket& p,
+                           size_t packet_size) override;
+
+ private:
+  static constexpr int kQueueSize = 64;
+  static constexpr Network::IPv4Addr kLoopbackIPv4Addr = {127, 0, 0, 1};
+
+  static LoopbackNet* loopback_;
+  Network::PacketContainer queue_[kQueueSize];
+  // Frames in [rx_cursor_, tx_cursor_) are waiting for PollRX().
+  uint64_t tx_cursor_;
+  uint64_t rx_cursor_;
+};
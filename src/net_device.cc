@@ -0,0 +1,65 @@
+#include "net_device.h"
+
+#include "packet_capture.h"
+
+void NetDevice::SendPacket() {
+  if (is_last_tx_dropped_) {
+    stats_.tx_drops++;
+    return;
+  }
+  if (PacketCapture::IsEnabled()) {
+    PacketCapture::GetInstance().Record(last_tx_buf_, last_tx_size_);
+  }
+  QueueTXPacket();
+  if (tx_batch_depth_) {
+    num_of_batched_tx_packets_++;
+    return;
+  }
+  KickTX();
+}
+
+void NetDevice::EndTXBatch() {
+  assert(tx_batch_depth_ > 0);
+  tx_batch_depth_--;
+  if (tx_batch_depth_ == 0 && num_of_batched_tx_packets_) {
+    num_of_batched_tx_packets_ = 0;
+    KickTX();
+  }
+}
+
+void NetDevice::SetTXBufUDPChecksum(Network::IPv4UDPPacket& p,
+                                    size_t packet_size) {
+  using IPv4UDPPacket = Network::IPv4UDPPacket;
+  p.csum.Clear();
+  p.csum =
+      Network::CalcUDPChecksum(&p, offsetof(IPv4UDPPacket, src_port),
+                               packet_size, p.ip.src_ip, p.ip.dst_ip, p.length);
+}
+
+void NetDevice::SetTXBufUDPSegmentation(uint16_t, uint16_t) {
+  Panic("NetDevice: UDP segmentation offload is not supported");
+}
+
+void NetDevice::SetSelfIPv4Addr(Network::IPv4Addr addr) {
+  self_ip_ = addr;
+  if (self_ip_.IsEqualTo(Network::kWildcardIPv4Addr))
+    return;
+  Network::GetInstance().RegisterPermanentARPResolution(self_ip_, mac_addr_);
+}
+
+bool NetDevice::DeliverRXFrame(uint8_t* frame,
+                               size_t frame_size,
+                               bool checksum_verified) {
+  if (PacketCapture::IsEnabled()) {
+    PacketCapture::GetInstance().Record(frame, frame_size);
+  }
+  if (frame_size > kMaxRXFrameSize ||
+      (!checksum_verified && !Network::IsUDPChecksumValid(frame, frame_size))) {
+    stats_.rx_drops++;
+    return false;
+  }
+  stats_.rx_packets++;
+  stats_.rx_bytes += frame_size;
+  Network::GetInstance().ProcessRXFrame(*this, frame, frame_size);
+  return true;
+}
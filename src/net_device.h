@@ -0,0 +1,125 @@
+#pragma once
+
+#include "generic.h"
+#include "network.h"
+
+// Interface between network interface drivers (virtio-net, rtl81xx,
+// loopback) and the protocol stack in network.cc / syscall.cc.
+class NetDevice {
+ public:
+  struct Stats {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t rx_drops;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_drops;
+  };
+  // Offload capabilities
+  static constexpr uint32_t kCapTXChecksum = 1 << 0;
+  static constexpr uint32_t kCapRXChecksum = 1 << 1;
+  static constexpr uint32_t kCapTXUDPSegmentation = 1 << 2;
+  static constexpr uint32_t kCapTXTCPSegmentation = 1 << 3;
+  // Frames up to this size can be sent if the device segments them.
+  static constexpr size_t kMaxTXFrameSize = Network::kMaxIPv4FrameSize;
+  // Devices with receive segmentation offload may deliver frames up to this
+  // size, larger than kEtherMTU.
+  static constexpr size_t kMaxRXFrameSize = Network::kMaxIPv4FrameSize;
+
+  virtual const char* GetName() = 0;
+
+  //
+  // TX
+  //
+  // Returns a buffer to build a frame of the given size in. The frame is
+  // sent by the next SendPacket() call. flow_hash (Network::CalcFlowHash)
+  // selects the queue on multiqueue devices. If the device cannot take the
+  // frame, a scratch buffer is returned and SendPacket() drops the frame.
+  template <typename T = uint8_t*>
+  T GetNextTXPacketBuf(size_t size, uint32_t flow_hash = 0) {
+    assert(size <= kMaxTXFrameSize);
+    last_tx_buf_ = GetNextTXBuf(size, flow_hash);
+    last_tx_size_ = size;
+    is_last_tx_dropped_ = !last_tx_buf_;
+    if (is_last_tx_dropped_) {
+      last_tx_buf_ = tx_drop_buf_;
+    }
+    return reinterpret_cast<T>(last_tx_buf_);
+  }
+  void SendPacket();
+  // Frames sent between BeginTXBatch() and EndTXBatch() are handed to the
+  // device with a single notification. The device is not notified if no
+  // frames are sent in the batch.
+  void BeginTXBatch() { tx_batch_depth_++; }
+  void EndTXBatch();
+  // Fills the UDP checksum of the frame in the last GetNextTXPacketBuf()
+  // buffer. Devices with kCapTXChecksum do it in hardware.
+  // Both of these do nothing if the frame is dropped, since the device has
+  // no buffer for it.
+  void SetUDPChecksum(Network::IPv4UDPPacket& p, size_t packet_size) {
+    if (!is_last_tx_dropped_) {
+      SetTXBufUDPChecksum(p, packet_size);
+    }
+  }
+  // Lets the device split the UDP datagram in the last GetNextTXPacketBuf()
+  // buffer into IPv4 fragments of segment_size bytes following the
+  // header_length bytes of headers. Requires kCapTXUDPSegmentation and
+  // SetUDPChecksum() being called first.
+  void SetTXUDPSegmentation(uint16_t header_length, uint16_t segment_size) {
+    if (!is_last_tx_dropped_) {
+      SetTXBufUDPSegmentation(header_length, segment_size);
+    }
+  }
+
+  //
+  // RX
+  //
+  // Passes received frames to Network::ProcessRXFrame(). Called
+  // periodically from NetworkManager().
+  virtual void PollRX() = 0;
+
+  uint32_t GetCapabilities() { return capabilities_; }
+  bool HasCapabilities(uint32_t caps) {
+    return (capabilities_ & caps) == caps;
+  }
+  bool IsLoopback() { return is_loopback_; }
+  const Stats& GetStats() { return stats_; }
+  const Network::EtherAddr GetSelfEtherAddr() { return mac_addr_; }
+  const Network::IPv4Addr GetSelfIPv4Addr() { return self_ip_; }
+  void SetSelfIPv4Addr(Network::IPv4Addr addr);
+
+ protected:
+  // Returns nullptr if the frame cannot be queued now or is too large for
+  // the device. QueueTXPacket() is not called for the frame then.
+  virtual uint8_t* GetNextTXBuf(size_t size, uint32_t flow_hash) = 0;
+  // Hands the frame of the last GetNextTXBuf() to the device.
+  virtual void QueueTXPacket() = 0;
+  // Notifies the device of the frames given by QueueTXPacket().
+  virtual void KickTX() = 0;
+  // Called for the frame of the last GetNextTXBuf() which returned a buffer.
+  virtual void SetTXBufUDPChecksum(Network::IPv4UDPPacket& p,
+                                   size_t packet_size);
+  virtual void SetTXBufUDPSegmentation(uint16_t header_length,
+                                       uint16_t segment_size);
+  // Drivers call this for each received frame. If checksum_verified is
+  // false, the UDP checksum is verified in software. Returns false if the
+  // frame is dropped, e.g. for being larger than kMaxRXFrameSize.
+  bool DeliverRXFrame(uint8_t* frame,
+                      size_t frame_size,
+                      bool checksum_verified);
+
+  Network::EtherAddr mac_addr_;
+  Network::IPv4Addr self_ip_;
+  uint32_t capabilities_;
+  bool is_loopback_;
+  Stats stats_;
+
+ private:
+  int tx_batch_depth_;
+  int num_of_batched_tx_packets_;
+  // For PacketCapture
+  uint8_t* last_tx_buf_;
+  size_t last_tx_size_;
+  bool is_last_tx_dropped_;
+  uint8_t tx_drop_buf_[kMaxTXFrameSize];
+};
@@ -1,7 +1,8 @@
 #include "network.h"
+#include "dns.h"
 #include "kernel.h"
 #include "liumos.h"
-#include "virtio_net.h"
+#include "net_device.h"
 
 void Network::IPv4Addr::Print() const {
   StringBuffer<128> line;
@@ -33,26 +34,1033 @@ Network& Network::GetInstance() {
   return *network_;
 }
 
+static uint64_t GetNowMs() {
+  return HPET::GetInstance().ReadMainCounterValueInMs();
+}
+
+static void SendPendingFrame(NetDevice& dev,
+                             Network::PacketBuffer& frame,
+                             Network::EtherAddr dst_eth_addr) {
+  Network::EtherFrame& eth =
+      *reinterpret_cast<Network::EtherFrame*>(frame.data);
+  eth.dst = dst_eth_addr;
+  uint8_t* buf = dev.GetNextTXPacketBuf<uint8_t*>(
+      frame.size, Network::CalcFlowHashOfFrame(frame.data, frame.size));
+  memcpy(buf, frame.data, frame.size);
+  dev.SendPacket();
+}
+
+void Network::FreePendingFrames(Neighbor& n) {
+  for (auto frame : n.pending_frames) {
+    FreePacketBuffer(frame);
+  }
+  n.pending_frames.clear();
+  n.pending_frames.shrink_to_fit();
+}
+
+void Network::RegisterARPResolution(IPv4Addr ip_addr, EtherAddr eth_addr) {
+  Neighbor& n = arp_table_[ip_addr];
+  if (n.state == Neighbor::State::kPermanent) {
+    return;
+  }
+  n.state = Neighbor::State::kReachable;
+  n.eth_addr = eth_addr;
+  n.updated_at_ms = GetNowMs();
+  n.num_of_requests = 0;
+  if (n.dev && !n.pending_frames.empty()) {
+    n.dev->BeginTXBatch();
+    for (auto frame : n.pending_frames) {
+      if (frame->size <= sizeof(EtherFrame) + kEtherMTU) {
+        SendPendingFrame(*n.dev, *frame, eth_addr);
+        continue;
+      }
+      SendIPv4Fragments(*n.dev, ip_addr, eth_addr, frame->data, frame->size,
+                        CalcFlowHashOfFrame(frame->data, frame->size));
+    }
+    n.dev->EndTXBatch();
+  }
+  FreePendingFrames(n);
+}
+
+void Network::RegisterPermanentARPResolution(IPv4Addr ip_addr,
+                                             EtherAddr eth_addr) {
+  Neighbor& n = arp_table_[ip_addr];
+  n.state = Neighbor::State::kPermanent;
+  n.eth_addr = eth_addr;
+  n.updated_at_ms = GetNowMs();
+  FreePendingFrames(n);
+}
+
+std::optional<Network::EtherAddr> Network::ResolveIPv4(NetDevice& dev,
+                                                       IPv4Addr ip_addr) {
+  using State = Neighbor::State;
+  const uint64_t now_ms = GetNowMs();
+  auto it = arp_table_.find(ip_addr);
+  if (it == arp_table_.end()) {
+    Neighbor& n = arp_table_[ip_addr];
+    n.state = State::kIncomplete;
+    n.updated_at_ms = now_ms;
+    n.last_request_at_ms = now_ms;
+    n.num_of_requests = 1;
+    n.dev = &dev;
+    SendARPRequest(dev, ip_addr);
+    return std::nullopt;
+  }
+  Neighbor& n = it->second;
+  if (n.state == State::kIncomplete) {
+    return std::nullopt;
+  }
+  if (n.state == State::kStale && n.num_of_requests == 0) {
+    // Keep using the stale entry while confirming it in background.
+    n.last_request_at_ms = now_ms;
+    n.num_of_requests = 1;
+    n.dev = &dev;
+    SendARPRequest(dev, ip_addr);
+  }
+  return n.eth_addr;
+}
+
+bool Network::EnqueuePendingFrame(IPv4Addr ip_addr,
+                                  const void* frame,
+                                  size_t size) {
+  auto it = arp_table_.find(ip_addr);
+  if (it == arp_table_.end()) {
+    return false;
+  }
+  Neighbor& n = it->second;
+  if (n.state != Neighbor::State::kIncomplete ||
+      n.pending_frames.size() >= kMaxPendingFramesPerNeighbor) {
+    return false;
+  }
+  PacketBuffer* buf = AllocPacketBuffer(size);
+  if (!buf) {
+    return false;
+  }
+  memcpy(buf->data, frame, size);
+  n.pending_frames.push_back(buf);
+  return true;
+}
+
+void Network::ProcessNeighborTimers() {
+  using State = Neighbor::State;
+  const uint64_t now_ms = GetNowMs();
+  for (auto it = arp_table_.begin(); it != arp_table_.end();) {
+    Neighbor& n = it->second;
+    if (n.state == State::kPermanent) {
+      it++;
+      continue;
+    }
+    const bool waiting_reply =
+        n.state == State::kIncomplete || n.num_of_requests > 0;
+    if (waiting_reply &&
+        now_ms - n.last_request_at_ms >= kARPRetryIntervalMs) {
+      if (n.num_of_requests >= kMaxARPRequests) {
+        if (n.state == State::kIncomplete) {
+          kprintf("network: ARP resolution failed. %lu frames dropped.\n",
+                  n.pending_frames.size());
+        }
+        FreePendingFrames(n);
+        it = arp_table_.erase(it);
+        continue;
+      }
+      n.last_request_at_ms = now_ms;
+      n.num_of_requests++;
+      if (n.dev) {
+        SendARPRequest(*n.dev, it->first);
+      }
+    }
+    if (n.state == State::kReachable &&
+        now_ms - n.updated_at_ms >= kNeighborReachableTimeMs) {
+      n.state = State::kStale;
+      n.updated_at_ms = now_ms;
+    } else if (n.state == State::kStale && n.num_of_requests == 0 &&
+               now_ms - n.updated_at_ms >= kNeighborStaleTimeMs) {
+      // Not used for a while
+      it = arp_table_.erase(it);
+      continue;
+    }
+    it++;
+  }
+}
+
+void Network::RegisterNetDevice(NetDevice& dev) {
+  net_devices_.push_back(&dev);
+  if (dev.IsLoopback()) {
+    if (!loopback_net_device_) {
+      loopback_net_device_ = &dev;
+    }
+    return;
+  }
+  if (!primary_net_device_) {
+    primary_net_device_ = &dev;
+  }
+}
+
+Network::Route Network::LookupRoute(IPv4Addr dst_ip_addr) {
+  // 127.0.0.0/8 and addresses of this host go through the loopback device.
+  if (loopback_net_device_) {
+    if (dst_ip_addr.addr[0] == 127) {
+      return {loopback_net_device_, dst_ip_addr};
+    }
+    for (auto dev : net_devices_) {
+      if (!dev->IsLoopback() && dst_ip_addr.IsEqualTo(dev->GetSelfIPv4Addr())) {
+        return {loopback_net_device_, dst_ip_addr};
+      }
+    }
+  }
+  if (!primary_net_device_) {
+    return {nullptr, dst_ip_addr};
+  }
+  if (dst_ip_addr.IsEqualTo(kBroadcastIPv4Addr) ||
+      dst_ip_addr.IsInSameSubnet(gateway_, netmask_)) {
+    return {primary_net_device_, dst_ip_addr};
+  }
+  return {primary_net_device_, gateway_};
+}
+
+static void ARPPacketHandler(NetDevice& dev, Network::ARPPacket& arp) {
+  using ARPPacket = Network::ARPPacket;
+  if (arp.GetOperation() == ARPPacket::Operation::kReply) {
+    Network::GetInstance().RegisterARPResolution(arp.sender_proto_addr,
+                                                 arp.sender_eth_addr);
+    return;
+  }
+  if (!arp.target_proto_addr.IsEqualTo(dev.GetSelfIPv4Addr())) {
+    // This is ARP Request, but not a request to me
+    return;
+  }
+  // RFC826: the requester is likely to talk to us soon, so learn it as well.
+  Network::GetInstance().RegisterARPResolution(arp.sender_proto_addr,
+                                               arp.sender_eth_addr);
+  // Reply to ARP
+  ARPPacket& reply = *dev.GetNextTXPacketBuf<ARPPacket*>(sizeof(ARPPacket));
+  reply.SetupReply(arp.sender_proto_addr, dev.GetSelfIPv4Addr(),
+                   arp.sender_eth_addr, dev.GetSelfEtherAddr());
+  dev.SendPacket();
+}
+
+static void SendICMPEchoReply(NetDevice& dev,
+                              const Network::ICMPPacket& req,
+                              size_t req_frame_size) {
+  using ICMPPacket = Network::ICMPPacket;
+  using IPv4Packet = Network::IPv4Packet;
+  using IPv4UDPPacket = Network::IPv4UDPPacket;
+  if (req_frame_size < sizeof(ICMPPacket)) {
+    return;
+  }
+  PutStringAndHex("req_frame_size", req_frame_size);
+  // Reply to ARP
+  ICMPPacket& reply = *dev.GetNextTXPacketBuf<ICMPPacket*>(req_frame_size);
+  memcpy(&reply, &req, req_frame_size);
+  // Setup ICMP
+  reply.type = ICMPPacket::Type::kEchoReply;
+  reply.csum.Clear();
+  reply.csum = Network::InternetChecksum::Calc(
+      &reply, offsetof(ICMPPacket, type), req_frame_size);
+  // Setup IP
+  reply.ip.dst_ip = req.ip.src_ip;
+  reply.ip.src_ip = req.ip.dst_ip;
+  reply.ip.csum.Clear();
+  reply.ip.csum = Network::InternetChecksum::Calc(
+      &reply, offsetof(IPv4Packet, version_and_ihl), req_frame_size);
+  // Setup Eth
+  reply.ip.eth.dst = req.ip.eth.src;
+  reply.ip.eth.src = dev.GetSelfEtherAddr();
+  // Send
+  dev.SendPacket();
+  PutString("Reply sent!: ");
+
+  // UDP
+  const char* s = "Hello! This is liumOS. Are you there?\n";
+  uint16_t dst_port = 11111;
+  uint16_t packet_size =
+      static_cast<uint16_t>((sizeof(IPv4UDPPacket) + strlen(s) + 1) & ~1);
+  IPv4UDPPacket& p = *dev.GetNextTXPacketBuf<IPv4UDPPacket*>(packet_size);
+  char* data = reinterpret_cast<char*>(reinterpret_cast<uint8_t*>(&p) +
+                                       sizeof(IPv4UDPPacket));
+  memcpy(&p, &req, packet_size);
+  memcpy(data, s, strlen(s));
+  // Setup UDP
+  p.SetDestinationPort(dst_port);
+  p.SetSourcePort(12345);
+  p.SetDataSize(strlen(s));
+  // Setup IP
+  p.ip.protocol = IPv4Packet::Protocol::kUDP;
+  p.ip.SetDataLength(packet_size - sizeof(IPv4Packet));
+  p.ip.dst_ip = req.ip.src_ip;
+  p.ip.src_ip = req.ip.dst_ip;
+  p.ip.csum.Clear();
+  p.ip.csum = Network::InternetChecksum::Calc(
+      &p, offsetof(IPv4Packet, version_and_ihl), sizeof(IPv4Packet));
+  dev.SetUDPChecksum(p, packet_size);
+  // Setup Eth
+  p.ip.eth.dst = req.ip.eth.src;
+  p.ip.eth.src = dev.GetSelfEtherAddr();
+  // Send
+  dev.SendPacket();
+}
+
+static void ICMPPacketHandler(NetDevice& dev,
+                              Network::IPv4Packet& p,
+                              size_t frame_size) {
+  using ICMPPacket = Network::ICMPPacket;
+  if (frame_size < sizeof(ICMPPacket)) {
+    return;
+  }
+  ICMPPacket& icmp = *reinterpret_cast<ICMPPacket*>(&p);
+  // Replies to reassembled requests larger than MTU are not supported.
+  if (icmp.type == ICMPPacket::Type::kEchoRequest &&
+      frame_size <= sizeof(Network::EtherFrame) + Network::kEtherMTU) {
+    SendICMPEchoReply(dev, icmp, frame_size);
+  }
+}
+
+void Network::ProcessRXFrame(NetDevice& dev,
+                             uint8_t* frame,
+                             size_t frame_size) {
+  RXFrameInfo info = ClassifyRXFrame(frame, frame_size);
+  if (info.kind == RXFrameInfo::Kind::kIPv4Fragment) {
+    PacketBuffer* datagram = ReassembleIPv4(frame, frame_size);
+    if (!datagram) {
+      return;
+    }
+    if (IsUDPChecksumValid(datagram->data, datagram->size)) {
+      HandleRXFrame(dev, ClassifyRXFrame(datagram->data, datagram->size),
+                    datagram->data, datagram->size);
+    }
+    FreePacketBuffer(datagram);
+    return;
+  }
+  HandleRXFrame(dev, info, frame, frame_size);
+}
+
+void Network::HandleRXFrame(NetDevice& dev,
+                            const RXFrameInfo& info,
+                            uint8_t* frame,
+                            size_t frame_size) {
+  using Kind = RXFrameInfo::Kind;
+  switch (info.kind) {
+    case Kind::kARPRequest:
+    case Kind::kARPReply:
+      ARPPacketHandler(dev, *reinterpret_cast<ARPPacket*>(frame));
+      return;
+    case Kind::kICMP:
+      ICMPPacketHandler(dev, *reinterpret_cast<IPv4Packet*>(frame),
+                        frame_size);
+      break;
+    case Kind::kUDP:
+      if (info.dst_port == 68) {
+        HandleDHCPMessage(dev, frame, frame_size);
+      }
+      if (HandleDNSMessage(dev, frame, frame_size)) {
+        return;
+      }
+      break;
+    default:
+      return;
+  }
+  DeliverFrameToSockets(info, frame, frame_size);
+}
+
+Network::PacketBuffer* Network::AllocPacketBuffer(size_t size) {
+  constexpr size_t kSmallCapacity = kPageSize - sizeof(PacketBuffer);
+  constexpr size_t kLargeCapacity = kMaxIPv4FrameSize;
+  const bool is_large = size > kSmallCapacity;
+  if (size > kLargeCapacity) {
+    return nullptr;
+  }
+  PacketBuffer*& free_list =
+      is_large ? free_large_packet_buffers_ : free_packet_buffers_;
+  PacketBuffer* buf = free_list;
+  if (buf) {
+    free_list = buf->next;
+  } else {
+    if (is_large && num_of_large_packet_buffers_ >= kMaxLargePacketBuffers) {
+      return nullptr;
+    }
+    const size_t capacity = is_large ? kLargeCapacity : kSmallCapacity;
+    buf =
+        AllocKernelMemory<PacketBuffer*>(sizeof(PacketBuffer) + capacity);
+    buf->capacity = capacity;
+    buf->data = reinterpret_cast<uint8_t*>(buf) + sizeof(PacketBuffer);
+    if (is_large) {
+      num_of_large_packet_buffers_++;
+    }
+  }
+  buf->next = nullptr;
+  buf->size = size;
+  return buf;
+}
+
+void Network::FreePacketBuffer(PacketBuffer* buf) {
+  PacketBuffer*& free_list = buf->capacity > kPageSize
+                                 ? free_large_packet_buffers_
+                                 : free_packet_buffers_;
+  buf->next = free_list;
+  free_list = buf;
+}
+
+Network::PacketBuffer* Network::ReassembleIPv4(uint8_t* frame,
+                                               size_t frame_size) {
+  using Result = IPv4Reassembly::Result;
+  IPv4Packet& p = *reinterpret_cast<IPv4Packet*>(frame);
+  const size_t header_end = sizeof(EtherFrame) + p.GetHeaderSize();
+  const size_t frame_end = sizeof(EtherFrame) + p.GetTotalLength();
+  if (p.GetHeaderSize() < sizeof(IPv4Packet) - sizeof(EtherFrame) ||
+      frame_end > frame_size || header_end > frame_end) {
+    ipv4_reassembly_stats_.drops++;
+    return nullptr;
+  }
+  // Find the datagram this fragment belongs to.
+  IPv4Reassembly* r = nullptr;
+  IPv4Reassembly* oldest = &ipv4_reassemblies_[0];
+  IPv4Reassembly* unused = nullptr;
+  for (auto& it : ipv4_reassemblies_) {
+    if (!it.in_use) {
+      unused = &it;
+      continue;
+    }
+    if (it.ident == p.ident && it.protocol == p.protocol &&
+        it.src_ip.IsEqualTo(p.src_ip) && it.dst_ip.IsEqualTo(p.dst_ip)) {
+      r = &it;
+      break;
+    }
+    if (!oldest->in_use || it.started_at_ms < oldest->started_at_ms) {
+      oldest = &it;
+    }
+  }
+  if (!r) {
+    if (!unused) {
+      // The cache is full. Give up the oldest one.
+      FreePacketBuffer(oldest->buf);
+      oldest->in_use = false;
+      ipv4_reassembly_stats_.drops++;
+      unused = oldest;
+    }
+    PacketBuffer* buf = AllocPacketBuffer(kMaxIPv4FrameSize);
+    if (!buf) {
+      ipv4_reassembly_stats_.drops++;
+      return nullptr;
+    }
+    r = unused;
+    bzero(r, sizeof(IPv4Reassembly));
+    r->in_use = true;
+    r->src_ip = p.src_ip;
+    r->dst_ip = p.dst_ip;
+    r->ident = p.ident;
+    r->protocol = p.protocol;
+    r->started_at_ms = GetNowMs();
+    r->buf = buf;
+    // Options are not copied to the reassembled datagram.
+    memcpy(buf->data, frame, sizeof(IPv4Packet));
+  }
+  const bool is_last =
+      !(p.GetFlagsAndFragmentOffset() & IPv4Packet::kFlagMoreFragments);
+  const size_t offset = p.GetFragmentOffset();
+  const size_t size = frame_end - header_end;
+  switch (r->AddFragment(offset, size, is_last)) {
+    case Result::kAccepted:
+      break;
+    case Result::kDuplicate:
+      return nullptr;
+    case Result::kOverlap:
+      // Overlapping fragments are used to evade filters. Drop the whole
+      // datagram as Linux does.
+      ipv4_reassembly_stats_.overlaps++;
+      FreePacketBuffer(r->buf);
+      r->in_use = false;
+      return nullptr;
+    case Result::kInvalid:
+      ipv4_reassembly_stats_.drops++;
+      FreePacketBuffer(r->buf);
+      r->in_use = false;
+      return nullptr;
+  }
+  memcpy(r->buf->data + sizeof(IPv4Packet) + offset, frame + header_end,
+         size);
+  if (offset == 0) {
+    // Use the header of the first fragment as the reference.
+    memcpy(r->buf->data, frame, sizeof(IPv4Packet));
+  }
+  if (!r->IsComplete()) {
+    return nullptr;
+  }
+  PacketBuffer* datagram = r->buf;
+  r->in_use = false;
+  datagram->size = sizeof(IPv4Packet) + r->data_size;
+  IPv4Packet& ip = *reinterpret_cast<IPv4Packet*>(datagram->data);
+  ip.version_and_ihl = 0x45;
+  ip.SetFlagsAndFragmentOffset(0);
+  ip.length[0] = (datagram->size - sizeof(EtherFrame)) >> 8;
+  ip.length[1] = (datagram->size - sizeof(EtherFrame)) & 0xFF;
+  ip.CalcAndSetChecksum();
+  ipv4_reassembly_stats_.reassembled++;
+  return datagram;
+}
+
+void Network::ProcessIPv4ReassemblyTimers() {
+  const uint64_t now_ms = GetNowMs();
+  for (auto& r : ipv4_reassemblies_) {
+    if (r.in_use && now_ms - r.started_at_ms >= kIPv4ReassemblyTimeoutMs) {
+      FreePacketBuffer(r.buf);
+      r.in_use = false;
+      ipv4_reassembly_stats_.timeouts++;
+    }
+  }
+}
+
+uint8_t* Network::GetIPv4FragmentationBuf() {
+  if (!ipv4_fragmentation_buf_) {
+    ipv4_fragmentation_buf_ = AllocKernelMemory<uint8_t*>(kMaxIPv4FrameSize);
+  }
+  return ipv4_fragmentation_buf_;
+}
+
+bool Network::SendIPv4Fragments(NetDevice& dev,
+                                IPv4Addr next_hop,
+                                std::optional<EtherAddr> dst_eth_addr,
+                                uint8_t* datagram,
+                                size_t datagram_size,
+                                uint32_t flow_hash) {
+  IPv4Packet& header = *reinterpret_cast<IPv4Packet*>(datagram);
+  const size_t data_size = datagram_size - sizeof(IPv4Packet);
+  constexpr size_t kIPHeaderSize = sizeof(IPv4Packet) - sizeof(EtherFrame);
+  // Fragment data except the last one must be multiple of 8 bytes.
+  constexpr size_t kMaxFragmentDataSize = (kEtherMTU - kIPHeaderSize) & ~7;
+  if (!dst_eth_addr.has_value()) {
+    // Queued as a whole so that a partial set of fragments is never held.
+    return EnqueuePendingFrame(next_hop, datagram, datagram_size);
+  }
+  dev.BeginTXBatch();
+  for (size_t offset = 0; offset < data_size;
+       offset += kMaxFragmentDataSize) {
+    const size_t size = std::min(data_size - offset, kMaxFragmentDataSize);
+    const bool is_last = offset + size == data_size;
+    const size_t frame_size = sizeof(IPv4Packet) + size;
+    uint8_t* frame = dev.GetNextTXPacketBuf<uint8_t*>(frame_size, flow_hash);
+    memcpy(frame, datagram, sizeof(IPv4Packet));
+    memcpy(frame + sizeof(IPv4Packet),
+           datagram + sizeof(IPv4Packet) + offset, size);
+    IPv4Packet& p = *reinterpret_cast<IPv4Packet*>(frame);
+    p.length[0] = (kIPHeaderSize + size) >> 8;
+    p.length[1] = (kIPHeaderSize + size) & 0xFF;
+    p.SetFlagsAndFragmentOffset(static_cast<uint16_t>(
+        (header.GetFlagsAndFragmentOffset() & IPv4Packet::kFlagDontFragment) |
+        (is_last ? 0 : IPv4Packet::kFlagMoreFragments) | (offset / 8)));
+    p.CalcAndSetChecksum();
+    p.eth.dst = *dst_eth_addr;
+    dev.SendPacket();
+  }
+  dev.EndTXBatch();
+  return true;
+}
+
+void Network::DeliverFrameToSockets(const RXFrameInfo& info,
+                                    uint8_t* frame,
+                                    size_t frame_size) {
+  if (info.kind == RXFrameInfo::Kind::kUDP) {
+    auto it = udp_sockets_.find(info.dst_port);
+    if (it == udp_sockets_.end()) {
+      return;
+    }
+    QueueFrameToSocket(*it->second, frame, frame_size);
+    return;
+  }
+  if (info.kind == RXFrameInfo::Kind::kICMP) {
+    for (auto sock : sockets_) {
+      if (sock->type == Socket::Type::kICMPDatagram ||
+          sock->type == Socket::Type::kICMPRaw) {
+        QueueFrameToSocket(*sock, frame, frame_size);
+      }
+    }
+  }
+}
+
+void Network::QueueFrameToSocket(Socket& sock,
+                                 uint8_t* frame,
+                                 size_t frame_size) {
+  if (sock.rx_queue.IsFull()) {
+    sock.rx_drops++;
+    return;
+  }
+  PacketBuffer* buf = AllocPacketBuffer(frame_size);
+  if (!buf) {
+    sock.rx_drops++;
+    return;
+  }
+  memcpy(buf->data, frame, frame_size);
+  sock.rx_queue.Push(buf);
+  // Readiness is tracked on enqueue so that epoll_wait() does not need to
+  // scan all the sockets in the interest list.
+  for (auto ep : sock.watchers) {
+    auto it = ep->interests.find(sock.fd);
+    assert(it != ep->interests.end());
+    EPoll::Interest& interest = it->second;
+    if (!(interest.events & kEPollIn) || interest.is_in_ready_list) {
+      continue;
+    }
+    interest.is_in_ready_list = true;
+    ep->ready_list.push_back(sock.fd);
+  }
+}
+
+bool Network::RegisterSocket(uint64_t pid, int fd, Socket::Type type) {
+  // returns true on failure
+  if (FindSocket(pid, fd) || FindEPoll(pid, fd)) {
+    return true;
+  }
+  Socket* sock = liumos->kernel_heap_allocator->Alloc<Socket>();
+  bzero(sock, sizeof(Socket));
+  new (sock) Socket();
+  sock->pid = pid;
+  sock->fd = fd;
+  sock->listen_port = 12345; /* TODO: use random port */
+  sock->type = type;
+  sockets_.push_back(sock);
+  if (type == Socket::Type::kUDP &&
+      udp_sockets_.find(sock->listen_port) == udp_sockets_.end()) {
+    udp_sockets_.insert({sock->listen_port, sock});
+  }
+  return false;
+}
+
+bool Network::BindToPort(uint64_t pid, int fd, uint16_t port) {
+  // returns true on failure
+  Socket* sock = FindSocket(pid, fd);
+  if (!sock) {
+    return true;
+  }
+  if (sock->type == Socket::Type::kUDP) {
+    if (DNSResolver::IsUpstreamPort(port)) {
+      kprintf("%s: port %d is reserved by the kernel\n", __func__, port);
+      return true;
+    }
+    auto it = udp_sockets_.find(port);
+    if (it != udp_sockets_.end() && it->second != sock) {
+      kprintf("%s: port %d is already in use\n", __func__, port);
+      return true;
+    }
+    auto prev = udp_sockets_.find(sock->listen_port);
+    if (prev != udp_sockets_.end() && prev->second == sock) {
+      udp_sockets_.erase(prev);
+    }
+    udp_sockets_.insert({port, sock});
+  }
+  sock->listen_port = port;
+  return false;
+}
+
+Network::Socket* Network::FindSocket(uint64_t pid, int fd) {
+  for (auto sock : sockets_) {
+    if (sock->pid == pid && sock->fd == fd) {
+      return sock;
+    }
+  }
+  return nullptr;
+}
+
+bool Network::CloseSocket(uint64_t pid, int fd) {
+  // returns true on failure
+  for (auto it = sockets_.begin(); it != sockets_.end(); it++) {
+    Socket* sock = *it;
+    if (sock->pid != pid || sock->fd != fd) {
+      continue;
+    }
+    while (!sock->watchers.empty()) {
+      RemoveFromEPoll(*sock->watchers.back(), *sock);
+    }
+    auto port = udp_sockets_.find(sock->listen_port);
+    if (port != udp_sockets_.end() && port->second == sock) {
+      udp_sockets_.erase(port);
+    }
+    while (!sock->rx_queue.IsEmpty()) {
+      FreePacketBuffer(sock->rx_queue.Pop());
+    }
+    sockets_.erase(it);
+    // The memory of sock itself stays since the kernel heap can not free it.
+    sock->~Socket();
+    return false;
+  }
+  return true;
+}
+
+Network::EPoll* Network::CreateEPoll(uint64_t pid, int fd) {
+  if (FindSocket(pid, fd) || FindEPoll(pid, fd)) {
+    return nullptr;
+  }
+  EPoll* ep = liumos->kernel_heap_allocator->Alloc<EPoll>();
+  bzero(ep, sizeof(EPoll));
+  new (ep) EPoll();
+  ep->pid = pid;
+  ep->fd = fd;
+  epolls_.push_back(ep);
+  return ep;
+}
+
+Network::EPoll* Network::FindEPoll(uint64_t pid, int fd) {
+  for (auto ep : epolls_) {
+    if (ep->pid == pid && ep->fd == fd) {
+      return ep;
+    }
+  }
+  return nullptr;
+}
+
+bool Network::CloseEPoll(uint64_t pid, int fd) {
+  // returns true on failure
+  for (auto it = epolls_.begin(); it != epolls_.end(); it++) {
+    EPoll* ep = *it;
+    if (ep->pid != pid || ep->fd != fd) {
+      continue;
+    }
+    for (auto& interest : ep->interests) {
+      std::vector<EPoll*>& watchers = interest.second.sock->watchers;
+      for (auto w = watchers.begin(); w != watchers.end(); w++) {
+        if (*w == ep) {
+          watchers.erase(w);
+          break;
+        }
+      }
+    }
+    epolls_.erase(it);
+    ep->~EPoll();
+    return false;
+  }
+  return true;
+}
+
+bool Network::AddToEPoll(EPoll& ep,
+                         Socket& sock,
+                         uint32_t events,
+                         uint64_t data) {
+  // returns true on failure
+  if (ep.interests.find(sock.fd) != ep.interests.end()) {
+    return true;
+  }
+  ep.interests.insert({sock.fd, {&sock, events, data, false}});
+  sock.watchers.push_back(&ep);
+  return ModifyEPoll(ep, sock, events, data);
+}
+
+bool Network::ModifyEPoll(EPoll& ep,
+                          Socket& sock,
+                          uint32_t events,
+                          uint64_t data) {
+  // returns true on failure
+  auto it = ep.interests.find(sock.fd);
+  if (it == ep.interests.end()) {
+    return true;
+  }
+  EPoll::Interest& interest = it->second;
+  interest.events = events;
+  interest.data = data;
+  // Frames queued before this call are reported as well.
+  if ((events & kEPollIn) && sock.IsReadable() &&
+      !interest.is_in_ready_list) {
+    interest.is_in_ready_list = true;
+    ep.ready_list.push_back(sock.fd);
+  }
+  return false;
+}
+
+bool Network::RemoveFromEPoll(EPoll& ep, Socket& sock) {
+  // returns true on failure
+  if (ep.interests.erase(sock.fd) == 0) {
+    return true;
+  }
+  for (auto it = sock.watchers.begin(); it != sock.watchers.end(); it++) {
+    if (*it == &ep) {
+      sock.watchers.erase(it);
+      break;
+    }
+  }
+  // Stale entries in ep.ready_list are skipped in CollectEPollEvents().
+  return false;
+}
+
+int Network::CollectEPollEvents(EPoll& ep,
+                                EPollEvent* events,
+                                int max_events) {
+  int num_of_events = 0;
+  // Each entry is visited at most once so that level-triggered sockets put
+  // back to the list are not reported twice.
+  size_t num_of_candidates = ep.ready_list.size();
+  while (num_of_candidates-- && num_of_events < max_events) {
+    int fd = ep.ready_list.front();
+    ep.ready_list.pop_front();
+    auto it = ep.interests.find(fd);
+    if (it == ep.interests.end()) {
+      continue;
+    }
+    EPoll::Interest& interest = it->second;
+    if (!(interest.events & kEPollIn) || !interest.sock->IsReadable()) {
+      interest.is_in_ready_list = false;
+      continue;
+    }
+    events[num_of_events].events = kEPollIn;
+    events[num_of_events].data = interest.data;
+    num_of_events++;
+    if (interest.events & kEPollET) {
+      interest.is_in_ready_list = false;
+      continue;
+    }
+    ep.ready_list.push_back(fd);
+  }
+  return num_of_events;
+}
+
+void Network::StartDHCPClient(NetDevice& dev) {
+  if (dev.IsLoopback()) {
+    return;
+  }
+  const EtherAddr mac = dev.GetSelfEtherAddr();
+  const uint32_t xid = static_cast<uint32_t>(ReadTSC()) ^
+                       *reinterpret_cast<const uint32_t*>(&mac.mac[2]);
+  DHCPClient& client = dhcp_clients_[&dev];
+  ApplyDHCPAction(dev, client, client.Start(mac, xid, GetNowMs()));
+}
+
+const Network::DHCPClient* Network::GetDHCPClient(NetDevice& dev) {
+  auto it = dhcp_clients_.find(&dev);
+  if (it == dhcp_clients_.end()) {
+    return nullptr;
+  }
+  return &it->second;
+}
+
+void Network::ProcessDHCPTimers() {
+  const uint64_t now_ms = GetNowMs();
+  for (auto& it : dhcp_clients_) {
+    ApplyDHCPAction(*it.first, it.second, it.second.HandleTimer(now_ms));
+  }
+}
+
+void Network::HandleDHCPMessage(NetDevice& dev,
+                                uint8_t* frame,
+                                size_t frame_size) {
+  auto it = dhcp_clients_.find(&dev);
+  if (it == dhcp_clients_.end()) {
+    return;
+  }
+  ApplyDHCPAction(dev, it->second,
+                  it->second.HandleMessage(frame, frame_size, GetNowMs()));
+}
+
+void Network::ApplyDHCPAction(NetDevice& dev,
+                              DHCPClient& client,
+                              DHCPClient::Action action) {
+  if (action.unconfigure) {
+    client.lease.addr.Print();
+    kprintf(": DHCP lease lost on %s\n", dev.GetName());
+    dev.SetSelfIPv4Addr(kWildcardIPv4Addr);
+  }
+  if (action.configure) {
+    const DHCPClient::Lease& lease = client.lease;
+    lease.addr.Print();
+    kprintf(" is assigned by DHCP (lease %u s)\n", lease.lease_time_s);
+    dev.SetSelfIPv4Addr(lease.addr);
+    if (&dev == primary_net_device_) {
+      lease.netmask.Print();
+      kprintf(" is netmask\n");
+      SetIPv4NetMask(lease.netmask);
+      if (!lease.router.IsEqualTo(kWildcardIPv4Addr)) {
+        lease.router.Print();
+        kprintf(" is router\n");
+        SetIPv4DefaultGateway(lease.router);
+      }
+      if (!lease.dns_server.IsEqualTo(kWildcardIPv4Addr)) {
+        lease.dns_server.Print();
+        kprintf(" is DNS server\n");
+        GetDNSResolver().SetUpstreamServer(lease.dns_server);
+      }
+    }
+  }
+  if (!action.send) {
+    return;
+  }
+  uint8_t msg[DHCPClient::kMaxMessageSize];
+  const size_t size = client.BuildMessage(msg);
+  if (client.state == DHCPClient::State::kRenewing) {
+    // Unicast to the server. Fall back to broadcast until it is resolved.
+    Route route = LookupRoute(client.lease.server);
+    std::optional<EtherAddr> server_eth_addr =
+        route.dev == &dev ? ResolveIPv4(dev, route.next_hop) : std::nullopt;
+    reinterpret_cast<EtherFrame*>(msg)->dst =
+        server_eth_addr.value_or(kBroadcastEtherAddr);
+  }
+  uint8_t* buf = dev.GetNextTXPacketBuf<uint8_t*>(size);
+  memcpy(buf, msg, size);
+  dev.SendPacket();
+}
+
+namespace {
+
+class NetworkDNSTransport : public DNSResolver::Transport {
+ public:
+  void Send(Network::IPv4Addr src_addr,
+            uint16_t src_port,
+            Network::IPv4Addr dst_addr,
+            uint16_t dst_port,
+            const uint8_t* msg,
+            size_t size) override {
+    if (Network::GetInstance().SendUDPDatagram(src_addr, src_port, dst_addr,
+                                               dst_port, msg, size)) {
+      kprintf("DNS: failed to send a message\n");
+    }
+  }
+};
+
+}  // namespace
+
+DNSResolver& Network::GetDNSResolver() {
+  if (!dns_resolver_) {
+    dns_resolver_ = liumos->kernel_heap_allocator->Alloc<DNSResolver>();
+    bzero(dns_resolver_, sizeof(DNSResolver));
+    new (dns_resolver_) DNSResolver();
+    dns_resolver_->SetRandomSeed(ReadTSC());
+  }
+  return *dns_resolver_;
+}
+
+void Network::ProcessDNSTimers() {
+  if (!dns_resolver_) {
+    return;
+  }
+  NetworkDNSTransport transport;
+  dns_resolver_->ProcessTimers(transport, GetNowMs());
+}
+
+bool Network::HandleDNSMessage(NetDevice& dev,
+                               uint8_t* frame,
+                               size_t frame_size) {
+  // returns true if the frame is consumed
+  IPv4UDPPacket& p = *reinterpret_cast<IPv4UDPPacket*>(frame);
+  const size_t udp_size =
+      static_cast<size_t>(p.length[0]) << 8 | p.length[1];
+  if (udp_size < 8 ||
+      offsetof(IPv4UDPPacket, src_port) + udp_size > frame_size) {
+    return false;
+  }
+  const uint8_t* msg = frame + sizeof(IPv4UDPPacket);
+  const size_t msg_size = udp_size - 8;
+  const uint16_t dst_port = p.GetDestinationPort();
+  // The stub serves only this host. Queries to kStubAddr from outside are
+  // dropped instead of making this host an open resolver.
+  if (dst_port == DNSResolver::kPort &&
+      p.ip.dst_ip.IsEqualTo(DNSResolver::kStubAddr)) {
+    if (!dev.IsLoopback()) {
+      return true;
+    }
+    NetworkDNSTransport transport;
+    GetDNSResolver().HandleQuery(transport, p.ip.src_ip, p.GetSourcePort(),
+                                 msg, msg_size, GetNowMs());
+    return true;
+  }
+  if (DNSResolver::IsUpstreamPort(dst_port) && dns_resolver_ &&
+      p.GetSourcePort() == DNSResolver::kPort &&
+      p.ip.src_ip.IsEqualTo(dns_resolver_->GetUpstreamServer())) {
+    NetworkDNSTransport transport;
+    dns_resolver_->HandleResponse(transport, dst_port, msg, msg_size,
+                                  GetNowMs());
+    return true;
+  }
+  return false;
+}
+
+bool Network::SendUDPDatagram(IPv4Addr src_addr,
+                              uint16_t src_port,
+                              IPv4Addr dst_addr,
+                              uint16_t dst_port,
+                              const uint8_t* data,
+                              size_t size) {
+  // returns true on failure
+  Route route = LookupRoute(dst_addr);
+  if (!route.dev) {
+    return true;
+  }
+  NetDevice& dev = *route.dev;
+  // Padded to even as SetDataSize does.
+  const size_t frame_size = sizeof(IPv4UDPPacket) + ((size + 1) & ~1ULL);
+  if (frame_size > sizeof(EtherFrame) + kEtherMTU) {
+    return true;
+  }
+  std::optional<EtherAddr> nexthop_eth_addr =
+      dev.IsLoopback() ? dev.GetSelfEtherAddr()
+                       : ResolveIPv4(dev, route.next_hop);
+  PacketContainer frame;
+  bzero(frame.data, frame_size);
+  frame.size = frame_size;
+  IPv4UDPPacket& udp = *reinterpret_cast<IPv4UDPPacket*>(frame.data);
+  if (nexthop_eth_addr.has_value()) {
+    udp.ip.eth.dst = *nexthop_eth_addr;
+  }
+  udp.ip.eth.src = dev.GetSelfEtherAddr();
+  udp.ip.eth.SetEthType(EtherFrame::kTypeIPv4);
+  udp.ip.version_and_ihl =
+      0x45;  // IPv4, header len = 5 * sizeof(uint32_t) = 20 bytes
+  udp.ip.SetDataLength(
+      static_cast<uint16_t>(frame_size - sizeof(IPv4Packet)));
+  udp.ip.ident = GetNextIPv4Ident();
+  udp.ip.ttl = 0xFF;
+  udp.ip.protocol = IPv4Packet::Protocol::kUDP;
+  udp.ip.src_ip = src_addr.IsEqualTo(kWildcardIPv4Addr)
+                      ? dev.GetSelfIPv4Addr()
+                      : src_addr;
+  udp.ip.dst_ip = dst_addr;
+  udp.ip.CalcAndSetChecksum();
+  memcpy(frame.data + sizeof(IPv4UDPPacket), data, size);
+  udp.SetSourcePort(src_port);
+  udp.SetDestinationPort(dst_port);
+  udp.SetDataSize(static_cast<uint16_t>(size));
+  udp.csum = CalcUDPChecksum(&udp, offsetof(IPv4UDPPacket, src_port),
+                             frame_size, udp.ip.src_ip, udp.ip.dst_ip,
+                             udp.length);
+  if (!nexthop_eth_addr.has_value()) {
+    return !EnqueuePendingFrame(route.next_hop, frame.data, frame.size);
+  }
+  uint8_t* buf = dev.GetNextTXPacketBuf<uint8_t*>(
+      frame_size, CalcFlowHash(udp.ip.src_ip, dst_addr,
+                               IPv4Packet::Protocol::kUDP, src_port,
+                               dst_port));
+  memcpy(buf, frame.data, frame_size);
+  dev.SendPacket();
+  return false;
+}
+
 void NetworkManager() {
-  auto& virtio_net = Virtio::Net::GetInstance();
+  auto& network = Network::GetInstance();
   while (true) {
     ClearIntFlag();
-    virtio_net.PollRXQueue();
+    for (auto dev : network.GetNetDevices()) {
+      dev->PollRX();
+    }
+    network.ProcessNeighborTimers();
+    network.ProcessIPv4ReassemblyTimers();
+    network.ProcessDHCPTimers();
+    network.ProcessDNSTimers();
     StoreIntFlag();
     Sleep();
   }
 }
 
-void SendARPRequest(Network::IPv4Addr ip_addr) {
-  using Net = Virtio::Net;
-  using ARPPacket = Virtio::Net::ARPPacket;
-  Net& virtio_net = Net::GetInstance();
-  ARPPacket& arp =
-      *virtio_net.GetNextTXPacketBuf<ARPPacket*>(sizeof(ARPPacket));
-  arp.SetupRequest(ip_addr, virtio_net.GetSelfIPv4Addr(),
-                   virtio_net.GetSelfEtherAddr());
+void SendARPRequest(NetDevice& dev, Network::IPv4Addr ip_addr) {
+  using ARPPacket = Network::ARPPacket;
+  if (dev.IsLoopback()) {
+    return;
+  }
+  ARPPacket& arp = *dev.GetNextTXPacketBuf<ARPPacket*>(sizeof(ARPPacket));
+  arp.SetupRequest(ip_addr, dev.GetSelfIPv4Addr(), dev.GetSelfEtherAddr());
   // send
-  virtio_net.SendPacket();
+  dev.SendPacket();
+}
+
+void SendARPRequest(Network::IPv4Addr ip_addr) {
+  Network::Route route = Network::GetInstance().LookupRoute(ip_addr);
+  if (!route.dev) {
+    PutString("No route to the host\n");
+    return;
+  }
+  SendARPRequest(*route.dev, ip_addr);
 }
 
 void SendARPRequest(const char* ip_addr_str) {
@@ -65,13 +1073,3 @@ void SendARPRequest(const char* ip_addr_str) {
   }
   SendARPRequest(*ip_addr);
 }
-
-void SendDHCPRequest() {
-  using DHCPPacket = Network::DHCPPacket;
-  auto& virtio_net = Virtio::Net::GetInstance();
-  // Send DHCP
-  DHCPPacket& request =
-      *virtio_net.GetNextTXPacketBuf<DHCPPacket*>(sizeof(DHCPPacket));
-  request.SetupRequest(virtio_net.GetSelfEtherAddr());
-  virtio_net.SendPacket();
-}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <deque>
 #include <optional>
 #include <unordered_map>
 #include <vector>
@@ -9,6 +10,9 @@
 
 #include "string_buffer.h"
 
+class DNSResolver;
+class NetDevice;
+
 class Network {
  public:
   //
@@ -48,7 +52,7 @@ class Network {
       eth_type[0] = etype[0];
       eth_type[1] = etype[1];
     }
-    bool HasEthType(const uint8_t(&etype)[2]) {
+    bool HasEthType(const uint8_t(&etype)[2]) const {
       return eth_type[0] == etype[0] && eth_type[1] == etype[1];
     }
   };
@@ -69,6 +73,11 @@ class Network {
              *reinterpret_cast<const uint16_t*>(to.csum);
     }
     static InternetChecksum Calc(void* buf, size_t start, size_t end) {
+      return FromSum(
+          SumWords(reinterpret_cast<uint8_t*>(buf) + start, end - start));
+    }
+    static InternetChecksum CalcScalar(void* buf, size_t start, size_t end) {
+      // Reference implementation: one 16-bit word per iteration.
       // https://tools.ietf.org/html/rfc1071
       uint8_t* p = reinterpret_cast<uint8_t*>(buf);
       uint32_t sum = 0;
@@ -82,6 +91,56 @@ class Network {
       return {static_cast<uint8_t>((sum >> 8) & 0xFF),
               static_cast<uint8_t>(sum & 0xFF)};
     }
+    // Adds the bytes in [p, p + size) to the partial one's complement sum.
+    // Words are loaded in native (little endian) order; since the one's
+    // complement sum commutes with byte swapping, FromSum swaps the result
+    // back to network byte order only once at the end (RFC1071 2.(B)).
+    // An odd trailing byte is padded with zero.
+    static uint64_t SumWords(const uint8_t* p, size_t size, uint64_t sum = 0) {
+      // 4 independent 64-bit accumulators with end-around carry
+      uint64_t acc[4] = {sum, 0, 0, 0};
+      while (size >= 32) {
+        for (int i = 0; i < 4; i++) {
+          const uint64_t v = reinterpret_cast<const uint64_t*>(p)[i];
+          acc[i] += v;
+          acc[i] += (acc[i] < v);
+        }
+        p += 32;
+        size -= 32;
+      }
+      while (size >= 8) {
+        const uint64_t v = *reinterpret_cast<const uint64_t*>(p);
+        acc[0] += v;
+        acc[0] += (acc[0] < v);
+        p += 8;
+        size -= 8;
+      }
+      uint64_t tail = 0;
+      for (size_t i = 0; i < size; i++) {
+        tail |= static_cast<uint64_t>(p[i]) << (8 * i);
+      }
+      acc[1] += tail;
+      acc[1] += (acc[1] < tail);
+      for (int i = 1; i < 4; i++) {
+        acc[0] += acc[i];
+        acc[0] += (acc[0] < acc[i]);
+      }
+      return acc[0];
+    }
+    // Folds the partial sum from SumWords into 16 bits in network byte order
+    // without complementing it.
+    static uint16_t FoldSum(uint64_t sum) {
+      sum = (sum & 0xFFFF'FFFF) + (sum >> 32);
+      sum = (sum & 0xFFFF'FFFF) + (sum >> 32);
+      sum = (sum & 0xFFFF) + (sum >> 16);
+      sum = (sum & 0xFFFF) + (sum >> 16);
+      return static_cast<uint16_t>(((sum & 0xFF) << 8) | ((sum >> 8) & 0xFF));
+    }
+    static InternetChecksum FromSum(uint64_t sum) {
+      const uint16_t folded = ~FoldSum(sum);
+      return {static_cast<uint8_t>(folded >> 8),
+              static_cast<uint8_t>(folded & 0xFF)};
+    }
   };
 
   //
@@ -175,7 +234,35 @@ class Network {
       csum = InternetChecksum::Calc(this, offsetof(IPv4Packet, version_and_ihl),
                                     sizeof(IPv4Packet));
     }
+    uint16_t GetTotalLength() const {
+      return static_cast<uint16_t>(length[0] << 8 | length[1]);
+    }
+    size_t GetHeaderSize() const { return (version_and_ihl & 0xF) * 4; }
+
+    // Fragmentation (RFC 791)
+    static constexpr uint16_t kFlagDontFragment = 0x4000;
+    static constexpr uint16_t kFlagMoreFragments = 0x2000;
+    static constexpr uint16_t kFragmentOffsetMask = 0x1FFF;
+    uint16_t GetFlagsAndFragmentOffset() const {
+      const uint8_t* v = reinterpret_cast<const uint8_t*>(&flags);
+      return static_cast<uint16_t>(v[0] << 8 | v[1]);
+    }
+    void SetFlagsAndFragmentOffset(uint16_t value) {
+      uint8_t* v = reinterpret_cast<uint8_t*>(&flags);
+      v[0] = value >> 8;
+      v[1] = value & 0xFF;
+    }
+    bool IsFragment() const {
+      return GetFlagsAndFragmentOffset() &
+             (kFlagMoreFragments | kFragmentOffsetMask);
+    }
+    // in bytes, from the beginning of the data of the original datagram
+    size_t GetFragmentOffset() const {
+      return (GetFlagsAndFragmentOffset() & kFragmentOffsetMask) * 8;
+    }
   };
+  // Ethernet header + the largest IPv4 datagram
+  static constexpr size_t kMaxIPv4FrameSize = sizeof(EtherFrame) + 0xFFFF;
 
   void SetIPv4DefaultGateway(IPv4Addr gateway) { gateway_ = gateway; }
   IPv4Addr GetIPv4DefaultGateway() { return gateway_; }
@@ -298,14 +385,14 @@ class Network {
       src_port[0] = port >> 8;
       src_port[1] = port & 0xFF;
     }
-    uint16_t GetSourcePort() {
+    uint16_t GetSourcePort() const {
       return static_cast<uint16_t>(src_port[0]) << 8 | src_port[1];
     }
     void SetDestinationPort(uint16_t port) {
       dst_port[0] = port >> 8;
       dst_port[1] = port & 0xFF;
     }
-    uint16_t GetDestinationPort() {
+    uint16_t GetDestinationPort() const {
       return static_cast<uint16_t>(dst_port[0]) << 8 | dst_port[1];
     }
     void SetDataSize(uint16_t size) {
@@ -315,6 +402,57 @@ class Network {
       length[1] = size & 0xFF;
     }
   };
+  // Hash of the (src, dst, protocol, src_port, dst_port) tuple. Used to pick
+  // a queue pair so that packets of the same flow stay in order.
+  static uint32_t CalcFlowHash(IPv4Addr src,
+                               IPv4Addr dst,
+                               IPv4Packet::Protocol protocol,
+                               uint16_t src_port,
+                               uint16_t dst_port) {
+    uint64_t h =
+        static_cast<uint64_t>(*reinterpret_cast<const uint32_t*>(src.addr))
+            << 32 |
+        *reinterpret_cast<const uint32_t*>(dst.addr);
+    h ^= (static_cast<uint64_t>(src_port) << 24 |
+          static_cast<uint64_t>(dst_port) << 8 |
+          static_cast<uint64_t>(protocol)) *
+         0x9E37'79B9'7F4A'7C15ULL;
+    // MurmurHash3 fmix64
+    h ^= h >> 33;
+    h *= 0xFF51'AFD7'ED55'8CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CE'B3FE'1A85'EC53ULL;
+    h ^= h >> 33;
+    return static_cast<uint32_t>(h);
+  }
+  static uint32_t CalcFlowHashOfFrame(uint8_t* frame, size_t frame_size) {
+    if (frame_size < sizeof(IPv4Packet)) {
+      return 0;
+    }
+    IPv4Packet& ip = *reinterpret_cast<IPv4Packet*>(frame);
+    if (!ip.eth.HasEthType(EtherFrame::kTypeIPv4)) {
+      return 0;
+    }
+    if (ip.protocol != IPv4Packet::Protocol::kUDP ||
+        frame_size < sizeof(IPv4UDPPacket)) {
+      return CalcFlowHash(ip.src_ip, ip.dst_ip, ip.protocol, 0, 0);
+    }
+    IPv4UDPPacket& udp = *reinterpret_cast<IPv4UDPPacket*>(frame);
+    return CalcFlowHash(ip.src_ip, ip.dst_ip, ip.protocol,
+                        udp.GetSourcePort(), udp.GetDestinationPort());
+  }
+  static uint64_t SumUDPPseudoHeader(Network::IPv4Addr src_addr,
+                                     Network::IPv4Addr dst_addr,
+                                     uint8_t (&udp_length)[2]) {
+    // https://tools.ietf.org/html/rfc768
+    // Summed in the same (little endian) lane as InternetChecksum::SumWords.
+    uint64_t sum = 0;
+    sum += *reinterpret_cast<const uint32_t*>(src_addr.addr);
+    sum += *reinterpret_cast<const uint32_t*>(dst_addr.addr);
+    sum += *reinterpret_cast<const uint16_t*>(udp_length);
+    sum += static_cast<uint64_t>(IPv4Packet::Protocol::kUDP) << 8;
+    return sum;
+  }
   static InternetChecksum CalcUDPChecksum(void* buf,
                                           size_t start,
                                           size_t end,
@@ -322,24 +460,109 @@ class Network {
                                           Network::IPv4Addr dst_addr,
                                           uint8_t (&udp_length)[2]) {
     // https://tools.ietf.org/html/rfc1071
-    uint8_t* p = reinterpret_cast<uint8_t*>(buf);
-    uint32_t sum = 0;
-    // Pseudo-header
-    sum += (static_cast<uint16_t>(src_addr.addr[0]) << 8) | src_addr.addr[1];
-    sum += (static_cast<uint16_t>(src_addr.addr[2]) << 8) | src_addr.addr[3];
-    sum += (static_cast<uint16_t>(dst_addr.addr[0]) << 8) | dst_addr.addr[1];
-    sum += (static_cast<uint16_t>(dst_addr.addr[2]) << 8) | dst_addr.addr[3];
-    sum += (static_cast<uint16_t>(udp_length[0]) << 8) | udp_length[1];
-    sum += 17;  // Protocol: UDP
-    for (size_t i = start; i < end; i += 2) {
-      sum += (static_cast<uint16_t>(p[i + 0])) << 8 | p[i + 1];
-    }
-    while (sum >> 16) {
-      sum = (sum & 0xffff) + (sum >> 16);
-    }
-    sum = ~sum;
-    return {static_cast<uint8_t>((sum >> 8) & 0xFF),
-            static_cast<uint8_t>(sum & 0xFF)};
+    return InternetChecksum::FromSum(InternetChecksum::SumWords(
+        reinterpret_cast<uint8_t*>(buf) + start, end - start,
+        SumUDPPseudoHeader(src_addr, dst_addr, udp_length)));
+  }
+  static InternetChecksum CalcUDPPseudoHeaderChecksum(
+      Network::IPv4Addr src_addr,
+      Network::IPv4Addr dst_addr,
+      uint8_t (&udp_length)[2]) {
+    // Not complemented: this is what the device expects in the checksum field
+    // when the checksum calculation is offloaded (virtio: 5.1.6.2).
+    const uint16_t folded = InternetChecksum::FoldSum(
+        SumUDPPseudoHeader(src_addr, dst_addr, udp_length));
+    return {static_cast<uint8_t>(folded >> 8),
+            static_cast<uint8_t>(folded & 0xFF)};
+  }
+  // Returns false if frame is an IPv4 UDP packet with a wrong checksum.
+  static bool IsUDPChecksumValid(uint8_t* frame, size_t frame_size) {
+    if (frame_size < sizeof(IPv4UDPPacket)) {
+      return true;
+    }
+    IPv4UDPPacket& p = *reinterpret_cast<IPv4UDPPacket*>(frame);
+    if (!p.ip.eth.HasEthType(EtherFrame::kTypeIPv4) ||
+        p.ip.protocol != IPv4Packet::Protocol::kUDP) {
+      return true;
+    }
+    if (p.ip.IsFragment()) {
+      // Verified after the reassembly
+      return true;
+    }
+    if (p.csum.csum[0] == 0 && p.csum.csum[1] == 0) {
+      // Checksum is not used by the sender
+      return true;
+    }
+    const size_t udp_length =
+        static_cast<size_t>(p.length[0]) << 8 | p.length[1];
+    const size_t udp_end = offsetof(IPv4UDPPacket, src_port) + udp_length;
+    if (udp_end > frame_size) {
+      return false;
+    }
+    // Summing the received checksum in gives zero (0xFFFF before complement)
+    // for a valid packet.
+    InternetChecksum result =
+        CalcUDPChecksum(frame, offsetof(IPv4UDPPacket, src_port), udp_end,
+                        p.ip.src_ip, p.ip.dst_ip, p.length);
+    return result.csum[0] == 0 && result.csum[1] == 0;
+  }
+
+  //
+  // RX classification
+  //
+  // A received frame is parsed once here and dispatched by ProcessRXFrame()
+  // on the result. Kept in the header so that the host-side replay harness
+  // (network_replay_test.cc) runs the same code as the kernel.
+  struct RXFrameInfo {
+    enum class Kind {
+      kUnknown,  // Not handled by this stack, or truncated
+      kARPRequest,
+      kARPReply,
+      kIPv4Fragment,  // To be reassembled, then classified again
+      kICMP,
+      kUDP,
+      kIPv4Other,
+    } kind;
+    uint16_t dst_port;  // valid for kUDP
+  };
+  static RXFrameInfo ClassifyRXFrame(uint8_t* frame, size_t frame_size) {
+    using Kind = RXFrameInfo::Kind;
+    if (frame_size < sizeof(EtherFrame)) {
+      return {Kind::kUnknown, 0};
+    }
+    EtherFrame& eth = *reinterpret_cast<EtherFrame*>(frame);
+    if (eth.HasEthType(EtherFrame::kTypeARP)) {
+      if (frame_size < sizeof(ARPPacket)) {
+        return {Kind::kUnknown, 0};
+      }
+      switch (reinterpret_cast<ARPPacket*>(frame)->GetOperation()) {
+        case ARPPacket::Operation::kRequest:
+          return {Kind::kARPRequest, 0};
+        case ARPPacket::Operation::kReply:
+          return {Kind::kARPReply, 0};
+        default:
+          return {Kind::kUnknown, 0};
+      }
+    }
+    if (!eth.HasEthType(EtherFrame::kTypeIPv4) ||
+        frame_size < sizeof(IPv4Packet)) {
+      return {Kind::kUnknown, 0};
+    }
+    IPv4Packet& ip = *reinterpret_cast<IPv4Packet*>(frame);
+    if (ip.IsFragment()) {
+      return {Kind::kIPv4Fragment, 0};
+    }
+    if (ip.protocol == IPv4Packet::Protocol::kICMP) {
+      return {Kind::kICMP, 0};
+    }
+    if (ip.protocol == IPv4Packet::Protocol::kUDP) {
+      if (frame_size < sizeof(IPv4UDPPacket)) {
+        return {Kind::kUnknown, 0};
+      }
+      return {Kind::kUDP,
+              reinterpret_cast<IPv4UDPPacket*>(frame)->GetDestinationPort()};
+    }
+    return {Kind::kIPv4Other, 0};
   }
 
   //
@@ -422,45 +645,563 @@ class Network {
   };
   static_assert(offsetof(DHCPPacket, cookie) == 278);
 
-  //
-  // ARP Table
-  //
-  using ARPTable = std::unordered_map<IPv4Addr, EtherAddr, IPv4AddrHash>;
-  const ARPTable& GetARPTable() { return arp_table_; }
-  void RegisterARPResolution(IPv4Addr ip_addr, EtherAddr eth_addr) {
-    arp_table_[ip_addr] = eth_addr;
-  }
-  std::optional<EtherAddr> ResolveIPv4(IPv4Addr ip_addr) {
-    if (arp_table_.find(ip_addr) == arp_table_.end())
-      return std::nullopt;
-    return arp_table_[ip_addr];
-  }
+  // DHCP client of a device (RFC2131 4.4). This is only a state machine:
+  // the caller passes the current time, sends the message built by
+  // BuildMessage() and applies the lease to the device as Action says.
+  // Driven by Network::ProcessDHCPTimers() and received DHCP messages.
+  struct DHCPClient {
+    enum class State {
+      kStopped,
+      kSelecting,   // DISCOVER sent, waiting for OFFER
+      kRequesting,  // REQUEST sent, waiting for ACK
+      kBound,
+      kRenewing,   // T1 passed. REQUEST is sent to the server.
+      kRebinding,  // T2 passed. REQUEST is broadcast.
+    };
+    // RFC2132 9.6
+    enum class MessageType : uint8_t {
+      kNone = 0,
+      kDiscover = 1,
+      kOffer = 2,
+      kRequest = 3,
+      kAck = 5,
+      kNak = 6,
+    };
+    // RFC2132
+    static constexpr uint8_t kOptionPad = 0;
+    static constexpr uint8_t kOptionSubnetMask = 1;
+    static constexpr uint8_t kOptionRouter = 3;
+    static constexpr uint8_t kOptionDNSServer = 6;
+    static constexpr uint8_t kOptionRequestedIPAddr = 50;
+    static constexpr uint8_t kOptionLeaseTime = 51;
+    static constexpr uint8_t kOptionMessageType = 53;
+    static constexpr uint8_t kOptionServerIdentifier = 54;
+    static constexpr uint8_t kOptionParameterRequestList = 55;
+    static constexpr uint8_t kOptionRenewalTime = 58;
+    static constexpr uint8_t kOptionRebindingTime = 59;
+    static constexpr uint8_t kOptionEnd = 255;
+    struct Lease {
+      IPv4Addr addr;
+      IPv4Addr server;
+      IPv4Addr router;      // kWildcardIPv4Addr if not given
+      IPv4Addr dns_server;  // kWildcardIPv4Addr if not given
+      IPv4NetMask netmask;
+      uint32_t lease_time_s;
+      uint32_t t1_s;
+      uint32_t t2_s;
+    };
+    struct Action {
+      bool send;         // Send the message built by BuildMessage().
+      bool configure;    // Apply the lease to the device.
+      bool unconfigure;  // The lease is lost. Clear the address.
+    };
+    // Retransmission of DISCOVER and REQUEST in kRequesting is doubled up to
+    // kMaxRetryIntervalMs (RFC2131 4.1). The first interval is shorter than
+    // the 4 seconds of the RFC to get the address soon after boot.
+    static constexpr uint64_t kInitialRetryIntervalMs = 1000;
+    static constexpr uint64_t kMaxRetryIntervalMs = 64 * 1000;
+    // Gives up the offer and starts over with DISCOVER after this.
+    static constexpr int kMaxRequests = 4;
+    // RFC2131 4.4.5
+    static constexpr uint64_t kMinRenewRetryIntervalMs = 60 * 1000;
+    static constexpr uint32_t kInfiniteLeaseTime = 0xFFFF'FFFF;
+    // BOOTP messages are at least 300 bytes (RFC1542 2.1), which is 64 bytes
+    // of cookie and options.
+    static constexpr size_t kMinOptionsSize = 60;
+    static constexpr size_t kMaxMessageSize = sizeof(DHCPPacket) + 64;
+
+    State state;
+    EtherAddr mac;
+    uint32_t xid;
+    uint64_t next_timer_ms;  // Time to retransmit or to change the state
+    uint64_t retry_interval_ms;
+    int num_of_requests;
+    IPv4Addr offered_addr;
+    IPv4Addr offered_server;
+    Lease lease;
+    uint64_t bound_at_ms;
+    bool has_lease;  // Still valid in kRenewing and kRebinding
+
+    Action Start(EtherAddr mac_addr, uint32_t new_xid, uint64_t now_ms) {
+      Action action = {};
+      action.unconfigure = has_lease;
+      mac = mac_addr;
+      xid = new_xid;
+      has_lease = false;
+      EnterSelecting(now_ms);
+      action.send = true;
+      return action;
+    }
+    Action HandleTimer(uint64_t now_ms) {
+      Action action = {};
+      if (state == State::kStopped || now_ms < next_timer_ms) {
+        return action;
+      }
+      switch (state) {
+        case State::kSelecting:
+          ScheduleRetransmission(now_ms);
+          action.send = true;
+          break;
+        case State::kRequesting:
+          if (num_of_requests >= kMaxRequests) {
+            EnterSelecting(now_ms);
+          } else {
+            num_of_requests++;
+            ScheduleRetransmission(now_ms);
+          }
+          action.send = true;
+          break;
+        case State::kBound:
+          state = State::kRenewing;
+          action.send = ScheduleRenewal(now_ms);
+          break;
+        case State::kRenewing:
+        case State::kRebinding:
+          if (now_ms >= bound_at_ms + lease.lease_time_s * 1000ULL) {
+            // The lease expired.
+            action.unconfigure = true;
+            has_lease = false;
+            xid++;
+            EnterSelecting(now_ms);
+            action.send = true;
+            break;
+          }
+          if (state == State::kRenewing &&
+              now_ms >= bound_at_ms + lease.t2_s * 1000ULL) {
+            state = State::kRebinding;
+          }
+          action.send = ScheduleRenewal(now_ms);
+          break;
+        default:
+          break;
+      }
+      return action;
+    }
+    // frame_size is the size of the frame from the Ethernet header.
+    Action HandleMessage(const uint8_t* frame,
+                         size_t frame_size,
+                         uint64_t now_ms) {
+      Action action = {};
+      if (state == State::kStopped || state == State::kBound ||
+          frame_size < sizeof(DHCPPacket)) {
+        return action;
+      }
+      const DHCPPacket& p = *reinterpret_cast<const DHCPPacket*>(frame);
+      if (p.op != 2 || p.xid != xid || !p.chaddr.IsEqualTo(mac) ||
+          p.cookie[0] != 99 || p.cookie[1] != 130 || p.cookie[2] != 83 ||
+          p.cookie[3] != 99) {
+        return action;
+      }
+      Lease offer = {};
+      offer.addr = p.yiaddr;
+      MessageType type = ParseOptions(frame, frame_size, offer);
+      if (type == MessageType::kOffer && state == State::kSelecting) {
+        offered_addr = offer.addr;
+        offered_server = offer.server;
+        state = State::kRequesting;
+        num_of_requests = 1;
+        retry_interval_ms = kInitialRetryIntervalMs;
+        next_timer_ms = now_ms + retry_interval_ms;
+        action.send = true;
+        return action;
+      }
+      if (state == State::kSelecting) {
+        return action;
+      }
+      if (type == MessageType::kNak) {
+        action.unconfigure = has_lease;
+        has_lease = false;
+        xid++;
+        EnterSelecting(now_ms);
+        action.send = true;
+        return action;
+      }
+      if (type != MessageType::kAck || !offer.lease_time_s) {
+        return action;
+      }
+      if (state != State::kRequesting) {
+        // The server of the lease may not be included in renewals.
+        if (offer.server.IsEqualTo(kWildcardIPv4Addr)) {
+          offer.server = lease.server;
+        }
+      }
+      if (!offer.t1_s || offer.t1_s >= offer.lease_time_s) {
+        offer.t1_s = offer.lease_time_s / 2;
+      }
+      if (!offer.t2_s || offer.t2_s >= offer.lease_time_s ||
+          offer.t2_s < offer.t1_s) {
+        offer.t2_s = static_cast<uint32_t>(offer.lease_time_s * 7ULL / 8);
+      }
+      lease = offer;
+      has_lease = true;
+      state = State::kBound;
+      bound_at_ms = now_ms;
+      next_timer_ms = lease.lease_time_s == kInfiniteLeaseTime
+                          ? ~0ULL
+                          : now_ms + lease.t1_s * 1000ULL;
+      action.configure = true;
+      return action;
+    }
+    // Builds the message to be sent in the current state into buf of
+    // kMaxMessageSize bytes and returns its size. eth.dst is broadcast, and
+    // should be replaced by the caller in kRenewing.
+    size_t BuildMessage(uint8_t* buf) const {
+      DHCPPacket& p = *reinterpret_cast<DHCPPacket*>(buf);
+      p.SetupRequest(mac);
+      p.xid = xid;
+      if (state == State::kRenewing || state == State::kRebinding) {
+        p.ciaddr = lease.addr;
+        p.udp.ip.src_ip = lease.addr;
+      }
+      if (state == State::kRenewing) {
+        p.udp.ip.dst_ip = lease.server;
+      }
+      uint8_t* opt = buf + sizeof(DHCPPacket);
+      size_t i = 0;
+      auto put_option = [&](uint8_t code, const void* data, uint8_t len) {
+        opt[i++] = code;
+        opt[i++] = len;
+        for (int k = 0; k < len; k++) {
+          opt[i++] = reinterpret_cast<const uint8_t*>(data)[k];
+        }
+      };
+      const MessageType type = state == State::kSelecting
+                                   ? MessageType::kDiscover
+                                   : MessageType::kRequest;
+      put_option(kOptionMessageType, &type, 1);
+      if (state == State::kRequesting) {
+        put_option(kOptionRequestedIPAddr, offered_addr.addr, 4);
+        put_option(kOptionServerIdentifier, offered_server.addr, 4);
+      }
+      constexpr uint8_t kParameters[] = {
+          kOptionSubnetMask,  kOptionRouter,      kOptionDNSServer,
+          kOptionLeaseTime,   kOptionRenewalTime, kOptionRebindingTime};
+      put_option(kOptionParameterRequestList, kParameters,
+                 sizeof(kParameters));
+      opt[i++] = kOptionEnd;
+      while (i < kMinOptionsSize || (i & 1)) {
+        opt[i++] = kOptionPad;
+      }
+      const size_t size = sizeof(DHCPPacket) + i;
+      p.udp.ip.SetDataLength(
+          static_cast<uint16_t>(size - sizeof(IPv4Packet)));
+      p.udp.ip.CalcAndSetChecksum();
+      p.udp.SetDataSize(static_cast<uint16_t>(size - sizeof(IPv4UDPPacket)));
+      p.udp.csum.Clear();
+      p.udp.csum = CalcUDPChecksum(buf, offsetof(DHCPPacket, udp.src_port),
+                                   size, p.udp.ip.src_ip, p.udp.ip.dst_ip,
+                                   p.udp.length);
+      return size;
+    }
+    // Fills the fields of lease given by options and returns the message
+    // type.
+    static MessageType ParseOptions(const uint8_t* frame,
+                                    size_t frame_size,
+                                    Lease& lease) {
+      MessageType type = MessageType::kNone;
+      auto read32 = [](const uint8_t* v) {
+        return static_cast<uint32_t>(v[0]) << 24 |
+               static_cast<uint32_t>(v[1]) << 16 |
+               static_cast<uint32_t>(v[2]) << 8 | v[3];
+      };
+      size_t i = sizeof(DHCPPacket);
+      while (i < frame_size) {
+        const uint8_t code = frame[i];
+        if (code == kOptionEnd) {
+          break;
+        }
+        if (code == kOptionPad) {
+          i++;
+          continue;
+        }
+        if (i + 2 > frame_size || i + 2 + frame[i + 1] > frame_size) {
+          break;
+        }
+        const uint8_t len = frame[i + 1];
+        const uint8_t* v = &frame[i + 2];
+        if (code == kOptionMessageType && len == 1) {
+          type = static_cast<MessageType>(v[0]);
+        } else if (code == kOptionSubnetMask && len == 4) {
+          lease.netmask = *reinterpret_cast<const IPv4NetMask*>(v);
+        } else if (code == kOptionRouter && len >= 4) {
+          lease.router = *reinterpret_cast<const IPv4Addr*>(v);
+        } else if (code == kOptionDNSServer && len >= 4) {
+          lease.dns_server = *reinterpret_cast<const IPv4Addr*>(v);
+        } else if (code == kOptionServerIdentifier && len == 4) {
+          lease.server = *reinterpret_cast<const IPv4Addr*>(v);
+        } else if (code == kOptionLeaseTime && len == 4) {
+          lease.lease_time_s = read32(v);
+        } else if (code == kOptionRenewalTime && len == 4) {
+          lease.t1_s = read32(v);
+        } else if (code == kOptionRebindingTime && len == 4) {
+          lease.t2_s = read32(v);
+        }
+        i += 2 + len;
+      }
+      return type;
+    }
+
+   private:
+    void EnterSelecting(uint64_t now_ms) {
+      state = State::kSelecting;
+      num_of_requests = 0;
+      retry_interval_ms = kInitialRetryIntervalMs;
+      next_timer_ms = now_ms + retry_interval_ms;
+    }
+    void ScheduleRetransmission(uint64_t now_ms) {
+      retry_interval_ms = retry_interval_ms * 2 > kMaxRetryIntervalMs
+                              ? kMaxRetryIntervalMs
+                              : retry_interval_ms * 2;
+      next_timer_ms = now_ms + retry_interval_ms;
+    }
+    // In kRenewing and kRebinding, waits one-half of the remaining time
+    // until T2 (or the expiry) before retransmission (RFC2131 4.4.5).
+    // Returns true to send a REQUEST now.
+    bool ScheduleRenewal(uint64_t now_ms) {
+      const uint64_t deadline =
+          bound_at_ms + (state == State::kRenewing ? lease.t2_s
+                                                    : lease.lease_time_s) *
+                            1000ULL;
+      uint64_t wait_ms = now_ms < deadline ? (deadline - now_ms) / 2 : 0;
+      if (wait_ms < kMinRenewRetryIntervalMs) {
+        wait_ms = kMinRenewRetryIntervalMs;
+      }
+      next_timer_ms = now_ms + wait_ms;
+      if (next_timer_ms > deadline) {
+        next_timer_ms = deadline;
+      }
+      return true;
+    }
+  };
+
+  // Payload size of an Ethernet frame (without Ethernet header)
+  static constexpr size_t kEtherMTU = 1500;
+  // Identification field for a new IPv4 datagram (RFC791)
+  uint16_t GetNextIPv4Ident() { return next_ipv4_ident_++; }
 
   //
-  // RX buffer
+  // Packet container
   //
   static constexpr int kPacketContainerSize = 2048;
-  static constexpr int kRXBufferSize = 32;
   packed_struct PacketContainer {
     size_t size;
     uint8_t data[kPacketContainerSize];
   };
-  void PushToRXBuffer(const void* data, size_t begin, size_t end) {
-    assert(begin < end);
-    PacketContainer buf;
-    buf.size = end - begin;
-    assert(buf.size <= kPacketContainerSize);
-    memcpy(buf.data, reinterpret_cast<const uint8_t*>(data) + begin, buf.size);
-    rx_buffer_.Push(buf);
+
+  //
+  // Packet buffer
+  //
+  // Holds a received frame or a reassembled IPv4 datagram until a socket
+  // reads it. Freed buffers are kept in free lists and reused.
+  struct PacketBuffer {
+    PacketBuffer* next;  // in a free list
+    size_t capacity;     // of data
+    size_t size;
+    uint8_t* data;
+  };
+  // Buffers for datagrams larger than a page are limited to this number.
+  static constexpr int kMaxLargePacketBuffers = 32;
+  // @network.cc
+  // Returns nullptr if size is too large or no buffers are left.
+  PacketBuffer* AllocPacketBuffer(size_t size);
+  void FreePacketBuffer(PacketBuffer* buf);
+
+  //
+  // IPv4 reassembly (RFC 791, RFC 815)
+  //
+  static constexpr int kMaxIPv4Reassemblies = 8;
+  static constexpr uint64_t kIPv4ReassemblyTimeoutMs = 30 * 1000;
+  struct IPv4Reassembly {
+    enum class Result {
+      kAccepted,
+      kDuplicate,  // all the bytes have been received already
+      kOverlap,    // partially overlaps with received bytes
+      kInvalid,
+    };
+    static constexpr size_t kBlockSize = 8;
+    static constexpr size_t kMaxDataSize = 0xFFFF - 20;
+    static constexpr size_t kNumOfBlocks = 0x10000 / kBlockSize;
+
+    bool in_use;
+    IPv4Addr src_ip;
+    IPv4Addr dst_ip;
+    uint16_t ident;
+    IPv4Packet::Protocol protocol;
+    uint64_t started_at_ms;
+    // Headers followed by the data of the original datagram
+    PacketBuffer* buf;
+    // Size of the data of the datagram. 0 until the last fragment arrives.
+    size_t data_size;
+    size_t received_size;
+    uint64_t received_blocks[kNumOfBlocks / 64];
+
+    // Marks [offset, offset + size) of the data as received. The caller
+    // copies the data only if kAccepted is returned. Since fragment offsets
+    // are multiples of kBlockSize, only the last fragment can end in the
+    // middle of a block.
+    Result AddFragment(size_t offset, size_t size, bool is_last) {
+      if (offset % kBlockSize || offset + size > kMaxDataSize ||
+          (!is_last && (size == 0 || size % kBlockSize)) ||
+          (data_size && (offset + size > data_size ||
+                         (is_last && offset + size != data_size)))) {
+        return Result::kInvalid;
+      }
+      const size_t first = offset / kBlockSize;
+      const size_t end = (offset + size + kBlockSize - 1) / kBlockSize;
+      size_t num_of_received = 0;
+      for (size_t i = first; i < end; i++) {
+        num_of_received += IsBlockReceived(i);
+      }
+      if (num_of_received == end - first) {
+        return Result::kDuplicate;
+      }
+      if (num_of_received) {
+        return Result::kOverlap;
+      }
+      if (is_last) {
+        // Fragments beyond the end may have been received.
+        for (size_t i = end; i < kNumOfBlocks; i++) {
+          if (IsBlockReceived(i)) {
+            return Result::kInvalid;
+          }
+        }
+        data_size = offset + size;
+      }
+      for (size_t i = first; i < end; i++) {
+        received_blocks[i / 64] |= 1ULL << (i % 64);
+      }
+      received_size += size;
+      return Result::kAccepted;
+    }
+    bool IsComplete() const { return data_size && received_size == data_size; }
+    bool IsBlockReceived(size_t i) const {
+      return (received_blocks[i / 64] >> (i % 64)) & 1;
+    }
+  };
+  struct IPv4ReassemblyStats {
+    uint64_t reassembled;
+    uint64_t timeouts;
+    uint64_t overlaps;
+    uint64_t drops;
+  };
+  // @network.cc
+  // Takes a fragment. Returns the reassembled datagram when all the
+  // fragments have arrived, otherwise nullptr. The caller frees it.
+  PacketBuffer* ReassembleIPv4(uint8_t* frame, size_t frame_size);
+  // Drops incomplete datagrams after kIPv4ReassemblyTimeoutMs.
+  void ProcessIPv4ReassemblyTimers();
+  const IPv4ReassemblyStats& GetIPv4ReassemblyStats() {
+    return ipv4_reassembly_stats_;
   }
-  PacketContainer PopFromRXBuffer() { return rx_buffer_.Pop(); }
-  bool HasPacketInRXBuffer() { return !rx_buffer_.IsEmpty(); }
+  // Sends an IPv4 datagram built in datagram, splitting it into fragments
+  // which fit in kEtherMTU. The checksums of upper layers should be filled
+  // already. If dst_eth_addr is not resolved yet, the whole datagram is held
+  // until the ARP reply for next_hop arrives, and fragmented then. Returns
+  // false on failure.
+  bool SendIPv4Fragments(NetDevice& dev,
+                         IPv4Addr next_hop,
+                         std::optional<EtherAddr> dst_eth_addr,
+                         uint8_t* datagram,
+                         size_t datagram_size,
+                         uint32_t flow_hash);
+  // A buffer of kMaxIPv4FrameSize to build a datagram to be fragmented.
+  uint8_t* GetIPv4FragmentationBuf();
+
+  //
+  // ARP Table (Neighbor cache)
+  //
+  struct Neighbor {
+    enum class State {
+      kIncomplete,  // ARP request sent, waiting for reply
+      kReachable,   // Resolved recently
+      kStale,       // Resolved, but needs to be confirmed before next use
+      kPermanent,   // Addresses of this host. Never expires.
+    } state;
+    EtherAddr eth_addr;
+    uint64_t updated_at_ms;       // last time the state was changed
+    uint64_t last_request_at_ms;  // last time an ARP request was sent
+    int num_of_requests;
+    NetDevice* dev;  // device to send ARP requests and pending frames on
+    // Outgoing frames held until the resolution completes. Frames larger
+    // than kEtherMTU are IPv4 datagrams to be fragmented on transmission.
+    std::vector<PacketBuffer*> pending_frames;
+  };
+  // Retry ARP request every kARPRetryIntervalMs, up to kMaxARPRequests times.
+  static constexpr uint64_t kARPRetryIntervalMs = 200;
+  static constexpr int kMaxARPRequests = 5;
+  static constexpr uint64_t kNeighborReachableTimeMs = 30 * 1000;
+  static constexpr uint64_t kNeighborStaleTimeMs = 60 * 1000;
+  static constexpr size_t kMaxPendingFramesPerNeighbor = 4;
+  using ARPTable = std::unordered_map<IPv4Addr, Neighbor, IPv4AddrHash>;
+  const ARPTable& GetARPTable() { return arp_table_; }
+  // @network.cc
+  void RegisterARPResolution(IPv4Addr ip_addr, EtherAddr eth_addr);
+  void RegisterPermanentARPResolution(IPv4Addr ip_addr, EtherAddr eth_addr);
+  // Returns the EtherAddr of ip_addr without blocking. If it is not resolved
+  // yet, an ARP request is sent on dev in background and std::nullopt is
+  // returned.
+  std::optional<EtherAddr> ResolveIPv4(NetDevice& dev, IPv4Addr ip_addr);
+  // Holds a frame to ip_addr until its EtherAddr is resolved. eth.dst of the
+  // frame will be filled on transmission. A frame larger than kEtherMTU is
+  // fragmented then, so it takes only one of kMaxPendingFramesPerNeighbor.
+  // Returns false if the frame is dropped.
+  bool EnqueuePendingFrame(IPv4Addr ip_addr, const void* frame, size_t size);
+  // Retries ARP requests and ages the entries. Called periodically.
+  void ProcessNeighborTimers();
+
+  //
+  // Devices and routing
+  //
+  struct Route {
+    NetDevice* dev;  // nullptr if there is no route
+    IPv4Addr next_hop;
+  };
+  // @network.cc
+  void RegisterNetDevice(NetDevice& dev);
+  const std::vector<NetDevice*>& GetNetDevices() { return net_devices_; }
+  // The first non-loopback device. gateway_ and netmask_ are for it.
+  NetDevice* GetPrimaryNetDevice() { return primary_net_device_; }
+  Route LookupRoute(IPv4Addr dst_ip_addr);
+  // Handles ARP, ICMP echo and DHCP, then queues the frame for sockets.
+  void ProcessRXFrame(NetDevice& dev, uint8_t* frame, size_t frame_size);
+
+  //
+  // DHCP client
+  //
+  // @network.cc
+  // (Re)starts acquiring an address for dev. The address of dev, and the
+  // netmask and the gateway if dev is the primary device, are configured
+  // when a lease is acquired.
+  void StartDHCPClient(NetDevice& dev);
+  // returns nullptr if not started
+  const DHCPClient* GetDHCPClient(NetDevice& dev);
+  // Retransmits messages and renews leases. Called periodically.
+  void ProcessDHCPTimers();
+
+  //
+  // DNS stub resolver (dns.h)
+  //
+  // @network.cc
+  DNSResolver& GetDNSResolver();
+  void ProcessDNSTimers();
+  // Sends a UDP datagram which fits in a frame from the kernel. src_addr
+  // may be kWildcardIPv4Addr for the address of the device. Returns true
+  // on failure.
+  bool SendUDPDatagram(IPv4Addr src_addr,
+                       uint16_t src_port,
+                       IPv4Addr dst_addr,
+                       uint16_t dst_port,
+                       const uint8_t* data,
+                       size_t size);
 
   static Network& GetInstance();
 
   //
   // sockets
   //
+  // Large enough to be drained in one recvmmsg() call of 64 messages.
+  static constexpr int kSocketRXQueueSize = 64;
+  struct EPoll;
   struct Socket {
     uint64_t pid;
     int fd;
@@ -470,49 +1211,106 @@ class Network {
       kICMPDatagram,
       kUDP,
     } type;
+    // Frames received for this socket. Frames are dropped while it is full.
+    RingBuffer<PacketBuffer*, kSocketRXQueueSize> rx_queue;
+    uint64_t rx_drops;
+    // epoll instances which have this socket in their interest list
+    std::vector<EPoll*> watchers;
+    //
+    bool IsReadable() { return !rx_queue.IsEmpty(); }
   };
+  // @network.cc
+  // returns true on failure
+  bool RegisterSocket(uint64_t pid, int fd, Socket::Type type);
+  bool BindToPort(uint64_t pid, int fd, uint16_t port);
+  // returns nullptr if not found
+  Socket* FindSocket(uint64_t pid, int fd);
+  // Unregisters the socket, removes it from epoll instances and frees the
+  // frames queued to it. Returns true if not found.
+  bool CloseSocket(uint64_t pid, int fd);
 
-  bool RegisterSocket(uint64_t pid, int fd, Socket::Type type) {
-    // returns true on failure
-    if (FindSocket(pid, fd).has_value()) {
-      return true;
-    }
-    sockets_.push_back({pid, fd, 12345 /* TODO: use random port */, type});
-    return false;
-  }
-  bool BindToPort(uint64_t pid, int fd, uint16_t port) {
-    // returns true on failure
-    for (auto& it : sockets_) {
-      if (it.pid == pid && it.fd == fd) {
-        it.listen_port = port;
-        return false;
-      }
-    }
-    return true;
-  }
-  std::optional<Socket> FindSocket(uint64_t pid, int fd) {
-    for (auto& it : sockets_) {
-      if (it.pid == pid && it.fd == fd) {
-        return it;
-      }
-    }
-    return std::nullopt;
-  }
+  //
+  // epoll
+  //
+  // Event flags are the same as Linux.
+  static constexpr uint32_t kEPollIn = 0x001;
+  static constexpr uint32_t kEPollET = 1U << 31;
+  packed_struct EPollEvent {
+    uint32_t events;
+    uint64_t data;
+  };
+  struct EPoll {
+    struct Interest {
+      Socket* sock;
+      uint32_t events;
+      uint64_t data;
+      bool is_in_ready_list;
+    };
+    uint64_t pid;
+    int fd;
+    std::unordered_map<int, Interest> interests;  // key: fd of the socket
+    // fds of sockets which may be readable. A socket is added here when a
+    // frame is queued to it, and checked again in CollectEPollEvents().
+    std::deque<int> ready_list;
+  };
+  // @network.cc
+  // returns nullptr on failure
+  EPoll* CreateEPoll(uint64_t pid, int fd);
+  // returns nullptr if not found
+  EPoll* FindEPoll(uint64_t pid, int fd);
+  // Unregisters the epoll instance and removes it from the watchers of its
+  // sockets. Returns true if not found.
+  bool CloseEPoll(uint64_t pid, int fd);
+  // returns true on failure
+  bool AddToEPoll(EPoll& ep, Socket& sock, uint32_t events, uint64_t data);
+  bool ModifyEPoll(EPoll& ep, Socket& sock, uint32_t events, uint64_t data);
+  bool RemoveFromEPoll(EPoll& ep, Socket& sock);
+  // Fills events with up to max_events ready sockets and returns the number
+  // of them. Level-triggered sockets stay in the ready list while they have
+  // frames, edge-triggered ones are reported once per arrival.
+  int CollectEPollEvents(EPoll& ep, EPollEvent* events, int max_events);
 
  private:
   static Network* network_;
 
   ARPTable arp_table_;
-  // +1ACD0
-  RingBuffer<PacketContainer, kRXBufferSize> rx_buffer_;  // (2048 + 8) * 32
-  std::vector<Socket> sockets_;
+  std::vector<Socket*> sockets_;
+  std::unordered_map<uint16_t, Socket*> udp_sockets_;  // key: listen_port
+  std::vector<EPoll*> epolls_;
+  std::unordered_map<NetDevice*, DHCPClient> dhcp_clients_;
+  DNSResolver* dns_resolver_;
+  PacketBuffer* free_packet_buffers_;
+  PacketBuffer* free_large_packet_buffers_;
+  int num_of_large_packet_buffers_;
+  IPv4Reassembly ipv4_reassemblies_[kMaxIPv4Reassemblies];
+  IPv4ReassemblyStats ipv4_reassembly_stats_;
+  uint8_t* ipv4_fragmentation_buf_;
   IPv4Addr gateway_;
   IPv4NetMask netmask_;
+  uint16_t next_ipv4_ident_;
+  std::vector<NetDevice*> net_devices_;
+  NetDevice* primary_net_device_;
+  NetDevice* loopback_net_device_;
 
   Network(){};
+  void HandleRXFrame(NetDevice& dev,
+                     const RXFrameInfo& info,
+                     uint8_t* frame,
+                     size_t frame_size);
+  void DeliverFrameToSockets(const RXFrameInfo& info,
+                             uint8_t* frame,
+                             size_t frame_size);
+  void QueueFrameToSocket(Socket& sock, uint8_t* frame, size_t frame_size);
+  void FreePendingFrames(Neighbor& n);
+  void HandleDHCPMessage(NetDevice& dev, uint8_t* frame, size_t frame_size);
+  // Returns true if the frame is for the DNS resolver.
+  bool HandleDNSMessage(NetDevice& dev, uint8_t* frame, size_t frame_size);
+  void ApplyDHCPAction(NetDevice& dev,
+                       DHCPClient& client,
+                       DHCPClient::Action action);
 };
 
 void NetworkManager();
+void SendARPRequest(NetDevice&, Network::IPv4Addr);
 void SendARPRequest(Network::IPv4Addr);
 void SendARPRequest(const char*);
-void SendDHCPRequest();
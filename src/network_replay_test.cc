@@ -0,0 +1,370 @@
+#include "network.h"
+
+#ifdef LIUMOS_TEST
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cassert>
+#include <chrono>
+#include <vector>
+
+// Replays a traffic trace through the RX classification and demux path of
+// Network (ClassifyRXFrame, IsUDPChecksumValid, ARP handling) on the host,
+// and reports ns/packet for each stage.
+//   $ make test_network_replay            # synthetic trace
+//   $ ./network_replay_test.bin dump.pcap # trace taken with `capture dump`
+
+using Frame = std::vector<uint8_t>;
+using Kind = Network::RXFrameInfo::Kind;
+
+static constexpr Network::EtherAddr kSelfMAC = {0x52, 0x54, 0x00,
+                                                0x12, 0x34, 0x56};
+static constexpr Network::EtherAddr kPeerMAC = {0x52, 0x54, 0x00,
+                                                0xAB, 0xCD, 0xEF};
+static constexpr Network::IPv4Addr kSelfIP = {10, 0, 2, 15};
+static constexpr Network::IPv4Addr kPeerIP = {10, 0, 2, 2};
+
+// Stands in for a NetDevice: keeps the frames "sent" by the handlers.
+struct FakeNetDevice {
+  std::vector<Frame> tx_frames;
+  uint8_t* GetNextTXPacketBuf(size_t size) {
+    tx_frames.emplace_back(size);
+    return tx_frames.back().data();
+  }
+};
+
+// Mirrors Network::HandleRXFrame() and DeliverFrameToSockets() without the
+// kernel parts (sockets are represented by counters).
+struct ReplayStack {
+  FakeNetDevice dev;
+  std::unordered_map<uint16_t, uint64_t> udp_sockets;  // port -> delivered
+  std::unordered_map<Network::IPv4Addr, Network::EtherAddr,
+                     Network::IPv4AddrHash>
+      arp_table;
+  uint64_t count[static_cast<int>(Kind::kIPv4Other) + 1];
+  uint64_t checksum_drops;
+  uint64_t udp_no_socket;
+
+  ReplayStack() : count(), checksum_drops(0), udp_no_socket(0) {}
+  void HandleARP(Network::ARPPacket& arp) {
+    using ARPPacket = Network::ARPPacket;
+    arp_table[arp.sender_proto_addr] = arp.sender_eth_addr;
+    if (arp.GetOperation() != ARPPacket::Operation::kRequest ||
+        !arp.target_proto_addr.IsEqualTo(kSelfIP)) {
+      return;
+    }
+    ARPPacket& reply = *reinterpret_cast<ARPPacket*>(
+        dev.GetNextTXPacketBuf(sizeof(ARPPacket)));
+    reply.SetupReply(arp.sender_proto_addr, kSelfIP, arp.sender_eth_addr,
+                     kSelfMAC);
+  }
+  void ProcessRXFrame(uint8_t* frame, size_t frame_size) {
+    if (!Network::IsUDPChecksumValid(frame, frame_size)) {
+      checksum_drops++;
+      return;
+    }
+    Network::RXFrameInfo info = Network::ClassifyRXFrame(frame, frame_size);
+    count[static_cast<int>(info.kind)]++;
+    switch (info.kind) {
+      case Kind::kARPRequest:
+      case Kind::kARPReply:
+        HandleARP(*reinterpret_cast<Network::ARPPacket*>(frame));
+        return;
+      case Kind::kUDP: {
+        auto it = udp_sockets.find(info.dst_port);
+        if (it == udp_sockets.end()) {
+          udp_no_socket++;
+          return;
+        }
+        it->second++;
+        return;
+      }
+      default:
+        return;
+    }
+  }
+};
+
+//
+// Synthetic trace
+//
+static void SetupIPv4(Network::IPv4Packet& ip,
+                      Network::IPv4Packet::Protocol protocol,
+                      uint16_t data_size) {
+  ip.eth.dst = kSelfMAC;
+  ip.eth.src = kPeerMAC;
+  ip.eth.SetEthType(Network::EtherFrame::kTypeIPv4);
+  ip.version_and_ihl = 0x45;
+  ip.ttl = 64;
+  ip.protocol = protocol;
+  ip.src_ip = kPeerIP;
+  ip.dst_ip = kSelfIP;
+  ip.SetDataLength(data_size);
+  ip.CalcAndSetChecksum();
+}
+
+static Frame MakeARP(bool is_request, Network::IPv4Addr target_ip) {
+  using ARPPacket = Network::ARPPacket;
+  Frame f(sizeof(ARPPacket));
+  ARPPacket& arp = *reinterpret_cast<ARPPacket*>(f.data());
+  if (is_request) {
+    arp.SetupRequest(target_ip, kPeerIP, kPeerMAC);
+  } else {
+    arp.SetupReply(target_ip, kPeerIP, kSelfMAC, kPeerMAC);
+  }
+  return f;
+}
+
+static Frame MakeICMPEcho(uint16_t seq) {
+  using ICMPPacket = Network::ICMPPacket;
+  constexpr size_t kPayloadSize = 56;
+  Frame f(sizeof(ICMPPacket) + kPayloadSize);
+  ICMPPacket& icmp = *reinterpret_cast<ICMPPacket*>(f.data());
+  SetupIPv4(icmp.ip, Network::IPv4Packet::Protocol::kICMP,
+            static_cast<uint16_t>(f.size() - sizeof(Network::IPv4Packet)));
+  icmp.type = ICMPPacket::Type::kEchoRequest;
+  icmp.sequence = seq;
+  icmp.csum = Network::InternetChecksum::Calc(
+      f.data(), offsetof(ICMPPacket, type), f.size());
+  return f;
+}
+
+static Frame MakeUDP(uint16_t dst_port,
+                     size_t payload_size,
+                     bool corrupt_checksum) {
+  using IPv4UDPPacket = Network::IPv4UDPPacket;
+  Frame f(sizeof(IPv4UDPPacket) + payload_size);
+  IPv4UDPPacket& udp = *reinterpret_cast<IPv4UDPPacket*>(f.data());
+  for (size_t i = sizeof(IPv4UDPPacket); i < f.size(); i++) {
+    f[i] = static_cast<uint8_t>(i * 13 + dst_port);
+  }
+  SetupIPv4(udp.ip, Network::IPv4Packet::Protocol::kUDP,
+            static_cast<uint16_t>(f.size() - sizeof(Network::IPv4Packet)));
+  udp.SetSourcePort(40000);
+  udp.SetDestinationPort(dst_port);
+  udp.SetDataSize(static_cast<uint16_t>(payload_size));
+  udp.csum.Clear();
+  udp.csum = Network::CalcUDPChecksum(
+      f.data(), offsetof(IPv4UDPPacket, src_port), f.size(), udp.ip.src_ip,
+      udp.ip.dst_ip, udp.length);
+  if (corrupt_checksum) {
+    f.back() ^= 0x5A;
+  }
+  return f;
+}
+
+// Not the last fragment of a datagram
+static Frame MakeUDPFragment(uint16_t offset_in_8bytes) {
+  Frame f = MakeUDP(9, 64, false);
+  Network::IPv4Packet& ip = *reinterpret_cast<Network::IPv4Packet*>(f.data());
+  ip.SetFlagsAndFragmentOffset(static_cast<uint16_t>(
+      offset_in_8bytes | Network::IPv4Packet::kFlagMoreFragments));
+  ip.CalcAndSetChecksum();
+  return f;
+}
+
+static constexpr uint16_t kBaseUDPPort = 10000;
+static constexpr int kNumOfBoundPorts = 16;
+
+struct SyntheticTrace {
+  std::vector<Frame> frames;
+  // Expected results
+  uint64_t arp_requests_to_self;
+  uint64_t count[static_cast<int>(Kind::kIPv4Other) + 1];
+  uint64_t checksum_drops;
+  uint64_t udp_no_socket;
+  uint64_t udp_per_port[kNumOfBoundPorts];
+};
+
+static void MakeSyntheticTrace(SyntheticTrace& t, int num_of_frames) {
+  t = {};
+  srand(0x4C69);
+  for (int i = 0; i < num_of_frames; i++) {
+    const int r = rand() % 100;
+    if (r < 5) {
+      const bool to_self = rand() & 1;
+      t.frames.push_back(MakeARP(true, to_self ? kSelfIP : kPeerIP));
+      t.count[static_cast<int>(Kind::kARPRequest)]++;
+      t.arp_requests_to_self += to_self;
+    } else if (r < 8) {
+      t.frames.push_back(MakeARP(false, kSelfIP));
+      t.count[static_cast<int>(Kind::kARPReply)]++;
+    } else if (r < 20) {
+      t.frames.push_back(MakeICMPEcho(static_cast<uint16_t>(i)));
+      t.count[static_cast<int>(Kind::kICMP)]++;
+    } else if (r < 22) {
+      t.frames.push_back(MakeUDPFragment(static_cast<uint16_t>(i & 7)));
+      t.count[static_cast<int>(Kind::kIPv4Fragment)]++;
+    } else if (r < 25) {
+      t.frames.push_back(MakeUDP(kBaseUDPPort, 32, true));
+      t.checksum_drops++;
+    } else {
+      // Ports beyond kNumOfBoundPorts have no socket.
+      const int port_idx = rand() % (kNumOfBoundPorts + 4);
+      const size_t payload_size = 16 + static_cast<size_t>(rand() % 1400 & ~1);
+      t.frames.push_back(MakeUDP(
+          static_cast<uint16_t>(kBaseUDPPort + port_idx), payload_size, false));
+      t.count[static_cast<int>(Kind::kUDP)]++;
+      if (port_idx < kNumOfBoundPorts) {
+        t.udp_per_port[port_idx]++;
+      } else {
+        t.udp_no_socket++;
+      }
+    }
+  }
+  // Truncated and foreign frames
+  t.frames.push_back(Frame(sizeof(Network::EtherFrame) - 1));
+  t.count[static_cast<int>(Kind::kUnknown)]++;
+  Frame tcp = MakeUDP(80, 32, false);
+  reinterpret_cast<Network::IPv4Packet*>(tcp.data())->protocol =
+      Network::IPv4Packet::Protocol::kTCP;
+  t.frames.push_back(tcp);
+  t.count[static_cast<int>(Kind::kIPv4Other)]++;
+}
+
+static void BindPorts(ReplayStack& stack) {
+  for (int i = 0; i < kNumOfBoundPorts; i++) {
+    stack.udp_sockets[static_cast<uint16_t>(kBaseUDPPort + i)] = 0;
+  }
+}
+
+static void TestSyntheticTrace(SyntheticTrace& t) {
+  ReplayStack stack;
+  BindPorts(stack);
+  for (auto& f : t.frames) {
+    stack.ProcessRXFrame(f.data(), f.size());
+  }
+  for (int k = 0; k <= static_cast<int>(Kind::kIPv4Other); k++) {
+    if (stack.count[k] != t.count[k]) {
+      printf("Kind %d: %llu != %llu\n", k,
+             static_cast<unsigned long long>(stack.count[k]),
+             static_cast<unsigned long long>(t.count[k]));
+      assert(false);
+    }
+  }
+  assert(stack.checksum_drops == t.checksum_drops);
+  assert(stack.udp_no_socket == t.udp_no_socket);
+  for (int i = 0; i < kNumOfBoundPorts; i++) {
+    assert(stack.udp_sockets[static_cast<uint16_t>(kBaseUDPPort + i)] ==
+           t.udp_per_port[i]);
+  }
+  // Each ARP request to us is answered with a reply to the requester.
+  assert(stack.dev.tx_frames.size() == t.arp_requests_to_self);
+  for (auto& f : stack.dev.tx_frames) {
+    Network::ARPPacket& reply =
+        *reinterpret_cast<Network::ARPPacket*>(f.data());
+    assert(reply.GetOperation() == Network::ARPPacket::Operation::kReply);
+    assert(reply.eth.dst.IsEqualTo(kPeerMAC));
+    assert(reply.sender_proto_addr.IsEqualTo(kSelfIP));
+  }
+  assert(stack.arp_table.count(kPeerIP) &&
+         stack.arp_table[kPeerIP].IsEqualTo(kPeerMAC));
+}
+
+//
+// pcap
+//
+static bool LoadPCAP(const char* path, std::vector<Frame>& frames) {
+  // https://wiki.wireshark.org/Development/LibpcapFileFormat
+  FILE* fp = fopen(path, "rb");
+  if (!fp) {
+    return false;
+  }
+  uint32_t global_header[6];
+  if (fread(global_header, sizeof(global_header), 1, fp) != 1 ||
+      global_header[0] != 0xA1B2C3D4 || global_header[5] != 1) {
+    // Only little endian captures of Ethernet are supported.
+    fclose(fp);
+    return false;
+  }
+  uint32_t record_header[4];
+  while (fread(record_header, sizeof(record_header), 1, fp) == 1) {
+    Frame f(record_header[2]);
+    if (fread(f.data(), 1, f.size(), fp) != f.size()) {
+      break;
+    }
+    frames.push_back(f);
+  }
+  fclose(fp);
+  return true;
+}
+
+//
+// Benchmark
+//
+template <typename F>
+static void Measure(const char* label,
+                    std::vector<Frame>& frames,
+                    int num_of_rounds,
+                    F f) {
+  uint64_t sink = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int round = 0; round < num_of_rounds; round++) {
+    for (auto& frame : frames) {
+      sink += f(frame.data(), frame.size());
+    }
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+  printf("%-12s: %7.2f ns/packet (sink=%llu)\n", label,
+         ns / (static_cast<double>(frames.size()) * num_of_rounds),
+         static_cast<unsigned long long>(sink));
+}
+
+static void BenchmarkReplay(std::vector<Frame>& frames, int num_of_rounds) {
+  Measure("classify", frames, num_of_rounds, [](uint8_t* frame, size_t size) {
+    return static_cast<uint64_t>(Network::ClassifyRXFrame(frame, size).kind);
+  });
+  Measure("udp checksum", frames, num_of_rounds,
+          [](uint8_t* frame, size_t size) {
+            return static_cast<uint64_t>(
+                Network::IsUDPChecksumValid(frame, size));
+          });
+  ReplayStack stack;
+  BindPorts(stack);
+  std::vector<Frame> arp_frames;
+  for (auto& f : frames) {
+    Kind kind = Network::ClassifyRXFrame(f.data(), f.size()).kind;
+    if (kind == Kind::kARPRequest || kind == Kind::kARPReply) {
+      arp_frames.push_back(f);
+    }
+  }
+  if (!arp_frames.empty()) {
+    Measure("arp", arp_frames, num_of_rounds,
+            [&stack](uint8_t* frame, size_t size) {
+              stack.ProcessRXFrame(frame, size);
+              stack.dev.tx_frames.clear();
+              return static_cast<uint64_t>(stack.arp_table.size());
+            });
+  }
+  Measure("rx path", frames, num_of_rounds,
+          [&stack](uint8_t* frame, size_t size) {
+            stack.ProcessRXFrame(frame, size);
+            stack.dev.tx_frames.clear();
+            return stack.checksum_drops;
+          });
+}
+
+int main(int argc, char** argv) {
+  if (argc >= 2) {
+    std::vector<Frame> frames;
+    if (!LoadPCAP(argv[1], frames)) {
+      printf("Failed to load %s\n", argv[1]);
+      return 1;
+    }
+    printf("%zu frames loaded from %s\n", frames.size(), argv[1]);
+    if (!frames.empty()) {
+      BenchmarkReplay(frames, 100);
+    }
+    return 0;
+  }
+  static SyntheticTrace trace;
+  MakeSyntheticTrace(trace, 4096);
+  TestSyntheticTrace(trace);
+  BenchmarkReplay(trace.frames, 50);
+  puts("PASS");
+  return 0;
+}
+
+#endif
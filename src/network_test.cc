@@ -3,10 +3,262 @@
 #ifdef LIUMOS_TEST
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <cassert>
+#include <chrono>
+#include <cstring>
+
+static void TestChecksumMatchesScalar() {
+  using InternetChecksum = Network::InternetChecksum;
+  constexpr size_t kBufSize = 2048;
+  // +1 for the byte which CalcScalar reads beyond an odd end
+  static uint8_t buf[kBufSize + 1];
+  srand(0x1234);
+  for (int trial = 0; trial < 64; trial++) {
+    for (size_t i = 0; i < kBufSize; i++) {
+      // Include runs of 0xFF to exercise carries.
+      buf[i] = (trial & 1) ? 0xFF : static_cast<uint8_t>(rand());
+    }
+    for (size_t start = 0; start < 8; start++) {
+      for (size_t end = start; end <= kBufSize; end += 1 + rand() % 61) {
+        uint8_t saved = buf[end];
+        buf[end] = 0;
+        InternetChecksum expected =
+            InternetChecksum::CalcScalar(buf, start, end);
+        InternetChecksum actual = InternetChecksum::Calc(buf, start, end);
+        buf[end] = saved;
+        if (!actual.IsEqualTo(expected)) {
+          printf("Checksum mismatch: start=%zu end=%zu %02X%02X != %02X%02X\n",
+                 start, end, actual.csum[0], actual.csum[1],
+                 expected.csum[0], expected.csum[1]);
+          assert(false);
+        }
+      }
+    }
+  }
+}
+
+static void BenchmarkChecksum() {
+  using InternetChecksum = Network::InternetChecksum;
+  constexpr size_t kBufSize = 1500;
+  constexpr int kNumOfIterations = 200000;
+  static uint8_t buf[kBufSize];
+  for (size_t i = 0; i < kBufSize; i++) {
+    buf[i] = static_cast<uint8_t>(i * 7);
+  }
+  auto measure = [&](const char* label, auto calc) {
+    uint16_t sink = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < kNumOfIterations; i++) {
+      buf[0] = static_cast<uint8_t>(i);
+      InternetChecksum csum = calc(buf, 0, kBufSize);
+      sink += csum.csum[0];
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    double sec = std::chrono::duration<double>(t1 - t0).count();
+    printf("%-8s: %6.2f GB/s (sink=%u)\n", label,
+           kBufSize * static_cast<double>(kNumOfIterations) / sec / 1e9, sink);
+  };
+  measure("scalar", InternetChecksum::CalcScalar);
+  measure("64-bit", InternetChecksum::Calc);
+}
+
+static void TestFlowHashSpreadsPorts() {
+  // Flows which differ only in the source port should be spread over the
+  // queue pairs fairly evenly, and the same flow must always map to the
+  // same queue pair.
+  constexpr int kNumOfQueuePairs = 4;
+  constexpr int kNumOfFlows = 4096;
+  Network::IPv4Addr src = {10, 10, 10, 18};
+  Network::IPv4Addr dst = {10, 10, 10, 90};
+  int count[kNumOfQueuePairs] = {};
+  for (int i = 0; i < kNumOfFlows; i++) {
+    uint16_t port = static_cast<uint16_t>(10000 + i);
+    uint32_t h = Network::CalcFlowHash(
+        src, dst, Network::IPv4Packet::Protocol::kUDP, port, 8080);
+    assert(h == Network::CalcFlowHash(
+                    src, dst, Network::IPv4Packet::Protocol::kUDP, port, 8080));
+    count[h % kNumOfQueuePairs]++;
+  }
+  for (int i = 0; i < kNumOfQueuePairs; i++) {
+    assert(count[i] > kNumOfFlows / kNumOfQueuePairs * 3 / 4);
+  }
+}
+
+static void TestIPv4ReassemblyBlocks() {
+  using IPv4Reassembly = Network::IPv4Reassembly;
+  using Result = IPv4Reassembly::Result;
+  static IPv4Reassembly r;
+  // Out of order arrival of 3 fragments: [0, 1480) [1480, 2960) [2960, 3000)
+  r = {};
+  assert(r.AddFragment(2960, 40, true) == Result::kAccepted);
+  assert(!r.IsComplete());
+  assert(r.AddFragment(0, 1480, false) == Result::kAccepted);
+  assert(r.AddFragment(0, 1480, false) == Result::kDuplicate);
+  assert(!r.IsComplete());
+  assert(r.AddFragment(1480, 1480, false) == Result::kAccepted);
+  assert(r.IsComplete());
+  assert(r.data_size == 3000);
+
+  // Partial overlaps are rejected.
+  r = {};
+  assert(r.AddFragment(0, 1480, false) == Result::kAccepted);
+  assert(r.AddFragment(1472, 16, false) == Result::kOverlap);
+
+  // Last fragment which does not end at the known end
+  r = {};
+  assert(r.AddFragment(8, 8, true) == Result::kAccepted);
+  assert(r.AddFragment(16, 8, false) == Result::kInvalid);
+  assert(r.AddFragment(0, 8, true) == Result::kInvalid);
+
+  // Data received beyond the last fragment
+  r = {};
+  assert(r.AddFragment(1480, 1480, false) == Result::kAccepted);
+  assert(r.AddFragment(0, 1000, true) == Result::kInvalid);
+
+  // Non-last fragments must be multiple of 8 bytes.
+  r = {};
+  assert(r.AddFragment(0, 1001, false) == Result::kInvalid);
+  assert(r.AddFragment(4, 8, false) == Result::kInvalid);
+
+  // The largest datagram
+  r = {};
+  for (size_t offset = 0; offset < IPv4Reassembly::kMaxDataSize;
+       offset += 1480) {
+    size_t size = IPv4Reassembly::kMaxDataSize - offset;
+    bool is_last = size <= 1480;
+    assert(r.AddFragment(offset, is_last ? size : 1480, is_last) ==
+           Result::kAccepted);
+  }
+  assert(r.IsComplete());
+  assert(r.AddFragment(IPv4Reassembly::kMaxDataSize, 8, true) ==
+         Result::kInvalid);
+}
+
+// Builds a reply of the server to the DHCP message in req.
+static size_t MakeDHCPReply(const uint8_t* req,
+                            uint8_t* buf,
+                            Network::DHCPClient::MessageType type,
+                            uint32_t lease_time_s) {
+  using DHCPClient = Network::DHCPClient;
+  using DHCPPacket = Network::DHCPPacket;
+  const DHCPPacket& q = *reinterpret_cast<const DHCPPacket*>(req);
+  DHCPPacket& p = *reinterpret_cast<DHCPPacket*>(buf);
+  p.SetupRequest(q.chaddr);
+  p.op = 2;
+  p.xid = q.xid;
+  p.yiaddr = {10, 0, 2, 15};
+  uint8_t* opt = buf + sizeof(DHCPPacket);
+  const uint8_t options[] = {
+      DHCPClient::kOptionMessageType, 1, static_cast<uint8_t>(type),
+      DHCPClient::kOptionServerIdentifier, 4, 10, 0, 2, 2,
+      DHCPClient::kOptionSubnetMask, 4, 255, 255, 255, 0,
+      DHCPClient::kOptionRouter, 4, 10, 0, 2, 2,
+      DHCPClient::kOptionLeaseTime, 4,
+      static_cast<uint8_t>(lease_time_s >> 24),
+      static_cast<uint8_t>(lease_time_s >> 16),
+      static_cast<uint8_t>(lease_time_s >> 8),
+      static_cast<uint8_t>(lease_time_s),
+      DHCPClient::kOptionEnd};
+  memcpy(opt, options, sizeof(options));
+  return sizeof(DHCPPacket) + sizeof(options);
+}
+
+static Network::DHCPClient::MessageType GetDHCPMessageType(
+    const uint8_t* msg,
+    size_t size) {
+  Network::DHCPClient::Lease lease = {};
+  return Network::DHCPClient::ParseOptions(msg, size, lease);
+}
+
+static void TestDHCPClient() {
+  using DHCPClient = Network::DHCPClient;
+  using MessageType = DHCPClient::MessageType;
+  using State = DHCPClient::State;
+  constexpr Network::EtherAddr kMAC = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
+  constexpr uint32_t kLeaseTime = 86400;
+  static DHCPClient c;
+  uint8_t msg[DHCPClient::kMaxMessageSize];
+  uint8_t reply[DHCPClient::kMaxMessageSize];
+  uint64_t now = 1000;
+
+  // DISCOVER is retransmitted with backoff.
+  DHCPClient::Action a = c.Start(kMAC, 0x1234, now);
+  assert(a.send && !a.configure && c.state == State::kSelecting);
+  size_t size = c.BuildMessage(msg);
+  assert(size >= 342 - sizeof(Network::EtherFrame));
+  assert(Network::IsUDPChecksumValid(msg, size));
+  assert(GetDHCPMessageType(msg, size) == MessageType::kDiscover);
+  assert(!c.HandleTimer(now + 999).send);
+  assert(c.HandleTimer(now + 1000).send);
+  now += 1000;
+  assert(!c.HandleTimer(now + 1999).send);
+  assert(c.HandleTimer(now + 2000).send);
+  now += 2000;
+
+  // OFFER -> REQUEST -> ACK
+  size_t reply_size =
+      MakeDHCPReply(msg, reply, MessageType::kOffer, kLeaseTime);
+  a = c.HandleMessage(reply, reply_size, now);
+  assert(a.send && c.state == State::kRequesting);
+  size = c.BuildMessage(msg);
+  assert(GetDHCPMessageType(msg, size) == MessageType::kRequest);
+  // A reply to another transaction is ignored.
+  reply_size = MakeDHCPReply(msg, reply, MessageType::kAck, kLeaseTime);
+  reinterpret_cast<Network::DHCPPacket*>(reply)->xid++;
+  a = c.HandleMessage(reply, reply_size, now);
+  assert(!a.send && !a.configure);
+  reinterpret_cast<Network::DHCPPacket*>(reply)->xid--;
+  a = c.HandleMessage(reply, reply_size, now);
+  assert(a.configure && !a.send && c.state == State::kBound);
+  assert(c.lease.addr.IsEqualTo({10, 0, 2, 15}));
+  assert(c.lease.router.IsEqualTo({10, 0, 2, 2}));
+  assert(c.lease.t1_s == kLeaseTime / 2);
+  assert(c.lease.t2_s == kLeaseTime * 7 / 8);
+
+  // Renewal is unicast from the leased address after T1.
+  const uint64_t bound_at = now;
+  assert(!c.HandleTimer(bound_at + kLeaseTime / 2 * 1000 - 1).send);
+  now = bound_at + kLeaseTime / 2 * 1000;
+  a = c.HandleTimer(now);
+  assert(a.send && c.state == State::kRenewing);
+  size = c.BuildMessage(msg);
+  Network::IPv4Packet& ip = *reinterpret_cast<Network::IPv4Packet*>(msg);
+  assert(ip.src_ip.IsEqualTo({10, 0, 2, 15}));
+  assert(ip.dst_ip.IsEqualTo({10, 0, 2, 2}));
+  assert(Network::IsUDPChecksumValid(msg, size));
+  // Retransmitted at half of the time until T2
+  assert(c.next_timer_ms == now + (kLeaseTime * 7 / 8 - kLeaseTime / 2) *
+                                      1000 / 2);
+  // Rebinding is broadcast after T2, and the lease is lost at the expiry.
+  now = bound_at + kLeaseTime * 7 / 8 * 1000;
+  a = c.HandleTimer(now);
+  assert(a.send && c.state == State::kRebinding);
+  size = c.BuildMessage(msg);
+  assert(ip.dst_ip.IsEqualTo(Network::kBroadcastIPv4Addr));
+  now = bound_at + static_cast<uint64_t>(kLeaseTime) * 1000;
+  a = c.HandleTimer(now);
+  assert(a.send && a.unconfigure && c.state == State::kSelecting);
+
+  // NAK restarts from DISCOVER.
+  size = c.BuildMessage(msg);
+  reply_size = MakeDHCPReply(msg, reply, MessageType::kOffer, kLeaseTime);
+  c.HandleMessage(reply, reply_size, now);
+  size = c.BuildMessage(msg);
+  reply_size = MakeDHCPReply(msg, reply, MessageType::kNak, kLeaseTime);
+  a = c.HandleMessage(reply, reply_size, now);
+  assert(a.send && !a.unconfigure && c.state == State::kSelecting);
+}
 
 int main() {
+  TestChecksumMatchesScalar();
+  BenchmarkChecksum();
+  TestFlowHashSpreadsPorts();
+  TestIPv4ReassemblyBlocks();
+  TestDHCPClient();
+
+
   auto ip_addr_actual = Network::IPv4Addr::CreateFromString("12.34.56.78");
   Network::IPv4Addr ip_addr_expected = {12, 34, 56, 78};
   assert(ip_addr_actual.has_value());
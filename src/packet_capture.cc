@@ -0,0 +1,155 @@
+#include "packet_capture.h"
+
+#include "kernel.h"
+#include "liumos.h"
+#include "network.h"
+
+PacketCapture* PacketCapture::capture_;
+bool PacketCapture::is_enabled_;
+
+PacketCapture& PacketCapture::GetInstance() {
+  if (!capture_) {
+    capture_ = liumos->kernel_heap_allocator->Alloc<PacketCapture>();
+    bzero(capture_, sizeof(PacketCapture));
+    new (capture_) PacketCapture();
+  }
+  assert(capture_);
+  return *capture_;
+}
+
+static uint64_t GetHPETMicroSecond() {
+  HPET& hpet = HPET::GetInstance();
+  return hpet.ReadMainCounterValue() / (hpet.GetCountPerSecond() / 1'000'000);
+}
+
+bool PacketCapture::Filter::Matches(const uint8_t* frame,
+                                    size_t frame_size) const {
+  using EtherFrame = Network::EtherFrame;
+  using IPv4Packet = Network::IPv4Packet;
+  using IPv4UDPPacket = Network::IPv4UDPPacket;
+  if (protocol == Protocol::kAny && !port) {
+    return true;
+  }
+  if (frame_size < sizeof(EtherFrame)) {
+    return false;
+  }
+  const EtherFrame& eth = *reinterpret_cast<const EtherFrame*>(frame);
+  if (protocol == Protocol::kARP) {
+    return eth.HasEthType(EtherFrame::kTypeARP);
+  }
+  if (!eth.HasEthType(EtherFrame::kTypeIPv4) ||
+      frame_size < sizeof(IPv4Packet)) {
+    return false;
+  }
+  const IPv4Packet& ip = *reinterpret_cast<const IPv4Packet*>(frame);
+  using IPProtocol = IPv4Packet::Protocol;
+  if ((protocol == Protocol::kICMP && ip.protocol != IPProtocol::kICMP) ||
+      (protocol == Protocol::kTCP && ip.protocol != IPProtocol::kTCP) ||
+      (protocol == Protocol::kUDP && ip.protocol != IPProtocol::kUDP)) {
+    return false;
+  }
+  if (!port) {
+    return true;
+  }
+  // TCP has the ports at the same place as UDP.
+  if ((ip.protocol != IPProtocol::kTCP && ip.protocol != IPProtocol::kUDP) ||
+      frame_size < sizeof(IPv4UDPPacket) || ip.IsFragment()) {
+    return false;
+  }
+  const IPv4UDPPacket& udp = *reinterpret_cast<const IPv4UDPPacket*>(frame);
+  return udp.GetSourcePort() == port || udp.GetDestinationPort() == port;
+}
+
+void PacketCapture::Start(const Filter& filter) {
+  if (!entries_) {
+    entries_ = AllocKernelMemory<Entry*>(sizeof(Entry) * kNumOfRecords);
+    bzero(entries_, sizeof(Entry) * kNumOfRecords);
+  }
+  is_enabled_ = false;
+  // Records of the previous capture are discarded.
+  __atomic_store_n(&read_idx_, write_idx_, __ATOMIC_RELEASE);
+  stats_ = {};
+  filter_ = filter;
+  start_tsc_ = ReadTSC();
+  start_hpet_us_ = GetHPETMicroSecond();
+  is_enabled_ = true;
+}
+
+void PacketCapture::Record(const uint8_t* frame, size_t frame_size) {
+  if (!filter_.Matches(frame, frame_size)) {
+    return;
+  }
+  // Reserve an entry. Other producers may be reserving at the same time.
+  uint64_t write_idx = __atomic_load_n(&write_idx_, __ATOMIC_RELAXED);
+  do {
+    if (write_idx - __atomic_load_n(&read_idx_, __ATOMIC_ACQUIRE) >=
+        kNumOfRecords) {
+      __atomic_fetch_add(&stats_.drops, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&write_idx_, &write_idx,
+                                        write_idx + 1, true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+  Entry& e = entries_[write_idx % kNumOfRecords];
+  e.tsc = ReadTSC();
+  e.orig_len = static_cast<uint32_t>(frame_size);
+  e.cap_len = static_cast<uint32_t>(std::min(frame_size, kSnapLength));
+  memcpy(e.data, frame, e.cap_len);
+  // Publish the entry after it is filled.
+  __atomic_store_n(&e.committed_idx, write_idx + 1, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&stats_.captured, 1, __ATOMIC_RELAXED);
+}
+
+void PacketCapture::WriteBytes(const void* buf, size_t size) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(buf);
+  for (size_t i = 0; i < size; i++) {
+    output_port_->SendChar(p[i]);
+  }
+}
+
+bool PacketCapture::WritePCAP() {
+  // https://wiki.wireshark.org/Development/LibpcapFileFormat
+  packed_struct GlobalHeader {
+    uint32_t magic_number;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t network;
+  };
+  packed_struct RecordHeader {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+  };
+  constexpr uint32_t kLinkTypeEthernet = 1;
+  if (!output_port_) {
+    return false;
+  }
+  GlobalHeader gh = {0xA1B2C3D4, 2, 4, 0, 0, kSnapLength, kLinkTypeEthernet};
+  WriteBytes(&gh, sizeof(gh));
+  // TSC frequency measured over the capture so far
+  const uint64_t now_tsc = ReadTSC();
+  const uint64_t elapsed_us = GetHPETMicroSecond() - start_hpet_us_;
+  const uint64_t tsc_per_us = std::max<uint64_t>(
+      (now_tsc - start_tsc_) / std::max<uint64_t>(elapsed_us, 1), 1);
+  const uint64_t write_idx = __atomic_load_n(&write_idx_, __ATOMIC_ACQUIRE);
+  for (uint64_t idx = read_idx_; idx < write_idx; idx++) {
+    Entry& e = entries_[idx % kNumOfRecords];
+    if (__atomic_load_n(&e.committed_idx, __ATOMIC_ACQUIRE) != idx + 1) {
+      // Still being written. It is written out by the next call.
+      break;
+    }
+    const uint64_t us = start_hpet_us_ + (e.tsc - start_tsc_) / tsc_per_us;
+    RecordHeader rh = {static_cast<uint32_t>(us / 1'000'000),
+                       static_cast<uint32_t>(us % 1'000'000), e.cap_len,
+                       e.orig_len};
+    WriteBytes(&rh, sizeof(rh));
+    WriteBytes(e.data, e.cap_len);
+    // Release the entry to the producer.
+    __atomic_store_n(&read_idx_, idx + 1, __ATOMIC_RELEASE);
+  }
+  return true;
+}
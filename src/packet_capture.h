@@ -0,0 +1,80 @@
+#pragma once
+
+#include "generic.h"
+
+class SerialPort;
+
+// Records frames sent and received by NetDevices into a ring buffer, and
+// writes them out in pcap format so that they can be opened in Wireshark:
+//   (liumOS) capture start udp port 53
+//   (liumOS) capture dump
+//   $ nc localhost 1234 > dump.pcap   # COM1 of qemu.mk
+class PacketCapture {
+ public:
+  struct Filter {
+    enum class Protocol {
+      kAny,
+      kARP,
+      kICMP,
+      kTCP,
+      kUDP,
+    } protocol;
+    uint16_t port;  // 0 matches any. Compared with src and dst ports.
+    bool Matches(const uint8_t* frame, size_t frame_size) const;
+  };
+  struct Stats {
+    uint64_t captured;
+    uint64_t drops;  // dropped since the ring was full
+  };
+  static constexpr int kNumOfRecords = 4096;
+  static constexpr size_t kSnapLength = 256;
+
+  static PacketCapture& GetInstance();
+  // Checked for every frame, so this should be cheap.
+  static bool IsEnabled() { return is_enabled_; }
+
+  void SetOutputPort(SerialPort& port) { output_port_ = &port; }
+  void Start(const Filter& filter);
+  void Stop() { is_enabled_ = false; }
+  void Record(const uint8_t* frame, size_t frame_size);
+  // Writes the records captured so far as a pcap file to the output port.
+  // Records written are removed from the ring. Returns false if there is no
+  // output port.
+  bool WritePCAP();
+  uint64_t GetNumOfPendingRecords() {
+    return __atomic_load_n(&write_idx_, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&read_idx_, __ATOMIC_ACQUIRE);
+  }
+  const Stats& GetStats() { return stats_; }
+
+ private:
+  struct Entry {
+    // idx + 1 when the entry of idx is published
+    uint64_t committed_idx;
+    uint64_t tsc;
+    uint32_t orig_len;
+    uint32_t cap_len;
+    uint8_t data[kSnapLength];
+  };
+
+  static PacketCapture* capture_;
+  static bool is_enabled_;
+
+  PacketCapture(){};
+  void WriteBytes(const void* buf, size_t size);
+
+  // Multiple producers (NetDevice::SendPacket() and DeliverRXFrame(),
+  // called from syscalls and the NetworkManager task) and a single consumer
+  // (WritePCAP). Both indices only increase. Producers reserve an entry by
+  // advancing write_idx_ atomically and publish it via committed_idx once it
+  // is filled. Only the consumer updates read_idx_, so no locks are needed.
+  Entry* entries_;
+  uint64_t write_idx_;
+  uint64_t read_idx_;
+  Filter filter_;
+  Stats stats_;
+  // To convert TSC values into time of HPET
+  uint64_t start_tsc_;
+  uint64_t start_hpet_us_;
+  SerialPort* output_port_;
+};
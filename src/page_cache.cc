@@ -0,0 +1,256 @@
+#include "page_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+constexpr uint32_t kSectorsPerPage = kPageSize / BlockDevice::kSectorSize;
+
+PageCache::PageCache(BlockDevice& dev)
+    : dev_(dev),
+      num_of_pages_on_device_((dev.GetNumOfSectors() + kSectorsPerPage - 1) /
+                              kSectorsPerPage),
+      clock_hand_(0),
+      num_of_dirty_pages_(0),
+      read_ahead_next_(0),
+      read_ahead_window_(1),
+      stats_() {
+  for (int i = 0; i < kNumOfHashBuckets; i++) {
+    hash_heads_[i] = kNone;
+  }
+  for (int i = 0; i < kNumOfPages; i++) {
+    pages_[i] = {};
+    pages_[i].hash_next = kNone;
+  }
+}
+
+uint32_t PageCache::GetNumOfSectorsInPage(uint64_t index) {
+  const uint64_t first_sector = index * kSectorsPerPage;
+  return static_cast<uint32_t>(
+      std::min<uint64_t>(kSectorsPerPage,
+                         dev_.GetNumOfSectors() - first_sector));
+}
+
+int PageCache::Lookup(uint64_t index) {
+  for (int p = hash_heads_[index % kNumOfHashBuckets]; p != kNone;
+       p = pages_[p].hash_next) {
+    if (pages_[p].index == index)
+      return p;
+  }
+  return kNone;
+}
+
+void PageCache::Unlink(int p) {
+  int* next = &hash_heads_[pages_[p].index % kNumOfHashBuckets];
+  while (*next != p) {
+    assert(*next != kNone);
+    next = &pages_[*next].hash_next;
+  }
+  *next = pages_[p].hash_next;
+}
+
+int PageCache::AllocPage(uint64_t index) {
+  assert(Lookup(index) == kNone);
+  for (int i = 0;; i++) {
+    if (i && i % kNumOfPages == 0) {
+      // Every page is in use by I/O. Let them complete.
+      dev_.Kick();
+      dev_.HandleCompletions();
+    }
+    const int p = clock_hand_;
+    clock_hand_ = (clock_hand_ + 1) % kNumOfPages;
+    Page& pg = pages_[p];
+    if (pg.is_used) {
+      if (pg.is_busy) {
+        if (!pg.req.is_done)
+          continue;
+        FinishIO(p);
+      }
+      if (pg.is_referenced) {
+        pg.is_referenced = false;
+        continue;
+      }
+      if (pg.is_dirty && WriteBack())
+        return kNone;
+      Unlink(p);
+    }
+    pg = {};
+    pg.index = index;
+    pg.is_used = true;
+    pg.is_referenced = true;
+    pg.hash_next = hash_heads_[index % kNumOfHashBuckets];
+    hash_heads_[index % kNumOfHashBuckets] = p;
+    return p;
+  }
+}
+
+bool PageCache::FinishIO(int p) {
+  Page& pg = pages_[p];
+  if (!pg.is_busy)
+    return false;
+  dev_.Wait(pg.req);
+  pg.is_busy = false;
+  const bool has_failed = pg.req.has_failed;
+  if (pg.req.type == BlockDevice::Request::Type::kRead) {
+    pg.is_valid = !has_failed;
+  } else if (!has_failed) {
+    pg.is_dirty = false;
+    num_of_dirty_pages_--;
+    stats_.written_back_pages++;
+  }
+  return has_failed;
+}
+
+void PageCache::SubmitRead(int p) {
+  Page& pg = pages_[p];
+  const uint32_t num_of_sectors = GetNumOfSectorsInPage(pg.index);
+  if (num_of_sectors < kSectorsPerPage) {
+    // The last page of the device
+    memset(&bufs_[p][num_of_sectors * BlockDevice::kSectorSize], 0,
+           kPageSize - num_of_sectors * BlockDevice::kSectorSize);
+  }
+  pg.req = {};
+  pg.req.type = BlockDevice::Request::Type::kRead;
+  pg.req.sector = pg.index * kSectorsPerPage;
+  pg.req.num_of_sectors = num_of_sectors;
+  pg.req.buf = bufs_[p];
+  dev_.SubmitWhenRoom(pg.req);
+  pg.is_busy = true;
+}
+
+void PageCache::ReadAhead(uint64_t index, int num_of_pages) {
+  const uint64_t end =
+      std::min(index + num_of_pages, num_of_pages_on_device_);
+  const uint64_t mark_index = index + num_of_pages / 2;
+  for (uint64_t i = index; i < end; i++) {
+    if (Lookup(i) != kNone)
+      continue;
+    const int p = AllocPage(i);
+    if (p == kNone)
+      break;
+    SubmitRead(p);
+    pages_[p].is_read_ahead_mark = (i == mark_index);
+    stats_.read_ahead_pages++;
+  }
+  read_ahead_next_ = index + num_of_pages;
+  dev_.Kick();
+}
+
+int PageCache::GetPage(uint64_t index, bool will_overwrite) {
+  if (index >= num_of_pages_on_device_)
+    return kNone;
+  int p = Lookup(index);
+  if (p != kNone) {
+    Page& pg = pages_[p];
+    pg.is_referenced = true;
+    if (pg.is_read_ahead_mark) {
+      // Reads are catching up with the read-ahead. Request the next window
+      // before it is needed.
+      pg.is_read_ahead_mark = false;
+      read_ahead_window_ =
+          std::min(read_ahead_window_ * 2, kMaxReadAheadPages);
+      ReadAhead(read_ahead_next_, read_ahead_window_);
+    }
+    if (pg.is_busy && !pg.req.is_done)
+      stats_.misses++;
+    else
+      stats_.hits++;
+    FinishIO(p);
+    if (pg.is_valid || will_overwrite)
+      return p;
+    // The last read has failed. Retry it.
+    SubmitRead(p);
+    dev_.Kick();
+    return FinishIO(p) ? kNone : p;
+  }
+  p = AllocPage(index);
+  if (p == kNone)
+    return kNone;
+  if (will_overwrite)
+    return p;
+  stats_.misses++;
+  if (index == read_ahead_next_) {
+    read_ahead_window_ = std::min(read_ahead_window_ * 2, kMaxReadAheadPages);
+  } else {
+    read_ahead_window_ = 1;
+  }
+  SubmitRead(p);
+  ReadAhead(index + 1, read_ahead_window_ - 1);
+  return FinishIO(p) ? kNone : p;
+}
+
+bool PageCache::Read(uint64_t ofs, void* dst, uint64_t size) {
+  uint8_t* p = reinterpret_cast<uint8_t*>(dst);
+  while (size) {
+    const uint64_t ofs_in_page = ofs & kPageAddrMask;
+    const uint64_t len = std::min(size, kPageSize - ofs_in_page);
+    const int page = GetPage(ofs >> kPageSizeExponent, false);
+    if (page == kNone)
+      return true;
+    memcpy(p, &bufs_[page][ofs_in_page], len);
+    p += len;
+    ofs += len;
+    size -= len;
+  }
+  return false;
+}
+
+bool PageCache::Write(uint64_t ofs, const void* src, uint64_t size) {
+  if (dev_.IsReadOnly() ||
+      ofs + size > dev_.GetNumOfSectors() * BlockDevice::kSectorSize)
+    return true;
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(src);
+  while (size) {
+    const uint64_t ofs_in_page = ofs & kPageAddrMask;
+    const uint64_t len = std::min(size, kPageSize - ofs_in_page);
+    const int page = GetPage(ofs >> kPageSizeExponent, len == kPageSize);
+    if (page == kNone)
+      return true;
+    Page& pg = pages_[page];
+    memcpy(&bufs_[page][ofs_in_page], p, len);
+    pg.is_valid = true;
+    if (!pg.is_dirty) {
+      pg.is_dirty = true;
+      num_of_dirty_pages_++;
+    }
+    p += len;
+    ofs += len;
+    size -= len;
+  }
+  if (num_of_dirty_pages_ > kMaxDirtyPages)
+    return WriteBack();
+  return false;
+}
+
+bool PageCache::WriteBack() {
+  int num_of_pages = 0;
+  for (int p = 0; p < kNumOfPages; p++) {
+    if (pages_[p].is_used && pages_[p].is_dirty)
+      writeback_order_[num_of_pages++] = p;
+  }
+  // Contiguous pages are merged into one request by the device.
+  std::sort(writeback_order_, writeback_order_ + num_of_pages,
+            [this](int a, int b) { return pages_[a].index < pages_[b].index; });
+  for (int i = 0; i < num_of_pages; i++) {
+    Page& pg = pages_[writeback_order_[i]];
+    FinishIO(writeback_order_[i]);
+    pg.req = {};
+    pg.req.type = BlockDevice::Request::Type::kWrite;
+    pg.req.sector = pg.index * kSectorsPerPage;
+    pg.req.num_of_sectors = GetNumOfSectorsInPage(pg.index);
+    pg.req.buf = bufs_[writeback_order_[i]];
+    dev_.SubmitWhenRoom(pg.req);
+    pg.is_busy = true;
+  }
+  dev_.Kick();
+  bool has_failed = false;
+  for (int i = 0; i < num_of_pages; i++) {
+    has_failed |= FinishIO(writeback_order_[i]);
+  }
+  return has_failed;
+}
+
+bool PageCache::Sync() {
+  bool has_failed = WriteBack();
+  has_failed |= dev_.Flush();
+  return has_failed;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "block_device.h"
+#include "generic.h"
+
+// Caches the contents of a block device in pages of kPageSize bytes, indexed
+// by the offset on the device. File systems read and write their metadata
+// and the contents of files through the same cache, so there is no separate
+// buffer for each of them.
+//
+// Read-ahead: a miss reads a window of the following pages together, and
+// only the page which was missed is waited for. When a read reaches the
+// middle of the window, the next window, twice as large up to
+// kMaxReadAheadPages, is requested without waiting. Since the device merges
+// requests for contiguous sectors, a window takes a few device requests.
+//
+// Write-back: writes only mark the pages dirty. Dirty pages are written in
+// the order of their offsets by Sync(), on eviction, or when more than
+// kMaxDirtyPages are dirty.
+class PageCache {
+ public:
+  static constexpr int kNumOfPages = 1024;
+  static constexpr int kMaxReadAheadPages = 32;
+  static constexpr int kMaxDirtyPages = kNumOfPages / 4;
+
+  struct Stats {
+    uint64_t hits;
+    // Reads which waited for the device
+    uint64_t misses;
+    uint64_t read_ahead_pages;
+    uint64_t written_back_pages;
+  };
+
+  PageCache(BlockDevice& dev);
+  // Copy size bytes from or to the device offset ofs through the cache.
+  // Return true on failure.
+  bool Read(uint64_t ofs, void* dst, uint64_t size);
+  bool Write(uint64_t ofs, const void* src, uint64_t size);
+  // Writes back all dirty pages and flushes the device. Returns true on
+  // failure.
+  bool Sync();
+  BlockDevice& GetDevice() { return dev_; }
+  const Stats& GetStats() const { return stats_; }
+
+ private:
+  static constexpr int kNumOfHashBuckets = kNumOfPages * 2;
+  static constexpr int kNone = -1;
+
+  struct Page {
+    uint64_t index;
+    int hash_next;
+    bool is_used;
+    bool is_valid;
+    bool is_dirty;
+    // Set for the page of read-ahead which triggers the next window.
+    bool is_read_ahead_mark;
+    // Recently used. Cleared by the clock hand of eviction.
+    bool is_referenced;
+    // An I/O request on the page has been submitted but not waited for.
+    bool is_busy;
+    BlockDevice::Request req;
+  };
+
+  int Lookup(uint64_t index);
+  // Returns a page which holds nothing, evicting another one if needed.
+  int AllocPage(uint64_t index);
+  void Unlink(int p);
+  // Waits for the I/O on the page. Returns true on failure.
+  bool FinishIO(int p);
+  void SubmitRead(int p);
+  // Requests the pages from index which are not cached yet without waiting,
+  // stopping at num_of_pages or the end of the device.
+  void ReadAhead(uint64_t index, int num_of_pages);
+  // Returns the page of index with its contents, or kNone on failure. If
+  // will_overwrite is true, the contents are not read from the device.
+  int GetPage(uint64_t index, bool will_overwrite);
+  bool WriteBack();
+  uint32_t GetNumOfSectorsInPage(uint64_t index);
+
+  BlockDevice& dev_;
+  uint64_t num_of_pages_on_device_;
+  int hash_heads_[kNumOfHashBuckets];
+  Page pages_[kNumOfPages];
+  int clock_hand_;
+  int num_of_dirty_pages_;
+  // The page right after the last window of read-ahead
+  uint64_t read_ahead_next_;
+  int read_ahead_window_;
+  Stats stats_;
+  // Dirty pages in the order of writing them back
+  int writeback_order_[kNumOfPages];
+  alignas(kPageSize) uint8_t bufs_[kNumOfPages][kPageSize];
+};
@@ -1,4 +1,5 @@
 #include "liumos.h"
+#include "util.h"
 
 template <>
 void IA_PDT::Print() {
@@ -107,6 +108,24 @@ void SetKernelPageEntries(IA_PML4& pml4) {
   }
 }
 
+// PAT entries are selected by {PAT, PCD, PWT} of the page. The default is
+// {WB, WT, UC-, UC} x 2, and the entries for PWT only (1 and 5) are replaced
+// with WC. The kernel page table has no pages with only PWT set before this.
+static void InitPAT() {
+  constexpr uint64_t kMemTypeUC = 0x00;
+  constexpr uint64_t kMemTypeWC = 0x01;
+  constexpr uint64_t kMemTypeWB = 0x06;
+  constexpr uint64_t kMemTypeUCMinus = 0x07;
+  constexpr uint64_t kHalf = kMemTypeWB | kMemTypeWC << 8 |
+                             kMemTypeUCMinus << 16 | kMemTypeUC << 24;
+  if (!GetBit<CPUFeatureIndex::kPAT>(liumos->cpu_features->features)) {
+    PutString("PAT not supported. Write-combining is not available.\n");
+    return;
+  }
+  WriteMSR(MSRIndex::kPAT, kHalf | kHalf << 32);
+  PutStringAndHex("PAT", ReadMSR(MSRIndex::kPAT));
+}
+
 void InitPaging() {
   IA32_EFER efer;
   efer.data = ReadMSR(MSRIndex::kEFER);
@@ -184,6 +203,7 @@ void InitPaging() {
                     kPageAttrPresent | kPageAttrWritable |
                         kPageAttrWriteThrough | kPageAttrCacheDisable);
 
+  InitPAT();
   WriteCR3(reinterpret_cast<uint64_t>(kernel_pml4));
   PutStringAndHex("Paging enabled. Kernel CR3", ReadCR3());
   PutStringAndHex("kernel_pml4", kernel_pml4);
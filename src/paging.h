@@ -26,6 +26,10 @@ constexpr uint64_t kPageAttrCacheDisable = 0b10000;
 
 constexpr uint64_t kPageAttrMemMappedIO =
     kPageAttrCacheDisable | kPageAttrPresent | kPageAttrWritable;
+// InitPaging() programs the PAT to make pages with only PWT set
+// write-combining instead of write-through. Without PAT support, they remain
+// write-through.
+constexpr uint64_t kPageAttrWriteCombining = kPageAttrWriteThrough;
 
 static inline uint64_t CeilToPageAlignment(uint64_t v) {
   return (v + kPageSize - 1) & ~kPageAddrMask;
@@ -2,6 +2,7 @@
 
 #include "asm.h"
 #include "console.h"
+#include "kernel_log.h"
 #include "serial.h"
 #include "sheet.h"
 #include "sheet_painter.h"
@@ -14,13 +15,20 @@ class PanicPrinter {
     new (pp_) PanicPrinter();
     pp_->sheet_ = &sheet;
     pp_->serial_ = &serial;
+    pp_->kernel_log_ = nullptr;
     pp_->in_progress_ = false;
   }
+  // The log is written out to the serial port after the panic message.
+  static void SetKernelLog(KernelLog& kernel_log) {
+    pp_->kernel_log_ = &kernel_log;
+  }
   static PanicPrinter& BeginPanic() {
     ClearIntFlag();
     if (!pp_ || !pp_->sheet_ || !pp_->serial_) {
       Die();
     }
+    // Interrupts will not be handled anymore.
+    pp_->serial_->DisableTXInterrupt();
     if (pp_->in_progress_) {
       pp_->PrintLine(
           "BeginPanic() called during panic printing. Double fault?");
@@ -37,6 +45,7 @@ class PanicPrinter {
     PrintLine(s);
     pp_->PrintLine("----  End  Panic ----");
     pp_->Flush();
+    pp_->WriteKernelLog();
     Die();
   }
   // This comment avoids removing newline after EndPanicAndDie
@@ -60,6 +69,15 @@ class PanicPrinter {
   }
 
  private:
+  void WriteKernelLog() {
+    if (!kernel_log_ || !serial_)
+      return;
+    const char* s = "---- Kernel Log ----\r\n";
+    for (int i = 0; s[i]; i++) {
+      serial_->SendChar(s[i]);
+    }
+    kernel_log_->WriteAllEntries(*serial_);
+  }
   void Flush() {
     const char* s = str_buf_.GetString();
     if (serial_) {
@@ -95,6 +113,7 @@ class PanicPrinter {
   static PanicPrinter* pp_;
   Sheet* sheet_;
   SerialPort* serial_;
+  KernelLog* kernel_log_;
   bool in_progress_;
   static constexpr int kBufSize = 1024;
   StringBuffer<kBufSize> str_buf_;
@@ -23,6 +23,7 @@ static const std::
              "RTL8111/8168/8411 PCI Express Gigabit Ethernet Controller"},
             {{0x10ec, 0x8139}, "RTL-8100/8101L/8139 PCI Fast Ethernet Adapter"},
             {{0x1af4, 0x1000}, "Virtio Network Card"},
+            {{0x1af4, 0x1001}, "Virtio Block Device"},
 };
 
 static void SelectRegister(uint32_t bus,
@@ -126,3 +127,57 @@ const char* PCI::GetDeviceName(DeviceIdent key) {
   const auto& it = device_infos.find(key);
   return it != device_infos.end() ? it->second : "(Unknown)";
 }
+
+uint8_t PCI::FindCapability(const DeviceLocation& dev, uint8_t cap_id) {
+  // PCI: 6.7. Capabilities List
+  constexpr uint32_t kPCIRegOffsetCapabilitiesPointer = 0x34;
+  uint8_t cap_ofs = ReadConfigRegister8(dev, kPCIRegOffsetCapabilitiesPointer);
+  for (; cap_ofs; cap_ofs = ReadConfigRegister8(dev, cap_ofs + 1)) {
+    if (ReadConfigRegister8(dev, cap_ofs) == cap_id)
+      return cap_ofs;
+  }
+  return 0;
+}
+
+bool PCI::EnableMSIX(const DeviceLocation& dev, int entry, uint8_t vector) {
+  // PCI: 6.8.2. MSI-X Capability and Table Structure
+  constexpr uint8_t kCapIDMSIX = 0x11;
+  constexpr uint32_t kMessageControlEnable = 1 << 31;
+  constexpr uint32_t kMessageControlFunctionMask = 1 << 30;
+  constexpr uint32_t kPCIRegOffsetBAR = 0x10;
+  const uint8_t cap_ofs = FindCapability(dev, kCapIDMSIX);
+  if (!cap_ofs)
+    return true;
+  const uint32_t cap = ReadConfigRegister32(dev, cap_ofs);
+  const int table_size = ((cap >> 16) & 0x7FF) + 1;
+  if (entry >= table_size)
+    return true;
+  const uint32_t table_ofs_and_bir = ReadConfigRegister32(dev, cap_ofs + 4);
+  const uint32_t bar_ofs = kPCIRegOffsetBAR + (table_ofs_and_bir & 0b111) * 4;
+  uint64_t bar = ReadConfigRegister32(dev, bar_ofs);
+  if (bar & 1) {
+    // The table should be in a memory space.
+    return true;
+  }
+  if (((bar >> 1) & 0b11) == 0b10) {
+    bar |= static_cast<uint64_t>(ReadConfigRegister32(dev, bar_ofs + 4)) << 32;
+  }
+  const uint64_t table_paddr =
+      (bar & ~0b1111ULL) + (table_ofs_and_bir & ~0b111U);
+  const uint64_t table_page = FloorToPageAlignment(table_paddr);
+  volatile uint32_t* table = reinterpret_cast<volatile uint32_t*>(
+      MapMemoryForIO<uint8_t*>(table_page,
+                               table_paddr - table_page + table_size * 16) +
+      (table_paddr - table_page));
+  // Each entry is {Message Address, Message Upper Address, Message Data,
+  // Vector Control}. Fixed delivery, edge triggered, physical destination.
+  volatile uint32_t* e = &table[entry * 4];
+  e[0] = 0xFEE0'0000 | (liumos->bsp_local_apic->GetID() << 12);
+  e[1] = 0;
+  e[2] = vector;
+  e[3] = 0;  // Unmask
+  WriteConfigRegister32(
+      dev, cap_ofs,
+      (cap | kMessageControlEnable) & ~kMessageControlFunctionMask);
+  return false;
+}
@@ -66,6 +66,12 @@ class PCI {
     WriteConfigRegister32(dev, reg + 4, static_cast<uint32_t>(value >> 32));
   }
   static const char* GetDeviceName(DeviceIdent key);
+  // Returns the offset of the capability cap_id in the configuration space
+  // of dev, or 0 if dev does not have it.
+  static uint8_t FindCapability(const DeviceLocation& dev, uint8_t cap_id);
+  // Routes the MSI-X table entry of dev to the vector of the BSP and enables
+  // MSI-X. Returns true on failure, e.g. if dev does not support MSI-X.
+  static bool EnableMSIX(const DeviceLocation& dev, int entry, uint8_t vector);
   static void EnsureBusMasterEnabled(DeviceLocation& dev) {
     constexpr uint32_t kPCIRegOffsetCommandAndStatus = 0x04;
     constexpr uint64_t kPCIRegCommandAndStatusMaskBusMasterEnable = 1 << 2;
@@ -0,0 +1,94 @@
+#include "pixel_kernels.h"
+
+#include "util.h"
+
+__attribute__((ms_abi)) static void CopyPixelsScalar(size_t count,
+                                                     const void* dst,
+                                                     const void* src) {
+  uint32_t* d = reinterpret_cast<uint32_t*>(const_cast<void*>(dst));
+  const uint32_t* s = reinterpret_cast<const uint32_t*>(src);
+  for (size_t i = 0; i < count; i++) {
+    d[i] = s[i];
+  }
+}
+
+__attribute__((ms_abi)) static void FillPixelsScalar(size_t count,
+                                                     const void* dst,
+                                                     uint32_t value) {
+  uint32_t* d = reinterpret_cast<uint32_t*>(const_cast<void*>(dst));
+  for (size_t i = 0; i < count; i++) {
+    d[i] = value;
+  }
+}
+
+__attribute__((ms_abi)) static void BlendPixelsScalar(size_t count,
+                                                      const void* dst,
+                                                      const void* src) {
+  uint32_t* d = reinterpret_cast<uint32_t*>(const_cast<void*>(dst));
+  const uint32_t* s = reinterpret_cast<const uint32_t*>(src);
+  for (size_t i = 0; i < count; i++) {
+    const uint32_t a = s[i] >> 24;
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+      const uint32_t t = ((s[i] >> shift) & 0xFF) * a +
+                         ((d[i] >> shift) & 0xFF) * (255 - a) + 128;
+      out |= ((t + (t >> 8)) >> 8) << shift;
+    }
+    d[i] = out;
+  }
+}
+
+PixelKernels::Type PixelKernels::type_ = PixelKernels::Type::kScalar;
+PixelKernels::CopyFunc PixelKernels::copy_ = CopyPixelsScalar;
+PixelKernels::FillFunc PixelKernels::fill_ = FillPixelsScalar;
+PixelKernels::CopyFunc PixelKernels::blend_ = BlendPixelsScalar;
+
+void PixelKernels::Init(const CPUFeatureSet& f, bool allow_avx2) {
+  if (allow_avx2 && IsSupported(f, Type::kAVX2)) {
+    Select(Type::kAVX2);
+    return;
+  }
+  Select(IsSupported(f, Type::kSSE2) ? Type::kSSE2 : Type::kScalar);
+}
+
+bool PixelKernels::IsSupported(const CPUFeatureSet& f, Type type) {
+  switch (type) {
+    case Type::kScalar:
+      return true;
+    case Type::kSSE2:
+      return GetBit<CPUFeatureIndex::kSSE2>(f.features);
+    case Type::kAVX2:
+      return GetBit<CPUFeatureIndex::kAVX2>(f.features);
+    default:
+      return false;
+  }
+}
+
+void PixelKernels::Select(Type type) {
+  type_ = type;
+  switch (type) {
+    case Type::kSSE2:
+      copy_ = CopyPixelsSSE2;
+      fill_ = FillPixelsSSE2;
+      blend_ = BlendPixelsSSE2;
+      return;
+    case Type::kAVX2:
+      copy_ = CopyPixelsAVX2;
+      fill_ = FillPixelsAVX2;
+      blend_ = BlendPixelsAVX2;
+      return;
+    default:
+      type_ = Type::kScalar;
+      copy_ = CopyPixelsScalar;
+      fill_ = FillPixelsScalar;
+      blend_ = BlendPixelsScalar;
+      return;
+  }
+}
+
+const char* PixelKernels::GetTypeName(Type type) {
+  static const char* kNames[] = {"scalar", "SSE2", "AVX2"};
+  static_assert(sizeof(kNames) / sizeof(kNames[0]) ==
+                static_cast<int>(Type::kNumOfTypes));
+  return kNames[static_cast<int>(type)];
+}
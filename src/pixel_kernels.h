@@ -0,0 +1,42 @@
+#pragma once
+
+#include "asm.h"
+
+// Kernels which process a row of 32-bit pixels for the compositor. The
+// fastest ones for the CPU are selected by Init(), and scalar ones are used
+// until then.
+class PixelKernels {
+ public:
+  enum class Type { kScalar, kSSE2, kAVX2, kNumOfTypes };
+  // AVX2 kernels are selected only if allow_avx2 is true, since the upper
+  // halves of YMM registers are not saved on context switches (FXSAVE).
+  static void Init(const CPUFeatureSet& f, bool allow_avx2);
+  static bool IsSupported(const CPUFeatureSet& f, Type type);
+  static void Select(Type type);
+  static Type GetSelectedType() { return type_; }
+  static const char* GetTypeName(Type type);
+
+  static void CopyRow(uint32_t* dst, const uint32_t* src, int count) {
+    copy_(count, dst, src);
+  }
+  static void FillRow(uint32_t* dst, uint32_t color, int count) {
+    fill_(count, dst, color);
+  }
+  // Blends src over dst with the alpha of each src pixel. Every channel
+  // (alpha as well) becomes (s * a + d * (255 - a)) / 255, rounded.
+  static void BlendRow(uint32_t* dst, const uint32_t* src, int count) {
+    blend_(count, dst, src);
+  }
+
+ private:
+  using CopyFunc = __attribute__((ms_abi)) void (*)(size_t count,
+                                                    const void* dst,
+                                                    const void* src);
+  using FillFunc = __attribute__((ms_abi)) void (*)(size_t count,
+                                                    const void* dst,
+                                                    uint32_t value);
+  static Type type_;
+  static CopyFunc copy_;
+  static FillFunc fill_;
+  static CopyFunc blend_;
+};
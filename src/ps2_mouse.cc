@@ -127,15 +127,9 @@ static void MoveMouseCursor(int& px, int& py, int dx, int dy) {
 }
 
 static Sheet* FindWindowAtPosition(int px, int py) {
-  Sheet* focused = nullptr;
-  for (Sheet* s = liumos->vram_sheet->GetChildAtBottom(); s && !s->IsTopmost();
-       s = s->GetUpper()) {
-    if (!s->GetRect().IsPointInRect(px, py) || s->IsLocked()) {
-      continue;
-    }
-    focused = s;
-  }
-  return focused;
+  return liumos->vram_sheet->FindChildAt(px, py, [](Sheet& s) {
+    return !s.IsTopmost() && !s.IsLocked();
+  });
 }
 
 void MouseManager() {
@@ -207,6 +201,7 @@ void MouseManager() {
       if (!last_left_button_state) {
         focused = FindWindowAtPosition(mx, my);
         if (focused) {
+          focused->Raise();
           focused_ofs_x = mx - focused->GetX();
           focused_ofs_y = my - focused->GetY();
         }
@@ -16,7 +16,7 @@ RTL81& RTL81::GetInstance() {
 
 static std::optional<PCI::DeviceLocation> FindRTL81XX() {
   for (auto& it : PCI::GetInstance().GetDeviceList()) {
-    if (!it.first.HasID(0x10EC, 0x8168)) {
+    if (!it.first.HasID(0x10EC, 0x8168) && !it.first.HasID(0x10EC, 0x8169)) {
       continue;
     }
     PutString("Device Found: ");
@@ -38,7 +38,7 @@ uint16_t RTL81::ReadPHYReg(uint8_t addr) {
 }
 
 void RTL81::Init() {
-  // https://wiki.osdev.org/RTL8139
+  // https://wiki.osdev.org/RTL8169
   kprintf("RTL8::Init()\n");
   if (auto dev = FindRTL81XX()) {
     dev_ = *dev;
@@ -50,16 +50,14 @@ void RTL81::Init() {
   io_addr_base_ = bar.base;
   PutStringAndHex("bar.base", bar.base);
 
-  Network::EtherAddr eth_addr;
   for (int i = 0; i < 6; i++) {
-    eth_addr.mac[i] = ReadIOPort8(io_addr_base_ + i);
+    mac_addr_.mac[i] = ReadIOPort8(io_addr_base_ + i);
   }
   kprintf("MAC Addr: ");
-  eth_addr.Print();
+  mac_addr_.Print();
   kprintf("\n");
 
   kprintf("Resetting the controller...");
-  // https://wiki.osdev.org/RTL8169
   WriteIOPort8(io_addr_base_ + 0x37, 0x10);
   /*set the Reset bit (0x10) to the Command Register (0x37)*/
   while (ReadIOPort8(io_addr_base_ + 0x37) & 0x10) {
@@ -68,89 +66,131 @@ void RTL81::Init() {
   }
   kprintf(" done.\n");
 
-  uint32_t transmit_config = ReadIOPort32(io_addr_base_ + 0x40);
-  kprintf("Transmit Config: 0x%08X\n", transmit_config);
-  uint32_t receive_config = ReadIOPort32(io_addr_base_ + 0x44);
-  kprintf("Receive Config: 0x%08X\n", receive_config);
+  // Unlock config registers (9346CR)
+  WriteIOPort8(io_addr_base_ + 0x50, 0xC0);
 
   // Setup recv buffer
-  rx_descriptors_ = AllocMemoryForMappedIO<RXCommandDescriptor*>(
-      kNumOfRXDescriptors * sizeof(RXCommandDescriptor));
+  rx_descriptors_ = AllocMemoryForMappedIO<CommandDescriptor*>(
+      kNumOfRXDescriptors * sizeof(CommandDescriptor));
   for (int i = 0; i < kNumOfRXDescriptors; i++) {
-    rx_buffers_[i] = AllocMemoryForMappedIO<void*>(kSizeOfEachRXBuffer);
-    rx_descriptors_[i].buf_size_and_flag =
-        kSizeOfEachRXBuffer | kRXFlagsOwnedByController;
+    rx_buffers_[i] = AllocMemoryForMappedIO<uint8_t*>(kSizeOfEachRXBuffer);
     rx_descriptors_[i].vlan_info = 0;
     rx_descriptors_[i].buf_phys_addr = v2p(rx_buffers_[i]);
+    rx_descriptors_[i].buf_size_and_flag =
+        kSizeOfEachRXBuffer | kFlagsOwnedByController |
+        (i == kNumOfRXDescriptors - 1 ? kFlagsEndOfRing : 0);
   }
-  // Mark EOR
-  rx_descriptors_[kNumOfRXDescriptors - 1].buf_size_and_flag |=
-      kRXFlagsEndOfRing;
+  rx_cursor_ = 0;
   uint64_t rx_desc_phys_addr = v2p(rx_descriptors_);
-  kprintf("rx_descriptors_: %p\n", rx_descriptors_);
-  kprintf("rx_desc_phys_addr: 0x%016llX\n", rx_desc_phys_addr);
   // Set RDSAR
   WriteIOPort32(io_addr_base_ + 0xE4, static_cast<uint32_t>(rx_desc_phys_addr));
   WriteIOPort32(io_addr_base_ + 0xE8,
                 static_cast<uint32_t>(rx_desc_phys_addr >> 32));
-  kprintf("RDSAR: %016llX\n",
-          (static_cast<uint64_t>(ReadIOPort32(io_addr_base_ + 0xE8)) << 32) |
-              ReadIOPort32(io_addr_base_ + 0xE4));
   // Set Receive Packet Maximum Size (RMS)
   WriteIOPort16(io_addr_base_ + 0xDA, kSizeOfEachRXBuffer);
+
+  // Setup send buffer. Descriptors are owned by the driver until
+  // QueueTXPacket() hands them to the controller.
+  tx_descriptors_ = AllocMemoryForMappedIO<CommandDescriptor*>(
+      kNumOfTXDescriptors * sizeof(CommandDescriptor));
+  for (int i = 0; i < kNumOfTXDescriptors; i++) {
+    tx_buffers_[i] = AllocMemoryForMappedIO<uint8_t*>(kSizeOfEachTXBuffer);
+    tx_descriptors_[i].vlan_info = 0;
+    tx_descriptors_[i].buf_phys_addr = v2p(tx_buffers_[i]);
+    tx_descriptors_[i].buf_size_and_flag =
+        i == kNumOfTXDescriptors - 1 ? kFlagsEndOfRing : 0;
+  }
+  tx_cursor_ = 0;
+  uint64_t tx_desc_phys_addr = v2p(tx_descriptors_);
+  // Set TNPDS (Transmit Normal Priority Descriptors Start Address)
+  WriteIOPort32(io_addr_base_ + 0x20, static_cast<uint32_t>(tx_desc_phys_addr));
+  WriteIOPort32(io_addr_base_ + 0x24,
+                static_cast<uint32_t>(tx_desc_phys_addr >> 32));
+  // Set Max Transmit Packet Size (MTPS) in 128 bytes unit
+  WriteIOPort8(io_addr_base_ + 0xEC, 0x3B);
+
+  // Enable receiver and transmitter before configuring them
+  WriteIOPort8(io_addr_base_ + 0x37, (1 << 3) | (1 << 2));
   // Set Receive Config to receive all packets
   WriteIOPort32(io_addr_base_ + 0x44, 0b1000'1111'0001'1111);
-  // Start receiver
-  WriteIOPort8(io_addr_base_ + 0x37, 1 << 3);
-
-  bool last_is_link_up = false;
-  uint32_t last_rx_desc_flags = 0;
-  uint16_t last_isr = 0;
-  uint16_t last_rxconf = 0;
-  uint8_t last_cmd = 0;
-  int idx = 0;
-  while (true) {
-    uint8_t phy_status = ReadIOPort8(io_addr_base_ + 0x6C);
-    bool is_link_up = phy_status & 2;
-    uint32_t rx_desc_flags = rx_descriptors_[idx].buf_size_and_flag;
-    uint16_t isr = ReadIOPort16(io_addr_base_ + 0x3E);
-    uint16_t rxconf = ReadIOPort16(io_addr_base_ + 0x44);
-    uint8_t cmd = ReadIOPort8(io_addr_base_ + 0x37);
-    if (last_is_link_up != is_link_up || last_rx_desc_flags != rx_desc_flags ||
-        last_isr != isr || last_rxconf != rxconf || last_cmd != cmd) {
-      kprintf("Link: %s, 0x%08X, isr: 0x%04X, rxconf: 0x%08X, Cmd: 0x%02X\n",
-              is_link_up ? "UP" : "DOWN", rx_desc_flags, isr, rxconf, cmd);
-      last_is_link_up = is_link_up;
-      last_rx_desc_flags = rx_desc_flags;
-      last_isr = isr;
-      last_rxconf = rxconf;
-      last_cmd = cmd;
-    }
-    if ((rx_desc_flags & kRXFlagsOwnedByController) == 0) {
-      size_t size = rx_descriptors_[idx].buf_size_and_flag & 0x1FFF;
-      kprintf("update on rx_descriptors_[%d]: received size = %d\n", idx, size);
-      // volatile void *data = rx_buffers_[idx];
-      // kprintbuf("received", data, 0, size);
-
-      if (rx_descriptors_[idx].buf_size_and_flag & kRXFlagsEndOfRing) {
-        rx_descriptors_[idx].vlan_info = 0;
-        rx_descriptors_[idx].buf_size_and_flag =
-            kSizeOfEachRXBuffer | kRXFlagsEndOfRing | kRXFlagsOwnedByController;
-        idx = 0;
-        last_rx_desc_flags = 0;
-      } else {
-        rx_descriptors_[idx].vlan_info = 0;
-        rx_descriptors_[idx].buf_size_and_flag =
-            kSizeOfEachRXBuffer | kRXFlagsOwnedByController;
-        idx++;
-        last_rx_desc_flags = 0;
-      }
+  // Set Transmit Config: IFG = 96 bit time, Max DMA Burst = unlimited
+  WriteIOPort32(io_addr_base_ + 0x40, 0x0300'0700);
+  // Lock config registers and mask all interrupts: polled by PollRX()
+  WriteIOPort8(io_addr_base_ + 0x50, 0x00);
+  WriteIOPort16(io_addr_base_ + 0x3C, 0);
+
+  uint8_t phy_status = ReadIOPort8(io_addr_base_ + 0x6C);
+  kprintf("Link: %s\n", (phy_status & 2) ? "UP" : "DOWN");
+
+  initialized_ = true;
+  Network::GetInstance().RegisterNetDevice(*this);
+  Network::GetInstance().StartDHCPClient(*this);
+}
+
+uint8_t* RTL81::GetNextTXBuf(size_t size, uint32_t) {
+  if (!initialized_) {
+    Panic("RTL81 not initialized yet");
+  }
+  if (size > kSizeOfEachTXBuffer) {
+    return nullptr;
+  }
+  CommandDescriptor& desc = tx_descriptors_[tx_cursor_];
+  // Wait until the controller is done with the previous frame in this slot.
+  // A stuck controller drops the frame, counted in tx_drops by SendPacket().
+  for (uint64_t i = 0; desc.buf_size_and_flag & kFlagsOwnedByController;
+       i++) {
+    if (i > kMaxTXDescriptorWaitCount) {
+      return nullptr;
     }
-    if ((cmd & 0x08) == 0) {
-      // Receiver has been stopped
+    asm volatile("pause");
+  }
+  tx_size_ = static_cast<uint32_t>(size);
+  return tx_buffers_[tx_cursor_];
+}
+
+void RTL81::QueueTXPacket() {
+  CommandDescriptor& desc = tx_descriptors_[tx_cursor_];
+  const bool is_last = tx_cursor_ == kNumOfTXDescriptors - 1;
+  desc.vlan_info = 0;
+  desc.buf_size_and_flag = tx_size_ | kFlagsOwnedByController |
+                           kFlagsFirstSegment | kFlagsLastSegment |
+                           (is_last ? kFlagsEndOfRing : 0);
+  tx_cursor_ = is_last ? 0 : tx_cursor_ + 1;
+  stats_.tx_packets++;
+  stats_.tx_bytes += tx_size_;
+}
+
+void RTL81::KickTX() {
+  // Set NPQ bit of TPPoll to make the controller scan the normal priority
+  // descriptors.
+  WriteIOPort8(io_addr_base_ + 0x38, 0x40);
+}
+
+void RTL81::PollRX() {
+  if (!initialized_) {
+    return;
+  }
+  while (true) {
+    CommandDescriptor& desc = rx_descriptors_[rx_cursor_];
+    const uint32_t flags = desc.buf_size_and_flag;
+    if (flags & kFlagsOwnedByController) {
       break;
     }
-    if (liumos->main_console->GetCharWithoutBlocking() != KeyID::kNoInput)
-      break;
+    constexpr uint32_t kFlagsSingleSegment =
+        kFlagsFirstSegment | kFlagsLastSegment;
+    // Received size includes 4 bytes of CRC.
+    const size_t size = flags & kRXSizeMask;
+    if ((flags & kRXFlagsReceiveError) ||
+        (flags & kFlagsSingleSegment) != kFlagsSingleSegment || size < 4) {
+      stats_.rx_drops++;
+    } else {
+      DeliverRXFrame(rx_buffers_[rx_cursor_], size - 4, false);
+    }
+    // Give the buffer back to the controller
+    const bool is_last = rx_cursor_ == kNumOfRXDescriptors - 1;
+    desc.vlan_info = 0;
+    desc.buf_size_and_flag = kSizeOfEachRXBuffer | kFlagsOwnedByController |
+                             (is_last ? kFlagsEndOfRing : 0);
+    rx_cursor_ = is_last ? 0 : rx_cursor_ + 1;
   }
 }
@@ -3,20 +3,30 @@
 #include <optional>
 
 #include "generic.h"
+#include "net_device.h"
 #include "network.h"
 #include "pci.h"
 
-class RTL81 {
+class RTL81 : public NetDevice {
  public:
   void Init();
+  const char* GetName() override { return "rtl81xx"; }
+  void PollRX() override;
+
   static RTL81& GetInstance();
 
-  packed_struct RXCommandDescriptor {
+  // Same layout is used for RX and TX descriptors
+  packed_struct CommandDescriptor {
     volatile uint32_t buf_size_and_flag;
     volatile uint32_t vlan_info;
     volatile uint64_t buf_phys_addr;
   };
-  static_assert(sizeof(RXCommandDescriptor) == 16);
+  static_assert(sizeof(CommandDescriptor) == 16);
+
+ protected:
+  uint8_t* GetNextTXBuf(size_t size, uint32_t flow_hash) override;
+  void QueueTXPacket() override;
+  void KickTX() override;
 
  private:
   uint16_t ReadPHYReg(uint8_t addr);
@@ -24,10 +34,25 @@ class RTL81 {
   static RTL81* rtl_;
   PCI::DeviceLocation dev_;
   uint16_t io_addr_base_;
+  bool initialized_;
   static constexpr uint32_t kSizeOfEachRXBuffer = 4096;
-  static constexpr uint32_t kRXFlagsOwnedByController = (1 << 31);
-  static constexpr uint32_t kRXFlagsEndOfRing = (1 << 30);
+  static constexpr uint32_t kSizeOfEachTXBuffer = 4096;
+  static constexpr uint32_t kFlagsOwnedByController = (1 << 31);
+  static constexpr uint32_t kFlagsEndOfRing = (1 << 30);
+  static constexpr uint32_t kFlagsFirstSegment = (1 << 29);
+  static constexpr uint32_t kFlagsLastSegment = (1 << 28);
+  static constexpr uint32_t kRXFlagsReceiveError = (1 << 21);
+  static constexpr uint32_t kRXSizeMask = 0x3FFF;
   static constexpr int kNumOfRXDescriptors = 32;
-  RXCommandDescriptor* rx_descriptors_;
-  volatile void* rx_buffers_[kNumOfRXDescriptors];
+  static constexpr int kNumOfTXDescriptors = 32;
+  // Frames are dropped if the controller holds the next TX descriptor for
+  // longer than this number of polls.
+  static constexpr uint64_t kMaxTXDescriptorWaitCount = 100'000'000;
+  CommandDescriptor* rx_descriptors_;
+  uint8_t* rx_buffers_[kNumOfRXDescriptors];
+  int rx_cursor_;
+  CommandDescriptor* tx_descriptors_;
+  uint8_t* tx_buffers_[kNumOfTXDescriptors];
+  int tx_cursor_;
+  uint32_t tx_size_;  // size of the frame in the last GetNextTXBuf()
 };
@@ -1,9 +1,19 @@
 #include "liumos.h"
 
+// https://wiki.osdev.org/Serial_Ports
+constexpr uint16_t kRegInterruptEnable = 1;
+constexpr uint16_t kRegInterruptIdentification = 2;
+constexpr uint16_t kRegLineStatus = 5;
+constexpr uint8_t kInterruptEnableTXEmpty = 0x02;
+constexpr uint8_t kLineStatusTXEmpty = 0x20;
+
 void SerialPort::Init(uint16_t port) {
-  // https://wiki.osdev.org/Serial_Ports
   port_ = port;
-  WriteIOPort8(port_ + 1, 0x00);  // Disable all interrupts
+  is_tx_interrupt_enabled_ = false;
+  is_tx_busy_ = false;
+  bzero(&stats_, sizeof(stats_));
+  new (&tx_queue_) RingBuffer<uint8_t, kTXQueueSize>();
+  WriteIOPort8(port_ + kRegInterruptEnable, 0x00);  // Disable all interrupts
   WriteIOPort8(port_ + 3, 0x80);  // Enable DLAB (set baud rate divisor)
   constexpr uint16_t baud_divisor =
       0x0001;  // baud rate = (115200 / baud_divisor)
@@ -16,17 +26,69 @@ void SerialPort::Init(uint16_t port) {
 }
 
 bool SerialPort::IsTransmitEmpty(void) {
-  return ReadIOPort8(port_ + 5) & 0x20;
+  return ReadIOPort8(port_ + kRegLineStatus) & kLineStatusTXEmpty;
+}
+
+void SerialPort::FillTXFIFO() {
+  int i = 0;
+  for (; i < kTXFIFOSize && !tx_queue_.IsEmpty(); i++) {
+    WriteIOPort8(port_, tx_queue_.Pop());
+  }
+  is_tx_busy_ = i > 0;
 }
 
 void SerialPort::SendChar(char c) {
-  while (!IsTransmitEmpty())
-    ;
-  WriteIOPort8(port_, c);
+  if (!is_tx_interrupt_enabled_) {
+    while (!IsTransmitEmpty())
+      ;
+    WriteIOPort8(port_, c);
+    return;
+  }
+  // Callers may have interrupts disabled already.
+  const bool int_enabled = ReadRFLAGS() & kRFlagsInterruptEnable;
+  ClearIntFlag();
+  while (tx_queue_.IsFull()) {
+    // Interrupts may never come while disabled, so drain by polling.
+    stats_.queue_full++;
+    while (!IsTransmitEmpty())
+      ;
+    FillTXFIFO();
+  }
+  tx_queue_.Push(c);
+  stats_.queued++;
+  if (!is_tx_busy_)
+    FillTXFIFO();
+  if (int_enabled)
+    StoreIntFlag();
+}
+
+void SerialPort::EnableTXInterrupt() {
+  is_tx_busy_ = false;
+  is_tx_interrupt_enabled_ = true;
+  WriteIOPort8(port_ + kRegInterruptEnable, kInterruptEnableTXEmpty);
+}
+
+void SerialPort::DisableTXInterrupt() {
+  WriteIOPort8(port_ + kRegInterruptEnable, 0x00);
+  is_tx_interrupt_enabled_ = false;
+  is_tx_busy_ = false;
+  while (!tx_queue_.IsEmpty()) {
+    while (!IsTransmitEmpty())
+      ;
+    WriteIOPort8(port_, tx_queue_.Pop());
+  }
+}
+
+void SerialPort::HandleInterrupt() {
+  stats_.interrupts++;
+  // Reading IIR acknowledges the TX empty interrupt.
+  ReadIOPort8(port_ + kRegInterruptIdentification);
+  if (is_tx_interrupt_enabled_ && IsTransmitEmpty())
+    FillTXFIFO();
 }
 
 bool SerialPort::IsReceived(void) {
-  return ReadIOPort8(port_ + 5) & 1;
+  return ReadIOPort8(port_ + kRegLineStatus) & 1;
 }
 
 char SerialPort::ReadCharReceived(void) {
@@ -1,17 +1,49 @@
 #pragma once
 #include "generic.h"
+#include "ring_buffer.h"
 
 constexpr uint16_t kPortCOM1 = 0x3f8;
 constexpr uint16_t kPortCOM2 = 0x2f8;
+constexpr uint8_t kIRQCOM1 = 4;
+constexpr uint8_t kIRQCOM2 = 3;
 
+// 16550 UART. TX is synchronous until EnableTXInterrupt() is called. After
+// that, SendChar() only queues bytes and they are written into the TX FIFO
+// of the UART by HandleInterrupt() each time the FIFO becomes empty.
 class SerialPort {
  public:
+  struct Stats {
+    uint64_t queued;
+    uint64_t interrupts;
+    // Number of times SendChar() waited for the UART since the queue was full
+    uint64_t queue_full;
+  };
   void Init(uint16_t port);
   void SendChar(char c);
   bool IsReceived(void);
   char ReadCharReceived(void);
+  void EnableTXInterrupt();
+  // Writes out the queued bytes and goes back to synchronous TX.
+  // Used on panic, when interrupts will not be handled anymore.
+  void DisableTXInterrupt();
+  // Should be called on the IRQ of this port.
+  void HandleInterrupt();
+  const Stats& GetStats() { return stats_; }
 
  private:
+  static constexpr int kTXQueueSize = 4096;
+  static constexpr int kTXFIFOSize = 16;
+
   bool IsTransmitEmpty(void);
+  // Moves bytes from tx_queue_ into the empty TX FIFO.
+  // Should be called with interrupts disabled.
+  void FillTXFIFO();
+
   uint16_t port_;
+  bool is_tx_interrupt_enabled_;
+  // True while the FIFO has bytes written by FillTXFIFO(), i.e. an
+  // interrupt will come when they are sent.
+  bool is_tx_busy_;
+  Stats stats_;
+  RingBuffer<uint8_t, kTXQueueSize> tx_queue_;
 };
@@ -1,29 +1,680 @@
 #include "sheet.h"
 
+#include <algorithm>
+
 #include "asm.h"
 #include "generic.h"
+#include "pixel_kernels.h"
+
+void SheetSpanMap::Replace(int y,
+                           int begin,
+                           int end,
+                           const Span* new_spans,
+                           int num_of_new_spans) {
+  int& n = num_of_spans_[y];
+  if (n < 0 || begin >= end) {
+    return;
+  }
+  Span* spans = &spans_[y * spans_per_row_];
+  // Spans in [i, j) overlap with the new one.
+  int i = 0;
+  while (i < n && spans[i].end <= begin) {
+    i++;
+  }
+  int j = i;
+  while (j < n && spans[j].begin < end) {
+    j++;
+  }
+  // Parts of the overlapped spans which stick out remain.
+  const bool has_left = i < j && spans[i].begin < begin;
+  const bool has_right = i < j && end < spans[j - 1].end;
+  const Span left = has_left ? Span{spans[i].begin, begin, spans[i].sheet}
+                             : Span{};
+  const Span right =
+      has_right ? Span{end, spans[j - 1].end, spans[j - 1].sheet} : Span{};
+  const int next_n = n - (j - i) + has_left + num_of_new_spans + has_right;
+  if (next_n > spans_per_row_) {
+    n = -1;
+    return;
+  }
+  const int tail = i + has_left + num_of_new_spans + has_right;
+  if (tail < j) {
+    for (int k = j; k < n; k++) {
+      spans[tail + (k - j)] = spans[k];
+    }
+  } else if (tail > j) {
+    for (int k = n - 1; k >= j; k--) {
+      spans[tail + (k - j)] = spans[k];
+    }
+  }
+  if (has_left) {
+    spans[i++] = left;
+  }
+  for (int k = 0; k < num_of_new_spans; k++) {
+    spans[i++] = new_spans[k];
+  }
+  if (has_right) {
+    spans[i] = right;
+  }
+  n = next_n;
+}
+
+void SheetSpanMap::PaintGaps(int y, int begin, int end, Sheet* sheet) {
+  for (int x = begin; x < end && num_of_spans_[y] >= 0;) {
+    const int n = num_of_spans_[y];
+    const Span* spans = GetSpans(y);
+    int i = 0;
+    while (i < n && spans[i].end <= x) {
+      i++;
+    }
+    if (i < n && spans[i].begin <= x) {
+      x = spans[i].end;
+      continue;
+    }
+    const int gap_end = i < n ? std::min(spans[i].begin, end) : end;
+    Paint(y, x, gap_end, sheet);
+    x = gap_end;
+  }
+}
+
+bool SheetSpanMap::HasGap(int y, int begin, int end) const {
+  const Span* spans = GetSpans(y);
+  int x = begin;
+  for (int i = 0; i < num_of_spans_[y] && x < end; i++) {
+    if (spans[i].end <= x) {
+      continue;
+    }
+    if (x < spans[i].begin) {
+      return true;
+    }
+    x = spans[i].end;
+  }
+  return x < end && num_of_spans_[y] >= 0;
+}
+
+Sheet* SheetSpanMap::GetSheetAt(int x, int y) const {
+  const Span* spans = GetSpans(y);
+  for (int i = 0; i < num_of_spans_[y]; i++) {
+    if (x < spans[i].begin) {
+      break;
+    }
+    if (x < spans[i].end) {
+      return spans[i].sheet;
+    }
+  }
+  return nullptr;
+}
+
+bool SheetGrid::GetCellRange(Rect r,
+                             int& x0,
+                             int& y0,
+                             int& x1,
+                             int& y1) const {
+  if (r.xsize <= 0 || r.ysize <= 0) {
+    return false;
+  }
+  x0 = std::max(r.x, 0) >> kCellSizeExponent;
+  y0 = std::max(r.y, 0) >> kCellSizeExponent;
+  x1 = std::min(GetNumOfCells(std::max(r.GetRight(), 0)), xcells_);
+  y1 = std::min(GetNumOfCells(std::max(r.GetBottom(), 0)), ycells_);
+  return x0 < x1 && y0 < y1;
+}
+
+int SheetGrid::CountEntriesInRect(Rect r) const {
+  int x0, y0, x1, y1;
+  if (!GetCellRange(r, x0, y0, x1, y1)) {
+    return 0;
+  }
+  int n = 0;
+  for (int cy = y0; cy < y1; cy++) {
+    for (int cx = x0; cx < x1; cx++) {
+      const Cell& cell = cells_[cy * xcells_ + cx];
+      if (cell.is_overflowed) {
+        return -1;
+      }
+      n += cell.num_of_entries;
+    }
+  }
+  return n;
+}
+
+void SheetGrid::Insert(Sheet* sheet, Rect r) {
+  int x0, y0, x1, y1;
+  if (!GetCellRange(r, x0, y0, x1, y1)) {
+    return;
+  }
+  for (int cy = y0; cy < y1; cy++) {
+    for (int cx = x0; cx < x1; cx++) {
+      Cell& cell = cells_[cy * xcells_ + cx];
+      if (cell.is_overflowed) {
+        continue;
+      }
+      Chunk* c = cell.chunks;
+      if (!c || c->num_of_entries == kEntriesPerChunk) {
+        if (!free_chunks_) {
+          // Give the chunks to other cells since this one is not used any
+          // more.
+          while (cell.chunks) {
+            Chunk* next = cell.chunks->next;
+            FreeChunk(cell.chunks);
+            cell.chunks = next;
+          }
+          cell.num_of_entries = 0;
+          cell.is_overflowed = true;
+          continue;
+        }
+        c = free_chunks_;
+        free_chunks_ = c->next;
+        num_of_free_chunks_--;
+        c->next = cell.chunks;
+        c->num_of_entries = 0;
+        cell.chunks = c;
+      }
+      c->entries[c->num_of_entries++] = {sheet, r};
+      cell.num_of_entries++;
+    }
+  }
+}
+
+void SheetGrid::Remove(Sheet* sheet, Rect r) {
+  int x0, y0, x1, y1;
+  if (!GetCellRange(r, x0, y0, x1, y1)) {
+    return;
+  }
+  for (int cy = y0; cy < y1; cy++) {
+    for (int cx = x0; cx < x1; cx++) {
+      Cell& cell = cells_[cy * xcells_ + cx];
+      Entry* found = nullptr;
+      for (Chunk* c = cell.chunks; c && !found; c = c->next) {
+        for (int i = 0; i < c->num_of_entries; i++) {
+          if (c->entries[i].sheet == sheet) {
+            found = &c->entries[i];
+            break;
+          }
+        }
+      }
+      if (!found) {
+        continue;
+      }
+      // Fill the hole with the last entry of the first chunk.
+      Chunk* first = cell.chunks;
+      *found = first->entries[--first->num_of_entries];
+      cell.num_of_entries--;
+      if (!first->num_of_entries) {
+        cell.chunks = first->next;
+        FreeChunk(first);
+      }
+    }
+  }
+}
+
+int Sheet::FindChildrenInRect(Rect r, Sheet** children) const {
+  if (!grid_) {
+    return -1;
+  }
+  int x0, y0, x1, y1;
+  if (!grid_->GetCellRange(r, x0, y0, x1, y1)) {
+    return 0;
+  }
+  // Overflowed cells fall back to the list before any sheet is looked at.
+  for (int cy = y0; cy < y1; cy++) {
+    for (int cx = x0; cx < x1; cx++) {
+      if (grid_->IsOverflowed(cx, cy)) {
+        return -1;
+      }
+    }
+  }
+  int n = 0;
+  for (int cy = y0; cy < y1; cy++) {
+    for (int cx = x0; cx < x1; cx++) {
+      grid_->ForEachInCell(cx, cy, [&](const SheetGrid::Entry& e) {
+        const Rect overlap = e.rect.GetIntersectionWith(r);
+        if (overlap.xsize <= 0 || overlap.ysize <= 0) {
+          return;
+        }
+        // Sheets in many cells are taken only in the first one of them.
+        if (std::max(overlap.x, 0) >> SheetGrid::kCellSizeExponent != cx ||
+            std::max(overlap.y, 0) >> SheetGrid::kCellSizeExponent != cy) {
+          return;
+        }
+        if (n < kMaxChildrenInRect) {
+          children[n] = e.sheet;
+        }
+        n++;
+      });
+    }
+  }
+  if (n > kMaxChildrenInRect) {
+    return -1;
+  }
+  std::sort(children, children + n,
+            [](const Sheet* a, const Sheet* b) { return a->z_ < b->z_; });
+  return n;
+}
+
+// Bounding rect of the pixels transferred into a sheet, for its damage
+// handler.
+struct DamageBounds {
+  DamageBounds(Rect r)
+      : left(r.GetRight()), top(r.GetBottom()), right(r.x), bottom(r.y) {}
+  void Add(int y, int begin, int end) {
+    left = std::min(left, begin);
+    right = std::max(right, end);
+    top = std::min(top, y);
+    bottom = std::max(bottom, y + 1);
+  }
+  bool IsEmpty() const { return left >= right; }
+  Rect GetRect() const { return {left, top, right - left, bottom - top}; }
+  int left, top, right, bottom;
+};
+
+void Sheet::FlushChildrenInRect(Rect r, uint64_t z_end) {
+  r = r.GetIntersectionWith(GetClientRect());
+  if (!map_ || r.xsize <= 0 || r.ysize <= 0) {
+    return;
+  }
+  DamageBounds damage(r);
+  for (int y = r.y; y < r.GetBottom(); y++) {
+    if (map_->IsOverflowed(y)) {
+      for (int x = r.x; x < r.GetRight(); x++) {
+        Sheet* s = FindVisibleChildAt(x, y);
+        if (s && s->z_ < z_end) {
+          s->TransferRowToParent(y, x, x + 1);
+          damage.Add(y, x, x + 1);
+        }
+      }
+      continue;
+    }
+    const SheetSpanMap::Span* spans = map_->GetSpans(y);
+    for (int i = 0; i < map_->GetNumOfSpans(y); i++) {
+      if (spans[i].begin >= r.GetRight()) {
+        break;
+      }
+      const int begin = std::max(spans[i].begin, r.x);
+      const int end = std::min(spans[i].end, r.GetRight());
+      if (begin < end && spans[i].sheet->z_ < z_end) {
+        spans[i].sheet->TransferRowToParent(y, begin, end);
+        damage.Add(y, begin, end);
+      }
+    }
+  }
+  if (damage_handler_ && !damage.IsEmpty()) {
+    damage_handler_(damage.GetRect());
+  }
+}
+
+Sheet* Sheet::FindInsertionPointAtFront() const {
+  Sheet* s = parent_->top_child_;
+  if (is_topmost_) {
+    return s;
+  }
+  while (s && s->is_topmost_) {
+    s = s->lower_;
+  }
+  return s;
+}
+
+void Sheet::LinkAbove(Sheet* lower) {
+  lower_ = lower;
+  upper_ = lower ? lower->upper_ : parent_->bottom_child_;
+  (lower ? lower->upper_ : parent_->bottom_child_) = this;
+  (upper_ ? upper_->lower_ : parent_->top_child_) = this;
+  const uint64_t z_lower = lower_ ? lower_->z_ : 0;
+  const uint64_t z_upper = upper_ ? upper_->z_ : z_lower + 2 * kZStep;
+  if (z_upper - z_lower >= 2) {
+    z_ = z_lower + (z_upper - z_lower) / 2;
+    return;
+  }
+  // No room between the neighbors. Renumber all the siblings.
+  uint64_t z = kZStep;
+  for (Sheet* s = parent_->bottom_child_; s; s = s->upper_) {
+    s->z_ = z;
+    z += kZStep;
+  }
+}
+
+void Sheet::Unlink() {
+  (lower_ ? lower_->upper_ : parent_->bottom_child_) = upper_;
+  (upper_ ? upper_->lower_ : parent_->top_child_) = lower_;
+  upper_ = nullptr;
+  lower_ = nullptr;
+}
+
+void Sheet::PaintMapRow(int y, int left, int right, Sheet* s) {
+  if (y < s->GetY() || s->GetRect().GetBottom() <= y) {
+    return;
+  }
+  const int begin = std::max(s->GetX(), left);
+  const int end = std::min(s->GetRect().GetRight(), right);
+  if (!s->is_alpha_enabled_) {
+    map_->PaintGaps(y, begin, end, s);
+    return;
+  }
+  // Alpha enabled: only runs of opaque pixels hide sheets below.
+  for (int x = begin; x < end;) {
+    if (!s->IsOpaqueAt(x, y)) {
+      x++;
+      continue;
+    }
+    int run_end = x + 1;
+    while (run_end < end && s->IsOpaqueAt(run_end, y)) {
+      run_end++;
+    }
+    map_->PaintGaps(y, x, run_end, s);
+    x = run_end;
+  }
+}
+
+// Adds spans of s to the sorted spans in band for the parts of [begin, end)
+// which they do not cover yet. Returns false if band runs out of spans.
+static bool AddToBand(SheetSpanMap::Span* band,
+                      int& num_of_spans,
+                      int max_spans,
+                      int begin,
+                      int end,
+                      Sheet* s) {
+  SheetSpanMap::Span merged[Sheet::kMaxSpansInBand];
+  int n = 0;
+  int x = begin;
+  for (int i = 0; i <= num_of_spans; i++) {
+    const int next = i < num_of_spans ? band[i].begin : end;
+    if (x < end && x < next) {
+      if (n >= max_spans) {
+        return false;
+      }
+      merged[n++] = {x, std::min(next, end), s};
+    }
+    if (i == num_of_spans) {
+      break;
+    }
+    if (n >= max_spans) {
+      return false;
+    }
+    merged[n++] = band[i];
+    x = std::max(x, band[i].end);
+  }
+  for (int i = 0; i < n; i++) {
+    band[i] = merged[i];
+  }
+  num_of_spans = n;
+  return true;
+}
+
+int Sheet::ComposeMapBand(Rect target,
+                          int y,
+                          Sheet* const* children,
+                          int n,
+                          int max_children,
+                          SheetSpanMap::Span* band,
+                          int& num_of_band_spans) const {
+  const int left = target.x;
+  const int right = target.GetRight();
+  int band_end = target.GetBottom();
+  int covered = 0;
+  num_of_band_spans = 0;
+  Sheet* s = n < 0 ? top_child_ : nullptr;
+  for (int i = n - 1; covered < right - left; i--) {
+    if (n >= 0) {
+      if (i < 0) {
+        break;
+      }
+      s = children[i];
+    } else if (!s) {
+      break;
+    } else if (max_children-- == 0) {
+      return y;
+    }
+    Sheet& c = *s;
+    s = s->lower_;
+    const int begin = std::max(c.GetX(), left);
+    const int end = std::min(c.GetRect().GetRight(), right);
+    if (begin >= end || c.GetRect().GetBottom() <= y) {
+      continue;
+    }
+    if (y < c.GetY()) {
+      // Rows from c.GetY() show c.
+      band_end = std::min(band_end, c.GetY());
+      continue;
+    }
+    if (c.is_alpha_enabled_) {
+      return y;
+    }
+    band_end = std::min(band_end, c.GetRect().GetBottom());
+    if (!AddToBand(band, num_of_band_spans, kMaxSpansInBand, begin, end,
+                   &c)) {
+      return y;
+    }
+    for (int k = 0; k < num_of_band_spans; k++) {
+      if (band[k].sheet == &c) {
+        covered += band[k].end - band[k].begin;
+      }
+    }
+  }
+  return band_end;
+}
+
+void Sheet::UpdateMap(Rect target) {
+  if (!map_) {
+    return;
+  }
+  target = target.GetIntersectionWith(GetClientRect());
+  // Only the target columns of each row are repainted, with the children
+  // which overlap the target. Overflowed rows are rebuilt as a whole with all
+  // the children so that they can recover. The grid returns every child
+  // which overlaps the target while a few children at the front often cover
+  // it, e.g. the raised one. So the children are walked from the front
+  // first, as far as the grid would visit its entries.
+  Sheet* children[kMaxChildrenInRect];
+  int n = -1;
+  const int max_front_children =
+      grid_ ? grid_->CountEntriesInRect(target) : -1;
+  bool is_grid_queried = max_front_children < 0;
+  SheetSpanMap::Span band[kMaxSpansInBand];
+  int num_of_band_spans = 0;
+  int band_end = target.y;
+  for (int y = target.y; y < target.GetBottom(); y++) {
+    if (y >= band_end && !is_grid_queried) {
+      band_end = ComposeMapBand(target, y, nullptr, -1,
+                                max_front_children, band,
+                                num_of_band_spans);
+      if (band_end == y) {
+        n = FindChildrenInRect(target, children);
+        is_grid_queried = true;
+      }
+    }
+    if (y >= band_end) {
+      band_end = ComposeMapBand(target, y, children, n, -1, band,
+                                num_of_band_spans);
+    }
+    if (y < band_end && !map_->IsOverflowed(y)) {
+      map_->Replace(y, target.x, target.GetRight(), band, num_of_band_spans);
+      continue;
+    }
+    int left = target.x;
+    int right = target.GetRight();
+    if (map_->IsOverflowed(y)) {
+      map_->ClearRow(y);
+      left = 0;
+      right = GetXSize();
+    } else {
+      map_->Paint(y, left, right, nullptr);
+    }
+    if (n < 0 || left != target.x || right != target.GetRight()) {
+      for (Sheet* s = top_child_; s && map_->HasGap(y, left, right);
+           s = s->lower_) {
+        PaintMapRow(y, left, right, s);
+      }
+      continue;
+    }
+    for (int i = n - 1; i >= 0 && map_->HasGap(y, left, right); i--) {
+      PaintMapRow(y, left, right, children[i]);
+    }
+  }
+}
+
+Sheet* Sheet::FindVisibleChildAt(int x, int y) const {
+  Sheet* found = nullptr;
+  if (ForEachChildNear(x, y, [&](const SheetGrid::Entry& e) {
+        if (e.rect.IsPointInRect(x, y) && (!found || found->z_ < e.sheet->z_) &&
+            e.sheet->IsOpaqueAt(x, y)) {
+          found = e.sheet;
+        }
+      })) {
+    return found;
+  }
+  for (Sheet* s = bottom_child_; s; s = s->upper_) {
+    if (s->IsOpaqueAt(x, y)) {
+      found = s;
+    }
+  }
+  return found;
+}
+
+Sheet* Sheet::GetVisibleChildAt(int x, int y) const {
+  if (!map_ || !GetClientRect().IsPointInRect(x, y)) {
+    return nullptr;
+  }
+  if (map_->IsOverflowed(y)) {
+    return FindVisibleChildAt(x, y);
+  }
+  return map_->GetSheetAt(x, y);
+}
+
+void Sheet::MovePixels(int to_x,
+                       int to_y,
+                       int from_x,
+                       int from_y,
+                       int w,
+                       int h) {
+  // Rows are moved in the order which does not overwrite rows to be read.
+  const bool is_backward = to_y > from_y;
+  for (int i = 0; i < h; i++) {
+    const int dy = is_backward ? h - 1 - i : i;
+    uint32_t* dst = &buf_[(to_y + dy) * pixels_per_scan_line_ + to_x];
+    const uint32_t* src = &buf_[(from_y + dy) * pixels_per_scan_line_ + from_x];
+    if (to_y != from_y) {
+      PixelKernels::CopyRow(dst, src, w);
+      continue;
+    }
+    // Within a row, copy in the direction which is safe on overlap.
+    if (to_x < from_x) {
+      for (int x = 0; x < w; x++) {
+        dst[x] = src[x];
+      }
+    } else {
+      for (int x = w - 1; x >= 0; x--) {
+        dst[x] = src[x];
+      }
+    }
+  }
+}
+
+bool Sheet::IsUnobscuredInParent(Rect r) const {
+  if (!parent_ || !parent_->map_ || is_alpha_enabled_ ||
+      r.GetIntersectionWith(parent_->GetClientRect()) != r) {
+    return false;
+  }
+  const SheetSpanMap& map = *parent_->map_;
+  for (int y = r.y; y < r.GetBottom(); y++) {
+    if (map.IsOverflowed(y)) {
+      return false;
+    }
+    // This sheet may be split into adjacent spans.
+    const SheetSpanMap::Span* spans = map.GetSpans(y);
+    int x = r.x;
+    for (int i = 0; i < map.GetNumOfSpans(y) && x < r.GetRight(); i++) {
+      if (spans[i].end <= x) {
+        continue;
+      }
+      if (x < spans[i].begin || spans[i].sheet != this) {
+        return false;
+      }
+      x = spans[i].end;
+    }
+    if (x < r.GetRight()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Sheet::MoveInParent(int to_x,
+                         int to_y,
+                         int from_x,
+                         int from_y,
+                         int w,
+                         int h) {
+  // Rows are processed in the same order as MovePixels(), so rows of the
+  // parent are not overwritten before being moved.
+  const bool is_backward = to_y > from_y;
+  bool is_all_moved = true;
+  for (int i = 0; i < h; i++) {
+    const int dy = is_backward ? h - 1 - i : i;
+    if (IsUnobscuredInParent({to_x, to_y + dy, w, 1}) &&
+        IsUnobscuredInParent({from_x, from_y + dy, w, 1})) {
+      parent_->MovePixels(to_x, to_y + dy, from_x, from_y + dy, w, 1);
+      continue;
+    }
+    FlushInParent(to_x, to_y + dy, w, 1);
+    is_all_moved = false;
+  }
+  if (parent_->damage_handler_) {
+    parent_->damage_handler_({to_x, to_y, w, h});
+  }
+  return is_all_moved;
+}
 
 void Sheet::BlockTransfer(int to_x,
                           int to_y,
                           int from_x,
                           int from_y,
                           int w,
-                          int h) {
-  uint32_t* b32 = reinterpret_cast<uint32_t*>(buf_);
-  if (w & 1) {
-    for (int dy = 0; dy < h; dy++) {
-      RepeatMove4Bytes(
-          w, &b32[(to_y + dy) * pixels_per_scan_line_ + (to_x)],
-          &b32[(from_y + dy) * pixels_per_scan_line_ + (from_x + 0)]);
+                          int h,
+                          bool propagate) {
+  MovePixels(to_x, to_y, from_x, from_y, w, h);
+  if (!propagate) {
+    Flush(to_x, to_y, w, h);
+    return;
+  }
+  // Coordinates are converted into those of the parent at each level.
+  for (Sheet* s = this; s->parent_; s = s->parent_) {
+    to_x += s->GetX();
+    to_y += s->GetY();
+    from_x += s->GetX();
+    from_y += s->GetY();
+    if (!s->MoveInParent(to_x, to_y, from_x, from_y, w, h)) {
+      return;
+    }
+  }
+}
+
+void Sheet::TransferRowToParent(int y, int begin, int end) {
+  uint32_t* dst = &parent_->buf_[y * parent_->pixels_per_scan_line_ + begin];
+  if (!is_alpha_enabled_) {
+    PixelKernels::CopyRow(dst, GetBufAtParentPos(begin, y), end - begin);
+    return;
+  }
+  // Composes the sheets below over a cleared row first so that blending
+  // does not accumulate on repeated flushes, even where no sheet is below.
+  PixelKernels::FillRow(dst, 0, end - begin);
+  for (Sheet* s = parent_->bottom_child_; s != this; s = s->upper_) {
+    if (y < s->GetY() || s->GetRect().GetBottom() <= y) {
+      continue;
+    }
+    const int b = std::max(begin, s->GetX());
+    const int e = std::min(end, s->GetRect().GetRight());
+    if (b >= e) {
+      continue;
     }
-  } else {
-    for (int dy = 0; dy < h; dy++) {
-      RepeatMove8Bytes(
-          w / 2, &b32[(to_y + dy) * pixels_per_scan_line_ + (to_x)],
-          &b32[(from_y + dy) * pixels_per_scan_line_ + (from_x + 0)]);
+    if (s->is_alpha_enabled_) {
+      PixelKernels::BlendRow(&dst[b - begin], s->GetBufAtParentPos(b, y),
+                             e - b);
+    } else {
+      PixelKernels::CopyRow(&dst[b - begin], s->GetBufAtParentPos(b, y),
+                            e - b);
     }
   }
-  Flush(to_x, to_y, w, h);
+  PixelKernels::BlendRow(dst, GetBufAtParentPos(begin, y), end - begin);
 }
 
 void Sheet::FlushInParent(int rx, int ry, int rw, int rh) {
@@ -39,17 +690,35 @@ void Sheet::FlushInParent(int rx, int ry, int rw, int rh) {
   assert(0 <= tx && 0 <= ty && (tx + tw) <= parent_->rect_.xsize &&
          (ty + th) <= parent_->rect_.ysize);
 
-  const auto parent_map = parent_->map_;
-  const auto parent_line_size = parent_->GetPixelsPerScanLine();
-  const auto parent_buf = parent_->buf_;
+  const SheetSpanMap& parent_map = *parent_->map_;
+  DamageBounds damage({tx, ty, tw, th});
+  auto transfer = [&](int y, int begin, int end) {
+    TransferRowToParent(y, begin, end);
+    damage.Add(y, begin, end);
+  };
   for (int y = ty; y < ty + th; y++) {
-    for (int x = tx; x < tx + tw; x++) {
-      if (parent_map[y * parent_line_size + x] != this) {
-        continue;
+    if (parent_map.IsOverflowed(y)) {
+      for (int x = tx; x < tx + tw; x++) {
+        if (parent_->FindVisibleChildAt(x, y) == this) {
+          transfer(y, x, x + 1);
+        }
       }
-      parent_buf[y * parent_line_size + x] =
-          buf_[(y - rect_.y) * pixels_per_scan_line_ + (x - rect_.x)];
+      continue;
     }
+    const SheetSpanMap::Span* spans = parent_map.GetSpans(y);
+    for (int i = 0; i < parent_map.GetNumOfSpans(y); i++) {
+      if (spans[i].begin >= tx + tw) {
+        break;
+      }
+      const int begin = std::max(spans[i].begin, tx);
+      const int end = std::min(spans[i].end, tx + tw);
+      if (spans[i].sheet == this && begin < end) {
+        transfer(y, begin, end);
+      }
+    }
+  }
+  if (parent_->damage_handler_ && !damage.IsEmpty()) {
+    parent_->damage_handler_(damage.GetRect());
   }
 }
 
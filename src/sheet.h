@@ -3,6 +3,157 @@
 #include <stdint.h>
 #include "rect.h"
 
+class Sheet;
+
+// Occlusion map of the children of a sheet. Each row of the sheet has a list
+// of spans sorted by x, and a span is a run of pixels which shows the same
+// child. Pixels out of the spans show no child. So moving a child rebuilds
+// only the lists of the rows it covers, and flushing a child copies each of
+// its spans at once. Rows are rebuilt from the front child to the back one,
+// filling only the gaps, and stop once no gap is left, so children hidden
+// behind a window in front are not visited. Consecutive rows crossed by the
+// same edges of children get the same spans, so they are computed once for
+// such a band of rows and copied into each row.
+class SheetSpanMap {
+ public:
+  struct Span {
+    int begin, end;  // [begin, end)
+    Sheet* sheet;
+  };
+  // spans should have spans_per_row elements for each row, and num_of_spans
+  // should have ysize elements.
+  void Init(Span* spans, int* num_of_spans, int ysize, int spans_per_row) {
+    spans_ = spans;
+    num_of_spans_ = num_of_spans;
+    ysize_ = ysize;
+    spans_per_row_ = spans_per_row;
+    for (int y = 0; y < ysize_; y++) {
+      ClearRow(y);
+    }
+  }
+  void ClearRow(int y) { num_of_spans_[y] = 0; }
+  // Makes [begin, end) of the row y show sheet, over the spans painted before.
+  // If sheet is nullptr, the range shows no child. If the row runs out of
+  // spans, it is marked as overflowed and keeps so until cleared.
+  void Paint(int y, int begin, int end, Sheet* sheet) {
+    if (!sheet) {
+      Replace(y, begin, end, nullptr, 0);
+      return;
+    }
+    const Span span = {begin, end, sheet};
+    Replace(y, begin, end, &span, 1);
+  }
+  // Makes [begin, end) of the row y show the sorted spans in it and no child
+  // elsewhere, over the spans painted before.
+  void Replace(int y,
+               int begin,
+               int end,
+               const Span* new_spans,
+               int num_of_new_spans);
+  // Makes the pixels in [begin, end) of the row y which show no child yet
+  // show sheet.
+  void PaintGaps(int y, int begin, int end, Sheet* sheet);
+  // Returns true if some pixels in [begin, end) of the row y show no child.
+  // False for overflowed rows.
+  bool HasGap(int y, int begin, int end) const;
+  // Users should find visible sheets on an overflowed row by themselves.
+  bool IsOverflowed(int y) const { return num_of_spans_[y] < 0; }
+  int GetNumOfSpans(int y) const { return num_of_spans_[y]; }
+  const Span* GetSpans(int y) const { return &spans_[y * spans_per_row_]; }
+  // Returns nullptr if no child is at (x, y). The row should not be
+  // overflowed.
+  Sheet* GetSheetAt(int x, int y) const;
+
+ private:
+  Span* spans_;
+  int* num_of_spans_;
+  int ysize_;
+  int spans_per_row_;
+};
+
+// Index of the children of a sheet by the square cells of the sheet which
+// they overlap, so that looking for the children around a point or in a rect
+// visits only the children in the cells covering it, not all of them. The
+// sheets of a cell are kept with their rects in a list of chunks, which are
+// taken from a pool shared by all the cells. So a crowded cell grows as long
+// as the pool lasts, and queries test the rects without touching the sheets.
+// If the pool runs out, the cell is marked as overflowed and keeps so, and
+// users should walk all the children for queries touching the cell.
+// A query costs time in proportion to the sheets in the cells, not log N:
+// with large or crowded sheets it may cost more than walking the children.
+class SheetGrid {
+ public:
+  static constexpr int kCellSizeExponent = 6;
+  static constexpr int kCellSize = 1 << kCellSizeExponent;
+  static constexpr int kEntriesPerChunk = 10;
+  static constexpr int GetNumOfCells(int size) {
+    return (size + kCellSize - 1) >> kCellSizeExponent;
+  }
+  struct Entry {
+    Sheet* sheet;
+    Rect rect;  // of the sheet in the indexed sheet
+  };
+  struct Chunk {
+    Chunk* next;
+    int num_of_entries;
+    Entry entries[kEntriesPerChunk];
+  };
+  struct Cell {
+    // Only the first chunk may have free entries.
+    Chunk* chunks;
+    int num_of_entries;
+    bool is_overflowed;
+  };
+  // cells should have xcells * ycells elements. The cells share chunks.
+  void Init(Cell* cells, int xcells, int ycells, Chunk* chunks,
+            int num_of_chunks) {
+    cells_ = cells;
+    xcells_ = xcells;
+    ycells_ = ycells;
+    for (int i = 0; i < xcells_ * ycells_; i++) {
+      cells_[i] = {nullptr, 0, false};
+    }
+    free_chunks_ = nullptr;
+    num_of_free_chunks_ = 0;
+    for (int i = 0; i < num_of_chunks; i++) {
+      FreeChunk(&chunks[i]);
+    }
+  }
+  // r is the rect of the sheet in the indexed sheet.
+  void Insert(Sheet* sheet, Rect r);
+  void Remove(Sheet* sheet, Rect r);
+  // Gets the range of cells [x0, x1) x [y0, y1) which covers r. Returns
+  // false if r covers no cells.
+  bool GetCellRange(Rect r, int& x0, int& y0, int& x1, int& y1) const;
+  bool IsOverflowed(int cx, int cy) const {
+    return cells_[cy * xcells_ + cx].is_overflowed;
+  }
+  // Returns the number of entries in the cells covering r, which a query for
+  // r visits, or -1 if any of the cells is overflowed.
+  int CountEntriesInRect(Rect r) const;
+  // Calls f(const Entry&) for each sheet in the cell, in no particular order.
+  template <class F>
+  void ForEachInCell(int cx, int cy, F f) const {
+    for (const Chunk* c = cells_[cy * xcells_ + cx].chunks; c; c = c->next) {
+      for (int i = 0; i < c->num_of_entries; i++) {
+        f(c->entries[i]);
+      }
+    }
+  }
+  int GetNumOfFreeChunks() const { return num_of_free_chunks_; }
+
+ private:
+  void FreeChunk(Chunk* c) {
+    c->next = free_chunks_;
+    free_chunks_ = c;
+    num_of_free_chunks_++;
+  }
+  Cell* cells_;
+  int xcells_, ycells_;
+  Chunk* free_chunks_;
+  int num_of_free_chunks_;
+};
+
 class Sheet {
   friend class SheetPainter;
 
@@ -15,7 +166,9 @@ class Sheet {
             int y = 0) {
     parent_ = nullptr;
     upper_ = nullptr;
+    lower_ = nullptr;
     bottom_child_ = nullptr;
+    top_child_ = nullptr;
     buf_ = buf;
     rect_.xsize = xsize;
     rect_.ysize = ysize;
@@ -23,12 +176,28 @@ class Sheet {
     rect_.x = x;
     rect_.y = y;
     map_ = nullptr;
+    grid_ = nullptr;
+    z_ = 0;
     is_topmost_ = false;
     is_alpha_enabled_ = false;
+    damage_handler_ = nullptr;
   }
-  void SetMap(Sheet** map) {
+  // Called with the rect of this sheet which children have updated by
+  // flushing, e.g. to present it to the screen later.
+  using DamageHandler = void (*)(const Rect& rect);
+  void SetDamageHandler(DamageHandler handler) { damage_handler_ = handler; }
+  void SetMap(SheetSpanMap* map) {
     map_ = map;
-    UpdateMap(GetRect());
+    UpdateMap(GetClientRect());
+  }
+  void SetGrid(SheetGrid* grid) {
+    grid_ = grid;
+    if (!grid_) {
+      return;
+    }
+    for (Sheet* s = bottom_child_; s; s = s->upper_) {
+      grid_->Insert(s, s->GetRect());
+    }
   }
   void SetParent(Sheet* parent) {
     parent_ = parent;
@@ -36,15 +205,47 @@ class Sheet {
       return;
     }
     // Insert at front
-    Sheet** topmost_upper_holder_ = &parent_->bottom_child_;
-    while (*topmost_upper_holder_ && !(*topmost_upper_holder_)->is_topmost_) {
-      topmost_upper_holder_ = &(*topmost_upper_holder_)->upper_;
+    LinkAbove(FindInsertionPointAtFront());
+    if (parent_->grid_) {
+      parent_->grid_->Insert(this, GetRect());
     }
-    upper_ = *topmost_upper_holder_;
-    *topmost_upper_holder_ = this;
     parent_->UpdateMap(GetRect());
     Flush();
   }
+  // Moves this sheet to the front of its siblings, but behind the topmost
+  // ones unless this is topmost.
+  void Raise() {
+    if (!parent_) {
+      return;
+    }
+    Unlink();
+    LinkAbove(FindInsertionPointAtFront());
+    parent_->UpdateMap(GetRect());
+    Flush();
+  }
+  // Moves this sheet to the back of its siblings.
+  void Lower() {
+    if (!parent_) {
+      return;
+    }
+    Unlink();
+    LinkAbove(nullptr);
+    parent_->UpdateMap(GetRect());
+    parent_->FlushChildrenInRect(GetRect(), kZMax);
+  }
+  // Removes this sheet from its parent, showing the sheets behind it.
+  void RemoveFromParent() {
+    if (!parent_) {
+      return;
+    }
+    Unlink();
+    if (parent_->grid_) {
+      parent_->grid_->Remove(this, GetRect());
+    }
+    parent_->UpdateMap(GetRect());
+    parent_->FlushChildrenInRect(GetRect(), kZMax);
+    parent_ = nullptr;
+  }
   void SetPosition(int x, int y) {
     const auto prev_rect = GetRect();
     rect_.x = x;
@@ -54,6 +255,10 @@ class Sheet {
     }
     const auto next_rect = GetRect();
     const auto intersection = prev_rect.GetIntersectionWith(next_rect);
+    if (parent_->grid_) {
+      parent_->grid_->Remove(this, prev_rect);
+      parent_->grid_->Insert(this, next_rect);
+    }
 
     // TODO(hikalium): avoid updating overwrapped area
     if (intersection.IsEmptyRect()) {
@@ -88,8 +293,23 @@ class Sheet {
       }
     }
 
-    for (Sheet* s = parent_->bottom_child_; s && s != this; s = s->upper_) {
-      s->FlushInParent(prev_rect.x, prev_rect.y, GetXSize(), GetYSize());
+    if (is_alpha_enabled_ || intersection.IsEmptyRect()) {
+      parent_->FlushChildrenInRect(prev_rect, z_);
+    } else {
+      // The intersection still shows this sheet, so only the parts of
+      // prev_rect around it are exposed.
+      const Rect& i = intersection;
+      parent_->FlushChildrenInRect(
+          {prev_rect.x, prev_rect.y, prev_rect.xsize, i.y - prev_rect.y}, z_);
+      parent_->FlushChildrenInRect({prev_rect.x, i.GetBottom(),
+                                    prev_rect.xsize,
+                                    prev_rect.GetBottom() - i.GetBottom()},
+                                   z_);
+      parent_->FlushChildrenInRect(
+          {prev_rect.x, i.y, i.x - prev_rect.x, i.ysize}, z_);
+      parent_->FlushChildrenInRect(
+          {i.GetRight(), i.y, prev_rect.GetRight() - i.GetRight(), i.ysize},
+          z_);
     }
     FlushInParent(GetX(), GetY(), GetXSize(), GetYSize());
   }
@@ -117,62 +337,146 @@ class Sheet {
   uint32_t* GetBuf() const { return buf_; }
   Rect GetRect() const { return rect_; }
   Rect GetClientRect() const { return {0, 0, rect_.xsize, rect_.ysize}; }
-  void BlockTransfer(int to_x, int to_y, int from_x, int from_y, int w, int h);
+  // Moves the pixels of w x h at (from_x, from_y) to (to_x, to_y), and
+  // flushes the rect moved to. The rects may overlap.
+  // With propagate, rows which the parent shows as they are in both rects
+  // are moved in the parent as well instead of being flushed, and so on for
+  // its ancestors while all the rows are moved. Users should keep the pixels
+  // in the rects flushed to use it.
+  void BlockTransfer(int to_x,
+                     int to_y,
+                     int from_x,
+                     int from_y,
+                     int w,
+                     int h,
+                     bool propagate = false);
   // Flush fluhes the contents of sheet buf_ to its parent sheet.
   // This function is not recursive.
   void FlushInParent(int px, int py, int w, int h);
   void Flush(int px, int py, int w, int h);
   void Flush() { Flush(0, 0, rect_.xsize, rect_.ysize); };
   Sheet* GetChildAtBottom() { return bottom_child_; }
+  Sheet* GetChildAtTop() { return top_child_; }
   Sheet* GetUpper() { return upper_; }
+  Sheet* GetLower() { return lower_; }
+  // Returns the frontmost child whose rect contains (x, y) and for which
+  // is_target returns true, or nullptr. Alpha is not taken into account.
+  template <typename F>
+  Sheet* FindChildAt(int x, int y, F is_target) {
+    // The sheets of a cell are not sorted: the frontmost one is searched.
+    Sheet* found = nullptr;
+    if (ForEachChildNear(x, y, [&](const SheetGrid::Entry& e) {
+          if (e.rect.IsPointInRect(x, y) && (!found || found->z_ < e.sheet->z_) &&
+              is_target(*e.sheet)) {
+            found = e.sheet;
+          }
+        })) {
+      return found;
+    }
+    for (Sheet* s = top_child_; s; s = s->lower_) {
+      if (s->GetRect().IsPointInRect(x, y) && is_target(*s)) {
+        return s;
+      }
+    }
+    return nullptr;
+  }
+  // Returns the child which is visible at (x, y) in this sheet, or nullptr.
+  // Only valid for sheets with a map.
+  Sheet* GetVisibleChildAt(int x, int y) const;
+  // Spans of a band of rows computed at once by UpdateMap.
+  static constexpr int kMaxSpansInBand = 64;
 
  private:
-  void UpdateMap(Rect target) {
-    if (!map_) {
-      return;
+  static constexpr int kMaxChildrenInRect = 128;
+  // Keys of the order of siblings: lower ones have smaller keys.
+  static constexpr uint64_t kZStep = 1ULL << 32;
+  static constexpr uint64_t kZMax = ~0ULL;
+
+  // Stores the children which overlap r into children from the back to the
+  // front and returns the number of them. Returns -1 if the grid can not
+  // tell or there are more than kMaxChildrenInRect of them: callers should
+  // walk the children instead.
+  int FindChildrenInRect(Rect r, Sheet** children) const;
+  // Calls f(const SheetGrid::Entry&) for each child in the cell of the grid
+  // which contains (x, y), which may not contain the point, in no particular
+  // order. Returns false if the grid can not tell.
+  template <class F>
+  bool ForEachChildNear(int x, int y, F f) const {
+    if (!grid_) {
+      return false;
     }
-    target = target.GetIntersectionWith(GetClientRect());
-    for (int y = target.y; y < target.GetBottom(); y++) {
-      for (int x = target.x; x < target.GetRight(); x++) {
-        map_[y * GetXSize() + x] = nullptr;
-      }
+    int x0, y0, x1, y1;
+    if (!grid_->GetCellRange({x, y, 1, 1}, x0, y0, x1, y1)) {
+      return true;
     }
-    for (Sheet* s = bottom_child_; s; s = s->upper_) {
-      if (s->is_alpha_enabled_) {
-        // Alpha enabled
-        const auto sbuf = s->buf_;
-        const auto sppl = s->GetPixelsPerScanLine();
-        const auto sy = s->GetY();
-        const auto sx = s->GetX();
-        Rect in_view = target.GetIntersectionWith(s->GetRect());
-        for (int y = in_view.y; y < in_view.y + in_view.ysize; y++) {
-          for (int x = in_view.x; x < in_view.x + in_view.xsize; x++) {
-            if ((sbuf[(y - sy) * sppl + (x - sx)] >> 24) == 0x00) {
-              continue;
-            }
-            map_[y * GetPixelsPerScanLine() + x] = s;
-          }
-        }
-      } else {
-        // Alpha disabled
-        Rect in_view = target.GetIntersectionWith(s->GetRect());
-        for (int y = in_view.y; y < in_view.y + in_view.ysize; y++) {
-          for (int x = in_view.x; x < in_view.x + in_view.xsize; x++) {
-            map_[y * GetPixelsPerScanLine() + x] = s;
-          }
-        }
-      }
+    if (grid_->IsOverflowed(x0, y0)) {
+      return false;
     }
+    grid_->ForEachInCell(x0, y0, f);
+    return true;
+  }
+  // Flushes the pixels in r of the children which are behind z_end. The
+  // visible child of each span of the map is flushed in a single pass over
+  // the rows, rather than walking the rows once for each child.
+  void FlushChildrenInRect(Rect r, uint64_t z_end);
+  // Returns the sibling which a new front sheet should be linked above.
+  Sheet* FindInsertionPointAtFront() const;
+  // Links this into the siblings above lower, or at the back if lower is
+  // nullptr.
+  void LinkAbove(Sheet* lower);
+  void Unlink();
+  // Moves pixels in buf_ as BlockTransfer() does, without flushing.
+  void MovePixels(int to_x, int to_y, int from_x, int from_y, int w, int h);
+  // Returns true if the parent shows the pixels of this sheet as they are in
+  // r, which is in the parent coordinates.
+  bool IsUnobscuredInParent(Rect r) const;
+  // Moves the rows of the rects in the parent coordinates in the parent if
+  // they are unobscured, or flushes them. Returns true if all are moved.
+  bool MoveInParent(int to_x, int to_y, int from_x, int from_y, int w, int h);
+  // Paints the pixels of the child s in [left, right) of the row y of the
+  // map which are not painted yet, i.e. not hidden by children in front.
+  void PaintMapRow(int y, int left, int right, Sheet* s);
+  // Computes the spans in [target.x, target.GetRight()) of the rows from y
+  // with the children (all of them if n < 0, up to max_children from the
+  // front unless it is negative), and returns the end of the rows which have
+  // the same spans. Returns y if the spans should be painted row by row, for
+  // children with alpha or too many spans, or if max_children of them do not
+  // cover the target.
+  int ComposeMapBand(Rect target,
+                     int y,
+                     Sheet* const* children,
+                     int n,
+                     int max_children,
+                     SheetSpanMap::Span* band,
+                     int& num_of_band_spans) const;
+  // Rebuilds rows of the map which the target rect covers.
+  void UpdateMap(Rect target);
+  // Same as GetVisibleChildAt() but looks up the children instead of the map.
+  Sheet* FindVisibleChildAt(int x, int y) const;
+  bool IsOpaqueAt(int x, int y) const {
+    // (x, y) is in the parent coordinates.
+    return IsInRectOnParent(x, y) &&
+           (!is_alpha_enabled_ || (*GetBufAtParentPos(x, y) >> 24) != 0);
+  }
+  // Returns the pixel of buf_ at (x, y) in the parent coordinates.
+  const uint32_t* GetBufAtParentPos(int x, int y) const {
+    return &buf_[(y - rect_.y) * pixels_per_scan_line_ + (x - rect_.x)];
   }
   bool IsInRectY(int y) { return 0 <= y && y < rect_.ysize; }
-  bool IsInRectOnParent(int x, int y) {
+  bool IsInRectOnParent(int x, int y) const {
     return rect_.y <= y && y < rect_.y + rect_.ysize && rect_.x <= x &&
            x < rect_.x + rect_.xsize;
   }
   void TransferLineFrom(Sheet& src, int py, int px, int w);
-  Sheet *parent_, *upper_, *bottom_child_;
+  // Writes [begin, end) of the row y in the parent coordinates, which shows
+  // this sheet, into the parent.
+  void TransferRowToParent(int y, int begin, int end);
+  Sheet *parent_, *upper_, *lower_, *bottom_child_, *top_child_;
   uint32_t* buf_;
-  Sheet** map_;
+  SheetSpanMap* map_;
+  SheetGrid* grid_;
+  uint64_t z_;
+  DamageHandler damage_handler_;
   Rect rect_;
   int pixels_per_scan_line_;
   bool is_topmost_;
@@ -1,28 +1,64 @@
 #include "sheet_painter.h"
 
 #include "asm.h"
+#include "pixel_kernels.h"
 
-// @font.gen.c
-extern uint8_t font[0x100][16];
+// Shared by all tasks without locking. Since glyphs of one color pair never
+// evict each other, concurrent lookups of the default colors only race on
+// expanding the same glyph into the same entry.
+static GlyphCache glyph_cache_;
+
+const GlyphCache::Stats& SheetPainter::GetGlyphCacheStats() {
+  return glyph_cache_.GetStats();
+}
 
 void SheetPainter::DrawCharacter(Sheet& s,
                                  char c,
                                  int px,
                                  int py,
                                  bool do_flush) {
-  if (!s.buf_)
+  DrawCharacters(s, &c, 1, px, py, kDefaultForeground, kDefaultBackground,
+                 do_flush);
+}
+
+void SheetPainter::DrawString(Sheet& sheet,
+                              const char* s,
+                              int px,
+                              int py,
+                              bool do_flush) {
+  int n = 0;
+  while (s[n])
+    n++;
+  DrawCharacters(sheet, s, n, px, py, kDefaultForeground, kDefaultBackground,
+                 do_flush);
+}
+
+void SheetPainter::DrawCharacters(Sheet& s,
+                                  const char* str,
+                                  int n,
+                                  int px,
+                                  int py,
+                                  uint32_t fg,
+                                  uint32_t bg,
+                                  bool do_flush) {
+  if (!s.buf_ || n <= 0)
     return;
+  constexpr int kW = GlyphCache::kWidth;
+  constexpr int kH = GlyphCache::kHeight;
   uint32_t* b32 = reinterpret_cast<uint32_t*>(s.buf_);
-  for (int dy = 0; dy < 16; dy++) {
-    for (int dx = 0; dx < 8; dx++) {
-      uint32_t col = ((font[(uint8_t)c][dy] >> (7 - dx)) & 1) ? 0xffffff : 0;
-      int x = px + dx;
-      int y = py + dy;
-      b32[y * s.pixels_per_scan_line_ + x] = col;
+  for (int i = 0; i < n; i++) {
+    const GlyphCache::Glyph& g = glyph_cache_.Lookup(str[i], fg, bg);
+    uint32_t* dst = &b32[py * s.pixels_per_scan_line_ + px + i * kW];
+    for (int dy = 0; dy < kH; dy++) {
+      // A fixed-size row of the glyph, copied without a loop at run time.
+      for (int dx = 0; dx < kW; dx++) {
+        dst[dx] = g.rows[dy][dx];
+      }
+      dst += s.pixels_per_scan_line_;
     }
   }
   if (do_flush)
-    s.Flush(px, py, 8, 16);
+    s.Flush(px, py, n * kW, kH);
 }
 
 void SheetPainter::DrawCharacterForeground(Sheet& s,
@@ -57,15 +93,8 @@ void SheetPainter::DrawRect(Sheet& s,
   if (!s.buf_)
     return;
   uint32_t* b32 = reinterpret_cast<uint32_t*>(s.buf_);
-  if (w & 1) {
-    for (int y = py; y < py + h; y++) {
-      RepeatStore4Bytes(w, &b32[y * s.pixels_per_scan_line_ + px], col);
-    }
-  } else {
-    for (int y = py; y < py + h; y++) {
-      RepeatStore8Bytes(w / 2, &b32[y * s.pixels_per_scan_line_ + px],
-                        ((uint64_t)col << 32) | col);
-    }
+  for (int y = py; y < py + h; y++) {
+    PixelKernels::FillRow(&b32[y * s.pixels_per_scan_line_ + px], col, w);
   }
   if (do_flush)
     s.Flush(px, py, w, h);
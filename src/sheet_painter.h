@@ -1,8 +1,12 @@
 #pragma once
+#include "glyph_cache.h"
 #include "sheet.h"
 
 class SheetPainter {
  public:
+  static constexpr uint32_t kDefaultForeground = 0xffffff;
+  static constexpr uint32_t kDefaultBackground = 0x000000;
+
   static void DrawCharacter(Sheet&,
                             char c,
                             int px,
@@ -12,16 +16,18 @@ class SheetPainter {
                          const char* s,
                          int px,
                          int py,
-                         bool do_flush = false) {
-    int i;
-    for (i = 0; s[i]; i++) {
-      DrawCharacter(sheet, s[i], px + 8 * i, py, false);
-    }
-    if (!do_flush) {
-      return;
-    }
-    sheet.Flush(px, py, px + 8 * i, py + 16);
-  };
+                         bool do_flush = false);
+  // Draws n characters of s from (px, py), with fg on bg, copying the rows
+  // of each cached glyph. Flushes the whole run at once.
+  static void DrawCharacters(Sheet& sheet,
+                             const char* s,
+                             int n,
+                             int px,
+                             int py,
+                             uint32_t fg,
+                             uint32_t bg,
+                             bool do_flush = false);
+  static const GlyphCache::Stats& GetGlyphCacheStats();
   static void DrawCharacterForeground(Sheet&,
                                       char c,
                                       int px,
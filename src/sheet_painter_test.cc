@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <vector>
+
+[[noreturn]] void Panic(const char* s) {
+  puts(s);
+  exit(EXIT_FAILURE);
+}
+#include "pixel_kernels.h"
+#include "sheet.h"
+#include "sheet_painter.h"
+
+// The test does not depend on the generated font.
+uint8_t font[0x100][16];
+
+static void InitFont() {
+  uint32_t v = 1;
+  for (int c = 0; c < 0x100; c++) {
+    for (int y = 0; y < 16; y++) {
+      v = v * 1103515245 + 12345;
+      font[c][y] = static_cast<uint8_t>(v >> 16);
+    }
+  }
+}
+
+// Draws a character by testing a bit per pixel as SheetPainter used to do.
+static void DrawCharacterPerPixel(uint32_t* buf,
+                                  int pixels_per_scan_line,
+                                  char c,
+                                  int px,
+                                  int py,
+                                  uint32_t fg,
+                                  uint32_t bg) {
+  for (int dy = 0; dy < 16; dy++) {
+    for (int dx = 0; dx < 8; dx++) {
+      uint32_t col = ((font[(uint8_t)c][dy] >> (7 - dx)) & 1) ? fg : bg;
+      buf[(py + dy) * pixels_per_scan_line + px + dx] = col;
+    }
+  }
+}
+
+static void TestDrawCharacters() {
+  constexpr int kXSize = 8 * 0x100 + 8;
+  constexpr int kPixelsPerScanLine = kXSize + 3;
+  constexpr int kYSize = 16 * 3;
+  std::vector<uint32_t> buf(kPixelsPerScanLine * kYSize, 0x123456);
+  std::vector<uint32_t> expected = buf;
+  Sheet sheet;
+  sheet.Init(buf.data(), kXSize, kYSize, kPixelsPerScanLine, 0, 0);
+
+  char all[0x100];
+  for (int i = 0; i < 0x100; i++) {
+    all[i] = static_cast<char>(i);
+  }
+  // The last row is drawn with the glyphs cached for the first row.
+  const uint32_t colors[][2] = {
+      {0xffffff, 0x000000}, {0x00ff00, 0x000080}, {0xffffff, 0x000000}};
+  for (int row = 0; row < 3; row++) {
+    const uint32_t fg = colors[row][0];
+    const uint32_t bg = colors[row][1];
+    SheetPainter::DrawCharacters(sheet, all, 0x100, 8, row * 16, fg, bg);
+    for (int i = 0; i < 0x100; i++) {
+      DrawCharacterPerPixel(expected.data(), kPixelsPerScanLine, all[i],
+                            8 + i * 8, row * 16, fg, bg);
+    }
+  }
+  assert(SheetPainter::GetGlyphCacheStats().hits == 0x100);
+  // Evicts glyphs of one of the pairs above.
+  SheetPainter::DrawCharacters(sheet, "abc", 3, 0, 16, 0xff0000, 0x0000ff);
+  for (int i = 0; i < 3; i++) {
+    DrawCharacterPerPixel(expected.data(), kPixelsPerScanLine, "abc"[i], i * 8,
+                          16, 0xff0000, 0x0000ff);
+  }
+  assert(buf == expected);
+}
+
+static void TestDrawStringFlush() {
+  // A string is flushed to the parent at once and only where it is drawn.
+  constexpr int kXSize = 64;
+  constexpr int kYSize = 48;
+  std::vector<uint32_t> child_buf(kXSize * kYSize, 0);
+  std::vector<uint32_t> parent_buf(kXSize * kYSize, 0x808080);
+  Sheet parent, child;
+  parent.Init(parent_buf.data(), kXSize, kYSize, kXSize, 0, 0);
+  constexpr int kSpansPerRow = 4;
+  SheetSpanMap map;
+  SheetSpanMap::Span spans[kYSize * kSpansPerRow];
+  int num_of_spans[kYSize];
+  map.Init(spans, num_of_spans, kYSize, kSpansPerRow);
+  parent.SetMap(&map);
+  child.Init(child_buf.data(), kXSize, kYSize, kXSize, 0, 0);
+  child.SetParent(&parent);  // This flushes the child as well
+  std::fill(parent_buf.begin(), parent_buf.end(), 0x808080);
+  SheetPainter::DrawString(child, "xyz", 16, 8, true);
+  SheetPainter::DrawRect(child, 0, 32, kXSize, 16, 0xff0000, false);
+  for (int y = 0; y < kYSize; y++) {
+    for (int x = 0; x < kXSize; x++) {
+      const bool in_string = 16 <= x && x < 16 + 8 * 3 && 8 <= y && y < 24;
+      const uint32_t p = parent_buf[y * kXSize + x];
+      assert(p == (in_string ? child_buf[y * kXSize + x] : 0x808080u));
+    }
+  }
+}
+
+static void BenchmarkDrawString() {
+  // Draws screens of 80-column lines like the console does.
+  constexpr int kColumns = 80;
+  constexpr int kRows = 30;
+  constexpr int kXSize = kColumns * 8;
+  constexpr int kYSize = kRows * 16;
+  constexpr int kNumOfScreens = 50;
+  std::vector<uint32_t> buf(kXSize * kYSize);
+  Sheet sheet;
+  sheet.Init(buf.data(), kXSize, kYSize, kXSize, 0, 0);
+  char line[kColumns];
+  for (int i = 0; i < kColumns; i++) {
+    line[i] = static_cast<char>(' ' + i % 95);
+  }
+  auto measure = [](auto draw_line) {
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < kNumOfScreens; i++) {
+      for (int y = 0; y < kRows; y++) {
+        draw_line(y * 16);
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    return kNumOfScreens * kRows * kColumns /
+           std::chrono::duration<double, std::micro>(end - begin).count();
+  };
+  const double per_pixel = measure([&](int py) {
+    for (int x = 0; x < kColumns; x++) {
+      DrawCharacterPerPixel(buf.data(), kXSize, line[x], x * 8, py, 0xffffff,
+                            0x000000);
+    }
+  });
+  const double per_character = measure([&](int py) {
+    for (int x = 0; x < kColumns; x++) {
+      SheetPainter::DrawCharacter(sheet, line[x], x * 8, py);
+    }
+  });
+  const double per_run = measure([&](int py) {
+    SheetPainter::DrawCharacters(sheet, line, kColumns, 0, py, 0xffffff,
+                                 0x000000);
+  });
+  printf("per-pixel %7.1f, cached per char %7.1f, cached per run %7.1f "
+         "MChars/s\n",
+         per_pixel, per_character, per_run);
+}
+
+int main() {
+  InitFont();
+  TestDrawCharacters();
+  TestDrawStringFlush();
+  BenchmarkDrawString();
+  puts("PASS");
+  return 0;
+}
@@ -2,14 +2,25 @@
 #include <stdlib.h>
 
 #include <cassert>
+#include <chrono>
 #include <functional>
+#include <vector>
 
 [[noreturn]] void Panic(const char* s) {
   puts(s);
   exit(EXIT_FAILURE);
 }
+#include "pixel_kernels.h"
 #include "sheet.h"
 
+template <int kYSize, int kSpansPerRow = 8>
+struct TestSpanMap {
+  TestSpanMap() { map.Init(spans, num_of_spans, kYSize, kSpansPerRow); }
+  SheetSpanMap map;
+  SheetSpanMap::Span spans[kYSize * kSpansPerRow];
+  int num_of_spans[kYSize];
+};
+
 static void TestFlushSheets(int x,
                             int y,
                             std::function<bool(int)> is_in_refresh_range) {
@@ -22,12 +33,12 @@ static void TestFlushSheets(int x,
   }
   uint32_t* src_buf = &src_mem[4];
   uint32_t* dst_buf = &dst_mem[4];
-  Sheet* dst_map[3 * 3];
+  TestSpanMap<2> dst_map;
 
   Sheet src, dst;
   src.Init(src_buf, 2, 2, 2, x, y);
   dst.Init(dst_buf, 2, 2, 2, 0, 0);
-  dst.SetMap(dst_map);
+  dst.SetMap(&dst_map.map);
 
   for (uint32_t i = 0; i < 12; i++) {
     assert(dst_mem[i] == i);
@@ -55,11 +66,11 @@ static void TestFlushOverwrapped(
   uint32_t sheet0_buf[3 * 3];
   uint32_t sheet1_buf[3 * 3];
   uint32_t sheet2_buf[3 * 3];
-  Sheet* sheet0_map[3 * 3];
+  TestSpanMap<3> sheet0_map;
 
   Sheet s0, s1, s2;
   s0.Init(sheet0_buf, 3, 3, 3, 0, 0);
-  s0.SetMap(sheet0_map);
+  s0.SetMap(&sheet0_map.map);
   s1.Init(sheet1_buf, 3, 3, 3, x1, y1);
   s2.Init(sheet2_buf, 3, 3, 3, x2, y2);
   s2.SetParent(&s0);
@@ -154,22 +165,26 @@ void ExpectEqBuf(uint32_t* actual, uint32_t* expected, int w, int h, int line) {
 #define EXPECT_EQ_BUF_3x3(actual, expected) \
   ExpectEqBuf((uint32_t*)actual, (uint32_t*)expected, 3, 3, __LINE__)
 
-void ExpectEqMap(void** actual, void** expected, int w, int h, int line) {
+void ExpectEqMap(const Sheet& parent,
+                 Sheet** expected,
+                 int w,
+                 int h,
+                 int line) {
   printf("%s on line %d:\n", __func__, line);
   for (int y = 0; y < h; y++) {
     for (int x = 0; x < w; x++) {
-      printf("%18p ", (void*)actual[y * w + x]);
+      printf("%18p ", (void*)parent.GetVisibleChildAt(x, y));
     }
     printf("\n");
   }
   for (int y = 0; y < h; y++) {
     for (int x = 0; x < w; x++) {
-      assert(actual[y * w + x] == expected[y * w + x]);
+      assert(parent.GetVisibleChildAt(x, y) == expected[y * w + x]);
     }
   }
 }
-#define EXPECT_EQ_MAP_3x3(actual, expected) \
-  ExpectEqMap((void**)actual, (void**)expected, 3, 3, __LINE__)
+#define EXPECT_EQ_MAP_3x3(parent, expected) \
+  ExpectEqMap(parent, expected, 3, 3, __LINE__)
 
 void SetBuf(uint32_t* buf, uint32_t value, int w, int h) {
   for (int y = 0; y < h; y++) {
@@ -184,7 +199,7 @@ static void TestUpdateMap() {
   printf("%s()\n", __func__);
 
   uint32_t sheet0_buf[3 * 3];
-  Sheet* sheet0_map[3 * 3];
+  TestSpanMap<3> sheet0_map;
   uint32_t sheet1_buf[3 * 3];
   uint32_t sheet2_buf[3 * 3];
 
@@ -202,7 +217,7 @@ static void TestUpdateMap() {
   s0.Init(sheet0_buf, 3, 3, 3, 0, 0);
   s1.Init(sheet1_buf, 3, 3, 3, 2, 0);
   s2.Init(sheet2_buf, 3, 3, 3, -1, -1);
-  s0.SetMap(sheet0_map);
+  s0.SetMap(&sheet0_map.map);
   s2.SetParent(&s0);
   s1.SetParent(&s0);
 
@@ -212,7 +227,7 @@ static void TestUpdateMap() {
         &s2,     &s2,     &s1,  // 2 2 1
         nullptr, nullptr, &s1,  // - - 1
     };
-    EXPECT_EQ_MAP_3x3(sheet0_map, sheet0_map_expected);
+    EXPECT_EQ_MAP_3x3(s0, sheet0_map_expected);
     uint32_t sheet0_buf_expected[3 * 3] = {
         2, 2, 1,  //
         2, 2, 1,  //
@@ -233,7 +248,7 @@ static void TestUpdateMap() {
         &s2,     &s3, &s3,  // 2 3 3
         nullptr, &s3, &s3,  // - 3 3
     };
-    EXPECT_EQ_MAP_3x3(sheet0_map, sheet0_map_expected);
+    EXPECT_EQ_MAP_3x3(s0, sheet0_map_expected);
     uint32_t sheet0_buf_expected[3 * 3] = {
         2, 2, 1,  //
         2, 3, 3,  //
@@ -247,7 +262,7 @@ static void TestMoveRelative() {
   printf("%s()\n", __func__);
 
   uint32_t sheet0_buf[3 * 3];
-  Sheet* sheet0_map[3 * 3];
+  TestSpanMap<3> sheet0_map;
   uint32_t sheet1_buf[3 * 3];
   uint32_t sheet2_buf[3 * 3];
   uint32_t sheet3_buf[3 * 3];
@@ -265,7 +280,7 @@ static void TestMoveRelative() {
   SET_BUF_3x3(sheet3_buf, 3);
 
   s0.Init(sheet0_buf, 3, 3, 3, 0, 0);
-  s0.SetMap(sheet0_map);
+  s0.SetMap(&sheet0_map.map);
 
   s1.Init(sheet1_buf, 3, 3, 3, 2, 0);
   s2.Init(sheet2_buf, 3, 3, 3, -1, -1);
@@ -281,7 +296,7 @@ static void TestMoveRelative() {
         &s2, &s2, &s1,  // 2 2 1
         &s3, &s3, &s1,  // 3 3 1
     };
-    EXPECT_EQ_MAP_3x3(sheet0_map, sheet0_map_expected);
+    EXPECT_EQ_MAP_3x3(s0, sheet0_map_expected);
     uint32_t sheet0_buf_expected[3 * 3] = {
         2, 2, 1,  //
         2, 2, 1,  //
@@ -298,7 +313,7 @@ static void TestMoveRelative() {
         &s2, &s1, &s1,  // 2 1 1
         &s3, &s1, &s1,  // 3 1 1
     };
-    EXPECT_EQ_MAP_3x3(sheet0_map, sheet0_map_expected);
+    EXPECT_EQ_MAP_3x3(s0, sheet0_map_expected);
     uint32_t sheet0_buf_expected[3 * 3] = {
         2, 1, 1,  //
         2, 1, 1,  //
@@ -315,7 +330,7 @@ static void TestMoveRelative() {
         &s2, &s1, &s1,  // 2 1 1
         &s3, &s1, &s1,  // 3 1 1
     };
-    EXPECT_EQ_MAP_3x3(sheet0_map, sheet0_map_expected);
+    EXPECT_EQ_MAP_3x3(s0, sheet0_map_expected);
     uint32_t sheet0_buf_expected[3 * 3] = {
         2, 2, 3,  //
         2, 1, 1,  //
@@ -329,7 +344,7 @@ static void TestTransparent() {
   printf("%s()\n", __func__);
 
   uint32_t sheet0_buf[3 * 3];  // vram
-  Sheet* sheet0_map[3 * 3];
+  TestSpanMap<3> sheet0_map;
   uint32_t sheet1_buf[3 * 3];  // background
   uint32_t sheet2_buf[3 * 3];  // foreground
 
@@ -344,7 +359,7 @@ static void TestTransparent() {
   SET_BUF_3x3(sheet2_buf, 2);
 
   s0.Init(sheet0_buf, 3, 3, 3, 0, 0);
-  s0.SetMap(sheet0_map);
+  s0.SetMap(&sheet0_map.map);
 
   s1.Init(sheet1_buf, 3, 3, 3, 0, 0);
   s1.SetParent(&s0);
@@ -358,7 +373,7 @@ static void TestTransparent() {
         &s2, &s2, &s2,  //
         &s2, &s2, &s2,  //
     };
-    EXPECT_EQ_MAP_3x3(sheet0_map, sheet0_map_expected);
+    EXPECT_EQ_MAP_3x3(s0, sheet0_map_expected);
     uint32_t sheet0_buf_expected[3 * 3] = {
         2, 2, 2,  //
         2, 2, 2,  //
@@ -375,7 +390,7 @@ static void TestTransparent() {
         &s1, &s1, &s1,  //
         &s1, &s1, &s1,  //
     };
-    EXPECT_EQ_MAP_3x3(sheet0_map, sheet0_map_expected);
+    EXPECT_EQ_MAP_3x3(s0, sheet0_map_expected);
     uint32_t sheet0_buf_expected[3 * 3] = {
         1, 1, 1,  //
         1, 1, 1,  //
@@ -385,7 +400,637 @@ static void TestTransparent() {
   }
 }
 
+static void TestSpanMapOverflow() {
+  printf("%s()\n", __func__);
+  // Row 0 of s0 needs 5 spans: 1 - 2 - 3, but the map has only 2 for a row.
+  uint32_t sheet0_buf[5 * 2];
+  uint32_t sheet1_buf[1 * 2];
+  uint32_t sheet2_buf[1 * 2];
+  uint32_t sheet3_buf[1 * 1];
+  TestSpanMap<2, 2> sheet0_map;
+  Sheet s0, s1, s2, s3;
+  SetBuf(sheet0_buf, 0, 5, 2);
+  SetBuf(sheet1_buf, 1, 1, 2);
+  SetBuf(sheet2_buf, 2, 1, 2);
+  SetBuf(sheet3_buf, 3, 1, 1);
+  s0.Init(sheet0_buf, 5, 2, 5, 0, 0);
+  s0.SetMap(&sheet0_map.map);
+  s1.Init(sheet1_buf, 1, 2, 1, 0, 0);
+  s2.Init(sheet2_buf, 1, 2, 1, 2, 0);
+  s3.Init(sheet3_buf, 1, 1, 1, 4, 0);
+  s1.SetParent(&s0);
+  s2.SetParent(&s0);
+  s3.SetParent(&s0);
+  assert(sheet0_map.map.IsOverflowed(0));
+  assert(!sheet0_map.map.IsOverflowed(1));
+  uint32_t sheet0_buf_expected[5 * 2] = {
+      1, 0, 2, 0, 3,  //
+      1, 0, 2, 0, 0,  //
+  };
+  ExpectEqBuf(sheet0_buf, sheet0_buf_expected, 5, 2, __LINE__);
+  assert(s0.GetVisibleChildAt(4, 0) == &s3);
+  assert(s0.GetVisibleChildAt(3, 0) == nullptr);
+
+  // Rows are rebuilt when s3 moves away.
+  s3.MoveRelative(0, 5);
+  assert(!sheet0_map.map.IsOverflowed(0));
+  assert(s0.GetVisibleChildAt(4, 0) == nullptr);
+}
+
+// Old representation of the map: a Sheet* for each pixel of the parent.
+// Emulates what moving a sheet cost with it, to compare with the spans.
+static void DragWithPerPixelMap(std::vector<Sheet*>& map,
+                                std::vector<uint32_t>& parent_buf,
+                                int parent_xsize,
+                                std::vector<Sheet*>& children,
+                                Rect prev,
+                                Rect next) {
+  Rect target = prev.GetUnionWith(next).GetIntersectionWith(
+      {0, 0, parent_xsize, static_cast<int>(map.size()) / parent_xsize});
+  for (int y = target.y; y < target.GetBottom(); y++) {
+    for (int x = target.x; x < target.GetRight(); x++) {
+      map[y * parent_xsize + x] = nullptr;
+    }
+  }
+  for (Sheet* s : children) {
+    Rect in_view = target.GetIntersectionWith(s->GetRect());
+    for (int y = in_view.y; y < in_view.GetBottom(); y++) {
+      for (int x = in_view.x; x < in_view.GetRight(); x++) {
+        map[y * parent_xsize + x] = s;
+      }
+    }
+  }
+  for (Sheet* s : children) {
+    Rect r = s == children.back() ? next : prev;
+    r = r.GetIntersectionWith(target).GetIntersectionWith(s->GetRect());
+    for (int y = r.y; y < r.GetBottom(); y++) {
+      for (int x = r.x; x < r.GetRight(); x++) {
+        if (map[y * parent_xsize + x] != s) {
+          continue;
+        }
+        parent_buf[y * parent_xsize + x] =
+            s->GetBuf()[(y - s->GetY()) * s->GetPixelsPerScanLine() +
+                        (x - s->GetX())];
+      }
+    }
+  }
+}
+
+static void BenchmarkWindowDrag(int xsize, int ysize) {
+  // A background and 8 windows, and the topmost window is dragged.
+  constexpr int kNumOfWindows = 8;
+  constexpr int kNumOfMoves = 64;
+  constexpr int kSpansPerRow = 64;
+  const int window_xsize = xsize / 3;
+  const int window_ysize = ysize / 3;
+  std::vector<uint32_t> vram(xsize * ysize);
+  std::vector<uint32_t> bg_buf(xsize * ysize, 0x000080);
+  std::vector<uint32_t> window_buf(window_xsize * window_ysize, 0xFFFFFF);
+  std::vector<SheetSpanMap::Span> spans(ysize * kSpansPerRow);
+  std::vector<int> num_of_spans(ysize);
+  SheetSpanMap map;
+  map.Init(spans.data(), num_of_spans.data(), ysize, kSpansPerRow);
+  Sheet vram_sheet, bg;
+  Sheet windows[kNumOfWindows];
+  vram_sheet.Init(vram.data(), xsize, ysize, xsize);
+  vram_sheet.SetMap(&map);
+  bg.Init(bg_buf.data(), xsize, ysize, xsize);
+  bg.SetParent(&vram_sheet);
+  std::vector<Sheet*> children = {&bg};
+  for (int i = 0; i < kNumOfWindows; i++) {
+    windows[i].Init(window_buf.data(), window_xsize, window_ysize,
+                    window_xsize, i * xsize / 16, i * ysize / 16);
+    windows[i].SetParent(&vram_sheet);
+    children.push_back(&windows[i]);
+  }
+  Sheet& dragged = windows[kNumOfWindows - 1];
+
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < kNumOfMoves; i++) {
+    dragged.MoveRelative(i < kNumOfMoves / 2 ? 5 : -5, 3);
+  }
+  auto end = std::chrono::steady_clock::now();
+  const double span_us =
+      std::chrono::duration<double, std::micro>(end - begin).count() /
+      kNumOfMoves;
+
+  // Without the span map, MoveRelative() only updates the position.
+  vram_sheet.SetMap(nullptr);
+  std::vector<Sheet*> per_pixel_map(xsize * ysize);
+  begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < kNumOfMoves; i++) {
+    Rect prev = dragged.GetRect();
+    dragged.MoveRelative(i < kNumOfMoves / 2 ? 5 : -5, 3);
+    DragWithPerPixelMap(per_pixel_map, vram, xsize, children, prev,
+                        dragged.GetRect());
+  }
+  end = std::chrono::steady_clock::now();
+  const double per_pixel_us =
+      std::chrono::duration<double, std::micro>(end - begin).count() /
+      kNumOfMoves;
+
+  printf("%4dx%4d: spans %8.1f us/move (map %7zu KiB), "
+         "per-pixel %8.1f us/move (map %7zu KiB)\n",
+         xsize, ysize, span_us,
+         (spans.size() * sizeof(spans[0]) +
+          num_of_spans.size() * sizeof(int)) >> 10,
+         per_pixel_us, (per_pixel_map.size() * sizeof(Sheet*)) >> 10);
+}
+
+static void TestBlendedFlush() {
+  printf("%s()\n", __func__);
+  uint32_t sheet0_buf[4 * 1];
+  uint32_t sheet1_buf[3 * 1] = {0x00102030, 0x00102030, 0x00102030};
+  uint32_t sheet2_buf[4 * 1] = {0x00FFFFFF, 0x80FFFFFF, 0xFF405060,
+                                0x80FFFFFF};
+  TestSpanMap<1> sheet0_map;
+  Sheet s0, s1, s2;
+  SetBuf(sheet0_buf, 0, 4, 1);
+  s0.Init(sheet0_buf, 4, 1, 4, 0, 0);
+  s0.SetMap(&sheet0_map.map);
+  s1.Init(sheet1_buf, 3, 1, 3, 0, 0);
+  s1.SetParent(&s0);
+  s2.Init(sheet2_buf, 4, 1, 4, 0, 0);
+  s2.SetParent(&s0);
+  s2.SetAlphaEnabled(true);
+  // Flushing twice gives the same result since s1 is composed again, and
+  // the last pixel, without any sheet below, is blended over zero.
+  s2.Flush();
+  s2.Flush();
+  uint32_t sheet0_buf_expected[4 * 1] = {0x00102030, 0x40889098, 0xFF405060,
+                                         0x40808080};
+  ExpectEqBuf(sheet0_buf, sheet0_buf_expected, 4, 1, __LINE__);
+}
+
+static Rect damaged_rects[16];
+static int num_of_damaged_rects;
+
+static void RecordDamage(const Rect& r) {
+  assert(num_of_damaged_rects < 16);
+  damaged_rects[num_of_damaged_rects++] = r;
+}
+
+static void TestDamageHandler() {
+  // sheet1 (2x2 at (1, 1)) is in front of sheet2 (4x1 at (0, 2)) on a 4x4
+  // sheet0.
+  uint32_t sheet0_buf[4 * 4] = {};
+  uint32_t sheet1_buf[2 * 2] = {};
+  uint32_t sheet2_buf[4 * 1] = {};
+  TestSpanMap<4> sheet0_map;
+  Sheet s0, s1, s2;
+  s0.Init(sheet0_buf, 4, 4, 4, 0, 0);
+  s0.SetMap(&sheet0_map.map);
+  s1.Init(sheet1_buf, 2, 2, 2, 1, 1);
+  s2.Init(sheet2_buf, 4, 1, 4, 0, 2);
+  s2.SetParent(&s0);
+  s1.SetParent(&s0);
+  s0.SetDamageHandler(RecordDamage);
+
+  num_of_damaged_rects = 0;
+  s1.Flush();
+  assert(num_of_damaged_rects == 1);
+  assert(damaged_rects[0] == Rect({1, 1, 2, 2}));
+  // Only the pixels not hidden by sheet1 are reported.
+  num_of_damaged_rects = 0;
+  s2.Flush(2, 0, 2, 1);
+  assert(num_of_damaged_rects == 1);
+  assert(damaged_rects[0] == Rect({3, 2, 1, 1}));
+  // Nothing is reported for a fully hidden area.
+  num_of_damaged_rects = 0;
+  s2.Flush(1, 0, 2, 1);
+  assert(num_of_damaged_rects == 0);
+}
+
+// A background and windows of distinct colors on a parent sheet, indexed by
+// a grid if slots_per_cell > 0.
+struct Desktop {
+  Desktop(int xsize,
+          int ysize,
+          int num_of_windows,
+          int window_xsize,
+          int window_ysize,
+          int slots_per_cell)
+      : vram(xsize * ysize),
+        bg_buf(xsize * ysize, 0x000080),
+        spans(ysize * kSpansPerRow),
+        num_of_spans(ysize),
+        windows(num_of_windows),
+        window_bufs(num_of_windows) {
+    map.Init(spans.data(), num_of_spans.data(), ysize, kSpansPerRow);
+    parent.Init(vram.data(), xsize, ysize, xsize);
+    parent.SetMap(&map);
+    if (slots_per_cell > 0) {
+      // Chunks for slots_per_cell sheets per cell on average.
+      const int xcells = SheetGrid::GetNumOfCells(xsize);
+      const int ycells = SheetGrid::GetNumOfCells(ysize);
+      cells.resize(xcells * ycells);
+      chunks.resize(xcells * ycells * slots_per_cell /
+                    SheetGrid::kEntriesPerChunk);
+      grid.Init(cells.data(), xcells, ycells, chunks.data(),
+                static_cast<int>(chunks.size()));
+      parent.SetGrid(&grid);
+    }
+    bg.Init(bg_buf.data(), xsize, ysize, xsize);
+    bg.SetParent(&parent);
+    srand(1);
+    for (int i = 0; i < num_of_windows; i++) {
+      window_bufs[i].assign(window_xsize * window_ysize, 0xFF000000 | i);
+      windows[i].Init(window_bufs[i].data(), window_xsize, window_ysize,
+                      window_xsize, rand() % (xsize - window_xsize),
+                      rand() % (ysize - window_ysize));
+      windows[i].SetParent(&parent);
+    }
+  }
+  Sheet* FindWindowAt(int x, int y) {
+    return parent.FindChildAt(x, y, [this](Sheet& s) { return &s != &bg; });
+  }
+  int GetIndexOf(const Sheet* s) const {
+    return s ? static_cast<int>(s - windows.data()) : -1;
+  }
+
+  static constexpr int kSpansPerRow = 64;
+  std::vector<uint32_t> vram;
+  std::vector<uint32_t> bg_buf;
+  std::vector<SheetSpanMap::Span> spans;
+  std::vector<int> num_of_spans;
+  std::vector<SheetGrid::Cell> cells;
+  std::vector<SheetGrid::Chunk> chunks;
+  SheetSpanMap map;
+  SheetGrid grid;
+  Sheet parent, bg;
+  std::vector<Sheet> windows;
+  std::vector<std::vector<uint32_t>> window_bufs;
+};
+
+static void TestGrid() {
+  printf("%s()\n", __func__);
+  constexpr int kXSize = 256;
+  constexpr int kYSize = 192;
+  constexpr int kNumOfWindows = 40;
+  constexpr int kNumOfOps = 300;
+  // Without a grid, with a grid, and with a grid which overflows.
+  Desktop desktops[] = {
+      {kXSize, kYSize, kNumOfWindows, 40, 30, 0},
+      {kXSize, kYSize, kNumOfWindows, 40, 30, 64},
+      {kXSize, kYSize, kNumOfWindows, 40, 30, 3},
+  };
+  unsigned int seed = 2;
+  for (int op = 0; op < kNumOfOps; op++) {
+    const int i = rand_r(&seed) % kNumOfWindows;
+    const int kind = rand_r(&seed) % 4;
+    const int dx = rand_r(&seed) % 41 - 20;
+    const int dy = rand_r(&seed) % 41 - 20;
+    const int px = rand_r(&seed) % kXSize;
+    const int py = rand_r(&seed) % kYSize;
+    for (Desktop& d : desktops) {
+      Sheet& w = d.windows[i];
+      if (kind == 0) {
+        w.Raise();
+      } else if (kind == 1) {
+        w.Lower();
+      } else {
+        w.MoveRelative(dx, dy);
+      }
+    }
+    const int found = desktops[0].GetIndexOf(desktops[0].FindWindowAt(px, py));
+    for (Desktop& d : desktops) {
+      assert(d.GetIndexOf(d.FindWindowAt(px, py)) == found);
+      assert(d.vram == desktops[0].vram);
+      for (int y = 0; y < kYSize; y++) {
+        for (int x = 0; x < kXSize; x++) {
+          const Sheet* s = d.parent.GetVisibleChildAt(x, y);
+          const Sheet* s0 = desktops[0].parent.GetVisibleChildAt(x, y);
+          assert((s == &d.bg && s0 == &desktops[0].bg) ||
+                 d.GetIndexOf(s) == desktops[0].GetIndexOf(s0));
+        }
+      }
+    }
+  }
+  // The order of siblings follows the operations.
+  Desktop& d = desktops[1];
+  Sheet* bottom = d.parent.GetChildAtBottom();
+  d.windows[3].Lower();
+  assert(d.parent.GetChildAtBottom() == &d.windows[3]);
+  assert(!d.windows[3].GetLower() && d.windows[3].GetUpper() == bottom);
+  d.windows[5].Raise();
+  assert(d.parent.GetChildAtTop() == &d.windows[5]);
+  assert(d.windows[5].GetLower()->GetUpper() == &d.windows[5]);
+}
+
+static void TestGridCrowdedCell() {
+  printf("%s()\n", __func__);
+  // 100 windows in the first cell, which has more sheets than the average
+  // of the chunks per cell.
+  constexpr int kXSize = 256;
+  constexpr int kYSize = 192;
+  constexpr int kNumOfWindows = 100;
+  Desktop d(kXSize, kYSize, kNumOfWindows, 8, 8, 32);
+  for (Sheet& w : d.windows) {
+    w.SetPosition(kXSize - 8, kYSize - 8);
+  }
+  const int num_of_free_chunks = d.grid.GetNumOfFreeChunks();
+  for (int i = 0; i < kNumOfWindows; i++) {
+    d.windows[i].SetPosition(i % 50, i / 50);
+  }
+  assert(!d.grid.IsOverflowed(0, 0));
+  int num_of_sheets = 0;
+  d.grid.ForEachInCell(0, 0, [&](const SheetGrid::Entry& e) {
+    assert(e.rect == e.sheet->GetRect());
+    num_of_sheets++;
+  });
+  assert(num_of_sheets == kNumOfWindows + 1 /* bg */);
+  assert(d.grid.CountEntriesInRect({0, 0, 1, 1}) == num_of_sheets);
+  d.windows[10].Raise();
+  assert(d.FindWindowAt(12, 2) == &d.windows[10]);
+  assert(d.parent.GetVisibleChildAt(12, 2) == &d.windows[10]);
+  // Moving them back gives the chunks back.
+  for (Sheet& w : d.windows) {
+    w.SetPosition(kXSize - 8, kYSize - 8);
+  }
+  assert(d.grid.GetNumOfFreeChunks() == num_of_free_chunks);
+  assert(d.FindWindowAt(12, 2) == nullptr);
+}
+
+static void TestRemoveFromParent() {
+  printf("%s()\n", __func__);
+  constexpr int kXSize = 256;
+  constexpr int kYSize = 192;
+  constexpr int kNumOfWindows = 8;
+  Desktop desktops[] = {
+      {kXSize, kYSize, kNumOfWindows, 80, 60, 0},
+      {kXSize, kYSize, kNumOfWindows, 80, 60, 64},
+  };
+  for (Desktop& d : desktops) {
+    Sheet& w = d.windows[5];
+    const Rect r = w.GetRect();
+    w.RemoveFromParent();
+    assert(w.GetRect() == r);
+    assert(d.windows[4].GetUpper() == &d.windows[6]);
+    assert(d.windows[6].GetLower() == &d.windows[4]);
+    assert(d.FindWindowAt(r.x, r.y) != &w);
+    // The sheets behind it are shown instead.
+    for (int y = 0; y < kYSize; y++) {
+      for (int x = 0; x < kXSize; x++) {
+        const Sheet* s = d.parent.GetVisibleChildAt(x, y);
+        assert(s != &w);
+        assert(d.vram[y * kXSize + x] ==
+               s->GetBuf()[(y - s->GetY()) * s->GetPixelsPerScanLine() +
+                           (x - s->GetX())]);
+      }
+    }
+    // Can be added again at the front.
+    w.SetParent(&d.parent);
+    assert(d.parent.GetChildAtTop() == &w);
+  }
+  assert(desktops[0].vram == desktops[1].vram);
+}
+
+static void BenchmarkManyWindows(int num_of_windows) {
+  // Drags, hit tests and raises random windows among num_of_windows windows
+  // of 160x120 on a 1280x720 screen.
+  constexpr int kXSize = 1280;
+  constexpr int kYSize = 720;
+  constexpr int kNumOfOps = 256;
+  double us[2][3];
+  for (int g = 0; g < 2; g++) {
+    Desktop d(kXSize, kYSize, num_of_windows, 160, 120, g ? 64 : 0);
+    unsigned int seed = 3;
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < kNumOfOps; i++) {
+      d.windows[rand_r(&seed) % num_of_windows].MoveRelative(
+          rand_r(&seed) % 9 - 4, rand_r(&seed) % 9 - 4);
+    }
+    auto end = std::chrono::steady_clock::now();
+    us[g][0] = std::chrono::duration<double, std::micro>(end - begin).count() /
+               kNumOfOps;
+    int hits = 0;
+    begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < kNumOfOps; i++) {
+      hits +=
+          d.FindWindowAt(rand_r(&seed) % kXSize, rand_r(&seed) % kYSize) !=
+          nullptr;
+    }
+    end = std::chrono::steady_clock::now();
+    us[g][1] = std::chrono::duration<double, std::micro>(end - begin).count() /
+               kNumOfOps;
+    assert(hits > 0);
+    begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < kNumOfOps; i++) {
+      d.windows[rand_r(&seed) % num_of_windows].Raise();
+    }
+    end = std::chrono::steady_clock::now();
+    us[g][2] = std::chrono::duration<double, std::micro>(end - begin).count() /
+               kNumOfOps;
+  }
+  printf("%4d windows: us/op list (grid): move %7.1f (%7.1f), "
+         "hit test %5.2f (%5.2f), raise %7.1f (%7.1f)\n",
+         num_of_windows, us[0][0], us[1][0], us[0][1], us[1][1], us[0][2],
+         us[1][2]);
+}
+
+// A 16x12 sheet at (4, 4) on a 32x24 sheet, optionally obscured by a 4x4
+// sheet at (6, 6).
+struct ScrollTestScreen {
+  ScrollTestScreen(bool is_obscured) {
+    parent.Init(parent_buf, 32, 24, 32);
+    parent.SetMap(&map.map);
+    for (uint32_t i = 0; i < 16 * 12; i++) {
+      child_buf[i] = 0x10000 + i;
+    }
+    for (uint32_t i = 0; i < 4 * 4; i++) {
+      cover_buf[i] = 0x20000 + i;
+    }
+    child.Init(child_buf, 16, 12, 16, 4, 4);
+    child.SetParent(&parent);
+    if (is_obscured) {
+      cover.Init(cover_buf, 4, 4, 4, 6, 6);
+      cover.SetParent(&parent);
+    }
+  }
+  uint32_t parent_buf[32 * 24] = {};
+  uint32_t child_buf[16 * 12];
+  uint32_t cover_buf[4 * 4];
+  TestSpanMap<24> map;
+  Sheet parent, child, cover;
+};
+
+static void TestBlockTransferPropagation() {
+  printf("%s()\n", __func__);
+  struct {
+    int to_x, to_y, from_x, from_y, w, h;
+  } moves[] = {
+      {0, 0, 0, 3, 16, 9},  // Scroll up
+      {0, 3, 0, 0, 16, 9},  // Scroll down
+      {3, 2, 0, 2, 13, 5},  // Move right within rows
+      {0, 2, 3, 2, 13, 5},  // Move left within rows
+  };
+  num_of_damaged_rects = 0;
+  for (bool is_obscured : {false, true}) {
+    for (auto& m : moves) {
+      // Propagated one is compared with the one flushed as before.
+      ScrollTestScreen flushed(is_obscured), propagated(is_obscured);
+      propagated.parent.SetDamageHandler(RecordDamage);
+      flushed.child.BlockTransfer(m.to_x, m.to_y, m.from_x, m.from_y, m.w,
+                                  m.h);
+      num_of_damaged_rects = 0;
+      propagated.child.BlockTransfer(m.to_x, m.to_y, m.from_x, m.from_y, m.w,
+                                     m.h, true);
+      for (int i = 0; i < 32 * 24; i++) {
+        assert(propagated.parent_buf[i] == flushed.parent_buf[i]);
+      }
+      for (int i = 0; i < 16 * 12; i++) {
+        assert(propagated.child_buf[i] == flushed.child_buf[i]);
+      }
+      // Moved rows are reported at once, and flushed rows one by one.
+      assert(num_of_damaged_rects >= 1);
+      assert(damaged_rects[num_of_damaged_rects - 1] ==
+             Rect({m.to_x + 4, m.to_y + 4, m.w, m.h}));
+      num_of_damaged_rects = 0;
+    }
+  }
+  // Pixels moved as expected.
+  ScrollTestScreen screen(false);
+  screen.child.BlockTransfer(0, 0, 0, 3, 16, 9, true);
+  assert(screen.child_buf[0] == 0x10000 + 3 * 16);
+  assert(screen.parent_buf[4 * 32 + 4] == 0x10000 + 3 * 16);
+  assert(screen.parent_buf[12 * 32 + 19] == 0x10000 + 11 * 16 + 15);
+}
+
+static void BenchmarkScroll(bool is_obscured) {
+  // Scrolls a 640x480 console by a line of 16 px.
+  constexpr int kXSize = 640;
+  constexpr int kYSize = 480;
+  constexpr int kLineHeight = 16;
+  constexpr int kNumOfScrolls = 256;
+  std::vector<uint32_t> vram(kXSize * kYSize);
+  std::vector<uint32_t> console_buf(kXSize * kYSize, 0xFFFFFF);
+  std::vector<uint32_t> cover_buf(128 * 128, 0x808080);
+  TestSpanMap<kYSize> map;
+  Sheet vram_sheet, console, cover;
+  vram_sheet.Init(vram.data(), kXSize, kYSize, kXSize);
+  vram_sheet.SetMap(&map.map);
+  console.Init(console_buf.data(), kXSize, kYSize, kXSize);
+  console.SetParent(&vram_sheet);
+  if (is_obscured) {
+    cover.Init(cover_buf.data(), 128, 128, 128);
+    cover.SetParent(&vram_sheet);
+  }
+  double us[2];
+  for (int propagate = 0; propagate < 2; propagate++) {
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < kNumOfScrolls; i++) {
+      console.BlockTransfer(0, 0, 0, kLineHeight, kXSize,
+                            kYSize - kLineHeight, propagate);
+    }
+    auto end = std::chrono::steady_clock::now();
+    us[propagate] =
+        std::chrono::duration<double, std::micro>(end - begin).count() /
+        kNumOfScrolls;
+  }
+  printf("scroll %dx%d%s: flush %6.1f us, propagate %6.1f us\n", kXSize,
+         kYSize, is_obscured ? " (obscured)" : "", us[0], us[1]);
+}
+
+static CPUFeatureSet GetHostCPUFeatures() {
+  CPUFeatureSet f = {};
+  if (__builtin_cpu_supports("sse2")) {
+    f.features |= 1ULL << CPUFeatureIndex::kSSE2;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    f.features |= 1ULL << CPUFeatureIndex::kAVX2;
+  }
+  return f;
+}
+
+static void TestPixelKernels() {
+  printf("%s()\n", __func__);
+  using Type = PixelKernels::Type;
+  const CPUFeatureSet f = GetHostCPUFeatures();
+  constexpr int kMaxCount = 41;
+  uint32_t src[kMaxCount], dst[kMaxCount], expected[kMaxCount];
+  uint32_t seed = 1;
+  auto next_random = [&seed]() {
+    seed = seed * 1103515245 + 12345;
+    return seed;
+  };
+  for (int t = 0; t < static_cast<int>(Type::kNumOfTypes); t++) {
+    const Type type = static_cast<Type>(t);
+    if (!PixelKernels::IsSupported(f, type)) {
+      continue;
+    }
+    for (int count = 0; count < kMaxCount; count++) {
+      for (int i = 0; i < kMaxCount; i++) {
+        src[i] = next_random();
+        dst[i] = expected[i] = next_random();
+      }
+      // Fully transparent and opaque pixels
+      src[0] &= 0x00FFFFFF;
+      src[1] |= 0xFF000000;
+      PixelKernels::Select(Type::kScalar);
+      PixelKernels::BlendRow(expected, src, count);
+      PixelKernels::Select(type);
+      PixelKernels::BlendRow(dst, src, count);
+      for (int i = 0; i < kMaxCount; i++) {
+        assert(dst[i] == expected[i]);
+      }
+      PixelKernels::CopyRow(dst, src, count);
+      PixelKernels::FillRow(&dst[count], 0x12345678, kMaxCount - count);
+      for (int i = 0; i < kMaxCount; i++) {
+        assert(dst[i] == (i < count ? src[i] : 0x12345678));
+      }
+    }
+    printf("%s: OK\n", PixelKernels::GetTypeName(type));
+  }
+  // The scalar blend gives exact rounding.
+  uint32_t d = 0x00000000, s = 0x80FFFFFF;
+  PixelKernels::Select(Type::kScalar);
+  PixelKernels::BlendRow(&d, &s, 1);
+  assert(d == 0x40808080);
+}
+
+static void BenchmarkPixelKernels() {
+  using Type = PixelKernels::Type;
+  const CPUFeatureSet f = GetHostCPUFeatures();
+  constexpr int kWidth = 1920;
+  constexpr int kNumOfRows = 1080;
+  std::vector<uint32_t> src(kWidth * kNumOfRows, 0x80FF8040);
+  std::vector<uint32_t> dst(kWidth * kNumOfRows, 0x00204060);
+  auto measure = [&](std::function<void(int)> row_op) {
+    auto begin = std::chrono::steady_clock::now();
+    for (int y = 0; y < kNumOfRows; y++) {
+      row_op(y);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return kWidth * kNumOfRows /
+           std::chrono::duration<double, std::micro>(end - begin).count();
+  };
+  for (int t = 0; t < static_cast<int>(Type::kNumOfTypes); t++) {
+    const Type type = static_cast<Type>(t);
+    if (!PixelKernels::IsSupported(f, type)) {
+      continue;
+    }
+    PixelKernels::Select(type);
+    const double copy = measure([&](int y) {
+      PixelKernels::CopyRow(&dst[y * kWidth], &src[y * kWidth], kWidth);
+    });
+    const double fill = measure([&](int y) {
+      PixelKernels::FillRow(&dst[y * kWidth], 0x00FFFFFF, kWidth);
+    });
+    const double blend = measure([&](int y) {
+      PixelKernels::BlendRow(&dst[y * kWidth], &src[y * kWidth], kWidth);
+    });
+    printf("%-6s: copy %8.1f, fill %8.1f, blend %8.1f MPixels/s\n",
+           PixelKernels::GetTypeName(type), copy, fill, blend);
+  }
+  PixelKernels::Init(f, true);
+}
+
 int main() {
+  TestPixelKernels();
+  TestBlendedFlush();
+  TestDamageHandler();
+  TestBlockTransferPropagation();
+  TestRemoveFromParent();
   TestTransparent();
   TestMoveRelative();
   TestUpdateMap();
@@ -422,6 +1067,23 @@ int main() {
       return 2;
     return 1;
   });
+
+  TestSpanMapOverflow();
+  TestGrid();
+  TestGridCrowdedCell();
+
+  BenchmarkPixelKernels();
+
+  BenchmarkWindowDrag(640, 480);
+  BenchmarkWindowDrag(1280, 720);
+  BenchmarkWindowDrag(1920, 1080);
+
+  BenchmarkScroll(false);
+  BenchmarkScroll(true);
+
+  BenchmarkManyWindows(16);
+  BenchmarkManyWindows(256);
+  BenchmarkManyWindows(1024);
   puts("PASS");
   return 0;
 }
@@ -3,7 +3,8 @@
 
 #include "liumos.h"
 
-#include "virtio_net.h"
+#include "fat32.h"
+#include "net_device.h"
 
 #include "kernel.h"
 
@@ -11,6 +12,7 @@ constexpr uint64_t kSyscallIndex_sys_read = 0;
 constexpr uint64_t kSyscallIndex_sys_write = 1;
 constexpr uint64_t kSyscallIndex_sys_open = 2;
 constexpr uint64_t kSyscallIndex_sys_close = 3;
+constexpr uint64_t kSyscallIndex_sys_lseek = 8;
 constexpr uint64_t kSyscallIndex_sys_mmap = 9;
 constexpr uint64_t kSyscallIndex_sys_msync = 26;
 constexpr uint64_t kSyscallIndex_sys_socket = 41;
@@ -18,9 +20,19 @@ constexpr uint64_t kSyscallIndex_sys_sendto = 44;
 constexpr uint64_t kSyscallIndex_sys_recvfrom = 45;
 constexpr uint64_t kSyscallIndex_sys_bind = 49;
 constexpr uint64_t kSyscallIndex_sys_exit = 60;
+constexpr uint64_t kSyscallIndex_sys_fsync = 74;
 constexpr uint64_t kSyscallIndex_sys_ftruncate = 77;
+constexpr uint64_t kSyscallIndex_sys_mkdir = 83;
 constexpr uint64_t kSyscallIndex_sys_getdents64 = 217;
+constexpr uint64_t kSyscallIndex_sys_clock_gettime = 228;
+constexpr uint64_t kSyscallIndex_sys_epoll_wait = 232;
+constexpr uint64_t kSyscallIndex_sys_epoll_ctl = 233;
+constexpr uint64_t kSyscallIndex_sys_epoll_create1 = 291;
+constexpr uint64_t kSyscallIndex_sys_recvmmsg = 299;
+constexpr uint64_t kSyscallIndex_sys_sendmmsg = 307;
 constexpr uint64_t kSyscallIndex_arch_prctl = 158;
+// liumOS specific syscalls
+constexpr uint64_t kSyscallIndex_liumos_damage_window = 1024;
 // constexpr uint64_t kArchSetGS = 0x1001;
 constexpr uint64_t kArchSetFS = 0x1002;
 // constexpr uint64_t kArchGetFS = 0x1003;
@@ -28,10 +40,28 @@ constexpr uint64_t kArchSetFS = 0x1002;
 
 // https://elixir.bootlin.com/linux/v4.15/source/include/uapi/asm-generic/errno-base.h#L6
 enum ErrorNumber {
+  kNoEntry = -2,
+  kIOError = -5,
   kBadFileDescriptor = -9,
+  kExists = -17,
+  kNotDirectory = -20,
+  kIsDirectory = -21,
   kInvalid = -22,
+  kTooManyFiles = -24,
+  kReadOnlyFileSystem = -30,
 };
 
+// https://elixir.bootlin.com/linux/v4.15/source/include/uapi/asm-generic/fcntl.h
+constexpr int kOpenAccessModeMask = 03;
+constexpr int kOpenReadOnly = 00;
+constexpr int kOpenCreate = 0100;
+constexpr int kOpenTruncate = 01000;
+constexpr int kOpenAppend = 02000;
+constexpr int kOpenDirectory = 0200000;
+constexpr int kSeekSet = 0;
+constexpr int kSeekCur = 1;
+constexpr int kSeekEnd = 2;
+
 // c.f.
 // https://elixir.bootlin.com/linux/v4.15/source/include/uapi/linux/in.h#L232
 // sockaddr_in means sockaddr for InterNet protocol(IP)
@@ -45,13 +75,67 @@ struct sockaddr_in {
 };
 typedef uint32_t socklen_t;
 
+// c.f.
+// https://elixir.bootlin.com/linux/v4.15/source/include/linux/socket.h#L48
+struct iovec {
+  void* iov_base;
+  size_t iov_len;
+};
+struct msghdr {
+  void* msg_name;
+  socklen_t msg_namelen;
+  struct iovec* msg_iov;
+  size_t msg_iovlen;
+  void* msg_control;
+  size_t msg_controllen;
+  unsigned int msg_flags;
+};
+struct mmsghdr {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+};
+
+// A window is a BMP file opened as "window.bmp" and mapped by mmap. The pages
+// of the file are shared by the process and the kernel, and the Sheet of the
+// window uses the pixels in them as its buffer. So updating the screen only
+// needs flushing the damaged area of the sheet, without copying the pixels.
+constexpr int kMaxWindowsPerProcess = 4;
+constexpr int kMaxWindowSize = 2048;
+constexpr uint64_t kWindowMapBase = 0x1'0000'0000;
+// Enough for the largest window with its BMP header.
+constexpr uint64_t kWindowMapStride = 0x200'0000;
+constexpr int kMaxDamageRectsPerCall = 64;
+
+struct WindowBuffer {
+  int fd;             // 0 if not in use
+  uint8_t* file_buf;  // mapped at GetWindowUserAddr() in the process
+  uint64_t map_size;
+  Sheet* sheet;  // created on the first flush since it needs the BMP header
+};
+
+static uint64_t GetWindowUserAddr(int window_idx) {
+  return kWindowMapBase + kWindowMapStride * window_idx;
+}
+
+// A file or a directory opened by sys_open. Files are read and written in
+// the FAT32 volume on the block device through the page cache. If no volume
+// is mounted, the files loaded by the loader can be read instead.
+constexpr int kMaxFilesPerProcess = 16;
+
+struct OpenFile {
+  int fd;  // 0 if not in use
+  bool is_writable;
+  bool is_append;
+  bool is_loader_file;
+  int idx_in_root_files;  // if is_loader_file and not file.is_dir
+  FAT32::File file;
+  // The offset in the file, or the position in the directory for getdents64
+  uint64_t offset;
+};
+
 struct PerProcessSyscallData {
-  Sheet* window_sheet;
-  uint32_t* window_buf;
-  int num_getdents64_called;
-  // for opening normal file: fd = 6
-  int idx_in_root_files;
-  uint64_t read_offset;
+  WindowBuffer windows[kMaxWindowsPerProcess];
+  OpenFile files[kMaxFilesPerProcess];
 };
 
 std::unordered_map<Process::PID, PerProcessSyscallData>
@@ -65,45 +149,61 @@ extern "C" uint64_t GetCurrentKernelStack(void) {
   return ctx.GetKernelRSP();
 }
 
-static bool IsICMPPacket(void* frame_data, size_t frame_size) {
-  using EtherFrame = Network::EtherFrame;
+static ssize_t CopyDatagram(Network::Socket& sock,
+                            Network::PacketBuffer& packet,
+                            void* buf,
+                            size_t buf_size,
+                            struct sockaddr_in* recv_addr) {
+  /* returns -1 on failure */
   using IPv4Packet = Network::IPv4Packet;
-  if (frame_size < sizeof(IPv4Packet)) {
-    return false;
+  using IPv4UDPPacket = Network::IPv4UDPPacket;
+  using ICMPPacket = Network::ICMPPacket;
+  using EtherFrame = Network::EtherFrame;
+  using Socket = Network::Socket;
+  if (sock.type == Socket::Type::kICMPDatagram) {
+    ICMPPacket& icmp = *reinterpret_cast<ICMPPacket*>(packet.data);
+    size_t icmp_data_size = packet.size - sizeof(IPv4Packet);
+    size_t copy_size = std::min(icmp_data_size, buf_size);
+    memcpy(buf, &icmp.type, copy_size);
+    if (recv_addr) {
+      recv_addr->sin_addr = icmp.ip.src_ip;
+    }
+    return icmp_data_size;
   }
-  EtherFrame& eth = *reinterpret_cast<EtherFrame*>(frame_data);
-  if (!eth.HasEthType(EtherFrame::kTypeIPv4)) {
-    return false;
+  if (sock.type == Socket::Type::kICMPRaw) {
+    size_t ip_data_size = packet.size - sizeof(EtherFrame);
+    size_t copy_size = std::min(ip_data_size, buf_size);
+    memcpy(buf, &packet.data[sizeof(EtherFrame)], copy_size);
+    return ip_data_size;
   }
-  IPv4Packet& p = *reinterpret_cast<IPv4Packet*>(frame_data);
-  if (p.protocol != IPv4Packet::Protocol::kICMP) {
-    return false;
+  if (sock.type == Socket::Type::kUDP) {
+    size_t udp_data_size = packet.size - sizeof(IPv4UDPPacket);
+    size_t copy_size = std::min(udp_data_size, buf_size);
+    memcpy(buf, &packet.data[sizeof(IPv4UDPPacket)], copy_size);
+    IPv4UDPPacket* udp_packet = reinterpret_cast<IPv4UDPPacket*>(packet.data);
+    if (recv_addr) {
+      recv_addr->sin_addr = udp_packet->ip.src_ip;
+      recv_addr->sin_port =
+          *reinterpret_cast<uint16_t*>(&udp_packet->src_port);
+    }
+    return udp_data_size;
   }
-  return true;
+  kprintf("%s: socket_type = %d is not a supported yet\n", __func__,
+          sock.type);
+  return -1;
 }
 
-static bool IsUDPPacketToPort(void* frame_data,
-                              size_t frame_size,
-                              uint16_t port) {
-  using EtherFrame = Network::EtherFrame;
-  using IPv4Packet = Network::IPv4Packet;
-  using IPv4UDPPacket = Network::IPv4UDPPacket;
-  if (frame_size < sizeof(IPv4UDPPacket)) {
-    return false;
-  }
-  EtherFrame& eth = *reinterpret_cast<EtherFrame*>(frame_data);
-  if (!eth.HasEthType(EtherFrame::kTypeIPv4)) {
-    return false;
-  }
-  IPv4Packet& p = *reinterpret_cast<IPv4Packet*>(frame_data);
-  if (p.protocol != IPv4Packet::Protocol::kUDP) {
-    return false;
-  }
-  IPv4UDPPacket& udp = *reinterpret_cast<IPv4UDPPacket*>(frame_data);
-  if (udp.GetDestinationPort() != port) {
-    return false;
-  }
-  return true;
+static ssize_t ReceiveDatagram(Network::Socket& sock,
+                               void* buf,
+                               size_t buf_size,
+                               struct sockaddr_in* recv_addr) {
+  /* returns -1 on failure. sock should be readable. */
+  assert(sock.IsReadable());
+  // Frames are sorted into sock.rx_queue by Network::ProcessRXFrame().
+  Network::PacketBuffer* packet = sock.rx_queue.Pop();
+  ssize_t result = CopyDatagram(sock, *packet, buf, buf_size, recv_addr);
+  Network::GetInstance().FreePacketBuffer(packet);
+  return result;
 }
 
 static ssize_t sys_recvfrom(int sockfd,
@@ -113,80 +213,301 @@ static ssize_t sys_recvfrom(int sockfd,
                             struct sockaddr_in* recv_addr,
                             socklen_t*) {
   /* returns -1 on failure */
-  using IPv4Packet = Network::IPv4Packet;
-  using IPv4UDPPacket = Network::IPv4UDPPacket;
-  using ICMPPacket = Network::ICMPPacket;
-  using EtherFrame = Network::EtherFrame;
-  using Socket = Network::Socket;
   Network& network = Network::GetInstance();
   auto pid = liumos->scheduler->GetCurrentProcess().GetID();
-  auto sock_holder = network.FindSocket(pid, sockfd);
-  if (!sock_holder.has_value()) {
+  Network::Socket* sock = network.FindSocket(pid, sockfd);
+  if (!sock) {
     kprintf("%s: fd %d is not a socket\n", __func__, sockfd);
     return -1;
   }
-  Socket::Type socket_type = (*sock_holder).type;
-  if (socket_type == Socket::Type::kICMPDatagram) {
-    for (;;) {
-      while (network.HasPacketInRXBuffer()) {
-        auto packet = network.PopFromRXBuffer();
-        if (!IsICMPPacket(packet.data, packet.size)) {
-          continue;
-        }
-        ICMPPacket& icmp = *reinterpret_cast<ICMPPacket*>(packet.data);
-        size_t icmp_data_size = packet.size - sizeof(IPv4Packet);
-        size_t copy_size = std::min(icmp_data_size, buf_size);
-        memcpy(buf, &icmp.type, copy_size);
-        recv_addr->sin_addr = icmp.ip.src_ip;
-        return icmp_data_size;
-      }
-      Sleep();
-    }
+  while (!sock->IsReadable()) {
+    Sleep();
+  }
+  return ReceiveDatagram(*sock, buf, buf_size, recv_addr);
+}
+
+static int sys_recvmmsg(int sockfd,
+                        struct mmsghdr* msgvec,
+                        unsigned int vlen,
+                        int /*flags*/,
+                        const void* /*timeout*/) {
+  /* returns -1 on failure, or the number of messages received */
+  // Blocks only until the first message arrives, as if MSG_WAITFORONE is
+  // always given. The timeout is not supported yet.
+  Network& network = Network::GetInstance();
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  Network::Socket* sock = network.FindSocket(pid, sockfd);
+  if (!sock) {
+    kprintf("%s: fd %d is not a socket\n", __func__, sockfd);
     return -1;
   }
-  if (socket_type == Socket::Type::kICMPRaw) {
-    for (;;) {
-      while (network.HasPacketInRXBuffer()) {
-        auto packet = network.PopFromRXBuffer();
-        if (!IsICMPPacket(packet.data, packet.size)) {
-          continue;
-        }
-        size_t ip_data_size = packet.size - sizeof(EtherFrame);
-        size_t copy_size = std::min(ip_data_size, buf_size);
-        memcpy(buf, &packet.data[sizeof(EtherFrame)], copy_size);
-        return ip_data_size;
-      }
-      Sleep();
+  if (vlen == 0) {
+    return 0;
+  }
+  while (!sock->IsReadable()) {
+    Sleep();
+  }
+  unsigned int num_of_received = 0;
+  for (; num_of_received < vlen && sock->IsReadable(); num_of_received++) {
+    struct msghdr& hdr = msgvec[num_of_received].msg_hdr;
+    if (hdr.msg_iovlen != 1) {
+      kprintf("%s: messages with %d iovecs are not supported yet\n",
+              __func__, hdr.msg_iovlen);
+      break;
     }
-    return -1;
+    ssize_t received_size = ReceiveDatagram(
+        *sock, hdr.msg_iov[0].iov_base, hdr.msg_iov[0].iov_len,
+        reinterpret_cast<sockaddr_in*>(hdr.msg_name));
+    if (received_size < 0) {
+      break;
+    }
+    msgvec[num_of_received].msg_len = static_cast<unsigned int>(received_size);
   }
-  if (socket_type == Socket::Type::kUDP) {
-    uint16_t port = (*sock_holder).listen_port;
-    for (;;) {
-      while (network.HasPacketInRXBuffer()) {
-        auto packet = network.PopFromRXBuffer();
-        if (!IsUDPPacketToPort(packet.data, packet.size, port)) {
-          continue;
-        }
-        size_t udp_data_size = packet.size - sizeof(IPv4UDPPacket);
-        size_t copy_size = std::min(udp_data_size, buf_size);
-        memcpy(buf, &packet.data[sizeof(IPv4UDPPacket)], copy_size);
-        IPv4UDPPacket* udp_packet =
-            reinterpret_cast<IPv4UDPPacket*>(packet.data);
-        recv_addr->sin_addr = udp_packet->ip.src_ip;
-        recv_addr->sin_port =
-            *reinterpret_cast<uint16_t*>(&udp_packet->src_port);
-        return udp_data_size;
+  return num_of_received ? static_cast<int>(num_of_received) : -1;
+}
+
+static WindowBuffer* FindWindowByFD(uint64_t pid, int fd) {
+  if (fd <= 0) {
+    return nullptr;
+  }
+  auto& ppdata = per_process_syscall_data[pid];
+  for (auto& w : ppdata.windows) {
+    if (w.fd == fd) {
+      return &w;
+    }
+  }
+  return nullptr;
+}
+
+static OpenFile* FindFileByFD(uint64_t pid, int fd) {
+  if (fd <= 0) {
+    return nullptr;
+  }
+  auto& ppdata = per_process_syscall_data[pid];
+  for (auto& f : ppdata.files) {
+    if (f.fd == fd) {
+      return &f;
+    }
+  }
+  return nullptr;
+}
+
+static int AllocFileDescriptor(uint64_t pid) {
+  // 0-2 are stdio.
+  Network& network = Network::GetInstance();
+  for (int fd = 3;; fd++) {
+    if (!network.FindSocket(pid, fd) && !network.FindEPoll(pid, fd) &&
+        !FindWindowByFD(pid, fd) && !FindFileByFD(pid, fd)) {
+      return fd;
+    }
+  }
+}
+
+static LoaderInfo& GetLoaderInfoInStraightMapping() {
+  return *reinterpret_cast<LoaderInfo*>(
+      reinterpret_cast<uint64_t>(&GetLoaderInfo()) +
+      GetKernelStraightMappingBase());
+}
+
+static int sys_open(const char* path, int flags) {
+  /* returns a negative error number on failure */
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  auto& ppdata = per_process_syscall_data[pid];
+  OpenFile* slot = nullptr;
+  for (auto& f : ppdata.files) {
+    if (!f.fd) {
+      slot = &f;
+      break;
+    }
+  }
+  if (!slot) {
+    return ErrorNumber::kTooManyFiles;
+  }
+  OpenFile f = {};
+  f.is_writable = (flags & kOpenAccessModeMask) != kOpenReadOnly;
+  f.is_append = flags & kOpenAppend;
+  if (FAT32* fs = GetRootFileSystem()) {
+    if ((flags & kOpenCreate) ? fs->Create(path, f.file)
+                              : fs->Open(path, f.file)) {
+      return ErrorNumber::kNoEntry;
+    }
+    if (f.file.is_dir && f.is_writable) {
+      return ErrorNumber::kIsDirectory;
+    }
+    if ((flags & kOpenTruncate) && f.is_writable &&
+        fs->Truncate(f.file, 0)) {
+      return ErrorNumber::kIOError;
+    }
+  } else {
+    if (f.is_writable || (flags & kOpenCreate)) {
+      return ErrorNumber::kReadOnlyFileSystem;
+    }
+    while (*path == '/') {
+      path++;
+    }
+    f.is_loader_file = true;
+    if (!*path || IsEqualString(path, ".")) {
+      f.file.is_dir = true;
+    } else {
+      f.idx_in_root_files = GetLoaderInfoInStraightMapping().FindFile(path);
+      if (f.idx_in_root_files < 0) {
+        return ErrorNumber::kNoEntry;
       }
-      Sleep();
     }
-    return -1;
   }
-  kprintf("%s: socket_type = %d is not a supported yet\n", __func__,
-          socket_type);
+  if ((flags & kOpenDirectory) && !f.file.is_dir) {
+    return ErrorNumber::kNotDirectory;
+  }
+  *slot = f;
+  slot->fd = AllocFileDescriptor(pid);
+  return slot->fd;
+}
+
+static uint64_t GetFileSize(const OpenFile& f) {
+  if (!f.is_loader_file) {
+    return f.file.size;
+  }
+  if (f.file.is_dir) {
+    return 0;
+  }
+  return GetLoaderInfoInStraightMapping()
+      .root_files[f.idx_in_root_files]
+      .GetFileSize();
+}
+
+static int sys_close(int fd) {
+  /* returns a negative error number on failure */
+  if (0 <= fd && fd <= 2) {
+    // stdio is always open.
+    return 0;
+  }
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  if (OpenFile* f = FindFileByFD(pid, fd)) {
+    f->fd = 0;
+    return 0;
+  }
+  if (WindowBuffer* w = FindWindowByFD(pid, fd)) {
+    // The pages stay mapped in the process since they can not be freed, and
+    // are mapped again if the slot is reused.
+    if (w->sheet) {
+      w->sheet->RemoveFromParent();
+    }
+    *w = {};
+    return 0;
+  }
+  Network& network = Network::GetInstance();
+  if (!network.CloseSocket(pid, fd) || !network.CloseEPoll(pid, fd)) {
+    return 0;
+  }
+  return ErrorNumber::kBadFileDescriptor;
+}
+
+static int OpenWindow() {
+  /* returns -1 on failure */
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  auto& ppdata = per_process_syscall_data[pid];
+  for (auto& w : ppdata.windows) {
+    if (!w.fd) {
+      w.fd = AllocFileDescriptor(pid);
+      return w.fd;
+    }
+  }
+  kprintf("%s: too many windows\n", __func__);
   return -1;
 }
 
+static uint64_t MapWindow(int fd, uint64_t size) {
+  /* returns -1 on failure */
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  auto& ppdata = per_process_syscall_data[pid];
+  WindowBuffer* w = FindWindowByFD(pid, fd);
+  if (!w || w->file_buf || size > kWindowMapStride) {
+    kprintf("%s: fd %d is not a window to map\n", __func__, fd);
+    return static_cast<uint64_t>(-1);
+  }
+  const uint64_t user_addr = GetWindowUserAddr(
+      static_cast<int>(w - &ppdata.windows[0]));
+  w->map_size = size;
+  w->file_buf = AllocKernelMemory<uint8_t*>(size);
+  bzero(w->file_buf, size);
+  uint64_t user_cr3 = ReadCR3();
+  WriteCR3(liumos->kernel_pml4_phys);
+  CreatePageMapping(GetSystemDRAMAllocator(),
+                    *reinterpret_cast<IA_PML4*>(user_cr3), user_addr,
+                    v2p(w->file_buf), size,
+                    kPageAttrPresent | kPageAttrWritable | kPageAttrUser);
+  WriteCR3(user_cr3);
+  return user_addr;
+}
+
+static WindowBuffer* FindWindowByUserAddr(uint64_t addr) {
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  auto& ppdata = per_process_syscall_data[pid];
+  for (int i = 0; i < kMaxWindowsPerProcess; i++) {
+    if (ppdata.windows[i].file_buf && addr == GetWindowUserAddr(i)) {
+      return &ppdata.windows[i];
+    }
+  }
+  return nullptr;
+}
+
+static Sheet* GetWindowSheet(WindowBuffer& w) {
+  /* returns nullptr on failure */
+  if (w.sheet) {
+    return w.sheet;
+  }
+  uint32_t offset_to_data = *reinterpret_cast<uint32_t*>(w.file_buf + 10);
+  int32_t xsize = *reinterpret_cast<int32_t*>(w.file_buf + 18);
+  int32_t ysize = *reinterpret_cast<int32_t*>(w.file_buf + 22);
+  if (ysize >= 0) {
+    kprintf("ysize should be negative\n");
+    return nullptr;
+  }
+  ysize = -ysize;
+  if (xsize <= 0 || ysize > kMaxWindowSize || xsize > kMaxWindowSize) {
+    kprintf("create window: window too large: %dx%d\n", xsize, ysize);
+    return nullptr;
+  }
+  if ((offset_to_data & 3) ||
+      offset_to_data + static_cast<uint64_t>(xsize) * ysize * 4 > w.map_size) {
+    kprintf("create window: pixels are out of the mapped area\n");
+    return nullptr;
+  }
+  klog(KernelLog::Level::kDebug, "offset_to_data = %d, xsize = %d, ysize = %d",
+       offset_to_data, xsize, ysize);
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  const int offset =
+      static_cast<int>(&w - &per_process_syscall_data[pid].windows[0]) * 32;
+  w.sheet = AllocKernelMemory<Sheet*>(sizeof(Sheet));
+  bzero(w.sheet, sizeof(Sheet));
+  w.sheet->Init(reinterpret_cast<uint32_t*>(w.file_buf + offset_to_data),
+                xsize, ysize, xsize, offset, offset);
+  w.sheet->SetParent(liumos->vram_sheet);
+  return w.sheet;
+}
+
+static int sys_liumos_damage_window(uint64_t addr,
+                                    const Rect* rects,
+                                    int num_of_rects) {
+  /* returns -1 on failure */
+  // Flushes rects of the window mapped at addr to the screen.
+  WindowBuffer* w = FindWindowByUserAddr(addr);
+  if (!w || num_of_rects < 0 || num_of_rects > kMaxDamageRectsPerCall) {
+    return -1;
+  }
+  Sheet* sheet = GetWindowSheet(*w);
+  if (!sheet) {
+    return -1;
+  }
+  for (int i = 0; i < num_of_rects; i++) {
+    Rect r = rects[i].GetIntersectionWith(sheet->GetClientRect());
+    if (r.xsize && r.ysize) {
+      sheet->Flush(r.x, r.y, r.xsize, r.ysize);
+    }
+  }
+  return 0;
+}
+
 static int sys_socket(int domain, int type, int protocol) {
   /* returns -1 on failure */
   constexpr int kDomainIPv4 = 2;
@@ -195,7 +516,7 @@ static int sys_socket(int domain, int type, int protocol) {
   constexpr int kProtocolICMP = 1;
   Network& network = Network::GetInstance();
   auto pid = liumos->scheduler->GetCurrentProcess().GetID();
-  const int sockfd = 3; /* Always assign 3 for now */
+  const int sockfd = AllocFileDescriptor(pid);
   if (domain == kDomainIPv4) {
     if (type == kTypeDatagram && protocol == kProtocolICMP) {
       if (network.RegisterSocket(pid, sockfd,
@@ -203,9 +524,9 @@ static int sys_socket(int domain, int type, int protocol) {
         kprintf("kernel: %s: failed to register socket.\n", __func__);
         return -1 /* Return -1 on error */;
       }
-      kprintf("kernel: %s: socket (fd=%d) created (IPv4, DGRAM, ICMP)\n",
-              __func__, sockfd);
-      return sockfd /* Always returns 3 for now */;
+      klog(KernelLog::Level::kDebug,
+           "%s: socket (fd=%d) created (IPv4, DGRAM, ICMP)", __func__, sockfd);
+      return sockfd;
     }
     if (type == kTypeRawSocket && protocol == kProtocolICMP) {
       if (network.RegisterSocket(pid, sockfd,
@@ -213,9 +534,9 @@ static int sys_socket(int domain, int type, int protocol) {
         kprintf("kernel: %s: failed to register socket.\n", __func__);
         return -1 /* Return -1 on error */;
       }
-      kprintf("kernel: %s: socket (fd=%d) created (IPv4, Raw, ICMPRaw)\n",
-              __func__, sockfd);
-      return sockfd /* Always returns 3 for now */;
+      klog(KernelLog::Level::kDebug,
+           "%s: socket (fd=%d) created (IPv4, Raw, ICMPRaw)", __func__, sockfd);
+      return sockfd;
     }
     if (type == kTypeDatagram && (protocol == 0 || protocol == 17)) {
       /* UDP */
@@ -223,8 +544,9 @@ static int sys_socket(int domain, int type, int protocol) {
         kprintf("kernel: %s: failed to register socket.\n", __func__);
         return -1 /* Return -1 on error */;
       }
-      kprintf("kernel: %s: socket (fd=%d) created (IPv4, DGRAM, %d)(UDP)\n",
-              __func__, sockfd, protocol);
+      klog(KernelLog::Level::kDebug,
+           "%s: socket (fd=%d) created (IPv4, DGRAM, %d)(UDP)", __func__,
+           sockfd, protocol);
       return sockfd;
     }
   }
@@ -238,7 +560,7 @@ static int sys_bind(int sockfd, sockaddr_in* addr, socklen_t addrlen) {
   Network& network = Network::GetInstance();
   auto pid = liumos->scheduler->GetCurrentProcess().GetID();
   auto sock_holder = network.FindSocket(pid, sockfd);
-  if (!sock_holder.has_value()) {
+  if (!sock_holder) {
     kprintf("%s: fd %d is not a socket\n", __func__, sockfd);
     return -1;
   }
@@ -248,10 +570,115 @@ static int sys_bind(int sockfd, sockaddr_in* addr, socklen_t addrlen) {
     kprintf("%s: BindToPort failed\n", __func__, sockfd);
     return -1;
   }
-  kprintf("%s: bind(%d, %p, %d)\n", __func__, sockfd, addr, addrlen);
+  klog(KernelLog::Level::kDebug, "%s: bind(%d, %p, %d)", __func__, sockfd, addr,
+       addrlen);
   return 0;
 }
 
+// struct timespec of Linux
+struct TimeSpec {
+  int64_t tv_sec;
+  int64_t tv_nsec;
+};
+
+static int sys_clock_gettime(int clk_id, TimeSpec* tp) {
+  /* returns -1 on failure */
+  constexpr int kClockRealtime = 0;
+  constexpr int kClockMonotonic = 1;
+  if (clk_id != kClockRealtime && clk_id != kClockMonotonic) {
+    kprintf("%s: clk_id = %d is not supported yet\n", __func__, clk_id);
+    return -1;
+  }
+  // Both clocks count from the boot since there is no RTC support yet.
+  HPET& hpet = HPET::GetInstance();
+  const uint64_t count = hpet.ReadMainCounterValue();
+  const uint64_t count_per_sec = hpet.GetCountPerSecond();
+  tp->tv_sec = count / count_per_sec;
+  tp->tv_nsec = (count % count_per_sec) * 1'000'000'000ULL / count_per_sec;
+  return 0;
+}
+
+static int sys_epoll_create1(int flags) {
+  /* returns -1 on failure */
+  if (flags) {
+    kprintf("%s: flags = %d is not supported yet\n", __func__, flags);
+    return -1;
+  }
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  const int epfd = AllocFileDescriptor(pid);
+  if (!Network::GetInstance().CreateEPoll(pid, epfd)) {
+    return -1;
+  }
+  return epfd;
+}
+
+static int sys_epoll_ctl(int epfd,
+                         int op,
+                         int fd,
+                         Network::EPollEvent* event) {
+  /* returns -1 on failure */
+  constexpr int kEPollCtlAdd = 1;
+  constexpr int kEPollCtlDel = 2;
+  constexpr int kEPollCtlMod = 3;
+  Network& network = Network::GetInstance();
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  Network::EPoll* ep = network.FindEPoll(pid, epfd);
+  if (!ep) {
+    kprintf("%s: fd %d is not an epoll\n", __func__, epfd);
+    return -1;
+  }
+  Network::Socket* sock = network.FindSocket(pid, fd);
+  if (!sock) {
+    kprintf("%s: fd %d is not a socket\n", __func__, fd);
+    return -1;
+  }
+  bool failed;
+  if (op == kEPollCtlAdd && event) {
+    failed = network.AddToEPoll(*ep, *sock, event->events, event->data);
+  } else if (op == kEPollCtlMod && event) {
+    failed = network.ModifyEPoll(*ep, *sock, event->events, event->data);
+  } else if (op == kEPollCtlDel) {
+    failed = network.RemoveFromEPoll(*ep, *sock);
+  } else {
+    kprintf("%s: op = %d is not supported\n", __func__, op);
+    return -1;
+  }
+  return failed ? -1 : 0;
+}
+
+static int sys_epoll_wait(int epfd,
+                          Network::EPollEvent* events,
+                          int max_events,
+                          int timeout_ms) {
+  /* returns -1 on failure, 0 on timeout */
+  Network& network = Network::GetInstance();
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  Network::EPoll* ep = network.FindEPoll(pid, epfd);
+  if (!ep) {
+    kprintf("%s: fd %d is not an epoll\n", __func__, epfd);
+    return -1;
+  }
+  if (max_events <= 0) {
+    return -1;
+  }
+  HPET& hpet = HPET::GetInstance();
+  const uint64_t start_ms = hpet.ReadMainCounterValueInMs();
+  for (;;) {
+    // The ready list is maintained by Network::QueueFrameToSocket(), so
+    // this does not scan the whole interest list.
+    int num_of_events = network.CollectEPollEvents(*ep, events, max_events);
+    if (num_of_events) {
+      return num_of_events;
+    }
+    if (timeout_ms >= 0 &&
+        hpet.ReadMainCounterValueInMs() - start_ms >=
+            static_cast<uint64_t>(timeout_ms)) {
+      return 0;
+    }
+    Sleep();
+  }
+}
+
 static ssize_t sys_read(int fd, void* buf, size_t count) {
   if (fd == 0) {
     if (count < 1)
@@ -263,101 +690,167 @@ static ssize_t sys_read(int fd, void* buf, size_t count) {
     reinterpret_cast<uint8_t*>(buf)[0] = proc_stdin.Pop();
     return 1;
   }
-  if (fd == 6) {
-    auto pid = liumos->scheduler->GetCurrentProcess().GetID();
-    auto& ppdata = per_process_syscall_data[pid];
-    LoaderInfo& loader_info = *reinterpret_cast<LoaderInfo*>(
-        reinterpret_cast<uint64_t>(&GetLoaderInfo()) +
-        GetKernelStraightMappingBase());
-    EFIFile& file = loader_info.root_files[ppdata.idx_in_root_files];
-    uint64_t file_size = file.GetFileSize();
-    const uint8_t* src = reinterpret_cast<const uint8_t*>(
-        reinterpret_cast<uint64_t>(file.GetBuf()) +
-        GetKernelStraightMappingBase());
-    assert(file_size >= ppdata.read_offset);
-    uint64_t copy_size = std::min(file_size - ppdata.read_offset, count);
-    if (copy_size) {
-      memcpy(buf, src + ppdata.read_offset, copy_size);
-      ppdata.read_offset += copy_size;
-    }
-    return copy_size;
-  }
-  kprintf("%s: fd %d is not supported yet: only stdin is supported now.\n",
-          __func__, fd);
-  return ErrorNumber::kInvalid;
-}
-
-static std::optional<Network::EtherAddr> ResolveIPv4WithTimeout(
-    Network::IPv4Addr dst_ip_addr,
-    uint64_t timeout_ms) {
-  Network& network = Network::GetInstance();
-  uint64_t time_passed_ms = 0;
-  constexpr uint64_t kWaitTimePerTryMs = 200;
-  Network::IPv4Addr nexthop_ip_addr;
-  if (dst_ip_addr.IsInSameSubnet(network.GetIPv4DefaultGateway(),
-                                 network.GetIPv4NetMask())) {
-    kprintf("kernel: dst is in the same subnet.\n");
-    nexthop_ip_addr = dst_ip_addr;
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  OpenFile* f = FindFileByFD(pid, fd);
+  if (!f) {
+    kprintf("%s: fd %d is not supported yet: only stdin and files are "
+            "supported now.\n",
+            __func__, fd);
+    return ErrorNumber::kInvalid;
+  }
+  if (f->file.is_dir) {
+    return ErrorNumber::kIsDirectory;
+  }
+  if (!f->is_loader_file) {
+    const int64_t read_size =
+        GetRootFileSystem()->Read(f->file, f->offset, buf, count);
+    if (read_size < 0) {
+      return ErrorNumber::kIOError;
+    }
+    f->offset += read_size;
+    return read_size;
+  }
+  EFIFile& file =
+      GetLoaderInfoInStraightMapping().root_files[f->idx_in_root_files];
+  uint64_t file_size = file.GetFileSize();
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(
+      reinterpret_cast<uint64_t>(file.GetBuf()) +
+      GetKernelStraightMappingBase());
+  if (f->offset >= file_size) {
+    return 0;
+  }
+  uint64_t copy_size = std::min(file_size - f->offset, count);
+  memcpy(buf, src + f->offset, copy_size);
+  f->offset += copy_size;
+  return copy_size;
+}
+
+static ssize_t sys_write(int fd, const void* buf, size_t count) {
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  OpenFile* f = FindFileByFD(pid, fd);
+  if (!f) {
+    kprintf("%s: fd = %d is not supported yet\n", __func__, fd);
+    return ErrorNumber::kBadFileDescriptor;
+  }
+  if (!f->is_writable) {
+    return ErrorNumber::kBadFileDescriptor;
+  }
+  if (f->is_append) {
+    f->offset = f->file.size;
+  }
+  const int64_t written_size =
+      GetRootFileSystem()->Write(f->file, f->offset, buf, count);
+  if (written_size < 0) {
+    return ErrorNumber::kIOError;
+  }
+  f->offset += written_size;
+  return written_size;
+}
+
+static int64_t sys_lseek(int fd, int64_t offset, int whence) {
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  OpenFile* f = FindFileByFD(pid, fd);
+  if (!f) {
+    return ErrorNumber::kBadFileDescriptor;
+  }
+  int64_t base;
+  if (whence == kSeekSet) {
+    base = 0;
+  } else if (whence == kSeekCur && !f->file.is_dir) {
+    base = static_cast<int64_t>(f->offset);
+  } else if (whence == kSeekEnd && !f->file.is_dir) {
+    base = static_cast<int64_t>(GetFileSize(*f));
   } else {
-    kprintf("kernel: dst is in a different subnet.\n");
-    nexthop_ip_addr = network.GetIPv4DefaultGateway();
-  }
-  while (time_passed_ms < timeout_ms) {
-    auto eth_container = network.ResolveIPv4(nexthop_ip_addr);
-    if (eth_container.has_value()) {
-      kprintf("kernel: ARP entry found!\n");
-      return eth_container;
-    }
-    SendARPRequest(nexthop_ip_addr);
-    kprintf("kernel: ARP request sent to %d.%d.%d.%d...\n",
-            nexthop_ip_addr.addr[0], nexthop_ip_addr.addr[1],
-            nexthop_ip_addr.addr[2], nexthop_ip_addr.addr[3]);
-    Sleep();
-    HPET::GetInstance().BusyWait(kWaitTimePerTryMs);
-    time_passed_ms += kWaitTimePerTryMs;
+    return ErrorNumber::kInvalid;
+  }
+  if (base + offset < 0) {
+    return ErrorNumber::kInvalid;
   }
-  kprintf("kernel: ARP resolution failed. (timeout)\n");
-  return std::nullopt;
+  f->offset = static_cast<uint64_t>(base + offset);
+  return base + offset;
 }
 
-static ssize_t sys_sendto(int sockfd,
-                          const void* buf,
-                          size_t len,
-                          int /*flags*/,
-                          const struct sockaddr_in* dest_addr,
-                          socklen_t /*addrlen*/) {
-  using Net = Virtio::Net;
-  using IPv4Packet = Virtio::Net::IPv4Packet;
+static int sys_mkdir(const char* path) {
+  FAT32* fs = GetRootFileSystem();
+  if (!fs) {
+    return ErrorNumber::kReadOnlyFileSystem;
+  }
+  FAT32::File dir;
+  if (!fs->Open(path, dir)) {
+    return ErrorNumber::kExists;
+  }
+  if (fs->CreateDirectory(path, dir)) {
+    return ErrorNumber::kNoEntry;
+  }
+  return 0;
+}
+
+static ssize_t SendDatagram(Network::Socket& sock,
+                            const void* buf,
+                            size_t len,
+                            const struct sockaddr_in* dest_addr) {
+  /* returns -1 on failure */
+  using IPv4Packet = Network::IPv4Packet;
   using IPv4Addr = Network::IPv4Addr;
   using EtherAddr = Network::EtherAddr;
+  using EtherFrame = Network::EtherFrame;
   using Socket = Network::Socket;
 
-  Net& virtio_net = Net::GetInstance();
   Network& network = Network::GetInstance();
-  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
-  auto sock_holder = network.FindSocket(pid, sockfd);
-  if (!sock_holder.has_value()) {
-    kprintf("%s: fd %d is not a socket\n", __func__, sockfd);
-    return -1;
-  }
-  Socket::Type socket_type = (*sock_holder).type;
+  Socket::Type socket_type = sock.type;
 
   IPv4Addr target_ip_addr = dest_addr->sin_addr;
-  std::optional<EtherAddr> target_eth_addr_holder =
-      ResolveIPv4WithTimeout(target_ip_addr, 1000);
-  if (!target_eth_addr_holder.has_value()) {
-    kprintf("%s: ARP resolution failed.\n", __func__);
+  Network::Route route = network.LookupRoute(target_ip_addr);
+  if (!route.dev) {
+    kprintf("%s: no route to the host\n", __func__);
     return -1;
   }
+  NetDevice& dev = *route.dev;
+  IPv4Addr nexthop_ip_addr = route.next_hop;
+  // Does not block. If the next hop is not resolved yet, the frame is built
+  // in pending_frame and held in the neighbor cache until the ARP reply
+  // arrives, instead of stalling the caller.
+  std::optional<EtherAddr> nexthop_eth_addr =
+      dev.IsLoopback() ? dev.GetSelfEtherAddr()
+                       : network.ResolveIPv4(dev, nexthop_ip_addr);
+  Network::PacketContainer pending_frame;
+  auto get_frame_buf = [&](size_t frame_size, uint32_t flow_hash) -> uint8_t* {
+    if (nexthop_eth_addr.has_value()) {
+      return dev.GetNextTXPacketBuf<uint8_t*>(frame_size, flow_hash);
+    }
+    pending_frame.size = frame_size;
+    return pending_frame.data;
+  };
+  auto send_frame = [&]() -> bool {
+    if (nexthop_eth_addr.has_value()) {
+      dev.SendPacket();
+      return true;
+    }
+    if (!network.EnqueuePendingFrame(nexthop_ip_addr, pending_frame.data,
+                                     pending_frame.size)) {
+      kprintf("%s: too many frames pending for ARP resolution.\n", __func__);
+      return false;
+    }
+    return true;
+  };
+
   if (socket_type == Network::Socket::Type::kICMPRaw ||
       socket_type == Network::Socket::Type::kICMPDatagram) {
-    using ICMPPacket = Virtio::Net::ICMPPacket;
-    ICMPPacket& icmp =
-        *virtio_net.GetNextTXPacketBuf<ICMPPacket*>(sizeof(IPv4Packet) + len);
+    using ICMPPacket = Network::ICMPPacket;
+    const size_t frame_size = sizeof(IPv4Packet) + len;
+    if (frame_size > Network::kPacketContainerSize) {
+      return -1;
+    }
+    ICMPPacket& icmp = *reinterpret_cast<ICMPPacket*>(get_frame_buf(
+        frame_size,
+        Network::CalcFlowHash(dev.GetSelfIPv4Addr(), target_ip_addr,
+                              IPv4Packet::Protocol::kICMP, 0, 0)));
     // ip.eth
-    icmp.ip.eth.dst = *target_eth_addr_holder;
-    icmp.ip.eth.src = virtio_net.GetSelfEtherAddr();
-    icmp.ip.eth.SetEthType(Net::EtherFrame::kTypeIPv4);
+    if (nexthop_eth_addr.has_value()) {
+      icmp.ip.eth.dst = *nexthop_eth_addr;
+    }
+    icmp.ip.eth.src = dev.GetSelfEtherAddr();
+    icmp.ip.eth.SetEthType(EtherFrame::kTypeIPv4);
     // ip
     icmp.ip.version_and_ihl =
         0x45;  // IPv4, header len = 5 * sizeof(uint32_t) = 20 bytes
@@ -366,55 +859,161 @@ static ssize_t sys_sendto(int sockfd,
     icmp.ip.ident = 0;
     icmp.ip.flags = 0;
     icmp.ip.ttl = 0xFF;
-    icmp.ip.protocol = Net::IPv4Packet::Protocol::kICMP;
-    icmp.ip.src_ip = virtio_net.GetSelfIPv4Addr();
+    icmp.ip.protocol = IPv4Packet::Protocol::kICMP;
+    icmp.ip.src_ip = dev.GetSelfIPv4Addr();
     icmp.ip.dst_ip = target_ip_addr;
     icmp.ip.CalcAndSetChecksum();
     // icmp
     memcpy(&icmp.type /*first member of ICMP*/, buf, len);
     // send
-    virtio_net.SendPacket();
+    if (!send_frame()) {
+      return -1;
+    }
     return len;
   }
   if (socket_type == Network::Socket::Type::kUDP) {
     len = (len + 1) & ~1;  // make size even
-    using IPv4UDPPacket = Virtio::Net::IPv4UDPPacket;
-    IPv4UDPPacket& udp = *virtio_net.GetNextTXPacketBuf<IPv4UDPPacket*>(
-        sizeof(IPv4UDPPacket) + len);
+    using IPv4UDPPacket = Network::IPv4UDPPacket;
+    const size_t frame_size = sizeof(IPv4UDPPacket) + len;
+    if (frame_size > Network::kMaxIPv4FrameSize) {
+      return -1;
+    }
+    // Datagrams larger than MTU are segmented by the device if possible,
+    // otherwise they are fragmented here.
+    const bool exceeds_mtu =
+        frame_size > sizeof(EtherFrame) + Network::kEtherMTU;
+    const bool use_ufo =
+        exceeds_mtu && nexthop_eth_addr.has_value() &&
+        dev.HasCapabilities(NetDevice::kCapTXUDPSegmentation);
+    const bool use_fragmentation = exceeds_mtu && !use_ufo;
+    const uint16_t dst_port = static_cast<uint16_t>(
+        ((dest_addr->sin_port >> 8) & 0xFF) | (dest_addr->sin_port << 8));
+    const uint32_t flow_hash =
+        Network::CalcFlowHash(dev.GetSelfIPv4Addr(), target_ip_addr,
+                              IPv4Packet::Protocol::kUDP, sock.listen_port,
+                              dst_port);
+    IPv4UDPPacket& udp = *reinterpret_cast<IPv4UDPPacket*>(
+        use_fragmentation ? network.GetIPv4FragmentationBuf()
+                          : get_frame_buf(frame_size, flow_hash));
     // ip.eth
-    udp.ip.eth.dst = *target_eth_addr_holder;
-    udp.ip.eth.src = virtio_net.GetSelfEtherAddr();
-    udp.ip.eth.SetEthType(Net::EtherFrame::kTypeIPv4);
+    if (nexthop_eth_addr.has_value()) {
+      udp.ip.eth.dst = *nexthop_eth_addr;
+    }
+    udp.ip.eth.src = dev.GetSelfEtherAddr();
+    udp.ip.eth.SetEthType(EtherFrame::kTypeIPv4);
     // ip
     udp.ip.version_and_ihl =
         0x45;  // IPv4, header len = 5 * sizeof(uint32_t) = 20 bytes
     udp.ip.dscp_and_ecn = 0;
-    udp.ip.SetDataLength(sizeof(IPv4UDPPacket) + len - sizeof(IPv4Packet));
-    udp.ip.ident = 0;
+    udp.ip.SetDataLength(static_cast<uint16_t>(sizeof(IPv4UDPPacket) + len -
+                                               sizeof(IPv4Packet)));
+    udp.ip.ident = network.GetNextIPv4Ident();
     udp.ip.flags = 0;
     udp.ip.ttl = 0xFF;
-    udp.ip.protocol = Net::IPv4Packet::Protocol::kUDP;
-    udp.ip.src_ip = virtio_net.GetSelfIPv4Addr();
+    udp.ip.protocol = IPv4Packet::Protocol::kUDP;
+    udp.ip.src_ip = dev.GetSelfIPv4Addr();
     udp.ip.dst_ip = target_ip_addr;
     udp.ip.CalcAndSetChecksum();
     // udp
     memcpy(reinterpret_cast<uint8_t*>(&udp) +
                sizeof(IPv4UDPPacket) /*right after the UDP header*/,
            buf, len);
-    udp.SetSourcePort((*sock_holder).listen_port);
+    udp.SetSourcePort(sock.listen_port);
     *reinterpret_cast<uint16_t*>(&udp.dst_port) = dest_addr->sin_port;
-    udp.SetDataSize(len);
-    udp.csum = Network::CalcUDPChecksum(
-        &udp, offsetof(IPv4UDPPacket, src_port), sizeof(IPv4UDPPacket) + len,
-        udp.ip.src_ip, udp.ip.dst_ip, udp.length);
+    udp.SetDataSize(static_cast<uint16_t>(len));
+    if (nexthop_eth_addr.has_value() && !use_fragmentation) {
+      dev.SetUDPChecksum(udp, frame_size);
+      if (use_ufo) {
+        // Fragment payloads except the last one must be multiple of 8 bytes.
+        constexpr size_t kIPHeaderSize =
+            sizeof(IPv4Packet) - sizeof(EtherFrame);
+        dev.SetTXUDPSegmentation(
+            sizeof(IPv4UDPPacket),
+            static_cast<uint16_t>((Network::kEtherMTU - kIPHeaderSize) & ~7));
+      }
+    } else {
+      // Pending frames and fragments are not in a device buffer to offload
+      // the checksum.
+      udp.csum.Clear();
+      udp.csum = Network::CalcUDPChecksum(
+          &udp, offsetof(IPv4UDPPacket, src_port), frame_size, udp.ip.src_ip,
+          udp.ip.dst_ip, udp.length);
+    }
+    if (use_fragmentation) {
+      if (!network.SendIPv4Fragments(dev, nexthop_ip_addr, nexthop_eth_addr,
+                                     reinterpret_cast<uint8_t*>(&udp),
+                                     frame_size, flow_hash)) {
+        kprintf("%s: failed to send fragments.\n", __func__);
+        return -1;
+      }
+      return len;
+    }
     // send
-    virtio_net.SendPacket();
+    if (!send_frame()) {
+      return -1;
+    }
     return len;
   }
   kprintf("%s: socket_type = %d is not supported\n", __func__, socket_type);
   return -1;
 }
 
+static ssize_t sys_sendto(int sockfd,
+                          const void* buf,
+                          size_t len,
+                          int /*flags*/,
+                          const struct sockaddr_in* dest_addr,
+                          socklen_t /*addrlen*/) {
+  /* returns -1 on failure */
+  Network& network = Network::GetInstance();
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  Network::Socket* sock = network.FindSocket(pid, sockfd);
+  if (!sock) {
+    kprintf("%s: fd %d is not a socket\n", __func__, sockfd);
+    return -1;
+  }
+  return SendDatagram(*sock, buf, len, dest_addr);
+}
+
+static int sys_sendmmsg(int sockfd,
+                        struct mmsghdr* msgvec,
+                        unsigned int vlen,
+                        int /*flags*/) {
+  /* returns -1 on failure, or the number of messages sent */
+  Network& network = Network::GetInstance();
+  auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+  Network::Socket* sock = network.FindSocket(pid, sockfd);
+  if (!sock) {
+    kprintf("%s: fd %d is not a socket\n", __func__, sockfd);
+    return -1;
+  }
+  // Frames of all the messages are handed to each device with one kick.
+  for (auto dev : network.GetNetDevices()) {
+    dev->BeginTXBatch();
+  }
+  unsigned int num_of_sent = 0;
+  for (; num_of_sent < vlen; num_of_sent++) {
+    struct msghdr& hdr = msgvec[num_of_sent].msg_hdr;
+    if (!hdr.msg_name || hdr.msg_iovlen != 1) {
+      kprintf("%s: messages without an address or with %d iovecs are not "
+              "supported yet\n",
+              __func__, hdr.msg_iovlen);
+      break;
+    }
+    ssize_t sent_size =
+        SendDatagram(*sock, hdr.msg_iov[0].iov_base, hdr.msg_iov[0].iov_len,
+                     reinterpret_cast<sockaddr_in*>(hdr.msg_name));
+    if (sent_size < 0) {
+      break;
+    }
+    msgvec[num_of_sent].msg_len = static_cast<unsigned int>(sent_size);
+  }
+  for (auto dev : network.GetNetDevices()) {
+    dev->EndTXBatch();
+  }
+  return num_of_sent ? static_cast<int>(num_of_sent) : -1;
+}
+
 packed_struct DirectoryEntry {
   uint64_t inode;        // +0
   uint64_t next_offset;  // +8
@@ -422,27 +1021,64 @@ packed_struct DirectoryEntry {
   uint8_t d_type;        // +18
 };
 static_assert(sizeof(DirectoryEntry) == 19);
+constexpr uint8_t kDirectoryEntryTypeDirectory = 4;
+constexpr uint8_t kDirectoryEntryTypeRegular = 8;
 
-static ssize_t sys_getdents64(int, void* buf, size_t) {
+static ssize_t sys_getdents64(int fd, void* buf, size_t buf_size) {
+  // Fills buf with as many entries as it can hold from the current position.
   auto pid = liumos->scheduler->GetCurrentProcess().GetID();
-  auto& ppdata = per_process_syscall_data[pid];
-
-  if (ppdata.num_getdents64_called != 0) {
-    return 0;
+  OpenFile* f = FindFileByFD(pid, fd);
+  if (!f) {
+    return ErrorNumber::kBadFileDescriptor;
   }
-  ppdata.num_getdents64_called++;
-
-  DirectoryEntry* de = reinterpret_cast<DirectoryEntry*>(buf);
-  const char* file_name = "TEST_FILE.bin";
-  size_t file_name_len = strlen(file_name);
-  de->inode = 123;
-  de->next_offset = 0;
-  de->this_size = sizeof(DirectoryEntry) + file_name_len + 1;
-  char* dst = reinterpret_cast<char*>(de + 1);
-  for (size_t i = 0; i < file_name_len + 1; i++) {
-    dst[i] = file_name[i];
+  if (!f->file.is_dir) {
+    return ErrorNumber::kNotDirectory;
   }
-  return de->this_size;
+  FAT32::DirEntry entry;
+  LoaderInfo& loader_info = GetLoaderInfoInStraightMapping();
+  uint8_t* dst = reinterpret_cast<uint8_t*>(buf);
+  size_t used_size = 0;
+  for (;;) {
+    uint64_t next_offset = f->offset;
+    const char* name;
+    uint64_t inode;
+    bool is_dir;
+    if (f->is_loader_file) {
+      if (next_offset >= static_cast<uint64_t>(loader_info.root_files_used)) {
+        break;
+      }
+      name = loader_info.root_files[next_offset].GetFileName();
+      inode = ++next_offset;
+      is_dir = false;
+    } else {
+      if (GetRootFileSystem()->ReadDir(f->file, next_offset, entry)) {
+        break;
+      }
+      name = entry.name;
+      inode = entry.id;
+      is_dir = entry.is_dir;
+    }
+    const size_t name_size = strlen(name) + 1;
+    const size_t entry_size =
+        (sizeof(DirectoryEntry) + name_size + 7) & ~static_cast<size_t>(7);
+    if (used_size + entry_size > buf_size) {
+      if (!used_size) {
+        return ErrorNumber::kInvalid;
+      }
+      break;
+    }
+    DirectoryEntry* de = reinterpret_cast<DirectoryEntry*>(dst + used_size);
+    de->inode = inode;
+    de->next_offset = next_offset;
+    de->this_size = static_cast<uint16_t>(entry_size);
+    de->d_type =
+        is_dir ? kDirectoryEntryTypeDirectory : kDirectoryEntryTypeRegular;
+    bzero(de + 1, entry_size - sizeof(DirectoryEntry));
+    memcpy(de + 1, name, name_size);
+    used_size += entry_size;
+    f->offset = next_offset;
+  }
+  return used_size;
 }
 
 __attribute__((ms_abi)) extern "C" void SyscallHandler(uint64_t* args) {
@@ -459,8 +1095,7 @@ __attribute__((ms_abi)) extern "C" void SyscallHandler(uint64_t* args) {
     const uint8_t* buf = reinterpret_cast<uint8_t*>(args[2]);
     uint64_t nbyte = args[3];
     if (fildes != 1) {
-      kprintf("%s: fd = %d is not supported yet\n", __func__, fildes);
-      args[0] = ErrorNumber::kBadFileDescriptor;
+      args[0] = sys_write(static_cast<int>(fildes), buf, nbyte);
       return;
     }
     if ((nbyte >> 63)) {
@@ -474,115 +1109,68 @@ __attribute__((ms_abi)) extern "C" void SyscallHandler(uint64_t* args) {
     return;
   }
   if (idx == kSyscallIndex_sys_open) {
-    auto pid = liumos->scheduler->GetCurrentProcess().GetID();
-    auto& ppdata = per_process_syscall_data[pid];
-
     const char* file_name = reinterpret_cast<const char*>(args[1]);
-    kprintf("file name: %s\n", file_name);
-
-    if (IsEqualString(".", file_name)) {
-      ppdata.num_getdents64_called = 0;
-      args[0] = 5;
-      return;
-    }
+    klog(KernelLog::Level::kDebug, "open: file name: %s", file_name);
 
     if (IsEqualString("window.bmp", file_name)) {
-      args[0] = 7;
+      *((int64_t*)&args[0]) = OpenWindow();
       return;
     }
-
-    int found_idx = -1;
-
-    LoaderInfo& loader_info = *reinterpret_cast<LoaderInfo*>(
-        reinterpret_cast<uint64_t>(&GetLoaderInfo()) +
-        GetKernelStraightMappingBase());
-    kprintf("&GetLoaderInfo(): %p\n", &GetLoaderInfo());
-    kprintf("&loader_info: %p\n", &loader_info);
-    for (int i = 0; i < loader_info.root_files_used; i++) {
-      if (IsEqualString(loader_info.root_files[i].GetFileName(), file_name)) {
-        found_idx = i;
-        break;
-      }
-    }
-    if (found_idx == -1) {
-      kprintf("not found!\n");
-      *((int64_t*)&args[0]) = -1;
+    *((int64_t*)&args[0]) = sys_open(file_name, static_cast<int>(args[2]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_close) {
+    *((int64_t*)&args[0]) = sys_close(static_cast<int>(args[1]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_lseek) {
+    *((int64_t*)&args[0]) =
+        sys_lseek(static_cast<int>(args[1]), static_cast<int64_t>(args[2]),
+                  static_cast<int>(args[3]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_fsync) {
+    auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+    OpenFile* f = FindFileByFD(pid, static_cast<int>(args[1]));
+    if (!f) {
+      *((int64_t*)&args[0]) = ErrorNumber::kBadFileDescriptor;
       return;
     }
-    kprintf("found at index = %d!\n", found_idx);
-    ppdata.idx_in_root_files = found_idx;
-    ppdata.read_offset = 0;
-    args[0] = 6;
+    *((int64_t*)&args[0]) = (!f->is_loader_file && GetRootFileSystem()->Sync())
+                                ? ErrorNumber::kIOError
+                                : 0;
     return;
   }
-  if (idx == kSyscallIndex_sys_close) {
-    args[0] = 0;
+  if (idx == kSyscallIndex_sys_mkdir) {
+    *((int64_t*)&args[0]) =
+        sys_mkdir(reinterpret_cast<const char*>(args[1]));
     return;
   }
   if (idx == kSyscallIndex_sys_mmap) {
     uint64_t size = args[2];
-    uint64_t fd = args[5];
-    if (fd != 7) {
-      kprintf("fd != 7\n");
-      args[0] = static_cast<uint64_t>(-1);
-      return;
-    }
-    uint64_t map_size = size;
-    kprintf("window_fb_map_size = %d\n", map_size);
-    uint8_t* buf_kernel = AllocKernelMemory<uint8_t*>(map_size);
-    uint64_t phys_addr = v2p(buf_kernel);
-    uint64_t user_cr3 = ReadCR3();
-    WriteCR3(liumos->kernel_pml4_phys);
-    CreatePageMapping(GetSystemDRAMAllocator(),
-                      *reinterpret_cast<IA_PML4*>(user_cr3), 0x1'0000'0000,
-                      phys_addr, map_size,
-                      kPageAttrPresent | kPageAttrWritable | kPageAttrUser);
-    WriteCR3(user_cr3);
-    args[0] = 0x1'0000'0000;
+    int fd = static_cast<int>(args[5]);
+    args[0] = MapWindow(fd, size);
     return;
   }
   if (idx == kSyscallIndex_sys_msync) {
-    uint64_t addr = args[1];
-    if (addr != 0x1'0000'0000) {
-      kprintf("invalid addr");
-      args[0] = static_cast<uint64_t>(-1);
-      return;
-    }
-    uint32_t offset_to_data = *reinterpret_cast<uint32_t*>(addr + 10);
-    int32_t xsize = *reinterpret_cast<uint32_t*>(addr + 18);
-    int32_t ysize = *reinterpret_cast<uint32_t*>(addr + 22);
-    if (ysize >= 0) {
-      kprintf("ysize should be negative\n");
-      args[0] = static_cast<uint64_t>(-1);
-      return;
-    }
-    ysize = -ysize;
-    if (ysize > 2048 || xsize > 2048) {
-      kprintf("msync: create window: window too large: %dx%d\n", xsize, ysize);
+    // Flushes the whole window. Use liumos_damage_window to flush a part.
+    WindowBuffer* w = FindWindowByUserAddr(args[1]);
+    Sheet* sheet = w ? GetWindowSheet(*w) : nullptr;
+    if (!sheet) {
+      kprintf("msync: invalid addr\n");
       args[0] = static_cast<uint64_t>(-1);
       return;
     }
-    auto pid = liumos->scheduler->GetCurrentProcess().GetID();
-    auto& ppdata = per_process_syscall_data[pid];
-    auto& sheet = ppdata.window_sheet;
-    auto& buf = ppdata.window_buf;
-    if (!sheet) {
-      kprintf("offset_to_data = %d, xsize = %d, ysize = %d\n", offset_to_data,
-              xsize, ysize);
-      // TODO(hikalium): allocate this backing sheet on fopen.
-      sheet = AllocKernelMemory<Sheet*>(sizeof(Sheet));
-      buf = AllocKernelMemory<uint32_t*>(xsize * ysize * 4);
-      bzero(sheet, sizeof(Sheet));
-      sheet->Init(buf, xsize, ysize, xsize, 0, 0);
-      kprintf("vram_sheet is at %p\n", liumos->vram_sheet);
-      sheet->SetParent(liumos->vram_sheet);
-    }
-    memcpy(buf, reinterpret_cast<uint32_t*>(addr + offset_to_data),
-           xsize * ysize * 4);
-    sheet->Flush(0, 0, xsize, ysize);
+    sheet->Flush();
     args[0] = 0;
     return;
   }
+  if (idx == kSyscallIndex_liumos_damage_window) {
+    args[0] = sys_liumos_damage_window(args[1],
+                                       reinterpret_cast<const Rect*>(args[2]),
+                                       static_cast<int>(args[3]));
+    return;
+  }
   if (idx == kSyscallIndex_sys_exit) {
     if (liumos->debug_mode_enabled) {
       const uint64_t exit_code = args[1];
@@ -598,8 +1186,15 @@ __attribute__((ms_abi)) extern "C" void SyscallHandler(uint64_t* args) {
   if (idx == kSyscallIndex_sys_ftruncate) {
     uint64_t fd = args[1];
     uint64_t size = args[2];
-    kprintf("ftruncate(fd=%d, size=%d)\n", fd, size);
-    if (fd != 5) {
+    klog(KernelLog::Level::kDebug, "ftruncate(fd=%d, size=%d)", fd, size);
+    auto pid = liumos->scheduler->GetCurrentProcess().GetID();
+    if (FindWindowByFD(pid, static_cast<int>(fd))) {
+      args[0] = 0;
+      return;
+    }
+    OpenFile* f = FindFileByFD(pid, static_cast<int>(fd));
+    if (!f || !f->is_writable ||
+        GetRootFileSystem()->Truncate(f->file, size)) {
       args[0] = -1;
       return;
     }
@@ -636,6 +1231,21 @@ __attribute__((ms_abi)) extern "C" void SyscallHandler(uint64_t* args) {
         reinterpret_cast<socklen_t*>(args[6]));
     return;
   }
+  if (idx == kSyscallIndex_sys_sendmmsg) {
+    args[0] = sys_sendmmsg(static_cast<int>(args[1]),
+                           reinterpret_cast<struct mmsghdr*>(args[2]),
+                           static_cast<unsigned int>(args[3]),
+                           static_cast<int>(args[4]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_recvmmsg) {
+    args[0] = sys_recvmmsg(static_cast<int>(args[1]),
+                           reinterpret_cast<struct mmsghdr*>(args[2]),
+                           static_cast<unsigned int>(args[3]),
+                           static_cast<int>(args[4]),
+                           reinterpret_cast<const void*>(args[5]));
+    return;
+  }
   if (idx == kSyscallIndex_sys_bind) {
     args[0] = sys_bind(static_cast<int>(args[1]),
                        reinterpret_cast<struct sockaddr_in*>(args[2]),
@@ -647,6 +1257,29 @@ __attribute__((ms_abi)) extern "C" void SyscallHandler(uint64_t* args) {
                              reinterpret_cast<void*>(args[2]), args[3]);
     return;
   }
+  if (idx == kSyscallIndex_sys_clock_gettime) {
+    args[0] = sys_clock_gettime(static_cast<int>(args[1]),
+                                reinterpret_cast<TimeSpec*>(args[2]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_epoll_create1) {
+    args[0] = sys_epoll_create1(static_cast<int>(args[1]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_epoll_ctl) {
+    args[0] = sys_epoll_ctl(static_cast<int>(args[1]),
+                            static_cast<int>(args[2]),
+                            static_cast<int>(args[3]),
+                            reinterpret_cast<Network::EPollEvent*>(args[4]));
+    return;
+  }
+  if (idx == kSyscallIndex_sys_epoll_wait) {
+    args[0] = sys_epoll_wait(
+        static_cast<int>(args[1]),
+        reinterpret_cast<Network::EPollEvent*>(args[2]),
+        static_cast<int>(args[3]), static_cast<int>(args[4]));
+    return;
+  }
   char s[64];
   snprintf(s, sizeof(s), "Unhandled syscall. rax = %lu\n", idx);
   PutString(s);
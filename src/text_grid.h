@@ -0,0 +1,84 @@
+#pragma once
+
+// A grid of character cells for text consoles.
+// Rows are held in a circular buffer, so scrolling up by one line only
+// advances the index of the top row and clears the new bottom row.
+// Changes since the last ClearDamage() are tracked as a range of dirty
+// columns per row and the number of lines scrolled, so that a renderer can
+// move the pixels once and redraw only the cells which were written.
+// Cells cleared by scrolling are not marked as dirty: the renderer is
+// expected to clear the rows exposed by scrolling.
+template <int kMaxColumns, int kMaxRows>
+class TextGrid {
+ public:
+  static constexpr char kBlank = ' ';
+
+  void Init(int columns, int rows) {
+    columns_ = columns < kMaxColumns ? columns : kMaxColumns;
+    rows_ = rows < kMaxRows ? rows : kMaxRows;
+    top_ = 0;
+    for (int y = 0; y < rows_; y++) {
+      ClearBufRow(y);
+    }
+    ClearDamage();
+  }
+  int GetColumns() const { return columns_; }
+  int GetRows() const { return rows_; }
+  // y is the row on the screen. 0 is the top row.
+  char GetChar(int x, int y) const { return cells_[GetBufRow(y)][x]; }
+  // Returns GetColumns() characters of row y.
+  const char* GetRow(int y) const { return cells_[GetBufRow(y)]; }
+  void PutChar(int x, int y, char c) {
+    int by = GetBufRow(y);
+    cells_[by][x] = c;
+    if (x < dirty_begin_[by])
+      dirty_begin_[by] = x;
+    if (x + 1 > dirty_end_[by])
+      dirty_end_[by] = x + 1;
+    has_damage_ = true;
+  }
+  void ScrollUp() {
+    ClearBufRow(top_);
+    top_ = (top_ + 1) % rows_;
+    if (num_of_scrolled_lines_ < rows_)
+      num_of_scrolled_lines_++;
+    has_damage_ = true;
+  }
+  // Saturates at GetRows().
+  int GetNumOfScrolledLines() const { return num_of_scrolled_lines_; }
+  // Returns the columns [begin, end) of row y written since the last
+  // ClearDamage(). begin >= end if nothing was written.
+  void GetDirtyRange(int y, int& begin, int& end) const {
+    int by = GetBufRow(y);
+    begin = dirty_begin_[by];
+    end = dirty_end_[by];
+  }
+  bool HasDamage() const { return has_damage_; }
+  void ClearDamage() {
+    for (int y = 0; y < rows_; y++) {
+      dirty_begin_[y] = columns_;
+      dirty_end_[y] = 0;
+    }
+    num_of_scrolled_lines_ = 0;
+    has_damage_ = false;
+  }
+
+ private:
+  int GetBufRow(int y) const { return (top_ + y) % rows_; }
+  void ClearBufRow(int by) {
+    for (int x = 0; x < columns_; x++) {
+      cells_[by][x] = kBlank;
+    }
+    dirty_begin_[by] = columns_;
+    dirty_end_[by] = 0;
+  }
+
+  char cells_[kMaxRows][kMaxColumns];
+  // Indexed by the row in cells_, so that they follow the row on scrolling.
+  int dirty_begin_[kMaxRows];
+  int dirty_end_[kMaxRows];
+  int columns_, rows_;
+  int top_;
+  int num_of_scrolled_lines_;
+  bool has_damage_;
+};
@@ -0,0 +1,111 @@
+#include "text_grid.h"
+
+#ifdef LIUMOS_TEST
+
+#include <stdio.h>
+
+#include <cassert>
+
+template <int kMaxColumns, int kMaxRows>
+static void ExpectRow(const TextGrid<kMaxColumns, kMaxRows>& grid,
+                      int y,
+                      const char* expected) {
+  for (int x = 0; x < grid.GetColumns(); x++) {
+    assert(grid.GetChar(x, y) == expected[x]);
+  }
+}
+
+template <int kMaxColumns, int kMaxRows>
+static void ExpectDirtyRange(const TextGrid<kMaxColumns, kMaxRows>& grid,
+                             int y,
+                             int expected_begin,
+                             int expected_end) {
+  int begin, end;
+  grid.GetDirtyRange(y, begin, end);
+  assert(begin == expected_begin && end == expected_end);
+}
+
+template <int kMaxColumns, int kMaxRows>
+static bool IsRowClean(const TextGrid<kMaxColumns, kMaxRows>& grid, int y) {
+  int begin, end;
+  grid.GetDirtyRange(y, begin, end);
+  return begin >= end;
+}
+
+static void TestPutChar() {
+  static TextGrid<8, 4> grid;
+  grid.Init(4, 3);
+  assert(grid.GetColumns() == 4 && grid.GetRows() == 3);
+  assert(!grid.HasDamage());
+  ExpectRow(grid, 0, "    ");
+
+  grid.PutChar(2, 1, 'a');
+  grid.PutChar(1, 1, 'b');
+  assert(grid.HasDamage());
+  ExpectRow(grid, 1, " ba ");
+  assert(grid.GetRow(1)[1] == 'b');
+  ExpectDirtyRange(grid, 1, 1, 3);
+  assert(IsRowClean(grid, 0) && IsRowClean(grid, 2));
+  assert(grid.GetNumOfScrolledLines() == 0);
+
+  grid.ClearDamage();
+  assert(!grid.HasDamage());
+  assert(IsRowClean(grid, 1));
+  ExpectRow(grid, 1, " ba ");
+}
+
+static void TestScroll() {
+  static TextGrid<8, 4> grid;
+  grid.Init(4, 3);
+  grid.PutChar(0, 0, '0');
+  grid.PutChar(0, 1, '1');
+  grid.PutChar(0, 2, '2');
+  grid.ClearDamage();
+
+  // Rows move up and the new bottom row is blank and clean.
+  grid.ScrollUp();
+  assert(grid.HasDamage());
+  assert(grid.GetNumOfScrolledLines() == 1);
+  ExpectRow(grid, 0, "1   ");
+  ExpectRow(grid, 1, "2   ");
+  ExpectRow(grid, 2, "    ");
+  for (int y = 0; y < 3; y++) {
+    assert(IsRowClean(grid, y));
+  }
+
+  // Dirty ranges follow their rows on scrolling.
+  grid.PutChar(3, 2, 'x');
+  grid.ScrollUp();
+  assert(grid.GetNumOfScrolledLines() == 2);
+  ExpectRow(grid, 1, "   x");
+  ExpectDirtyRange(grid, 1, 3, 4);
+  assert(IsRowClean(grid, 0) && IsRowClean(grid, 2));
+
+  // The number of scrolled lines saturates at the number of rows.
+  for (int i = 0; i < 5; i++) {
+    grid.ScrollUp();
+  }
+  assert(grid.GetNumOfScrolledLines() == 3);
+  for (int y = 0; y < 3; y++) {
+    ExpectRow(grid, y, "    ");
+    assert(IsRowClean(grid, y));
+  }
+  grid.ClearDamage();
+  assert(grid.GetNumOfScrolledLines() == 0);
+}
+
+static void TestSizeIsClamped() {
+  static TextGrid<8, 4> grid;
+  grid.Init(100, 100);
+  assert(grid.GetColumns() == 8 && grid.GetRows() == 4);
+}
+
+int main() {
+  TestPutChar();
+  TestScroll();
+  TestSizeIsClamped();
+  puts("PASS");
+  return 0;
+}
+
+#endif
@@ -0,0 +1,65 @@
+#include "virtio.h"
+
+#include "kernel.h"
+
+namespace Virtio {
+
+static uint64_t CalcSizeOfVirtqueue(int queue_size) {
+  // First part: Descriptor Table + Available Ring
+  // Second part: Used Ring
+  return CeilToPageAlignment(sizeof(Virtqueue::Descriptor) * queue_size +
+                             sizeof(uint16_t) * (2 + queue_size)) +
+         CeilToPageAlignment(sizeof(uint16_t) * 2 +
+                             sizeof(uint32_t) * 2 * queue_size);
+}
+
+void Virtqueue::Alloc(int queue_size) {
+  // 2.6.2 Legacy Interfaces: A Note on Virtqueue Layout
+  assert(0 <= queue_size && queue_size <= kMaxQueueSize);
+  queue_size_ = queue_size;
+  const uint64_t buf_size = CalcSizeOfVirtqueue(queue_size);
+  base_ = AllocMemoryForMappedIO<uint8_t*>(buf_size);
+  bzero(base_, buf_size);
+}
+
+uint64_t Virtqueue::GetPhysAddr() {
+  return v2p(reinterpret_cast<uint64_t>(base_));
+}
+
+void Virtqueue::SetDescriptor(int idx,
+                              void* vaddr,
+                              uint32_t len,
+                              uint16_t flags,
+                              uint16_t next) {
+  assert(0 <= idx && idx < queue_size_);
+  buf_[idx] = vaddr;
+  Descriptor& desc =
+      *reinterpret_cast<Descriptor*>(base_ + sizeof(Descriptor) * idx);
+  desc.addr = v2p(vaddr);
+  desc.len = len;
+  desc.flags = flags;
+  desc.next = next;
+}
+
+uint16_t Virtqueue::GetUsedRingIndex() {
+  // This function returns the index of used ring
+  // which will be written by device on the next data arriving.
+  volatile uint16_t& pidx = *reinterpret_cast<volatile uint16_t*>(
+      base_ +
+      CeilToPageAlignment(sizeof(Descriptor) * queue_size_ +
+                          sizeof(uint16_t) * (2 * queue_size_)) +
+      sizeof(uint16_t));
+  return pidx;
+}
+
+Virtqueue::UsedRingEntry& Virtqueue::GetUsedRingEntry(int idx) {
+  assert(0 <= idx && idx < queue_size_);
+  UsedRingEntry* used_ring = reinterpret_cast<UsedRingEntry*>(
+      base_ +
+      CeilToPageAlignment(sizeof(Descriptor) * queue_size_ +
+                          sizeof(uint16_t) * (2 * queue_size_)) +
+      2 * sizeof(uint16_t));
+  return used_ring[idx];
+}
+
+}  // namespace Virtio
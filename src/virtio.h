@@ -0,0 +1,89 @@
+#pragma once
+
+#include "generic.h"
+
+namespace Virtio {
+
+// 4.1.4.8 Legacy Interfaces: A Note on PCI Device Layout
+// Offsets of the registers in the I/O BAR of legacy devices.
+constexpr int kRegDeviceFeatures = 0;
+constexpr int kRegDriverFeatures = 4;
+constexpr int kRegQueueAddress = 8;
+constexpr int kRegQueueSize = 12;
+constexpr int kRegQueueSelect = 14;
+constexpr int kRegQueueNotify = 16;
+constexpr int kRegDeviceStatus = 18;
+constexpr int kRegISRStatus = 19;
+// Only present if MSI-X is enabled.
+constexpr int kRegConfigMSIXVector = 20;
+constexpr int kRegQueueMSIXVector = 22;
+// The device-specific configuration follows the registers above.
+constexpr int kRegDeviceConfig = 20;
+constexpr int kRegDeviceConfigWithMSIX = 24;
+constexpr uint16_t kNoMSIXVector = 0xFFFF;
+
+// 2.1 Device Status Field
+constexpr uint8_t kDeviceStatusAcknowledge = 1;
+constexpr uint8_t kDeviceStatusDriver = 2;
+constexpr uint8_t kDeviceStatusDriverOK = 4;
+constexpr uint8_t kDeviceStatusFeaturesOK = 8;
+// constexpr uint8_t kDeviceStatusDeviceNeedsReset = 64;
+// constexpr uint8_t kDeviceStatusFailed = 128;
+
+// 2.6.5 The Virtqueue Descriptor Table
+constexpr uint16_t kDescFlagNext = 1;
+constexpr uint16_t kDescFlagWrite = 2;
+
+class Virtqueue {
+ public:
+  packed_struct Descriptor {
+    volatile uint64_t addr;
+    volatile uint32_t len;
+    volatile uint16_t flags;
+    volatile uint16_t next;
+  };
+  struct UsedRingEntry {
+    volatile uint32_t id;   // index of start of used descriptor chain
+    volatile uint32_t len;  // in byte
+  };
+  void Alloc(int queue_size);
+  uint64_t GetPhysAddr();
+  void SetDescriptor(int idx,
+                     void* vaddr,
+                     uint32_t len,
+                     uint16_t flags,
+                     uint16_t next);
+  template <typename T = uint8_t*>
+  T GetDescriptorBuf(int idx) {
+    assert(0 <= idx && idx < queue_size_);
+    return reinterpret_cast<T>(buf_[idx]);
+  }
+  uint32_t GetDescriptorSize(int idx) {
+    assert(0 <= idx && idx < queue_size_);
+    Descriptor& desc =
+        *reinterpret_cast<Descriptor*>(base_ + sizeof(Descriptor) * idx);
+    return desc.len;
+  }
+  void SetAvailableRingEntry(int idx, uint16_t desc_idx) {
+    assert(0 <= idx && idx < queue_size_);
+    volatile uint16_t* ring = reinterpret_cast<volatile uint16_t*>(
+        base_ + sizeof(Descriptor) * queue_size_ + sizeof(uint16_t) * 2);
+    ring[idx] = desc_idx;
+  }
+  void SetAvailableRingIndex(int idx) {
+    volatile uint16_t& pidx = *reinterpret_cast<volatile uint16_t*>(
+        base_ + sizeof(Descriptor) * queue_size_ + sizeof(uint16_t));
+    pidx = idx;
+  }
+  uint16_t GetUsedRingIndex();
+  UsedRingEntry& GetUsedRingEntry(int idx);
+  int GetQueueSize() { return queue_size_; }
+
+ private:
+  static constexpr int kMaxQueueSize = 0x100;
+  int queue_size_;
+  uint8_t* base_;
+  void* buf_[kMaxQueueSize];
+};
+
+}  // namespace Virtio
@@ -0,0 +1,346 @@
+#include "virtio_blk.h"
+
+#include <algorithm>
+#include <optional>
+
+#include "interrupt.h"
+#include "kernel.h"
+
+namespace Virtio {
+
+Blk* Blk::blk_;
+
+// Requests are queued by tasks and completed on the interrupt.
+static bool DisableInterrupts() {
+  const bool was_enabled = ReadRFLAGS() & kRFlagsInterruptEnable;
+  ClearIntFlag();
+  return was_enabled;
+}
+
+static void RestoreInterrupts(bool was_enabled) {
+  if (was_enabled)
+    StoreIntFlag();
+}
+
+static std::optional<PCI::DeviceLocation> FindVirtioBlk() {
+  for (auto& it : PCI::GetInstance().GetDeviceList()) {
+    if (!it.first.HasID(0x1af4, 0x1001))
+      continue;
+    kprintf("virtio-blk device found: %s\n", PCI::GetDeviceName(it.first));
+    return it.second;
+  }
+  PutString("virtio-blk: device not found\n");
+  return {};
+}
+
+static void FailRequest(Blk::Request& req) {
+  req.has_failed = true;
+  req.is_done = true;
+  if (req.on_complete)
+    req.on_complete(req);
+}
+
+static void VirtioBlkInterruptHandler(uint64_t, InterruptInfo*) {
+  Blk::GetInstance().HandleInterrupt();
+  liumos->bsp_local_apic->SendEndOfInterrupt();
+}
+
+uint8_t Blk::ReadConfigReg8(int ofs) {
+  return ReadIOPort8(config_io_addr_base_ + ofs);
+}
+uint16_t Blk::ReadConfigReg16(int ofs) {
+  assert((ofs & 0b1) == 0);
+  return ReadIOPort16(config_io_addr_base_ + ofs);
+}
+uint32_t Blk::ReadConfigReg32(int ofs) {
+  assert((ofs & 0b11) == 0);
+  return ReadIOPort32(config_io_addr_base_ + ofs);
+}
+
+void Blk::WriteConfigReg8(int ofs, uint8_t data) {
+  WriteIOPort8(config_io_addr_base_ + ofs, data);
+}
+void Blk::WriteConfigReg16(int ofs, uint16_t data) {
+  assert((ofs & 0b1) == 0);
+  WriteIOPort16(config_io_addr_base_ + ofs, data);
+}
+void Blk::WriteConfigReg32(int ofs, uint32_t data) {
+  assert((ofs & 0b11) == 0);
+  WriteIOPort32(config_io_addr_base_ + ofs, data);
+}
+
+Blk& Blk::GetInstance() {
+  if (!blk_) {
+    blk_ = liumos->kernel_heap_allocator->Alloc<Blk>();
+    bzero(blk_, sizeof(Blk));
+    new (blk_) Blk();
+  }
+  assert(blk_);
+  return *blk_;
+}
+
+void Blk::Init() {
+  PutString("Virtio::Blk::Init()\n");
+  if (auto dev = FindVirtioBlk()) {
+    dev_ = *dev;
+  } else {
+    return;
+  }
+  PCI::EnsureBusMasterEnabled(dev_);
+  config_io_addr_base_ = PCI::GetBARForIO(dev_).base;
+
+  // 3.1.1 Driver Requirements: Device Initialization
+  WriteConfigReg8(kRegDeviceStatus,
+                  ReadConfigReg8(kRegDeviceStatus) | kDeviceStatusAcknowledge);
+  WriteConfigReg8(kRegDeviceStatus,
+                  ReadConfigReg8(kRegDeviceStatus) | kDeviceStatusDriver);
+  features_ = ReadConfigReg32(kRegDeviceFeatures) &
+              (kFeaturesSegMax | kFeaturesRO | kFeaturesBlkSize |
+               kFeaturesFlush);
+  WriteConfigReg32(kRegDriverFeatures, features_);
+  WriteConfigReg8(kRegDeviceStatus,
+                  ReadConfigReg8(kRegDeviceStatus) | kDeviceStatusFeaturesOK);
+
+  // 4.1.5.1.2 Interrupts: Enabling MSI-X moves the device configuration.
+  // INTx is disabled by EnsureBusMasterEnabled(), so completions are only
+  // polled without MSI-X.
+  is_msix_enabled_ = !PCI::EnableMSIX(dev_, 0, kInterruptVector);
+  device_config_ofs_ =
+      is_msix_enabled_ ? kRegDeviceConfigWithMSIX : kRegDeviceConfig;
+  if (is_msix_enabled_) {
+    WriteConfigReg16(kRegConfigMSIXVector, kNoMSIXVector);
+  }
+
+  // 4.1.5.1.3 Virtqueue Configuration
+  // 5.2.2 Virtqueues: requestq is the only queue.
+  WriteConfigReg16(kRegQueueSelect, 0);
+  const uint16_t queue_size = ReadConfigReg16(kRegQueueSize);
+  if (queue_size < kNumOfDescriptorsPerSlot) {
+    kprintf("virtio-blk: queue size %d is too small\n", queue_size);
+    return;
+  }
+  vq_.Alloc(queue_size);
+  const uint64_t vq_pfn = vq_.GetPhysAddr() >> kPageSizeExponent;
+  assert(vq_pfn == (vq_pfn & 0xFFFF'FFFF));
+  WriteConfigReg32(kRegQueueAddress, static_cast<uint32_t>(vq_pfn));
+  if (is_msix_enabled_) {
+    WriteConfigReg16(kRegQueueMSIXVector, 0);
+    if (ReadConfigReg16(kRegQueueMSIXVector) != 0) {
+      PutString("virtio-blk: failed to assign MSI-X vector to the queue\n");
+      is_msix_enabled_ = false;
+    }
+  }
+  avail_idx_ = 0;
+  used_idx_ = 0;
+
+  // 5.2.4 Device configuration layout
+  num_of_sectors_ = ReadDeviceConfig32(0) |
+                    (static_cast<uint64_t>(ReadDeviceConfig32(4)) << 32);
+  max_segments_ = kNumOfDescriptorsPerSlot - 2;
+  if (features_ & kFeaturesSegMax) {
+    const uint32_t seg_max = ReadDeviceConfig32(12);
+    if (seg_max && seg_max < max_segments_)
+      max_segments_ = seg_max;
+  }
+
+  num_of_slots_ = queue_size / kNumOfDescriptorsPerSlot;
+  if (num_of_slots_ > kMaxSlots)
+    num_of_slots_ = kMaxSlots;
+  slot_bufs_ =
+      AllocMemoryForMappedIO<SlotBuf*>(sizeof(SlotBuf) * num_of_slots_);
+  free_slots_ =
+      num_of_slots_ == 64 ? ~0ULL : ((1ULL << num_of_slots_) - 1);
+  num_of_queued_slots_ = 0;
+
+  IDT::GetInstance().SetIntHandler(kInterruptVector, VirtioBlkInterruptHandler);
+  WriteConfigReg8(kRegDeviceStatus,
+                  ReadConfigReg8(kRegDeviceStatus) | kDeviceStatusDriverOK);
+  initialized_ = true;
+  kprintf("virtio-blk: %lu MiB%s, %d slots of %u segments, completion: %s\n",
+          num_of_sectors_ * kSectorSize >> 20, IsReadOnly() ? " (ro)" : "",
+          num_of_slots_, max_segments_,
+          is_msix_enabled_ ? "MSI-X" : "polling");
+}
+
+bool Blk::CanMerge(const Slot& s, const Request& req) const {
+  const Request& last = *s.last;
+  return req.type == last.type && req.type != Request::Type::kFlush &&
+         req.sector == s.end_sector &&
+         s.end_sector + req.num_of_sectors - s.first->sector <=
+             kMaxSectorsPerSlot;
+}
+
+bool Blk::AppendSegments(int slot, Request& req) {
+  // Splits the buffer into physically contiguous segments. The first one is
+  // appended to the last segment of the slot if they are contiguous.
+  Slot& s = slots_[slot];
+  if (req.type == Request::Type::kFlush)
+    return false;
+  uint8_t* const buf = reinterpret_cast<uint8_t*>(req.buf);
+  const uint64_t size = static_cast<uint64_t>(req.num_of_sectors) * kSectorSize;
+  auto for_each_chunk = [buf, size](auto f) {
+    for (uint64_t ofs = 0; ofs < size;) {
+      uint8_t* p = buf + ofs;
+      const uint64_t len =
+          std::min(kPageSize - (reinterpret_cast<uint64_t>(p) & kPageAddrMask),
+                   size - ofs);
+      f(p, v2p(p), static_cast<uint32_t>(len));
+      ofs += len;
+    }
+  };
+  // Count the segments first not to modify the slot if they do not fit.
+  int num_of_segments = s.num_of_segments;
+  uint64_t end_paddr = s.segment_end_paddr;
+  for_each_chunk([&](uint8_t*, uint64_t paddr, uint32_t len) {
+    if (!num_of_segments || paddr != end_paddr)
+      num_of_segments++;
+    end_paddr = paddr + len;
+  });
+  if (num_of_segments > static_cast<int>(max_segments_))
+    return true;
+  const uint16_t flags =
+      kDescFlagNext |
+      (req.type == Request::Type::kRead ? kDescFlagWrite : 0);
+  const int first_desc = GetFirstDescriptorIndex(slot) + 1;
+  for_each_chunk([&](uint8_t* p, uint64_t paddr, uint32_t len) {
+    if (s.num_of_segments && paddr == s.segment_end_paddr) {
+      const int idx = first_desc + s.num_of_segments - 1;
+      vq_.SetDescriptor(idx, vq_.GetDescriptorBuf(idx),
+                        vq_.GetDescriptorSize(idx) + len, flags,
+                        static_cast<uint16_t>(idx + 1));
+    } else {
+      const int idx = first_desc + s.num_of_segments++;
+      vq_.SetDescriptor(idx, p, len, flags, static_cast<uint16_t>(idx + 1));
+    }
+    s.segment_end_paddr = paddr + len;
+  });
+  return false;
+}
+
+bool Blk::Submit(Request& req) {
+  req.is_done = false;
+  req.has_failed = false;
+  req.next_merged = nullptr;
+  if (!initialized_ ||
+      (req.type == Request::Type::kWrite && IsReadOnly())) {
+    FailRequest(req);
+    return false;
+  }
+  if (req.type == Request::Type::kFlush && !(features_ & kFeaturesFlush)) {
+    // Without VIRTIO_BLK_F_FLUSH, writes are not cached by the device.
+    req.is_done = true;
+    if (req.on_complete)
+      req.on_complete(req);
+    return false;
+  }
+  const bool was_enabled = DisableInterrupts();
+  stats_.requests++;
+  if (num_of_queued_slots_) {
+    Slot& s = slots_[queued_slots_[num_of_queued_slots_ - 1]];
+    if (CanMerge(s, req) &&
+        !AppendSegments(queued_slots_[num_of_queued_slots_ - 1], req)) {
+      s.last->next_merged = &req;
+      s.last = &req;
+      s.end_sector += req.num_of_sectors;
+      stats_.merged_requests++;
+      RestoreInterrupts(was_enabled);
+      return false;
+    }
+  }
+  if (!free_slots_) {
+    stats_.requests--;
+    RestoreInterrupts(was_enabled);
+    return true;
+  }
+  const int slot = __builtin_ctzll(free_slots_);
+  Slot& s = slots_[slot];
+  s.first = &req;
+  s.last = &req;
+  s.end_sector = req.sector + req.num_of_sectors;
+  s.num_of_segments = 0;
+  s.segment_end_paddr = 0;
+  if (AppendSegments(slot, req)) {
+    // Too fragmented to be sent at once.
+    FailRequest(req);
+    RestoreInterrupts(was_enabled);
+    return false;
+  }
+  free_slots_ &= ~(1ULL << slot);
+  queued_slots_[num_of_queued_slots_++] = slot;
+  RestoreInterrupts(was_enabled);
+  return false;
+}
+
+void Blk::Kick() {
+  const bool was_enabled = DisableInterrupts();
+  if (!num_of_queued_slots_) {
+    RestoreInterrupts(was_enabled);
+    return;
+  }
+  // 5.2.6 Device Operation
+  for (int i = 0; i < num_of_queued_slots_; i++) {
+    const int slot = queued_slots_[i];
+    const Slot& s = slots_[slot];
+    SlotBuf& sb = slot_bufs_[slot];
+    const int head = GetFirstDescriptorIndex(slot);
+    const int status_idx = head + 1 + s.num_of_segments;
+    sb.header.type = static_cast<uint32_t>(s.first->type);
+    sb.header.reserved = 0;
+    sb.header.sector = s.first->sector;
+    sb.status = 0xFF;
+    vq_.SetDescriptor(head, &sb.header, sizeof(sb.header), kDescFlagNext,
+                      static_cast<uint16_t>(head + 1));
+    vq_.SetDescriptor(status_idx, const_cast<uint8_t*>(&sb.status),
+                      sizeof(sb.status), kDescFlagWrite, 0);
+    vq_.SetAvailableRingEntry(avail_idx_ % vq_.GetQueueSize(),
+                              static_cast<uint16_t>(head));
+    avail_idx_++;
+  }
+  stats_.device_requests += num_of_queued_slots_;
+  num_of_queued_slots_ = 0;
+  vq_.SetAvailableRingIndex(avail_idx_);
+  WriteConfigReg16(kRegQueueNotify, 0);
+  RestoreInterrupts(was_enabled);
+}
+
+void Blk::CompleteSlot(int slot) {
+  const Slot& s = slots_[slot];
+  const bool has_failed = slot_bufs_[slot].status != 0;
+  for (Request* req = s.first; req;) {
+    Request* next = req->next_merged;
+    if (!has_failed) {
+      const uint64_t bytes =
+          static_cast<uint64_t>(req->num_of_sectors) * kSectorSize;
+      if (req->type == Request::Type::kRead)
+        stats_.read_bytes += bytes;
+      else if (req->type == Request::Type::kWrite)
+        stats_.written_bytes += bytes;
+    }
+    req->has_failed = has_failed;
+    req->is_done = true;
+    // req may be reused from here.
+    if (req->on_complete)
+      req->on_complete(*req);
+    req = next;
+  }
+  free_slots_ |= 1ULL << slot;
+}
+
+void Blk::HandleCompletions() {
+  if (!initialized_)
+    return;
+  const bool was_enabled = DisableInterrupts();
+  while (vq_.GetUsedRingIndex() != used_idx_) {
+    const auto& e = vq_.GetUsedRingEntry(used_idx_ % vq_.GetQueueSize());
+    used_idx_++;
+    CompleteSlot(static_cast<int>(e.id / kNumOfDescriptorsPerSlot));
+  }
+  RestoreInterrupts(was_enabled);
+}
+
+void Blk::HandleInterrupt() {
+  stats_.interrupts++;
+  HandleCompletions();
+}
+
+}  // namespace Virtio
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "block_device.h"
+#include "generic.h"
+#include "pci.h"
+#include "virtio.h"
+
+namespace Virtio {
+// Block device over the legacy virtio PCI interface.
+// Requests are queued with Submit() and sent to the device at once by
+// Kick(), as TX packets of Net are. Until Kick(), a request which reads or
+// writes the sectors right after the last queued one is merged into the same
+// virtio request, so sequential I/O takes fewer round trips to the device.
+// Completions are handled on the MSI-X interrupt, and also polled by
+// BlockDevice::Wait() in case MSI-X is not available.
+class Blk : public BlockDevice {
+ public:
+  static constexpr uint8_t kInterruptVector = 0x30;
+
+  struct Stats {
+    uint64_t requests;
+    // Requests merged into the virtio request of the previous one
+    uint64_t merged_requests;
+    uint64_t device_requests;
+    uint64_t interrupts;
+    uint64_t read_bytes;
+    uint64_t written_bytes;
+  };
+
+  static Blk& GetInstance();
+  void Init();
+  bool IsInitialized() const { return initialized_; }
+  bool IsReadOnly() override { return features_ & kFeaturesRO; }
+  uint64_t GetNumOfSectors() override { return num_of_sectors_; }
+  // Number of virtio requests which can be in flight at once.
+  int GetNumOfSlots() const { return num_of_slots_; }
+  const Stats& GetStats() const { return stats_; }
+
+  // Queues req, or merges it into the last queued request.
+  bool Submit(Request& req) override;
+  void Kick() override;
+  void HandleCompletions() override;
+  // Should be called on the interrupt of the device.
+  void HandleInterrupt();
+
+ private:
+  // 5.2.3 Feature bits
+  static constexpr uint32_t kFeaturesSegMax = (1 << 2);
+  static constexpr uint32_t kFeaturesRO = (1 << 5);
+  static constexpr uint32_t kFeaturesBlkSize = (1 << 6);
+  static constexpr uint32_t kFeaturesFlush = (1 << 9);
+
+  // Each slot owns a fixed range of descriptors: the header, the segments of
+  // the data, and the status.
+  static constexpr int kNumOfDescriptorsPerSlot = 16;
+  static constexpr int kMaxSlots = 64;
+  // Limits the size of merged requests to keep the latency bounded.
+  static constexpr uint32_t kMaxSectorsPerSlot = 2048;
+
+  packed_struct RequestHeader {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+  };
+  // Placed in memory which the device reads and writes.
+  struct SlotBuf {
+    RequestHeader header;
+    volatile uint8_t status;
+  };
+  struct Slot {
+    Request* first;
+    Request* last;
+    uint64_t end_sector;
+    int num_of_segments;
+    // Physical address right after the last segment, to extend it.
+    uint64_t segment_end_paddr;
+  };
+
+  int GetFirstDescriptorIndex(int slot) const {
+    return slot * kNumOfDescriptorsPerSlot;
+  }
+  bool CanMerge(const Slot& s, const Request& req) const;
+  bool AppendSegments(int slot, Request& req);
+  void CompleteSlot(int slot);
+
+  uint8_t ReadConfigReg8(int ofs);
+  uint16_t ReadConfigReg16(int ofs);
+  uint32_t ReadConfigReg32(int ofs);
+  void WriteConfigReg8(int ofs, uint8_t data);
+  void WriteConfigReg16(int ofs, uint16_t data);
+  void WriteConfigReg32(int ofs, uint32_t data);
+  uint32_t ReadDeviceConfig32(int ofs) {
+    return ReadConfigReg32(device_config_ofs_ + ofs);
+  }
+
+  static Blk* blk_;
+  bool initialized_;
+  PCI::DeviceLocation dev_;
+  uint16_t config_io_addr_base_;
+  int device_config_ofs_;
+  uint32_t features_;
+  bool is_msix_enabled_;
+  uint64_t num_of_sectors_;
+  uint32_t max_segments_;
+  Virtqueue vq_;
+  uint16_t avail_idx_;
+  uint16_t used_idx_;
+  int num_of_slots_;
+  Slot slots_[kMaxSlots];
+  SlotBuf* slot_bufs_;
+  uint64_t free_slots_;  // bitmap
+  // Slots queued but not made available to the device yet, in order.
+  int queued_slots_[kMaxSlots];
+  int num_of_queued_slots_;
+  Stats stats_;
+};
+}  // namespace Virtio
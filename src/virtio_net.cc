@@ -1,5 +1,7 @@
 #include "virtio_net.h"
 
+#include <algorithm>
+
 #include "kernel.h"
 
 namespace Virtio {
@@ -47,79 +49,13 @@ uint8_t Net::ReadDeviceStatus() {
 void Net::WriteDeviceStatus(uint8_t data) {
   WriteConfigReg8(18, data);
 }
+uint32_t Net::GetDeviceFeatures() {
+  return ReadConfigReg32(0);
+}
 void Net::SetFeatures(uint32_t f) {
   WriteConfigReg32(4, f);
 }
 
-// 2.1 Device Status Field
-constexpr static uint8_t kDeviceStatusAcknowledge = 1;
-constexpr static uint8_t kDeviceStatusDriver = 2;
-constexpr static uint8_t kDeviceStatusDriverOK = 4;
-constexpr static uint8_t kDeviceStatusFeaturesOK = 8;
-// constexpr static uint8_t kDeviceStatusDeviceNeedsReset = 64;
-// constexpr static uint8_t kDeviceStatusFailed = 128;
-
-constexpr static uint32_t kFeaturesMAC = (1 << 5);
-constexpr static uint32_t kFeaturesStatus = (1 << 16);
-
-static uint64_t CalcSizeOfVirtqueue(int queue_size) {
-  // First part: Descriptor Table + Available Ring
-  // Second part: Used Ring
-  return CeilToPageAlignment(sizeof(Net::Virtqueue::Descriptor) * queue_size +
-                             sizeof(uint16_t) * (2 + queue_size)) +
-         CeilToPageAlignment(sizeof(uint16_t) * 2 +
-                             sizeof(uint32_t) * 2 * queue_size);
-}
-
-void Net::Virtqueue::Alloc(int queue_size) {
-  // 2.6.2 Legacy Interfaces: A Note on Virtqueue Layout
-  assert(0 <= queue_size && queue_size <= kMaxQueueSize);
-  queue_size_ = queue_size;
-  const uint64_t buf_size = CalcSizeOfVirtqueue(queue_size);
-  base_ = AllocMemoryForMappedIO<uint8_t*>(buf_size);
-  bzero(base_, buf_size);
-}
-
-uint64_t Net::Virtqueue::GetPhysAddr() {
-  return v2p(reinterpret_cast<uint64_t>(base_));
-}
-
-void Net::Virtqueue::SetDescriptor(int idx,
-                                   void* vaddr,
-                                   uint32_t len,
-                                   uint16_t flags,
-                                   uint16_t next) {
-  assert(0 <= idx && idx < queue_size_);
-  buf_[idx] = vaddr;
-  Descriptor& desc =
-      *reinterpret_cast<Descriptor*>(base_ + sizeof(Descriptor) * idx);
-  desc.addr = v2p(vaddr);
-  desc.len = len;
-  desc.flags = flags;
-  desc.next = next;
-}
-
-uint16_t Net::Virtqueue::GetUsedRingIndex() {
-  // This function returns the index of used ring
-  // which will be written by device on the next data arriving.
-  volatile uint16_t& pidx = *reinterpret_cast<volatile uint16_t*>(
-      base_ +
-      CeilToPageAlignment(sizeof(Descriptor) * queue_size_ +
-                          sizeof(uint16_t) * (2 * queue_size_)) +
-      sizeof(uint16_t));
-  return pidx;
-}
-
-Net::Virtqueue::UsedRingEntry& Net::Virtqueue::GetUsedRingEntry(int idx) {
-  assert(0 <= idx && idx < queue_size_);
-  UsedRingEntry* used_ring = reinterpret_cast<UsedRingEntry*>(
-      base_ +
-      CeilToPageAlignment(sizeof(Descriptor) * queue_size_ +
-                          sizeof(uint16_t) * (2 * queue_size_)) +
-      2 * sizeof(uint16_t));
-  return used_ring[idx];
-}
-
 void PrintARPPacket(Net::ARPPacket& arp) {
   switch (arp.GetOperation()) {
     case Net::ARPPacket::Operation::kRequest:
@@ -143,241 +79,280 @@ void PrintARPPacket(Net::ARPPacket& arp) {
   PutString("Received ARP with invalid Operation\n");
 }
 
-using InternetChecksum = Net::InternetChecksum;
-using EtherFrame = Net::EtherFrame;
-using ARPPacket = Net::ARPPacket;
-using IPv4Packet = Net::IPv4Packet;
-using ICMPPacket = Net::ICMPPacket;
 using IPv4UDPPacket = Net::IPv4UDPPacket;
 
-static bool ARPPacketHandler(uint8_t* frame_data, size_t frame_size) {
-  if (frame_size < sizeof(ARPPacket)) {
-    return false;
-  }
-  EtherFrame& eth = *reinterpret_cast<EtherFrame*>(frame_data);
-  if (!eth.HasEthType(Net::EtherFrame::kTypeARP)) {
-    return false;
-  }
-  ARPPacket& arp = *reinterpret_cast<ARPPacket*>(frame_data);
-  Net& net = Net::GetInstance();
-  if (arp.GetOperation() == ARPPacket::Operation::kReply) {
-    Network::GetInstance().RegisterARPResolution(arp.sender_proto_addr,
-                                                 arp.sender_eth_addr);
-    return true;
-  }
-  if (arp.GetOperation() != ARPPacket::Operation::kRequest) {
+bool Net::ProcessPacket(uint8_t* buf, size_t buf_size) {
+  size_t frame_size = buf_size - header_size_;
+  uint8_t* frame_data = buf + header_size_;
+  // 5.1.6.4.1 Device Requirements: Processing of Incoming Packets
+  // DATA_VALID: already validated by the device. NEEDS_CSUM: the packet came
+  // from the host with a partial checksum which will never be on the wire.
+  const PacketBufHeader& hdr = *reinterpret_cast<PacketBufHeader*>(buf);
+  const bool checksum_verified =
+      hdr.flags &
+      (PacketBufHeader::kFlagDataValid | PacketBufHeader::kFlagNeedsChecksum);
+  if (!DeliverRXFrame(frame_data, frame_size, checksum_verified)) {
+    if (debug_mode_enabled_) {
+      kprintf("virtio-net: dropped a packet (bad checksum or too large)\n");
+    }
     return false;
   }
-  if (!arp.target_proto_addr.IsEqualTo(net.GetSelfIPv4Addr())) {
-    // This is ARP Request, but not a request to me
-    return true;
-  }
-  // Reply to ARP
-  ARPPacket& reply = *net.GetNextTXPacketBuf<ARPPacket*>(sizeof(ARPPacket));
-  reply.SetupReply(arp.sender_proto_addr, net.GetSelfIPv4Addr(),
-                   arp.sender_eth_addr, net.GetSelfEtherAddr());
-  net.SendPacket();
   return true;
 }
 
-static void SendICMPEchoReply(const ICMPPacket& req, size_t req_frame_size) {
-  if (req_frame_size < sizeof(ICMPPacket)) {
+void Net::PollRXQueue(int pair) {
+  const int qidx = GetRXQueueIndex(pair);
+  auto& rxq = vq_[qidx];
+  auto& rxq_cursor = vq_cursor_[qidx];
+  const uint16_t rxq_size = vq_size_[qidx];
+  QueueStats& stats = rx_stats_[pair];
+  if (rxq.GetUsedRingIndex() == rxq_cursor) {
     return;
   }
-  PutStringAndHex("req_frame_size", req_frame_size);
-  Net& net = Net::GetInstance();
-  // Reply to ARP
-  ICMPPacket& reply = *net.GetNextTXPacketBuf<ICMPPacket*>(req_frame_size);
-  memcpy(&reply, &req, req_frame_size);
-  // Setup ICMP
-  reply.type = ICMPPacket::Type::kEchoReply;
-  reply.csum.Clear();
-  reply.csum = Network::InternetChecksum::Calc(
-      &reply, offsetof(ICMPPacket, type), req_frame_size);
-  // Setup IP
-  reply.ip.dst_ip = req.ip.src_ip;
-  reply.ip.src_ip = req.ip.dst_ip;
-  reply.ip.csum.Clear();
-  reply.ip.csum = Network::InternetChecksum::Calc(
-      &reply, offsetof(IPv4Packet, version_and_ihl), req_frame_size);
-  // Setup Eth
-  reply.ip.eth.dst = req.ip.eth.src;
-  reply.ip.eth.src = net.GetSelfEtherAddr();
-  // Send
-  net.SendPacket();
-  PutString("Reply sent!: ");
-
-  // UDP
-  const char* s = "Hello! This is liumOS. Are you there?\n";
-  uint16_t dst_port = 11111;
-  uint16_t packet_size =
-      static_cast<uint16_t>((sizeof(IPv4UDPPacket) + strlen(s) + 1) & ~1);
-  IPv4UDPPacket& p = *net.GetNextTXPacketBuf<IPv4UDPPacket*>(packet_size);
-  char* data = reinterpret_cast<char*>(reinterpret_cast<uint8_t*>(&p) +
-                                       sizeof(IPv4UDPPacket));
-  memcpy(&p, &req, packet_size);
-  memcpy(data, s, strlen(s));
-  // Setup UDP
-  p.SetDestinationPort(dst_port);
-  p.SetSourcePort(12345);
-  p.SetDataSize(strlen(s));
-  p.csum.Clear();
-  p.csum = Network::CalcUDPChecksum(&p, offsetof(IPv4UDPPacket, src_port),
-                                    packet_size, req.ip.dst_ip, req.ip.src_ip,
-                                    p.length);
-  // Setup IP
-  p.ip.protocol = IPv4Packet::Protocol::kUDP;
-  p.ip.SetDataLength(packet_size - sizeof(IPv4Packet));
-  p.ip.dst_ip = req.ip.src_ip;
-  p.ip.src_ip = req.ip.dst_ip;
-  p.ip.csum.Clear();
-  p.ip.csum = Network::InternetChecksum::Calc(
-      &p, offsetof(IPv4Packet, version_and_ihl), sizeof(IPv4Packet));
-  // Setup Eth
-  p.ip.eth.dst = req.ip.eth.src;
-  p.ip.eth.src = net.GetSelfEtherAddr();
-  // Send
-  net.SendPacket();
+  // Give the buffer back to the device. All buffers were made available
+  // at Init(), so the available index runs rxq_size ahead of the cursor.
+  auto recycle = [&](uint16_t desc_idx) {
+    rxq.SetAvailableRingEntry(rxq_cursor % rxq_size, desc_idx);
+    rxq_cursor++;
+  };
+  uint16_t used_idx;
+  while ((used_idx = rxq.GetUsedRingIndex()) != rxq_cursor) {
+    auto& used = rxq.GetUsedRingEntry(rxq_cursor % rxq_size);
+    const uint16_t desc_idx = static_cast<uint16_t>(used.id);
+    uint8_t* buf = rxq.GetDescriptorBuf(desc_idx);
+    uint32_t len = used.len;
+    uint16_t num_buffers = 1;
+    if (features_ & kFeaturesMrgRXBuf) {
+      // 5.1.6.4 Processing of Incoming Packets
+      num_buffers = reinterpret_cast<PacketBufHeader*>(buf)->num_buffers;
+      if (!num_buffers || num_buffers > rxq_size) {
+        // Broken header. Waiting for the rest would never end.
+        recycle(desc_idx);
+        stats.drops++;
+        continue;
+      }
+      if (static_cast<uint16_t>(used_idx - rxq_cursor) < num_buffers) {
+        // The rest of the frame is not in the used ring yet.
+        break;
+      }
+    }
+    // The device does not write to the recycled buffers until they are made
+    // available by SetAvailableRingIndex() below.
+    if (num_buffers > 1) {
+      len = static_cast<uint32_t>(MergeRXBuffers(
+          rx_merge_buf_, header_size_ + kMaxRXFrameSize, num_buffers,
+          [&](uint32_t& buf_len) -> const uint8_t* {
+            auto& e = rxq.GetUsedRingEntry(rxq_cursor % rxq_size);
+            const uint16_t idx = static_cast<uint16_t>(e.id);
+            buf_len = e.len;
+            recycle(idx);
+            return rxq.GetDescriptorBuf(idx);
+          }));
+      buf = rx_merge_buf_;
+      if (!len) {
+        stats.drops++;
+        continue;
+      }
+    } else {
+      recycle(desc_idx);
+    }
+    if (ProcessPacket(buf, len)) {
+      stats.packets++;
+      stats.bytes += len - header_size_;
+    } else {
+      stats.drops++;
+    }
+  }
+  rxq.SetAvailableRingIndex(static_cast<uint16_t>(rxq_cursor + rxq_size));
+  WriteConfigReg16(16 /* Queue Notify */, static_cast<uint16_t>(qidx));
 }
 
-static bool ICMPPacketHandler(IPv4Packet& p, size_t frame_size) {
-  if (p.protocol != IPv4Packet::Protocol::kICMP) {
-    return false;
+void Net::PollRX() {
+  for (int i = 0; i < num_of_queue_pairs_; i++) {
+    PollRXQueue(i);
   }
-  if (frame_size < sizeof(ICMPPacket)) {
-    return false;
-  }
-  ICMPPacket& icmp = *reinterpret_cast<Net::ICMPPacket*>(&p);
-  if (icmp.type == ICMPPacket::Type::kEchoRequest) {
-    SendICMPEchoReply(icmp, frame_size);
-  }
-  return true;
 }
 
-static bool UDPPacketHandler(IPv4Packet& p, size_t frame_size) {
-  using IPv4Addr = Network::IPv4Addr;
-  using IPv4NetMask = Network::IPv4NetMask;
-  if (p.protocol != IPv4Packet::Protocol::kUDP) {
-    return false;
-  }
-  if (frame_size < sizeof(IPv4UDPPacket)) {
-    return false;
-  }
-  Net::IPv4UDPPacket& udp = *reinterpret_cast<Net::IPv4UDPPacket*>(&p);
-  if (udp.GetDestinationPort() != 68) {
-    // Not a DHCP packet
-    return false;
-  }
-  Net::DHCPPacket& dhcp = *reinterpret_cast<Net::DHCPPacket*>(&p);
-  Net& net = Net::GetInstance();
-  Network& network = Network::GetInstance();
-  if (dhcp.op != 2 || !dhcp.chaddr.IsEqualTo(net.GetSelfEtherAddr())) {
-    return false;
-  }
-  dhcp.yiaddr.Print();
-  kprintf(" is assigned by DHCP\n");
-  net.SetSelfIPv4Addr(dhcp.yiaddr);
-  // https://tools.ietf.org/html/rfc2131
-  // 3. The Client-Server Protocol
-  if (dhcp.cookie[0] != 99 || dhcp.cookie[1] != 130 || dhcp.cookie[2] != 83 ||
-      dhcp.cookie[3] != 99) {
-    kprintf("Unexpected DHCP Option cookie\n");
-    return true;
+int Net::GetNumOfSmallTXDescriptors(int qidx) {
+  return (features_ & (kFeaturesHostTSO4 | kFeaturesHostUFO))
+             ? vq_size_[qidx] - kNumOfLargeTXBuffers
+             : vq_size_[qidx];
+}
+
+uint8_t* Net::GetNextTXBuf(size_t size, uint32_t flow_hash) {
+  if (!initialized_) {
+    Panic("Virtio::Net not initialized yet");
   }
-  uint8_t* buf = reinterpret_cast<uint8_t*>(&dhcp);
-  size_t i = sizeof(Net::DHCPPacket);
-  while (i < frame_size) {
-    uint8_t option = buf[i];
-    uint8_t option_data_len = buf[i + 1];
-    if (option_data_len == 0) {
-      break;
-    }
-    if (option == 3) {
-      // Router
-      assert(option_data_len == 4);
-      IPv4Addr router_ip = *reinterpret_cast<IPv4Addr*>(&buf[i + 2]);
-      router_ip.Print();
-      kprintf(" is router\n");
-      network.SetIPv4DefaultGateway(router_ip);
+  const uint32_t buf_size = static_cast<uint32_t>(header_size_ + size);
+  tx_pair_ = static_cast<int>(flow_hash % num_of_queue_pairs_);
+  const int qidx = GetTXQueueIndex(tx_pair_);
+  auto& txq = vq_[qidx];
+  const int num_of_small_descs = GetNumOfSmallTXDescriptors(qidx);
+  if (buf_size <= kPageSize) {
+    tx_desc_idx_ = static_cast<uint16_t>(vq_cursor_[qidx] % num_of_small_descs);
+  } else {
+    if (num_of_small_descs == vq_size_[qidx]) {
+      // No segmentation offload, so no large buffers either.
+      return nullptr;
     }
-    if (option == 1) {
-      // Subnet Mask
-      assert(option_data_len == 4);
-      IPv4NetMask netmask = *reinterpret_cast<IPv4NetMask*>(&buf[i + 2]);
-      netmask.Print();
-      kprintf(" is netmask\n");
-      network.SetIPv4NetMask(netmask);
+    const int k = large_tx_cursor_[tx_pair_] % kNumOfLargeTXBuffers;
+    // Wait until the device is done with the previous frame in this buffer.
+    // If the device is too slow, drop the frame instead of waiting longer.
+    const uint16_t avail_idx = large_tx_avail_idx_[tx_pair_][k];
+    for (int i = 0;
+         static_cast<int16_t>(txq.GetUsedRingIndex() - avail_idx) < 0; i++) {
+      if (i >= kMaxLargeTXBufferWaitCount) {
+        tx_stats_[tx_pair_].drops++;
+        return nullptr;
+      }
+      asm volatile("pause");
     }
-    i += 2 + option_data_len;
+    large_tx_cursor_[tx_pair_]++;
+    tx_desc_idx_ = static_cast<uint16_t>(num_of_small_descs + k);
   }
-  return true;
+  uint8_t* buf = txq.GetDescriptorBuf(tx_desc_idx_);
+  txq.SetDescriptor(tx_desc_idx_, buf, buf_size, 0, 0);
+  bzero(buf, header_size_);
+  return buf + header_size_;
 }
 
-static bool IPv4PacketHandler(uint8_t* frame_data, size_t frame_size) {
-  using EtherFrame = Net::EtherFrame;
-  using IPv4Packet = Net::IPv4Packet;
-  if (frame_size < sizeof(IPv4Packet)) {
-    return false;
-  }
-  EtherFrame& eth = *reinterpret_cast<Net::EtherFrame*>(frame_data);
-  if (!eth.HasEthType(Net::EtherFrame::kTypeIPv4)) {
-    return false;
-  }
-  IPv4Packet& p = *reinterpret_cast<Net::IPv4Packet*>(frame_data);
-  if (ICMPPacketHandler(p, frame_size)) {
-    return true;
+Net::PacketBufHeader& Net::GetLastTXPacketBufHeader() {
+  return *vq_[GetTXQueueIndex(tx_pair_)].GetDescriptorBuf<PacketBufHeader*>(
+      tx_desc_idx_);
+}
+
+void Net::QueueTXPacket() {
+  const int qidx = GetTXQueueIndex(tx_pair_);
+  auto& txq = vq_[qidx];
+  uint32_t data_size = txq.GetDescriptorSize(tx_desc_idx_);
+  txq.SetAvailableRingEntry(vq_cursor_[qidx] % vq_size_[qidx], tx_desc_idx_);
+  vq_cursor_[qidx]++;
+  txq.SetAvailableRingIndex(vq_cursor_[qidx]);
+  const int num_of_small_descs = GetNumOfSmallTXDescriptors(qidx);
+  if (tx_desc_idx_ >= num_of_small_descs) {
+    large_tx_avail_idx_[tx_pair_][tx_desc_idx_ - num_of_small_descs] =
+        vq_cursor_[qidx];
   }
-  if (UDPPacketHandler(p, frame_size)) {
-    return true;
+  tx_stats_[tx_pair_].packets++;
+  tx_stats_[tx_pair_].bytes += data_size - header_size_;
+  stats_.tx_packets++;
+  stats_.tx_bytes += data_size - header_size_;
+  tx_kick_pending_pairs_ |= 1u << tx_pair_;
+}
+
+void Net::KickTX() {
+  for (int pair = 0; pair < num_of_queue_pairs_; pair++) {
+    if (!(tx_kick_pending_pairs_ & (1u << pair)))
+      continue;
+    WriteConfigReg16(16 /* Queue Notify */,
+                     static_cast<uint16_t>(GetTXQueueIndex(pair)));
   }
-  return true;
+  tx_kick_pending_pairs_ = 0;
 }
 
-void Net::ProcessPacket(uint8_t* buf, size_t buf_size) {
-  size_t frame_size = buf_size - sizeof(Net::PacketBufHeader);
-  uint8_t* frame_data = buf + sizeof(Net::PacketBufHeader);
-  ARPPacketHandler(frame_data, frame_size) ||
-      IPv4PacketHandler(frame_data, frame_size);
-  Network::GetInstance().PushToRXBuffer(frame_data, 0, frame_size);
+void Net::SetTXBufUDPSegmentation(uint16_t header_length,
+                                  uint16_t segment_size) {
+  SetTXSegmentation(PacketBufHeader::kGSOTypeUDP, header_length,
+                    segment_size);
 }
 
-void Net::PollRXQueue() {
-  auto& rxq = vq_[kIndexOfRXVirtqueue];
-  auto& rxq_cursor_ = vq_cursor_[kIndexOfRXVirtqueue];
-  if (rxq.GetUsedRingIndex() == rxq_cursor_) {
+void Net::SetTXSegmentation(uint8_t gso_type,
+                            uint16_t header_length,
+                            uint16_t gso_size) {
+  // 5.1.6.2 Packet Transmission
+  assert(IsTXSegmentationEnabled(gso_type));
+  PacketBufHeader& hdr = GetLastTXPacketBufHeader();
+  assert(hdr.flags & PacketBufHeader::kFlagNeedsChecksum);
+  hdr.gso_type = gso_type;
+  hdr.header_length = header_length;
+  hdr.gso_size = gso_size;
+}
+
+void Net::SetTXBufUDPChecksum(IPv4UDPPacket& p, size_t packet_size) {
+  if (!HasCapabilities(kCapTXChecksum)) {
+    NetDevice::SetTXBufUDPChecksum(p, packet_size);
     return;
   }
-  while (rxq.GetUsedRingIndex() != rxq_cursor_) {
-    int idx = rxq_cursor_ % vq_size_[kIndexOfRXVirtqueue];
-    Net::ProcessPacket(rxq.GetDescriptorBuf(idx),
-                       rxq.GetUsedRingEntry(idx).len);
-    rxq.GetUsedRingEntry(idx).len = 0;
-    rxq_cursor_++;
+  // 5.1.6.2 Packet Transmission
+  // The device calculates the checksum from csum_start to the end of the
+  // packet, using the pseudo-header sum placed in the checksum field.
+  PacketBufHeader& hdr = GetLastTXPacketBufHeader();
+  hdr.flags |= PacketBufHeader::kFlagNeedsChecksum;
+  hdr.csum_start = offsetof(IPv4UDPPacket, src_port);
+  hdr.csum_offset =
+      offsetof(IPv4UDPPacket, csum) - offsetof(IPv4UDPPacket, src_port);
+  p.csum = Network::CalcUDPPseudoHeaderChecksum(p.ip.src_ip, p.ip.dst_ip,
+                                                p.length);
+}
+
+static int CountEnabledProcessors() {
+  using namespace ACPI;
+  if (!liumos->acpi.madt) {
+    return 1;
+  }
+  MADT& madt = *liumos->acpi.madt;
+  int count = 0;
+  for (int i = 0; i < (int)(madt.length - offsetof(MADT, entries));
+       i += madt.entries[i + 1]) {
+    uint8_t type = madt.entries[i];
+    if (type == kProcessorLocalAPICInfo && (madt.entries[i + 4] & 1)) {
+      count++;
+    } else if (type == kProcessorLocalx2APICStruct &&
+               (madt.entries[i + 8] & 1)) {
+      count++;
+    }
   }
-  rxq.SetAvailableRingIndex(rxq_cursor_ - 1);
-  WriteConfigReg16(16 /* Queue Notify */, kIndexOfRXVirtqueue);
+  return count;
+}
+
+uint16_t Net::GetQueueSize(int index) {
+  WriteConfigReg16(14 /* queue_select */, static_cast<uint16_t>(index));
+  return ReadConfigReg16(12 /* queue_size */);
 }
 
-void Net::SendPacket() {
-  const int idx =
-      vq_cursor_[kIndexOfTXVirtqueue] % vq_size_[kIndexOfTXVirtqueue];
-  auto& txq = vq_[kIndexOfTXVirtqueue];
-  uint8_t* data = txq.GetDescriptorBuf(idx);
-  uint32_t data_size = txq.GetDescriptorSize(idx);
-  if (debug_mode_enabled_) {
-    kprintbuf("SendPacket data", data, sizeof(PacketBufHeader), data_size);
+uint16_t Net::InitVirtqueue(int index, Virtqueue& vq) {
+  // 4.1.5.1.3 Virtqueue Configuration
+  uint16_t queue_size = GetQueueSize(index);
+  if (!queue_size)
+    return 0;
+  vq.Alloc(queue_size);
+  uint64_t vq_pfn = vq.GetPhysAddr() >> kPageSizeExponent;
+  assert(vq_pfn == (vq_pfn & 0xFFFF'FFFF));
+  WriteConfigReg32(8, static_cast<uint32_t>(vq_pfn));
+  return queue_size;
+}
+
+bool Net::SetNumOfQueuePairs(int num_of_pairs) {
+  // 5.1.6.5.5 Automatic receive steering in multiqueue mode
+  // struct virtio_net_ctrl { u8 class; u8 command; u8 data[]; u8 ack; }
+  if (!(features_ & kFeaturesMQ)) {
+    return false;
+  }
+  constexpr uint8_t kCtrlClassMQ = 4;
+  constexpr uint8_t kCtrlMQVQPairsSet = 0;
+  constexpr uint8_t kCtrlAckOK = 0;
+  uint8_t* cmd = ctrl_buf_;
+  uint16_t* pairs = reinterpret_cast<uint16_t*>(ctrl_buf_ + 2);
+  uint8_t* ack = ctrl_buf_ + 4;
+  cmd[0] = kCtrlClassMQ;
+  cmd[1] = kCtrlMQVQPairsSet;
+  *pairs = static_cast<uint16_t>(num_of_pairs);
+  *reinterpret_cast<volatile uint8_t*>(ack) = 0xFF;
+  ctrl_vq_.SetDescriptor(0, cmd, 2, kDescFlagNext, 1);
+  ctrl_vq_.SetDescriptor(1, pairs, sizeof(uint16_t), kDescFlagNext, 2);
+  ctrl_vq_.SetDescriptor(2, ack, 1, kDescFlagWrite, 0);
+  ctrl_vq_.SetAvailableRingEntry(ctrl_vq_cursor_ % ctrl_vq_.GetQueueSize(),
+                                 0);
+  const uint16_t used_idx = ctrl_vq_.GetUsedRingIndex();
+  ctrl_vq_.SetAvailableRingIndex(++ctrl_vq_cursor_);
+  WriteConfigReg16(16 /* Queue Notify */, ctrl_vq_index_);
+  // The device handles control commands synchronously on the notify.
+  for (int i = 0; i < 1000000 && ctrl_vq_.GetUsedRingIndex() == used_idx;
+       i++) {
+    asm volatile("pause");
   }
-  PacketBufHeader& hdr = *txq.GetDescriptorBuf<PacketBufHeader*>(idx);
-  hdr.flags = 0;
-  hdr.gso_type = PacketBufHeader::kGSOTypeNone;
-  hdr.header_length = 0x00;
-  hdr.gso_size = 0;
-  hdr.csum_start = 0;
-  hdr.csum_offset = 0;
-  txq.SetAvailableRingEntry(idx, idx);
-  vq_cursor_[kIndexOfTXVirtqueue]++;
-  txq.SetAvailableRingIndex(idx + 1);
-  WriteConfigReg16(16 /* Queue Notify */, kIndexOfTXVirtqueue);
+  return ctrl_vq_.GetUsedRingIndex() != used_idx &&
+         *reinterpret_cast<volatile uint8_t*>(ack) == kCtrlAckOK;
 }
 
 Net& Net::GetInstance() {
@@ -419,22 +394,93 @@ void Net::Init() {
   WriteDeviceStatus(ReadDeviceStatus() | kDeviceStatusDriver);
   // 5.1.4.2 Driver Requirements: Device configuration layout
   // A driver SHOULD negotiate VIRTIO_NET_F_MAC if the device offers it
-  SetFeatures(kFeaturesStatus | kFeaturesMAC);
+  // 5.1.6.2 / 5.1.6.3: Use checksum offloading if offered
+  // 5.1.6.5.5 Automatic receive steering in multiqueue mode
+  // 5.1.6.2 / 5.1.6.4: Segmentation offload on TX and mergeable RX buffers.
+  // On RX, only UDP datagrams are taken unsegmented (VIRTIO_NET_F_GUEST_UFO)
+  // since there is no TCP to use VIRTIO_NET_F_GUEST_TSO4.
+  features_ = GetDeviceFeatures() &
+              (kFeaturesStatus | kFeaturesMAC | kFeaturesCSUM |
+               kFeaturesGuestCSUM | kFeaturesCtrlVQ | kFeaturesMQ |
+               kFeaturesHostTSO4 | kFeaturesHostUFO | kFeaturesMrgRXBuf |
+               kFeaturesGuestUFO);
+  if (!(features_ & kFeaturesCtrlVQ)) {
+    // VIRTIO_NET_F_MQ requires VIRTIO_NET_F_CTRL_VQ
+    features_ &= ~kFeaturesMQ;
+  }
+  if (!(features_ & kFeaturesCSUM)) {
+    // VIRTIO_NET_F_HOST_* require VIRTIO_NET_F_CSUM
+    features_ &= ~(kFeaturesHostTSO4 | kFeaturesHostUFO);
+  }
+  if (!(features_ & kFeaturesGuestCSUM) || !(features_ & kFeaturesMrgRXBuf)) {
+    // VIRTIO_NET_F_GUEST_* require VIRTIO_NET_F_GUEST_CSUM. Without
+    // mergeable buffers, they also require RX buffers of 64 KiB each.
+    features_ &= ~kFeaturesGuestUFO;
+  }
+  // 5.1.4 Device configuration layout
+  // The device configuration can be read before FEATURES_OK, so the feature
+  // set is settled here and not changed afterwards.
+  uint16_t max_virtqueue_pairs = 1;
+  if (features_ & kFeaturesMQ) {
+    max_virtqueue_pairs = ReadConfigReg16(0x14 + 8 /* max_virtqueue_pairs */);
+  }
+  if (features_ & kFeaturesCtrlVQ) {
+    ctrl_vq_index_ = static_cast<uint16_t>(max_virtqueue_pairs * 2);
+    if (!GetQueueSize(ctrl_vq_index_)) {
+      features_ &= ~(kFeaturesCtrlVQ | kFeaturesMQ);
+      max_virtqueue_pairs = 1;
+    }
+  }
+  SetFeatures(features_);
+  if (features_ & kFeaturesCSUM)
+    capabilities_ |= kCapTXChecksum;
+  if (features_ & kFeaturesGuestCSUM)
+    capabilities_ |= kCapRXChecksum;
+  if (features_ & kFeaturesHostTSO4)
+    capabilities_ |= kCapTXTCPSegmentation;
+  if (features_ & kFeaturesHostUFO)
+    capabilities_ |= kCapTXUDPSegmentation;
+  kprintf("virtio-net: checksum offload: tx=%s, rx=%s\n",
+          HasCapabilities(kCapTXChecksum) ? "on" : "off",
+          HasCapabilities(kCapRXChecksum) ? "on" : "off");
+  kprintf(
+      "virtio-net: segmentation offload: tso4=%s, ufo=%s, guest_ufo=%s, "
+      "mrg_rxbuf=%s\n",
+      (features_ & kFeaturesHostTSO4) ? "on" : "off",
+      (features_ & kFeaturesHostUFO) ? "on" : "off",
+      (features_ & kFeaturesGuestUFO) ? "on" : "off",
+      (features_ & kFeaturesMrgRXBuf) ? "on" : "off");
+  // 5.1.6.1 Legacy Interface: Device Operation
+  // num_buffers is only in the header if VIRTIO_NET_F_MRG_RXBUF is used.
+  header_size_ = (features_ & kFeaturesMrgRXBuf)
+                     ? sizeof(PacketBufHeader)
+                     : offsetof(PacketBufHeader, num_buffers);
   WriteDeviceStatus(ReadDeviceStatus() | kDeviceStatusFeaturesOK);
 
+  // One queue pair per CPU, as far as the device allows.
+  num_of_queue_pairs_ = CountEnabledProcessors();
+  if (num_of_queue_pairs_ > max_virtqueue_pairs)
+    num_of_queue_pairs_ = max_virtqueue_pairs;
+  if (num_of_queue_pairs_ > kMaxQueuePairs)
+    num_of_queue_pairs_ = kMaxQueuePairs;
+  if (num_of_queue_pairs_ < 1)
+    num_of_queue_pairs_ = 1;
+
   // 5.1.5 Device Initialization
-  // 4.1.5.1.3 Virtqueue Configuration
-  for (int i = 0; i < kNumOfVirtqueues; i++) {
-    WriteConfigReg16(14 /* queue_select */, i);
-    uint16_t queue_size = ReadConfigReg16(12);
-    if (!queue_size)
-      break;
-    vq_[i].Alloc(queue_size);
-    vq_size_[i] = queue_size;
+  for (int i = 0; i < num_of_queue_pairs_ * 2; i++) {
+    vq_size_[i] = InitVirtqueue(i, vq_[i]);
     vq_cursor_[i] = 0;
-    uint64_t vq_pfn = vq_[i].GetPhysAddr() >> kPageSizeExponent;
-    assert(vq_pfn == (vq_pfn & 0xFFFF'FFFF));
-    WriteConfigReg32(8, static_cast<uint32_t>(vq_pfn));
+    if (!vq_size_[i]) {
+      kprintf("virtio-net: queue %d is not available\n", i);
+      num_of_queue_pairs_ = i / 2;
+      break;
+    }
+  }
+  assert(num_of_queue_pairs_ >= 1);
+  if (features_ & kFeaturesCtrlVQ) {
+    ctrl_vq_cursor_ = 0;
+    InitVirtqueue(ctrl_vq_index_, ctrl_vq_);
+    ctrl_buf_ = AllocMemoryForMappedIO<uint8_t*>(kPageSize);
   }
 
   WriteDeviceStatus(ReadDeviceStatus() | kDeviceStatusDriverOK);
@@ -448,24 +494,49 @@ void Net::Init() {
   mac_addr_.Print();
   PutChar('\n');
 
-  // Populate RX Buffer
-  auto& rxq = vq_[kIndexOfRXVirtqueue];
-  vq_cursor_[kIndexOfRXVirtqueue] = 0;
-  for (int i = 0; i < vq_size_[kIndexOfRXVirtqueue]; i++) {
-    rxq.SetDescriptor(i, AllocMemoryForMappedIO<void*>(kPageSize), kPageSize,
-                      2 /* device write only */, 0);
-    rxq.SetAvailableRingEntry(i, i);
-    rxq.SetAvailableRingIndex(i + 1);
+  for (int pair = 0; pair < num_of_queue_pairs_; pair++) {
+    // Populate RX Buffer
+    // With mergeable buffers, frames can span multiple smaller buffers.
+    const int rx_qidx = GetRXQueueIndex(pair);
+    auto& rxq = vq_[rx_qidx];
+    const uint32_t rx_buf_size =
+        (features_ & kFeaturesMrgRXBuf) ? kMergeableRXBufferSize : kPageSize;
+    uint8_t* rx_page = nullptr;
+    for (int i = 0; i < vq_size_[rx_qidx]; i++) {
+      const uint64_t ofs = (i * rx_buf_size) % kPageSize;
+      if (ofs == 0) {
+        rx_page = AllocMemoryForMappedIO<uint8_t*>(kPageSize);
+      }
+      rxq.SetDescriptor(i, rx_page + ofs, rx_buf_size, kDescFlagWrite, 0);
+      rxq.SetAvailableRingEntry(i, static_cast<uint16_t>(i));
+    }
+    rxq.SetAvailableRingIndex(vq_size_[rx_qidx]);
+    WriteConfigReg16(16 /* Queue Notify */, static_cast<uint16_t>(rx_qidx));
+
+    // Populate TX Buffer
+    const int tx_qidx = GetTXQueueIndex(pair);
+    auto& txq = vq_[tx_qidx];
+    const int num_of_small_descs = GetNumOfSmallTXDescriptors(tx_qidx);
+    for (int i = 0; i < vq_size_[tx_qidx]; i++) {
+      const uint64_t buf_size = i < num_of_small_descs
+                                    ? kPageSize
+                                    : header_size_ + kMaxTXFrameSize;
+      txq.SetDescriptor(i, AllocMemoryForMappedIO<void*>(buf_size),
+                        static_cast<uint32_t>(buf_size),
+                        0 /* device read only */, 0);
+    }
+  }
+  if (features_ & kFeaturesMrgRXBuf) {
+    rx_merge_buf_ =
+        AllocMemoryForMappedIO<uint8_t*>(header_size_ + kMaxRXFrameSize);
   }
-  WriteConfigReg16(16 /* Queue Notify */, kIndexOfRXVirtqueue);
-
-  // Populate TX Buffer
-  auto& txq = vq_[kIndexOfTXVirtqueue];
-  vq_cursor_[kIndexOfTXVirtqueue] = 0;
-  for (int i = 0; i < vq_size_[kIndexOfTXVirtqueue]; i++) {
-    txq.SetDescriptor(i, AllocMemoryForMappedIO<void*>(kPageSize), kPageSize,
-                      0 /* device read only */, 0);
+  if (num_of_queue_pairs_ > 1 && !SetNumOfQueuePairs(num_of_queue_pairs_)) {
+    kprintf("virtio-net: failed to enable multiqueue\n");
+    num_of_queue_pairs_ = 1;
   }
-  SendDHCPRequest();
+  kprintf("virtio-net: %d queue pair(s) in use (device max: %d)\n",
+          num_of_queue_pairs_, max_virtqueue_pairs);
+  Network::GetInstance().RegisterNetDevice(*this);
+  Network::GetInstance().StartDHCPClient(*this);
 }
 }  // namespace Virtio
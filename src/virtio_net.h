@@ -1,13 +1,16 @@
 #pragma once
 
+#include <algorithm>
 #include <optional>
 
 #include "generic.h"
+#include "net_device.h"
 #include "network.h"
 #include "pci.h"
+#include "virtio.h"
 
 namespace Virtio {
-class Net {
+class Net : public NetDevice {
  public:
   struct PacketBufHeader {
     // virtio: 5.1.6 Device Operation
@@ -17,9 +20,15 @@ class Net {
     uint16_t gso_size;
     uint16_t csum_start;
     uint16_t csum_offset;
+    // Only present if VIRTIO_NET_F_MRG_RXBUF is negotiated. Use
+    // Net::header_size_ instead of sizeof(PacketBufHeader).
+    uint16_t num_buffers;
     //
     static constexpr uint8_t kFlagNeedsChecksum = 1;
+    static constexpr uint8_t kFlagDataValid = 2;
     static constexpr uint8_t kGSOTypeNone = 0;
+    static constexpr uint8_t kGSOTypeTCPv4 = 1;
+    static constexpr uint8_t kGSOTypeUDP = 3;
   };
   using InternetChecksum = Network::InternetChecksum;
   using EtherFrame = Network::EtherFrame;
@@ -29,104 +38,143 @@ class Net {
   using IPv4UDPPacket = Network::IPv4UDPPacket;
   using ARPPacket = Network::ARPPacket;
 
-  class Virtqueue {
-   public:
-    packed_struct Descriptor {
-      volatile uint64_t addr;
-      volatile uint32_t len;
-      volatile uint16_t flags;
-      volatile uint16_t next;
-    };
-    struct UsedRingEntry {
-      volatile uint32_t id;   // index of start of used descriptor chain
-      volatile uint32_t len;  // in byte
-    };
-    void Alloc(int queue_size);
-    uint64_t GetPhysAddr();
-    void SetDescriptor(int idx,
-                       void* vaddr,
-                       uint32_t len,
-                       uint16_t flags,
-                       uint16_t next);
-    template <typename T = uint8_t*>
-    T GetDescriptorBuf(int idx) {
-      assert(0 <= idx && idx < queue_size_);
-      return reinterpret_cast<T>(buf_[idx]);
-    }
-    uint32_t GetDescriptorSize(int idx) {
-      assert(0 <= idx && idx < queue_size_);
-      Descriptor& desc =
-          *reinterpret_cast<Descriptor*>(base_ + sizeof(Descriptor) * idx);
-      return desc.len;
-    }
-    void SetAvailableRingEntry(int idx, uint16_t desc_idx) {
-      assert(0 <= idx && idx < queue_size_);
-      volatile uint16_t* ring = reinterpret_cast<volatile uint16_t*>(
-          base_ + sizeof(Descriptor) * queue_size_ + sizeof(uint16_t) * 2);
-      ring[idx] = desc_idx;
-    }
-    void SetAvailableRingIndex(int idx) {
-      volatile uint16_t& pidx = *reinterpret_cast<volatile uint16_t*>(
-          base_ + sizeof(Descriptor) * queue_size_ + sizeof(uint16_t));
-      pidx = idx;
-    }
-    uint16_t GetUsedRingIndex();
-    UsedRingEntry& GetUsedRingEntry(int idx);
-
-   private:
-    static constexpr int kMaxQueueSize = 0x100;
-    int queue_size_;
-    uint8_t* base_;
-    void* buf_[kMaxQueueSize];
+  using Virtqueue = Virtio::Virtqueue;
+
+  struct QueueStats {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t drops;
   };
+  static constexpr int kMaxQueuePairs = 4;
+
+  // 5.1.6.4 Processing of Incoming Packets
+  // With VIRTIO_NET_F_MRG_RXBUF, a frame spans num_buffers RX buffers and
+  // its header is at the beginning of the first one. Gathers them into dst
+  // which has dst_size bytes. get_buf(len) returns the next buffer and sets
+  // len to its length. It is called num_buffers times even if the frame does
+  // not fit, so that the caller can recycle all the buffers. Returns the
+  // size of the gathered header and frame, or 0 if they do not fit.
+  template <class GetBuf>
+  static size_t MergeRXBuffers(uint8_t* dst,
+                               size_t dst_size,
+                               uint16_t num_buffers,
+                               GetBuf get_buf) {
+    size_t size = 0;
+    bool fits = true;
+    for (int i = 0; i < num_buffers; i++) {
+      uint32_t len;
+      const uint8_t* buf = get_buf(len);
+      fits = fits && len <= dst_size - size;
+      if (fits) {
+        std::copy(buf, buf + len, dst + size);
+        size += len;
+      }
+    }
+    return fits ? size : 0;
+  }
 
-  void PollRXQueue();
   void Init();
+  const char* GetName() override { return "virtio-net"; }
+  void PollRX() override;
 
-  template <typename T = uint8_t*>
-  T GetNextTXPacketBuf(size_t size) {
-    if (!initialized_) {
-      Panic("Virtio::Net not initialized yet");
-    }
-    uint32_t buf_size = static_cast<uint32_t>(sizeof(PacketBufHeader) + size);
-    assert(buf_size < kPageSize);
-    auto& txq = vq_[kIndexOfTXVirtqueue];
-    const int idx =
-        vq_cursor_[kIndexOfTXVirtqueue] % vq_size_[kIndexOfTXVirtqueue];
-    txq.SetDescriptor(idx, txq.GetDescriptorBuf(idx), buf_size, 0, 0);
-    return reinterpret_cast<T>(txq.GetDescriptorBuf(idx) +
-                               sizeof(PacketBufHeader));
+  int GetNumOfQueuePairs() { return num_of_queue_pairs_; }
+  const QueueStats& GetRXQueueStats(int pair) {
+    assert(0 <= pair && pair < num_of_queue_pairs_);
+    return rx_stats_[pair];
   }
-  const Network::IPv4Addr GetSelfIPv4Addr() { return self_ip_; }
-  void SetSelfIPv4Addr(Network::IPv4Addr addr) {
-    self_ip_ = addr;
-    if (self_ip_.IsEqualTo(Network::kWildcardIPv4Addr))
-      return;
-    Network::GetInstance().RegisterARPResolution(self_ip_, mac_addr_);
+  const QueueStats& GetTXQueueStats(int pair) {
+    assert(0 <= pair && pair < num_of_queue_pairs_);
+    return tx_stats_[pair];
   }
-  const Network::EtherAddr GetSelfEtherAddr() { return {mac_addr_}; }
-  void SendPacket();
 
   static Net& GetInstance();
 
+ protected:
+  // flow_hash selects the TX queue pair so that packets in the same flow are
+  // not reordered.
+  uint8_t* GetNextTXBuf(size_t size, uint32_t flow_hash) override;
+  void QueueTXPacket() override;
+  void KickTX() override;
+  void SetTXBufUDPChecksum(IPv4UDPPacket& p, size_t packet_size) override;
+  void SetTXBufUDPSegmentation(uint16_t header_length,
+                               uint16_t segment_size) override;
+
  private:
-  static constexpr int kNumOfVirtqueues = 3;
+  static constexpr int kNumOfVirtqueues = kMaxQueuePairs * 2;
 
-  static constexpr int kIndexOfRXVirtqueue = 0;
-  static constexpr int kIndexOfTXVirtqueue = 1;
+  // 5.1.3 Feature bits
+  static constexpr uint32_t kFeaturesCSUM = (1 << 0);
+  static constexpr uint32_t kFeaturesGuestCSUM = (1 << 1);
+  static constexpr uint32_t kFeaturesMAC = (1 << 5);
+  static constexpr uint32_t kFeaturesGuestUFO = (1 << 10);
+  static constexpr uint32_t kFeaturesHostTSO4 = (1 << 11);
+  static constexpr uint32_t kFeaturesHostUFO = (1 << 14);
+  static constexpr uint32_t kFeaturesMrgRXBuf = (1 << 15);
+  static constexpr uint32_t kFeaturesStatus = (1 << 16);
+  static constexpr uint32_t kFeaturesCtrlVQ = (1 << 17);
+  static constexpr uint32_t kFeaturesMQ = (1 << 22);
+
+  // 5.1.2 Virtqueues
+  // receiveq(n) = 2n, transmitq(n) = 2n + 1,
+  // controlq = 2 * max_virtqueue_pairs (2 if VIRTIO_NET_F_MQ is not used)
+  static int GetRXQueueIndex(int pair) { return pair * 2; }
+  static int GetTXQueueIndex(int pair) { return pair * 2 + 1; }
+
+  // The last kNumOfLargeTXBuffers descriptors of each TX queue point to
+  // buffers large enough for kMaxTXFrameSize. They are only allocated if
+  // segmentation offload is negotiated.
+  static constexpr int kNumOfLargeTXBuffers = 4;
+  // How long GetNextTXBuf() waits for a large TX buffer to be returned
+  // before dropping the frame.
+  static constexpr int kMaxLargeTXBufferWaitCount = 1'000'000;
+  // With VIRTIO_NET_F_MRG_RXBUF, a frame larger than this spans buffers.
+  static constexpr uint32_t kMergeableRXBufferSize = 2048;
 
   static Net* net_;
   bool initialized_;
   PCI::DeviceLocation dev_;
-  Network::EtherAddr mac_addr_;
   uint16_t config_io_addr_base_;
   Virtqueue vq_[kNumOfVirtqueues];
   uint16_t vq_size_[kNumOfVirtqueues];
   uint16_t vq_cursor_[kNumOfVirtqueues];
-  Network::IPv4Addr self_ip_;
+  int num_of_queue_pairs_;
+  int tx_pair_;           // queue pair of the last GetNextTXPacketBuf()
+  uint16_t tx_desc_idx_;  // descriptor of the last GetNextTXPacketBuf()
+  int large_tx_cursor_[kMaxQueuePairs];
+  // Available ring index which must be consumed before reusing each large
+  // TX buffer.
+  uint16_t large_tx_avail_idx_[kMaxQueuePairs][kNumOfLargeTXBuffers];
+  size_t header_size_;
+  // Frames which span RX buffers are gathered here. Has header_size_ +
+  // kMaxRXFrameSize bytes.
+  uint8_t* rx_merge_buf_;
+  QueueStats rx_stats_[kMaxQueuePairs];
+  QueueStats tx_stats_[kMaxQueuePairs];
+  Virtqueue ctrl_vq_;
+  uint16_t ctrl_vq_index_;
+  uint16_t ctrl_vq_cursor_;
+  uint8_t* ctrl_buf_;
+  uint32_t tx_kick_pending_pairs_;  // bitmap of pairs to notify in KickTX()
   bool debug_mode_enabled_;
+  uint32_t features_;
 
-  void ProcessPacket(uint8_t* buf, size_t buf_size);
+  bool ProcessPacket(uint8_t* buf, size_t buf_size);
+  PacketBufHeader& GetLastTXPacketBufHeader();
+  bool IsTXSegmentationEnabled(uint8_t gso_type) {
+    if (gso_type == PacketBufHeader::kGSOTypeTCPv4)
+      return features_ & kFeaturesHostTSO4;
+    if (gso_type == PacketBufHeader::kGSOTypeUDP)
+      return features_ & kFeaturesHostUFO;
+    return false;
+  }
+  void SetTXSegmentation(uint8_t gso_type,
+                         uint16_t header_length,
+                         uint16_t gso_size);
+  int GetNumOfSmallTXDescriptors(int qidx);
+  void PollRXQueue(int pair);
+  uint16_t GetQueueSize(int index);
+  uint16_t InitVirtqueue(int index, Virtqueue& vq);
+  bool SetNumOfQueuePairs(int num_of_pairs);
 
   uint8_t ReadConfigReg8(int ofs);
   uint16_t ReadConfigReg16(int ofs);
@@ -138,6 +186,7 @@ class Net {
 
   uint8_t ReadDeviceStatus();
   void WriteDeviceStatus(uint8_t);
+  uint32_t GetDeviceFeatures();
   void SetFeatures(uint32_t);
 };
 };  // namespace Virtio
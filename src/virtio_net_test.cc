@@ -3,12 +3,57 @@
 #ifdef LIUMOS_TEST
 
 #include <stdio.h>
+#include <string.h>
 
 #include <cassert>
+#include <vector>
+
+static void TestMergeRXBuffers() {
+  using Virtio::Net;
+  // A frame of 4000 bytes in RX buffers of 2048 bytes, as the device fills
+  // them with VIRTIO_NET_F_MRG_RXBUF.
+  constexpr size_t kBufSize = 2048;
+  constexpr size_t kFrameSize = 4000;
+  constexpr size_t kMergedSize = sizeof(Net::PacketBufHeader) + kFrameSize;
+  std::vector<uint8_t> expected(kMergedSize);
+  Net::PacketBufHeader hdr = {};
+  hdr.num_buffers = 2;
+  memcpy(expected.data(), &hdr, sizeof(hdr));
+  for (size_t i = sizeof(hdr); i < kMergedSize; i++) {
+    expected[i] = static_cast<uint8_t>(i * 7);
+  }
+  uint8_t bufs[3][kBufSize];
+  uint32_t lens[3] = {kBufSize, kMergedSize - kBufSize, 100};
+  memcpy(bufs[0], expected.data(), lens[0]);
+  memcpy(bufs[1], expected.data() + lens[0], lens[1]);
+  memset(bufs[2], 0xFF, sizeof(bufs[2]));  // the next frame
+
+  int num_of_taken = 0;
+  auto get_buf = [&](uint32_t& len) -> const uint8_t* {
+    len = lens[num_of_taken];
+    return bufs[num_of_taken++];
+  };
+  const auto& header = *reinterpret_cast<Net::PacketBufHeader*>(bufs[0]);
+  std::vector<uint8_t> merged(kMergedSize + 16, 0xCC);
+  assert(Net::MergeRXBuffers(merged.data(), merged.size(), header.num_buffers,
+                             get_buf) == kMergedSize);
+  assert(num_of_taken == 2);
+  assert(memcmp(merged.data(), expected.data(), kMergedSize) == 0);
+  assert(merged[kMergedSize] == 0xCC);
+
+  // A frame which does not fit is dropped, but all of its buffers are
+  // taken to be recycled.
+  num_of_taken = 0;
+  assert(Net::MergeRXBuffers(merged.data(), kMergedSize - 1,
+                             header.num_buffers, get_buf) == 0);
+  assert(num_of_taken == 2);
+}
 
 int main() {
   using Virtio::Net;
 
+  TestMergeRXBuffers();
+
   constexpr Network::EtherAddr test_eth_addr = {0x12, 0x34, 0x56,
                                                 0x78, 0x9A, 0xBC};
   assert(test_eth_addr.IsEqualTo(test_eth_addr));